@@ -0,0 +1,547 @@
+/* For dup, dup2, fileno, sysconf, and clock_gettime */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "hibp-bloom.h"
+#include "executor.h"
+#include "stream.h"
+
+/* Throughput and latency benchmarks for the library and for the command-line tool's file
+ * parsing, over a fixed set of parameters so that runs are comparable from one commit to
+ * the next. Results are written to the standard output as JSON lines, one per measurement:
+ *
+ *   {"benchmark": "query_sha1_batch", "layout": "blocked", "n_hash_functions": 7,
+ *    "log2_bits": 26, "value": 31.4, "unit": "ns/op"}
+ *
+ * Each value is the median of REPEATS timed runs, following an untimed warm-up run. Usage:
+ *
+ *   bench [--max-log2-bits=<n>] [<substring>]
+ *
+ * --max-log2-bits skips filters of more than 2**n bits (the largest are 2 GB), and a
+ * substring restricts the run to the benchmarks whose names contain it. Files are written
+ * to the working directory; make bench runs the benchmarks in a temporary one */
+
+#define SHA1_BYTES HIBP_SHA1_BYTES
+#define REPEATS 5
+
+/* Elements inserted and queried per run */
+#define N_SHAS (1 << 20)
+#define N_LATENCY (1 << 18)
+
+/* Elements per file parsed by insert-file */
+#define N_STREAM (1 << 20)
+
+/* The filter saved and loaded, filled to its design capacity so that it's representative
+ * of a real filter (in particular, compressibility) */
+#define IO_LOG2_BITS 28
+#define IO_N_HASH_FUNCTIONS 7
+
+typedef struct {
+  hibp_layout_t layout;
+  size_t n_hash_functions;
+  size_t log2_bits;
+} filter_case_t;
+
+/* From L2-resident (32 KB) to several times the last-level cache (2 GB) */
+static const filter_case_t filter_cases[] = {
+  { HIBP_LAYOUT_STANDARD, 7, 18 },
+  { HIBP_LAYOUT_STANDARD, 7, 22 },
+  { HIBP_LAYOUT_STANDARD, 7, 26 },
+  { HIBP_LAYOUT_STANDARD, 7, 30 },
+  { HIBP_LAYOUT_STANDARD, 7, 34 },
+  { HIBP_LAYOUT_BLOCKED,  7, 18 },
+  { HIBP_LAYOUT_BLOCKED,  7, 22 },
+  { HIBP_LAYOUT_BLOCKED,  7, 26 },
+  { HIBP_LAYOUT_BLOCKED,  7, 30 },
+  { HIBP_LAYOUT_BLOCKED,  7, 34 }
+};
+
+static const size_t n_filter_cases = sizeof(filter_cases) / sizeof(filter_case_t);
+
+typedef struct {
+  hibp_format_t format;
+  const char* name;
+} format_case_t;
+
+static const format_case_t format_cases[] = {
+  { HIBP_FORMAT_COMPACT,      "compact" },
+  { HIBP_FORMAT_ALIGNED,      "aligned" },
+  { HIBP_FORMAT_CHUNKED,      "chunked" },
+  { HIBP_FORMAT_CHUNKED_SHA1, "chunked-sha1" },
+  { HIBP_FORMAT_COMPRESSED,   "compressed" }
+};
+
+static const size_t n_format_cases = sizeof(format_cases) / sizeof(format_case_t);
+
+/* The formats of insert-file */
+static const char* stream_formats[] = { "strings", "lines", "shas", "hibp" };
+static const size_t n_stream_formats = sizeof(stream_formats) / sizeof(const char*);
+
+static size_t max_log2_bits = 64;
+static const char* only = NULL;
+
+/* ================================================================
+ * Utilities
+ * ================================================================ */
+
+static void die(const char* message) {
+  fprintf(stderr, "bench: %s\n", message);
+  exit(1);
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+  const double x = *(const double*)a;
+  const double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+static double median(double* times) {
+  qsort(times, REPEATS, sizeof(double), compare_doubles);
+  return times[REPEATS / 2];
+}
+
+static int selected(const char* benchmark) {
+  return only == NULL || strstr(benchmark, only) != NULL;
+}
+
+/* Whether any of the NULL-terminated list of benchmarks is selected */
+static int any_selected(const char* const* benchmarks) {
+  for(size_t i = 0; benchmarks[i] != NULL; i ++) {
+    if(selected(benchmarks[i])) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static const char* layout2str(hibp_layout_t layout) {
+  return (layout == HIBP_LAYOUT_BLOCKED) ? "blocked" : "standard";
+}
+
+/* Emit a measurement. params is a JSON fragment of "key": value pairs, each followed by a
+ * comma */
+static void report(const char* benchmark, const char* params, double value, const char* unit) {
+  printf("{\"benchmark\": \"%s\", %s\"value\": %.6g, \"unit\": \"%s\"}\n", benchmark, params, value, unit);
+  fflush(stdout);
+}
+
+/* A fixed sequence of pseudo-random bytes (xorshift64*), standing in for SHA1s, which are
+ * uniform anyway */
+static uint64_t prng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t prng(void) {
+  prng_state ^= prng_state >> 12;
+  prng_state ^= prng_state << 25;
+  prng_state ^= prng_state >> 27;
+  return prng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static void random_bytes(hibp_byte_t* buffer, size_t size) {
+  for(size_t i = 0; i < size; i ++) {
+    buffer[i] = (hibp_byte_t)(prng() >> 56);
+  }
+}
+
+static void new_filter(hibp_bloom_filter_t* bf, hibp_layout_t layout, size_t n_hash_functions,
+                       size_t log2_bits) {
+  const hibp_status_t status = (layout == HIBP_LAYOUT_BLOCKED)
+    ? hibp_bf_new_blocked(bf, n_hash_functions, log2_bits)
+    : hibp_bf_new(bf, n_hash_functions, log2_bits);
+
+  if(status != HIBP_OK) {
+    die("couldn't create a filter");
+  }
+}
+
+static double cpus(void) {
+  const long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return (n < 1) ? 1.0 : (double)n;
+}
+
+/* ================================================================
+ * Insertion and queries
+ * ================================================================ */
+
+/* Queries are of elements in the filter, for which every probe is made; queries for
+ * absent elements can stop at the first unset bit, so their cost varies with the load */
+static void bench_filter(const filter_case_t* cs, const hibp_byte_t* shas, int* results) {
+  char params[256];
+  snprintf(params, sizeof(params), "\"layout\": \"%s\", \"n_hash_functions\": %lu, \"log2_bits\": %lu, ",
+           layout2str(cs->layout), (unsigned long)cs->n_hash_functions, (unsigned long)cs->log2_bits);
+
+  hibp_bloom_filter_t bf;
+  new_filter(&bf, cs->layout, cs->n_hash_functions, cs->log2_bits);
+
+  double times[REPEATS];
+
+  /* The warm-up run faults in the bit vector, and leaves the elements in the filter for the
+   * queries below */
+  hibp_bf_insert_sha1_batch(&bf, N_SHAS, shas);
+
+  if(selected("insert_sha1_batch")) {
+    for(size_t r = 0; r < REPEATS; r ++) {
+      const double start = now();
+      hibp_bf_insert_sha1_batch(&bf, N_SHAS, shas);
+      times[r] = now() - start;
+    }
+
+    report("insert_sha1_batch", params, N_SHAS / median(times) / 1e6, "Mops/s");
+  }
+
+  if(selected("insert_sha1_parallel")) {
+    hibp_bf_insert_sha1_parallel(&bf, N_SHAS, shas, 0);
+
+    for(size_t r = 0; r < REPEATS; r ++) {
+      const double start = now();
+      hibp_bf_insert_sha1_parallel(&bf, N_SHAS, shas, 0);
+      times[r] = now() - start;
+    }
+
+    char parallel_params[300];
+    snprintf(parallel_params, sizeof(parallel_params), "%s\"n_threads\": %.0f, ", params, cpus());
+    report("insert_sha1_parallel", parallel_params, N_SHAS / median(times) / 1e6, "Mops/s");
+  }
+
+  /* Latency: each query's element depends on the result of the one before (always 1, but
+   * the CPU can't know that), so that their cache misses can't overlap */
+  if(selected("query_sha1_latency")) {
+    for(size_t r = 0; r <= REPEATS; r ++) {
+      const double start = now();
+      size_t i = 0;
+
+      for(size_t j = 0; j < N_LATENCY; j ++) {
+        const int found = hibp_bf_query_sha1(&bf, shas + i * SHA1_BYTES);
+        i = (i + 1 + (size_t)!found) % N_SHAS;
+      }
+
+      if(i != N_LATENCY % N_SHAS) {
+        die("an inserted element was absent from the filter");
+      }
+
+      if(r > 0) {
+        times[r - 1] = now() - start;
+      }
+    }
+
+    report("query_sha1_latency", params, median(times) / N_LATENCY * 1e9, "ns/op");
+  }
+
+  /* Throughput: independent queries, one at a time */
+  if(selected("query_sha1_throughput")) {
+    for(size_t r = 0; r <= REPEATS; r ++) {
+      const double start = now();
+      size_t found = 0;
+
+      for(size_t i = 0; i < N_SHAS; i ++) {
+        found += (size_t)hibp_bf_query_sha1(&bf, shas + i * SHA1_BYTES);
+      }
+
+      if(found != N_SHAS) {
+        die("an inserted element was absent from the filter");
+      }
+
+      if(r > 0) {
+        times[r - 1] = now() - start;
+      }
+    }
+
+    report("query_sha1_throughput", params, median(times) / N_SHAS * 1e9, "ns/op");
+  }
+
+  if(selected("query_sha1_batch")) {
+    for(size_t r = 0; r <= REPEATS; r ++) {
+      const double start = now();
+      hibp_bf_query_sha1_batch(&bf, N_SHAS, shas, results);
+
+      if(r > 0) {
+        times[r - 1] = now() - start;
+      }
+    }
+
+    report("query_sha1_batch", params, median(times) / N_SHAS * 1e9, "ns/op");
+  }
+
+  hibp_bf_destroy(&bf);
+}
+
+/* ================================================================
+ * Saving and loading
+ * ================================================================ */
+
+static void bench_io(void) {
+  static const char* const benchmarks[] = { "save_file", "load_file", NULL };
+
+  if(IO_LOG2_BITS > max_log2_bits || !any_selected(benchmarks)) {
+    return;
+  }
+
+  hibp_bloom_filter_t bf;
+  new_filter(&bf, HIBP_LAYOUT_STANDARD, IO_N_HASH_FUNCTIONS, IO_LOG2_BITS);
+
+  /* About half of the bits set */
+  const size_t n = (size_t)((double)((size_t)1 << IO_LOG2_BITS) * log(2.0) / IO_N_HASH_FUNCTIONS);
+  hibp_byte_t* shas = malloc(N_SHAS * SHA1_BYTES);
+
+  if(shas == NULL) {
+    die("out of memory");
+  }
+
+  for(size_t i = 0; i < n; i += N_SHAS) {
+    const size_t m = (n - i < N_SHAS) ? n - i : N_SHAS;
+    random_bytes(shas, m * SHA1_BYTES);
+    hibp_bf_insert_sha1_parallel(&bf, m, shas, 0);
+  }
+
+  free(shas);
+
+  for(size_t f = 0; f < n_format_cases; f ++) {
+    char params[256];
+    snprintf(params, sizeof(params), "\"format\": \"%s\", \"log2_bits\": %lu, ", format_cases[f].name,
+             (unsigned long)IO_LOG2_BITS);
+
+    double save_times[REPEATS];
+    double load_times[REPEATS];
+    long size = 0;
+
+    for(size_t r = 0; r <= REPEATS; r ++) {
+      double start = now();
+
+      FILE* file = fopen("bench.bl", "wb");
+
+      if(file == NULL || hibp_bf_save_file_format(&bf, file, format_cases[f].format) != HIBP_OK) {
+        die("couldn't save the filter");
+      }
+
+      size = ftell(file);
+      fclose(file);
+
+      const double save_time = now() - start;
+
+      /* Loading reads from the page cache, so this measures parsing and verification rather
+       * than the disk */
+      start = now();
+
+      hibp_bloom_filter_t loaded;
+      file = fopen("bench.bl", "rb");
+
+      if(file == NULL || hibp_bf_load_file(&loaded, file) != HIBP_OK) {
+        die("couldn't load the filter");
+      }
+
+      fclose(file);
+
+      const double load_time = now() - start;
+
+      hibp_bf_destroy(&loaded);
+
+      if(r > 0) {
+        save_times[r - 1] = save_time;
+        load_times[r - 1] = load_time;
+      }
+    }
+
+    remove("bench.bl");
+
+    /* Bandwidth relative to the size of the filter in memory, so that formats compare */
+    const double megabytes = (double)((size_t)1 << IO_LOG2_BITS) / 8 / 1e6;
+
+    char size_params[300];
+    snprintf(size_params, sizeof(size_params), "%s\"file_size\": %ld, ", params, size);
+
+    if(selected("save_file")) {
+      report("save_file", size_params, megabytes / median(save_times), "MB/s");
+    }
+
+    if(selected("load_file")) {
+      report("load_file", size_params, megabytes / median(load_times), "MB/s");
+    }
+  }
+
+  hibp_bf_destroy(&bf);
+}
+
+/* ================================================================
+ * insert-file
+ * ================================================================ */
+
+static void write_hex(FILE* file, const hibp_byte_t* sha, int upper) {
+  static const char* digits[2] = { "0123456789abcdef", "0123456789ABCDEF" };
+
+  for(size_t i = 0; i < SHA1_BYTES; i ++) {
+    fputc(digits[upper][sha[i] >> 4], file);
+    fputc(digits[upper][sha[i] & 15], file);
+  }
+}
+
+/* Write N_STREAM elements in the given insert-file format to filename, returning its size:
+ * for strings and lines, 8 to 16 random printable characters (as for passwords); for shas
+ * and hibp, random hashes (with a count, for hibp, as in the Pwned Passwords dump) */
+static long write_stream_file(const char* filename, const char* format) {
+  FILE* file = fopen(filename, "wb");
+
+  if(file == NULL) {
+    die("couldn't write a file for insert-file");
+  }
+
+  for(size_t i = 0; i < N_STREAM; i ++) {
+    if(strcmp(format, "strings") == 0 || strcmp(format, "lines") == 0) {
+      const size_t length = 8 + prng() % 9;
+
+      for(size_t j = 0; j < length; j ++) {
+        fputc('!' + (int)(prng() % 94), file);
+      }
+
+      fputc((strcmp(format, "strings") == 0 && i % 8 != 7) ? ' ' : '\n', file);
+    } else {
+      hibp_byte_t sha[SHA1_BYTES];
+      random_bytes(sha, SHA1_BYTES);
+
+      if(strcmp(format, "hibp") == 0) {
+        write_hex(file, sha, 1);
+        fprintf(file, ":%lu\r\n", (unsigned long)(1 + prng() % 1000));
+      } else {
+        write_hex(file, sha, 0);
+        fputc('\n', file);
+      }
+    }
+  }
+
+  const long size = ftell(file);
+  fclose(file);
+
+  return size;
+}
+
+/* Run a script through the executor, as bin/hibp-bloom -c would, discarding its output */
+static void run_script(const char* script) {
+  fflush(stdout);
+  const int saved = dup(fileno(stdout));
+  const int null = open("/dev/null", O_WRONLY);
+
+  if(saved < 0 || null < 0 || dup2(null, fileno(stdout)) < 0) {
+    die("couldn't redirect the standard output");
+  }
+
+  close(null);
+
+  stream_t stream;
+  stream_new_str(&stream, script, "<bench>");
+
+  executor_t ex;
+  executor_new(&ex, &stream, 1);
+
+  do {
+    executor_exec_one(&ex);
+  } while(ex.status == EX_OK);
+
+  const int failed = (ex.status != EX_EOF);
+
+  executor_destroy(&ex);
+  stream_close(&stream);
+
+  fflush(stdout);
+  dup2(saved, fileno(stdout));
+  close(saved);
+
+  if(failed) {
+    die("a script failed");
+  }
+}
+
+static void bench_stream(void) {
+  if(!selected("insert_file")) {
+    return;
+  }
+
+  for(size_t f = 0; f < n_stream_formats; f ++) {
+    const char* format = stream_formats[f];
+
+    char filename[64];
+    snprintf(filename, sizeof(filename), "bench.%s", format);
+    const long size = write_stream_file(filename, format);
+
+    /* A small filter, so that the time is mostly in parsing (and, for strings and lines,
+     * hashing) rather than in cache misses */
+    char script[256];
+    snprintf(script, sizeof(script), "create 1 16; insert-file \"%s\" %s; unload", filename, format);
+
+    double times[REPEATS];
+
+    for(size_t r = 0; r <= REPEATS; r ++) {
+      const double start = now();
+      run_script(script);
+
+      if(r > 0) {
+        times[r - 1] = now() - start;
+      }
+    }
+
+    remove(filename);
+
+    char params[256];
+    snprintf(params, sizeof(params), "\"format\": \"%s\", \"file_size\": %ld, ", format, size);
+    report("insert_file", params, (double)size / 1e6 / median(times), "MB/s");
+  }
+}
+
+/* ================================================================
+ * main
+ * ================================================================ */
+
+int main(int argc, char** argv) {
+  for(int i = 1; i < argc; i ++) {
+    if(strncmp(argv[i], "--max-log2-bits=", 16) == 0) {
+      max_log2_bits = strtoul(argv[i] + 16, NULL, 10);
+    } else if(argv[i][0] != '-' && only == NULL) {
+      only = argv[i];
+    } else {
+      fprintf(stderr, "usage: %s [--max-log2-bits=<n>] [<substring>]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  hibp_byte_t* shas = malloc(N_SHAS * SHA1_BYTES);
+  int* results = malloc(N_SHAS * sizeof(int));
+
+  if(shas == NULL || results == NULL) {
+    die("out of memory");
+  }
+
+  random_bytes(shas, N_SHAS * SHA1_BYTES);
+
+  static const char* const filter_benchmarks[] = {
+    "insert_sha1_batch", "insert_sha1_parallel", "query_sha1_latency", "query_sha1_throughput",
+    "query_sha1_batch", NULL
+  };
+
+  if(any_selected(filter_benchmarks)) {
+    for(size_t c = 0; c < n_filter_cases; c ++) {
+      if(filter_cases[c].log2_bits <= max_log2_bits) {
+        bench_filter(&filter_cases[c], shas, results);
+      }
+    }
+  }
+
+  free(shas);
+  free(results);
+
+  bench_io();
+  bench_stream();
+
+  return 0;
+}
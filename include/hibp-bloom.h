@@ -2,6 +2,7 @@
 #define _HIBP_BLOOM_H_
 
 #include <stddef.h>
+#include <stdint.h>
 #include <limits.h>
 
 #if CHAR_BIT != 8
@@ -12,6 +13,43 @@ typedef unsigned char hibp_byte_t;
 
 #define HIBP_SHA1_BYTES 20
 
+/* ================================================================
+ * hibp_layout_t
+ * ================================================================ */
+
+/* How a Bloom filter maps the hash functions of an element onto its bit vector */
+typedef enum {
+  /* Each hash function selects a bit anywhere in the bit vector. For a large filter,
+   * this means that a query for a present element costs one cache miss (and likely
+   * one TLB miss) per hash function */
+  HIBP_LAYOUT_STANDARD = 0,
+
+  /* The first hash function selects a 512-bit (64-byte, i.e. one cache line) block of
+   * the bit vector, and each remaining hash function selects a bit within that block.
+   * Queries cost exactly one cache miss, at the price of a slightly higher false positive
+   * rate for a given size. Requires log2_bits >= 9 and n_hash_functions >= 2 */
+  HIBP_LAYOUT_BLOCKED = 1
+} hibp_layout_t;
+
+/* ================================================================
+ * hibp_hashing_t
+ * ================================================================ */
+
+/* The family from which a Bloom filter's hash functions are drawn */
+typedef enum {
+  /* Each hash function concatenates a randomly-chosen selection of the bits of the SHA1.
+   * The selections are stored with the filter (one byte per bit selected) and compiled
+   * into lookup tables on load, and every filter has hash functions of its own */
+  HIBP_HASHING_RANDOM = 0,
+
+  /* Double hashing, per Kirsch and Mitzenmacher ("Less Hashing, Same Performance"): the
+   * i'th hash function is h1 + i * h2 (mod the number of bits to choose from), where h1
+   * and h2 are 64-bit words taken from the last 16 bytes of the SHA1. Nothing is stored,
+   * and each probe costs one multiply-add; the false positive rate is asymptotically the
+   * same. Every filter with the same layout and parameters has the same hash functions */
+  HIBP_HASHING_DOUBLE = 1
+} hibp_hashing_t;
+
 /* ================================================================
  * hibp_bloom_filter_t
  * ================================================================ */
@@ -21,6 +59,12 @@ typedef unsigned char hibp_byte_t;
  * comments within are pedagogical and are not documentation */
 
 typedef struct {
+  /* How are the hash functions mapped onto the bit vector? */
+  hibp_layout_t layout;
+
+  /* Which family are the hash functions drawn from? */
+  hibp_hashing_t hashing;
+
   /* How many hash functions does this Bloom filter use? */
   size_t n_hash_functions;
 
@@ -29,14 +73,230 @@ typedef struct {
    * to know the log2_bits anyway */
   size_t log2_bits;
 
+  /* The number of bits in our filter; 2**log2_bits, unless the filter was created with
+   * hibp_bf_new_bits, in which case log2_bits is rounded up. Our hash functions (which
+   * yield values log2_bits bits long) are then mapped onto the vector by multiply-shift,
+   * which costs a multiplication per probe */
+  size_t bits;
+
   /* Blob of data encoding the Bloom filter hash functions and the Bloom filter bit vector.
-   * The first log2_bits * n_hash_functions bytes encode the hash functions;
-   * the next ceil((2**log2_bits) / 8) bytes encode the bit vector. */
+   * In the standard layout, the first log2_bits * n_hash_functions bytes encode the hash
+   * functions; in the blocked layout, the block-selecting hash function takes
+   * log2_bits - 9 bytes and each of the others takes 9 bytes. The next
+   * ceil(bits / 8) bytes encode the bit vector. Double hashing needs no
+   * encoding, so the buffer is then just the bit vector */
   hibp_byte_t* buffer;
+
+  /* The hash functions above, compiled into byte-wise lookup tables so that they can be
+   * evaluated with a handful of table lookups rather than one shift-and-mask per bit.
+   * Derived from buffer whenever a filter is created or loaded; never persisted. NULL for
+   * double hashing */
+  struct hibp_compiled_st* compiled;
+
+  /* If the filter was loaded with hibp_bf_map_file, then buffer points into a private
+   * mapping of the whole file, and these are the base address and length of that
+   * mapping; hibp_bf_destroy then unmaps it rather than freeing buffer. NULL and 0 if buffer
+   * was allocated otherwise */
+  void* mapping;
+  size_t mapping_size;
+
+  /* If buffer was allocated according to a hibp_allocator_t other than the default (see
+   * hibp_bf_new_alloc), how to release it: either the user's free function, or the extent
+   * of the anonymous mapping we made. NULL if buffer was allocated with malloc or mapped
+   * from a file */
+  struct hibp_allocation_st* allocation;
+
+  /* For a mapped filter, where its checksums are, and which of its chunks have been
+   * verified so far (see HIBP_MAP_LAZY_VERIFY). NULL if the filter wasn't mapped */
+  struct hibp_verifier_st* verifier;
+
+  /* If the filter was opened with hibp_bf_page_file, a cache of the pages of its bit
+   * vector, which otherwise stays on disk and is read a page at a time as queries probe
+   * it; buffer then holds only the hash functions. NULL otherwise */
+  struct hibp_pager_st* pager;
+
+  /* Which pages of buffer have been written to since hibp_bf_track_changes was called, so
+   * that only those need be persisted or shipped elsewhere. NULL if changes aren't being
+   * tracked */
+  struct hibp_tracker_st* tracker;
+
+  /* Nonzero if insertions may run concurrently with one another; see
+   * hibp_bf_set_concurrent */
+  int concurrent;
+
+  /* Counts of queries, insertions, and so on (see hibp_bf_get_stats), if the library was
+   * built with HIBP_STATS; NULL otherwise. Allocated apart from the filter, on a cache line
+   * of its own, so that threads counting their queries don't contend for the cache line
+   * holding the fields above */
+  struct hibp_stats_st* stats;
 } hibp_bloom_filter_t;
 
+/* ================================================================
+ * hibp_sharded_filter_t
+ * ================================================================ */
+
+/* A single logical Bloom filter split into 2**log2_shards independent filters, or shards,
+ * each holding the elements whose SHA1 hashes begin with a particular log2_shards-bit
+ * prefix (cf. the k-anonymity range API of Have I Been Pwned, which serves hashes by their
+ * first five hex digits). Each shard is persisted to a file of its own, alongside a small
+ * manifest, so that a node can load or map only the shards that it serves, and so that
+ * shards can be built, saved, and loaded in parallel. As for hibp_bloom_filter_t, this
+ * structure's internals are private */
+
+typedef struct {
+  size_t log2_shards;
+
+  /* Parameters shared by every shard. log2_bits is per shard, so the logical filter has
+   * 2**(log2_shards + log2_bits) bits in total */
+  hibp_layout_t layout;
+  size_t n_hash_functions;
+  size_t log2_bits;
+
+  /* The i'th shard holds elements with prefix i. Only initialized if loaded[i] is nonzero;
+   * a filter loaded from disk may have only some of its shards in memory */
+  hibp_bloom_filter_t* shards;
+  hibp_byte_t* loaded;
+} hibp_sharded_filter_t;
+
+/* ================================================================
+ * hibp_counting_filter_t
+ * ================================================================ */
+
+/* A Bloom filter from which elements can be removed. Alongside an ordinary Bloom filter,
+ * it keeps a 4-bit counter for every bit of the bit vector, counting the insertions that
+ * set that bit, and keeps the bit vector in step with them: a bit is set if and only if
+ * its counter is nonzero. Queries are then answered from the bit vector alone, just as
+ * fast as for the underlying filter, which can also be saved or copied by itself for
+ * readers that have no use for the counters. The counters take four times the memory of
+ * the bit vector. As for hibp_bloom_filter_t, this structure's internals are private */
+
+typedef struct {
+  /* The underlying filter, whose bit vector has the bits with nonzero counters set */
+  hibp_bloom_filter_t filter;
+
+  /* The counter of the i'th bit of the bit vector is bits [4 * (i % 16), 4 * (i % 16) + 4)
+   * of the (i / 16)'th word, so that a 64-byte block of the blocked layout has its
+   * counters in four consecutive cache lines. Allocated on a cache line boundary */
+  uint64_t* counters;
+} hibp_counting_filter_t;
+
+/* ================================================================
+ * hibp_fuse_filter_t
+ * ================================================================ */
+
+/* A static filter, i.e. one built once from a complete set and never inserted into
+ * thereafter: a binary fuse filter (Graf and Lemire, "Binary Fuse Filters: Fast and Smaller
+ * Than Xor Filters"), with 8- or 16-bit fingerprints. Each element is mapped to three
+ * slots of an array of fingerprints, and an element is reported present if the XOR of
+ * its three slots is its own fingerprint, so a query costs three memory accesses, and the
+ * false positive rate is 2**-fingerprint_bits (about 0.4% and 0.0015% respectively).
+ * Takes about 1.13 * fingerprint_bits bits per element, against the 1.44 * log2(1 / rate)
+ * bits of an optimal Bloom filter. Split into 2**log2_shards independent filters by SHA1
+ * prefix, as for hibp_sharded_filter_t, so that the shards can be built in parallel with
+ * bounded memory (see hibp_fuse_builder_t). As for hibp_bloom_filter_t, this structure's
+ * internals are private */
+
+typedef struct {
+  /* 8 or 16 */
+  size_t fingerprint_bits;
+
+  size_t log2_shards;
+
+  /* The parameters and fingerprints of each shard */
+  struct hibp_fuse_shard_st* shards;
+} hibp_fuse_filter_t;
+
+/* Accumulates the elements of a hibp_fuse_filter_t, partitioned by shard, until it's
+ * built with hibp_ff_build. Holds 8 bytes per element not yet built into its shard: every
+ * element, for a builder made with hibp_ff_builder_new, but only those of the last few
+ * shards, for one made with hibp_ff_builder_new_sorted */
+
+typedef struct {
+  size_t fingerprint_bits;
+  size_t log2_shards;
+
+  /* The keys of the elements of each shard not yet built */
+  struct hibp_fuse_bucket_st* buckets;
+
+  /* For a sorted builder, the shards, of which the first n_built have been built; NULL
+   * otherwise */
+  struct hibp_fuse_shard_st* shards;
+  size_t n_built;
+
+  /* For a sorted builder, the shard of the last element added, and the number of threads
+   * to build passed shards on (and so how many to build at once); 0 otherwise */
+  size_t current;
+  size_t n_threads;
+
+  /* The first failure of a sorted builder to build a shard (a hibp_status_t, which is
+   * declared below), or HIBP_OK */
+  int status;
+} hibp_fuse_builder_t;
+
+/* ================================================================
+ * hibp_scalable_filter_t
+ * ================================================================ */
+
+/* A Bloom filter that grows to accommodate however many elements are inserted into it,
+ * without the false positive rate exceeding a bound fixed at creation (Almeida et al.,
+ * "Scalable Bloom Filters"). It's a chain of ordinary filters, or layers: the first sized
+ * for a planned capacity, and each subsequent one for twice the capacity of its
+ * predecessor and a false positive rate 0.85 times as large, so that the rates of all
+ * layers sum to at most the bound. Elements are inserted into the newest layer, until the
+ * number of bits set in it (counted as they're set, rather than by rescanning the vector)
+ * reaches the number expected of a layer at capacity, whereupon a new layer is added. A
+ * query checks every layer, those with the most elements first, until one is positive.
+ * As for hibp_bloom_filter_t, this structure's internals are private */
+
+typedef struct {
+  /* Parameters shared by every layer */
+  hibp_layout_t layout;
+  hibp_hashing_t hashing;
+
+  /* The capacity of the first layer, and the bound on the false positive rate of the
+   * whole */
+  size_t capacity;
+  double fp;
+
+  /* The layers, oldest first, and the indices of the layers in the order in which they're
+   * queried */
+  size_t n_layers;
+  struct hibp_scalable_layer_st* layers;
+  size_t* order;
+} hibp_scalable_filter_t;
+
+/* ================================================================
+ * hibp_query_queue_t
+ * ================================================================ */
+
+/* Answers queries of a Bloom filter asynchronously, for callers that mustn't block on
+ * memory or disk, such as network services built around an event loop. SHA1s are
+ * submitted, each with a tag of the caller's choosing, and a pool of worker threads takes
+ * them off the queue in batches and answers each batch with hibp_bf_query_sha1_batch, so
+ * that the probes of a batch overlap one another (and the pages of a paged filter that a
+ * batch needs are read at once). Each result is then reported with its tag, either by
+ * calling back from the worker or through a completion queue that the caller polls, which
+ * comes with a file descriptor for event loops to watch. As for hibp_bloom_filter_t, this
+ * structure's internals are private */
+
+typedef struct {
+  const hibp_bloom_filter_t* filter;
+
+  /* The queues and workers, which mustn't move once the workers are running */
+  struct hibp_query_queue_st* state;
+} hibp_query_queue_t;
+
+/* A query answered by a hibp_query_queue_t: the tag it was submitted with, and its result,
+ * as for hibp_bf_query_sha1 */
+typedef struct {
+  void* tag;
+  int result;
+} hibp_completion_t;
+
 /* FIXME: move this somewhere sane and document it */
 typedef struct {
+  hibp_layout_t layout;
+  hibp_hashing_t hashing;
   size_t n_hash_functions;
   size_t log2_bits;
   size_t bits;
@@ -45,8 +305,84 @@ typedef struct {
 
 void hibp_bf_get_info(hibp_filter_info_t* info, const hibp_bloom_filter_t* bf);
 
-/* FIXME: ditto */
+/* ================================================================
+ * hibp_filter_stats_t
+ * ================================================================ */
+
+/* Statistics about a Bloom filter, as reported by hibp_bf_get_stats */
+
+typedef struct {
+  /* Nonzero if the library was built with HIBP_STATS (make STATS=1), in which case
+   * queries, insertions, loads, verification, and saves are counted and timed, with
+   * relaxed atomic additions, from the time that the filter is created or loaded (or
+   * hibp_bf_reset_stats is called). The counters and timings below are 0 otherwise */
+  int counters_enabled;
+
+  /* Queries, by any of the query functions, and how many of them were answered
+   * positively */
+  unsigned long long n_queries;
+  unsigned long long n_positives;
+
+  /* Bits tested by those queries, up to and including the first unset bit for negative
+   * queries. n_probes / n_queries, the mean cost of a query, is close to
+   * 1 / (1 - fill_ratio) when nearly all queries are negative */
+  unsigned long long n_probes;
+
+  /* Elements inserted, by any of the insertion functions */
+  unsigned long long n_inserts;
+
+  /* Wall-clock seconds spent loading (or mapping), verifying, and saving the filter. A
+   * filter is verified as part of being loaded, so that time also counts towards
+   * load_seconds */
+  double load_seconds;
+  double verify_seconds;
+  double save_seconds;
+
+  /* The number of bits set in the bit vector, and the fraction of bits that are set */
+  size_t bits_set;
+  double fill_ratio;
+
+  /* The false positive rate to expect of the filter as it stands, and an estimate of the
+   * number of distinct elements inserted into it, both computed from its bits (for the
+   * blocked layout, from the number of bits set in each block). Both are exact in
+   * expectation; the estimate of the cardinality is accurate to within a percent or so
+   * for filters of more than a few thousand elements, but is infinite if the filter (or
+   * any block of it) is saturated */
+  double estimated_fpr;
+  double estimated_cardinality;
+} hibp_filter_stats_t;
+
+/* ================================================================
+ * hibp_fpr_estimate_t
+ * ================================================================ */
+
+/* An empirical estimate of the false positive rate of a Bloom filter, as made by
+ * hibp_bf_estimate_fpr */
+
+typedef struct {
+  /* The number of random elements queried, and how many of them were (falsely) reported
+   * present */
+  size_t trials;
+  size_t positives;
+
+  /* positives / trials */
+  double rate;
+
+  /* A 95% confidence interval for the false positive rate (the Wilson score interval,
+   * which unlike the normal approximation stays within [0, 1] and is sound even when
+   * positives is small, or 0) */
+  double lower;
+  double upper;
+} hibp_fpr_estimate_t;
+
+/* FIXME: ditto. The other variants return SIZE_MAX if the parameters are invalid for the
+ * given layout */
 size_t hibp_compute_total_size(size_t n_hash_functions, size_t log2_bits);
+size_t hibp_compute_total_size_layout(hibp_layout_t layout, size_t n_hash_functions, size_t log2_bits);
+size_t hibp_compute_total_size_hashing(hibp_layout_t layout, hibp_hashing_t hashing,
+                                       size_t n_hash_functions, size_t log2_bits);
+size_t hibp_compute_total_size_bits(hibp_layout_t layout, hibp_hashing_t hashing,
+                                    size_t n_hash_functions, size_t bits);
 
 /* ================================================================
  * Error codes
@@ -75,6 +411,119 @@ typedef enum {
   HIBP_OK = 0
 } hibp_status_t;
 
+/* ================================================================
+ * hibp_format_t
+ * ================================================================ */
+
+/* On-disk formats in which a filter can be saved. Every format can be loaded or mapped */
+typedef enum {
+  /* The original format. The bit vector immediately follows the header and hash
+   * functions, and so starts at an arbitrary offset within the file. Filters with the
+   * standard layout, random hash functions, and 2**log2_bits bits are byte-for-byte
+   * compatible with older versions of this library */
+  HIBP_FORMAT_COMPACT = 0,
+
+  /* The header is padded so that the bit vector starts on a 4 KiB boundary within the
+   * file, so that a mapped filter's bit vector is page-aligned and can be read with
+   * O_DIRECT. Also records the size of the bit vector explicitly. Costs up to 4 KiB of
+   * padding per file */
+  HIBP_FORMAT_ALIGNED = 1,
+
+  /* As for HIBP_FORMAT_ALIGNED, but rather than a single SHA1 over the whole filter, a
+   * CRC32C is stored for every 4 MiB chunk of it. Checksumming is then several times
+   * faster, runs on every CPU, and lets a mapped filter be verified piecemeal (see
+   * HIBP_MAP_LAZY_VERIFY) */
+  HIBP_FORMAT_CHUNKED = 2,
+
+  /* As for HIBP_FORMAT_CHUNKED, but with a SHA1 per chunk. Slower, but stronger */
+  HIBP_FORMAT_CHUNKED_SHA1 = 3,
+
+  /* Every 4 MiB chunk of the filter is LZ4-compressed independently, and checksummed with
+   * a CRC32C. A sparsely-populated filter shrinks considerably; a well-filled one barely
+   * at all, but costs little more than the compact format. Chunks are compressed and
+   * decompressed on every CPU, a batch at a time as the file is written or read. Compressed
+   * files can't be mapped with hibp_bf_map_file */
+  HIBP_FORMAT_COMPRESSED = 4
+} hibp_format_t;
+
+/* ================================================================
+ * hibp_map_flag_t
+ * ================================================================ */
+
+/* Flags for hibp_bf_map_file; combine with bitwise OR, or pass 0 for the defaults */
+typedef enum {
+  /* Prefault the whole mapping up front (MAP_POPULATE where supported), so that early
+   * queries don't stall on page faults. Slower to map, but no slower than loading */
+  HIBP_MAP_POPULATE = 0x1,
+
+  /* Ask the kernel to back the mapping with huge pages (MADV_HUGEPAGE where supported),
+   * to cut down on TLB misses for large filters. Purely advisory */
+  HIBP_MAP_HUGEPAGES = 0x2,
+
+  /* Don't verify the checksum while mapping. Mapping is then close to instantaneous
+   * (unless HIBP_MAP_POPULATE is given); verification can be done later, if at all, with
+   * hibp_bf_verify */
+  HIBP_MAP_NO_VERIFY = 0x4,
+
+  /* Verify each chunk of the filter (see HIBP_FORMAT_CHUNKED) the first time that it's
+   * accessed, rather than up front. A query that touches a corrupt chunk reports the
+   * element as present (i.e. corruption never yields a false negative), and
+   * hibp_bf_verify reports the corruption. Filters saved in other formats consist of a
+   * single chunk, and so are effectively verified up front. Overrides HIBP_MAP_NO_VERIFY */
+  HIBP_MAP_LAZY_VERIFY = 0x8
+} hibp_map_flag_t;
+
+/* ================================================================
+ * hibp_page_params_t
+ * ================================================================ */
+
+/* Parameters for hibp_bf_page_file. Zero-initialize for the defaults */
+typedef struct {
+  /* How much memory to cache pages of the bit vector in, in bytes: 64 MiB if 0. At least 16
+   * pages are cached, whatever this is */
+  size_t cache_size;
+
+  /* Log base 2 of the size of a page, between 9 and 16: 12 (i.e. 4 KiB, the block size of
+   * most storage) if 0 */
+  size_t log2_page_size;
+
+  /* How many pages a batched query may be reading at once, on as many threads: 32 if 0.
+   * Solid-state storage serves many reads at once about as quickly as one */
+  size_t io_depth;
+} hibp_page_params_t;
+
+/* ================================================================
+ * hibp_alloc_flag_t
+ * ================================================================ */
+
+/* Flags for hibp_allocator_t, governing where the bit vector of a filter is allocated;
+ * combine with bitwise OR, or pass 0 for an ordinary heap allocation. Any of these flags
+ * has the buffer mapped directly from the kernel, so it's only worthwhile for large
+ * filters */
+typedef enum {
+  /* Back the buffer with transparent huge pages (2 MB-aligned, with MADV_HUGEPAGE where
+   * supported), to cut down on TLB misses. Purely advisory */
+  HIBP_ALLOC_HUGEPAGES = 0x1,
+
+  /* Back the buffer with 2 MB (respectively 1 GB) pages from the kernel's reserved pool
+   * (MAP_HUGETLB). Unlike HIBP_ALLOC_HUGEPAGES, this is guaranteed, and so allocation fails
+   * with HIBP_E_NOMEM if the pool is too small (see /proc/sys/vm/nr_hugepages), or with
+   * HIBP_E_INVAL where unsupported. The two are mutually exclusive */
+  HIBP_ALLOC_HUGETLB = 0x2,
+  HIBP_ALLOC_HUGETLB_1GB = 0x4,
+
+  /* Spread the pages round-robin across every NUMA node that the process may allocate
+   * from (MPOL_INTERLEAVE), so that no node's memory controller (or interconnect) takes
+   * the brunt of the random probes of threads running on every node. Advisory; a no-op on
+   * machines or kernels without NUMA support */
+  HIBP_ALLOC_INTERLEAVE = 0x8,
+
+  /* Place the pages on the given NUMA node (MPOL_PREFERRED), falling back to other nodes
+   * only if it runs out of memory. Advisory, as above. Mutually exclusive with
+   * HIBP_ALLOC_INTERLEAVE */
+  HIBP_ALLOC_NODE = 0x10
+} hibp_alloc_flag_t;
+
 /* ================================================================
  * Callback types
  * ================================================================ */
@@ -99,6 +548,57 @@ typedef int (*hibp_getc_t)(void*);
  * otherwise ignored. This signature is isomorphic to fputc from stdio */
 typedef int (*hibp_putc_t)(int, void*);
 
+/* For passing arbitrary streams into hibp_bf_load_reader. Given a ctx, read up to size
+ * bytes into buffer and return the number of bytes read, which must be 0 if and only if
+ * the stream is exhausted or an error occurs. Short reads are fine; the caller retries.
+ * This signature is isomorphic to read(2) or fread from stdio, modulo argument order */
+typedef size_t (*hibp_read_t)(void* ctx, void* buffer, size_t size);
+
+/* For passing arbitrary streams into hibp_bf_save_writer. Given a ctx, write up to size
+ * bytes from buffer and return the number of bytes written, which must be 0 if and only if
+ * an error occurs. Short writes are fine; the caller retries */
+typedef size_t (*hibp_write_t)(void* ctx, const void* buffer, size_t size);
+
+/* For supplying the memory backing a filter through hibp_allocator_t. Given a ctx, return
+ * size bytes of zeroed memory, suitably aligned for any type (as for calloc), or NULL if
+ * allocation fails */
+typedef void* (*hibp_alloc_t)(void* ctx, size_t size);
+
+/* The counterpart of hibp_alloc_t, called by hibp_bf_destroy with the same ctx, the
+ * memory returned by the allocation function, and the size that was asked of it */
+typedef void (*hibp_free_t)(void* ctx, void* buffer, size_t size);
+
+/* For receiving the results of queries submitted to a hibp_query_queue_t. Given a ctx,
+ * the tag that a query was submitted with, and its result as for hibp_bf_query_sha1, do
+ * whatever is to be done with it. Called on the worker thread that answered the query,
+ * and so on several threads at once, so it must be thread-safe; it also holds up the rest
+ * of its batch, so it should be quick (e.g. hand the result to an event loop) */
+typedef void (*hibp_complete_t)(void* ctx, void* tag, int result);
+
+/* ================================================================
+ * hibp_allocator_t
+ * ================================================================ */
+
+/* How hibp_bf_new_alloc, hibp_bf_new_copy, and hibp_bf_load_*_alloc allocate the
+ * buffer of a filter; passing NULL instead of one of these is equivalent to a zeroed
+ * hibp_allocator_t, i.e. an ordinary heap allocation. The filter remembers how it was
+ * allocated, and hibp_bf_destroy releases its buffer accordingly */
+typedef struct {
+  /* A combination of hibp_alloc_flag_t */
+  int flags;
+
+  /* The NUMA node for HIBP_ALLOC_NODE, numbered as by the kernel; ignored otherwise */
+  int node;
+
+  /* If alloc is non-NULL, the buffer is instead allocated by calling alloc(ctx, size) and
+   * released by calling free(ctx, buffer, size), and flags and node are ignored. For
+   * placement policies beyond those above, or to account for memory separately. free is
+   * then required: an allocator with alloc but not free is rejected with HIBP_E_INVAL */
+  hibp_alloc_t alloc;
+  hibp_free_t free;
+  void* ctx;
+} hibp_allocator_t;
+
 /* ================================================================
  * Public API
  * ================================================================ */
@@ -126,6 +626,37 @@ void hibp_compute_optimal_params(size_t* n_hash_functions, size_t* log2_bits,
 void hibp_compute_constrained_params(size_t* n_hash_functions, size_t* log2_bits,
                                      size_t count, size_t max_memory);
 
+/* Counterparts of hibp_compute_optimal_params and hibp_compute_constrained_params for
+ * filters with the blocked layout, to be passed into hibp_bf_new_blocked. The false
+ * positive rate of a blocked filter has no closed form; it is instead computed from the
+ * distribution of elements across blocks (per Putze et al., "Cache-, Hash- and
+ * Space-Efficient Bloom Filters"). n_hash_functions includes the block-selecting hash
+ * function. Expect a blocked filter to need somewhat more memory than a standard filter
+ * for the same false positive rate */
+void hibp_compute_optimal_blocked_params(size_t* n_hash_functions, size_t* log2_bits,
+                                         size_t count, double fp);
+void hibp_compute_constrained_blocked_params(size_t* n_hash_functions, size_t* log2_bits,
+                                             size_t count, size_t max_memory);
+
+/* Counterparts of the above that compute a number of bits to be passed into
+ * hibp_bf_new_bits, rather than rounding the size of the filter to a power of 2. For the
+ * blocked layout, bits is a whole number of blocks. Where a power of 2 would overshoot
+ * what's needed for fp, these save up to half the memory; where it would undershoot
+ * max_memory, these make use of all of it */
+void hibp_compute_optimal_bits(hibp_layout_t layout, size_t* n_hash_functions, size_t* bits,
+                               size_t count, double fp);
+void hibp_compute_constrained_bits(hibp_layout_t layout, size_t* n_hash_functions, size_t* bits,
+                                   size_t count, size_t max_memory);
+
+/* The number of NUMA nodes that this process may allocate memory from (more precisely, one
+ * more than the highest-numbered such node), or 1 on machines or kernels without NUMA
+ * support */
+size_t hibp_numa_n_nodes(void);
+
+/* The NUMA node of the CPU that the calling thread is running on, or 0 if unknown. The
+ * thread may migrate at any time, so pin it for this to be meaningful */
+int hibp_numa_node(void);
+
 /* Given a 40-byte ASCII hexadecimal representation of a SHA1 hash, re-encode it
  * as 20 bytes of binary. Bail out at the first non-hex byte (so passing too-short
  * C strings does not induce undefined behavior). Returns HIBP_E_INVAL if the first
@@ -156,6 +687,63 @@ hibp_status_t hibp_bf_new(hibp_bloom_filter_t* bf, size_t n_hash_functions, size
 hibp_status_t hibp_bf_new_prng(hibp_bloom_filter_t* bf, size_t n_hash_functions, size_t log2_bits,
                                void* ctx, hibp_prng_t prng);
 
+/* Counterparts of hibp_bf_new and hibp_bf_new_prng that initialize a filter with the
+ * blocked layout (see hibp_layout_t). n_hash_functions includes the block-selecting hash
+ * function, so a blocked filter sets n_hash_functions - 1 bits per element. Returns
+ * HIBP_E_INVAL if log2_bits < 9 or n_hash_functions < 2; otherwise identical semantics */
+hibp_status_t hibp_bf_new_blocked(hibp_bloom_filter_t* bf, size_t n_hash_functions, size_t log2_bits);
+hibp_status_t hibp_bf_new_blocked_prng(hibp_bloom_filter_t* bf, size_t n_hash_functions,
+                                       size_t log2_bits, void* ctx, hibp_prng_t prng);
+
+/* Initialize a filter with the given layout whose hash functions are drawn from the given
+ * family (see hibp_hashing_t). For HIBP_HASHING_RANDOM, equivalent to hibp_bf_new or
+ * hibp_bf_new_blocked. Returns HIBP_E_INVAL if layout or hashing is unknown; otherwise
+ * identical semantics */
+hibp_status_t hibp_bf_new_hashing(hibp_bloom_filter_t* bf, hibp_layout_t layout,
+                                  hibp_hashing_t hashing, size_t n_hash_functions,
+                                  size_t log2_bits);
+
+/* Counterpart of hibp_bf_new_hashing for a bit vector of any size rather than a power of
+ * 2; in the blocked layout, bits must be a multiple of 512. Where bits is a power of 2,
+ * exactly equivalent to hibp_bf_new_hashing. Otherwise, every probe costs an extra
+ * multiplication, and the filter is saved in a format that older versions of this library
+ * can't read. Returns HIBP_E_INVAL if bits is zero (or not a whole number of blocks);
+ * otherwise identical semantics */
+hibp_status_t hibp_bf_new_bits(hibp_bloom_filter_t* bf, hibp_layout_t layout,
+                               hibp_hashing_t hashing, size_t n_hash_functions, size_t bits);
+
+/* Counterpart of hibp_bf_new_bits that allocates the filter's buffer as directed by
+ * allocator (see hibp_allocator_t), e.g. to back a large filter with huge pages or to
+ * interleave it across NUMA nodes. allocator may be NULL, in which case this is exactly
+ * hibp_bf_new_bits. Returns HIBP_E_INVAL if allocator's flags are contradictory or can't be
+ * honoured on this platform, or if it has alloc but not free, and HIBP_E_NOMEM if
+ * allocation fails (in particular, if the huge page pool is exhausted); otherwise
+ * identical semantics */
+hibp_status_t hibp_bf_new_alloc(hibp_bloom_filter_t* bf, hibp_layout_t layout,
+                                hibp_hashing_t hashing, size_t n_hash_functions, size_t bits,
+                                const hibp_allocator_t* allocator);
+
+/* Initialize the Bloom filter pointed to by dst as an empty filter with the same layout,
+ * parameters, and hash functions as src, such that dst and src can later be combined with
+ * hibp_bf_union and hibp_bf_intersect. To build a filter across several machines, create
+ * a filter once, and distribute it (or only its hash functions, by saving it while it's
+ * still empty); each machine can then build a like filter over its share of the data,
+ * and the results can be combined exactly. Returns HIBP_E_NOMEM if memory allocation
+ * fails, in which case no call to hibp_bf_destroy is necessary, and HIBP_OK otherwise */
+hibp_status_t hibp_bf_new_like(hibp_bloom_filter_t* dst, const hibp_bloom_filter_t* src);
+
+/* Initialize the Bloom filter pointed to by dst as an exact copy of src, hash functions,
+ * bits and all, allocated as directed by allocator (which may be NULL). To serve queries
+ * from every socket of a NUMA machine at local latency, make one copy per node with
+ * HIBP_ALLOC_NODE, and have each querying thread use the copy for hibp_numa_node(). The
+ * copies are independent filters: an insertion into one isn't seen by the others, so insert
+ * into each (or rebuild them with hibp_bf_union). A lazily-verified src is verified in full
+ * first. Returns HIBP_E_CHECKSUM (if so) or HIBP_E_NOMEM, in which case no call to
+ * hibp_bf_destroy is necessary, or HIBP_E_INVAL as for hibp_bf_new_alloc, and HIBP_OK
+ * otherwise */
+hibp_status_t hibp_bf_new_copy(hibp_bloom_filter_t* dst, const hibp_bloom_filter_t* src,
+                               const hibp_allocator_t* allocator);
+
 /* Deallocate any dynamically-allocated memory associated with the Bloom filter bf. Every
  * call to hibp_bf_new* or hibp_bf_load* should have a corresponding call to
  * hibp_bf_destroy to avoid leaking memory. A Bloom filter cannot be used after being
@@ -165,7 +753,9 @@ void hibp_bf_destroy(hibp_bloom_filter_t* bf);
 /* == IO == */
 
 /* Read, allocate, and initialize a previously-saved Bloom filter from the given file.
- * Returns:
+ * In the compact format, filters with the standard layout are saved in the original file
+ * format, which doesn't record a layout; blocked filters are saved in a newer format which
+ * does. Files in any of the other formats (see hibp_format_t) can also be loaded. Returns:
  * - HIBP_E_VERSION if the version string of the given file doesn't match the expectation
  * - HIBP_E_IO in the case of an IO error (including but not limited to premature EOF)
  * - HIBP_E_INVAL if n_hash_functions or log2_bits is zero
@@ -185,6 +775,71 @@ hibp_status_t hibp_bf_load_file(hibp_bloom_filter_t* bf, FILE* file);
  * hipb_bf_load_file */
 hibp_status_t hibp_bf_load_stream(hibp_bloom_filter_t* bf, void* ctx, hibp_getc_t getc);
 
+/* Like hibp_bf_load_stream, but the stream is read in large blocks by calling read as
+ * specified in the comment for hibp_read_t, rather than one byte at a time. Prefer this
+ * for filters of any size coming from a socket, an object store, etc. */
+hibp_status_t hibp_bf_load_reader(hibp_bloom_filter_t* bf, void* ctx, hibp_read_t read);
+
+/* Counterparts of hibp_bf_load_file and hibp_bf_load_reader that allocate the filter's
+ * buffer as directed by allocator (which may be NULL); see hibp_bf_new_alloc. Otherwise
+ * identical semantics */
+hibp_status_t hibp_bf_load_file_alloc(hibp_bloom_filter_t* bf, FILE* file,
+                                      const hibp_allocator_t* allocator);
+hibp_status_t hibp_bf_load_reader_alloc(hibp_bloom_filter_t* bf, void* ctx, hibp_read_t read,
+                                        const hibp_allocator_t* allocator);
+
+/* Initialize a Bloom filter from the file with the given name, which must have been
+ * saved by hibp_bf_save_file or hibp_bf_save_stream. Rather than being read into memory,
+ * the file is mapped copy-on-write, so that processes mapping the same file share a
+ * single copy of it in the page cache, and so that startup doesn't wait on reading the
+ * whole file. The filter can be inserted into as usual; insertions only modify private
+ * copies of the affected pages, never the file itself. flags is a combination of
+ * hibp_map_flag_t. Returns:
+ * - HIBP_E_IO if the file can't be opened or mapped (errno is set), or is truncated
+ * - HIBP_E_CHECKSUM if the checksum doesn't match, unless HIBP_MAP_NO_VERIFY was given
+ * - HIBP_E_NOMEM if mapping the file or compiling the hash functions runs out of memory
+ * - HIBP_E_{VERSION,INVAL,2BIG} as for hibp_bf_load_file; in particular, HIBP_E_VERSION
+ *   for a file saved with HIBP_FORMAT_COMPRESSED
+ * - HIBP_OK otherwise
+ * In all cases except the last, no call to hibp_bf_destroy is necessary */
+hibp_status_t hibp_bf_map_file(hibp_bloom_filter_t* bf, const char* filename, int flags);
+
+/* Initialize a Bloom filter from the file with the given name, as for hibp_bf_map_file,
+ * but for a filter too large for memory: only the header and hash functions are read up
+ * front, and each query reads just the pages of the bit vector that it probes, through an
+ * LRU cache of the size given by params (which may be NULL for the defaults). Batched
+ * queries read the pages that every query of a window of them probes at once, so that
+ * their reads overlap. Best combined with the blocked layout, whose queries each probe a
+ * single page, and with HIBP_FORMAT_ALIGNED (or chunked), which keeps blocks from
+ * straddling pages. A query that can't read a page reports the element as present (so
+ * that IO errors never yield false negatives), and hibp_bf_verify then reports HIBP_E_IO.
+ * The bit vector isn't verified against its checksum; map or load the file to do that.
+ * A paged filter can be queried (from any number of threads at once), and its info
+ * retrieved, but nothing else; in particular, it mustn't be inserted into, saved, or
+ * combined. Returns:
+ * - HIBP_E_INVAL if params->log2_page_size is out of range
+ * - HIBP_E_2BIG if the filter has too many hash functions to be paged (over 512)
+ * - HIBP_E_IO, HIBP_E_NOMEM, and HIBP_E_{VERSION,INVAL,2BIG} as for hibp_bf_map_file
+ * - HIBP_OK otherwise
+ * In all cases except the last, no call to hibp_bf_destroy is necessary */
+hibp_status_t hibp_bf_page_file(hibp_bloom_filter_t* bf, const char* filename, const hibp_page_params_t* params);
+
+/* For a filter opened with hibp_bf_page_file, the number of probes that found their page
+ * cached, the number that had to read it, and the number of reads that failed. All 0 for
+ * other filters */
+void hibp_bf_page_counts(const hibp_bloom_filter_t* bf, size_t* hits, size_t* misses, size_t* errors);
+
+/* Verify the checksum(s) of a filter mapped with HIBP_MAP_NO_VERIFY, returning
+ * HIBP_E_CHECKSUM if any doesn't match, HIBP_E_NOMEM if memory allocation fails, and
+ * HIBP_OK otherwise. Chunks are verified in parallel. The checksums cover the filter as
+ * it was saved, so this should be done before inserting into the filter. For a filter
+ * mapped with HIBP_MAP_LAZY_VERIFY, only the chunks that haven't been accessed yet are
+ * verified, and chunks already found to be corrupt are reported as such. For a filter
+ * opened with hibp_bf_page_file, returns HIBP_E_IO if any read of a page has failed.
+ * Filters that weren't mapped were already verified when they were loaded, and always
+ * yield HIBP_OK */
+hibp_status_t hibp_bf_verify(const hibp_bloom_filter_t* bf);
+
 /* Persist a Bloom filter by writing its representation to the given file. Returns
  * HIBP_E_IO in the event of an IO error, HIBP_OK otherwise. */
 hibp_status_t hibp_bf_save_file(const hibp_bloom_filter_t* bf, FILE* file);
@@ -196,6 +851,21 @@ hibp_status_t hibp_bf_save_file(const hibp_bloom_filter_t* bf, FILE* file);
  * identical to hipb_bf_save_file */
 hibp_status_t hibp_bf_save_stream(const hibp_bloom_filter_t* bf, void* ctx, hibp_putc_t putc);
 
+/* Counterparts of hibp_bf_save_file and hibp_bf_save_stream that write the filter in the
+ * given format (the above use HIBP_FORMAT_COMPACT). Return HIBP_E_INVAL if format isn't a
+ * valid hibp_format_t, and HIBP_E_NOMEM if memory allocation fails (which can only happen
+ * for the chunked and compressed formats); otherwise identical semantics */
+hibp_status_t hibp_bf_save_file_format(const hibp_bloom_filter_t* bf, FILE* file, hibp_format_t format);
+hibp_status_t hibp_bf_save_stream_format(const hibp_bloom_filter_t* bf, void* ctx, hibp_putc_t putc,
+                                         hibp_format_t format);
+
+/* Counterparts of hibp_bf_save_stream and hibp_bf_save_stream_format that write the filter
+ * in large blocks by calling write as specified in the comment for hibp_write_t, rather
+ * than one byte at a time. IO errors must be signalled by returning 0 from write */
+hibp_status_t hibp_bf_save_writer(const hibp_bloom_filter_t* bf, void* ctx, hibp_write_t write);
+hibp_status_t hibp_bf_save_writer_format(const hibp_bloom_filter_t* bf, void* ctx, hibp_write_t write,
+                                         hibp_format_t format);
+
 /* == Insertion == */
 
 /* Given a string encoded as a byte buffer, insert it into the set */
@@ -207,6 +877,122 @@ void hibp_bf_insert_str(hibp_bloom_filter_t* bf, const char* str);
 /* Given the 20-byte binary SHA1 hash of some string, insert that string into the set */
 void hibp_bf_insert_sha1(hibp_bloom_filter_t* bf, const hibp_byte_t* sha);
 
+/* Batched counterparts of the above. For large filters, insertions and queries are
+ * dominated by cache misses; the batched functions compute the bit positions for a
+ * window of several elements up front and prefetch them all, so that the cache misses
+ * for the whole window overlap rather than being serviced one at a time. The variants
+ * taking strings also compute the SHA1s of short strings (up to 247 bytes) eight at a
+ * time, in the lanes of a SIMD register (AVX2 where available), which for passwords and
+ * the like is several times faster than hashing them one by one. Prefer these whenever
+ * many elements are available at once */
+
+/* Given n strings, the i'th being encoded as the byte buffer buffers[i] of size sizes[i],
+ * insert all of them into the set */
+void hibp_bf_insert_batch(hibp_bloom_filter_t* bf, size_t n, const size_t* sizes,
+                          const hibp_byte_t* const* buffers);
+
+/* Given n 20-byte binary SHA1 hashes laid out back-to-back in shas (i.e. n * 20 bytes in
+ * total), insert the corresponding strings into the set */
+void hibp_bf_insert_sha1_batch(hibp_bloom_filter_t* bf, size_t n, const hibp_byte_t* shas);
+
+/* Counterparts of the above that split the input across n_threads threads (including the
+ * calling thread), or one per online CPU if n_threads is 0, returning once everything has
+ * been inserted. Threads set bits with atomic OR, so no partitioning of the input or
+ * locking is necessary, and the resulting filter is identical to that produced by the
+ * single-threaded functions. Intended for bulk builds; worthwhile only for large n. Unless
+ * bf is in concurrent mode (see below), bf must not be accessed by any other thread for the
+ * duration of the call */
+void hibp_bf_insert_parallel(hibp_bloom_filter_t* bf, size_t n, const size_t* sizes,
+                             const hibp_byte_t* const* buffers, size_t n_threads);
+void hibp_bf_insert_sha1_parallel(hibp_bloom_filter_t* bf, size_t n, const hibp_byte_t* shas,
+                                  size_t n_threads);
+
+/* Put bf into concurrent mode (or, if concurrent is zero, take it out again), in which any
+ * number of threads may insert into bf with any of the functions above, and query it with
+ * any of the functions below, all at once and without locking. Insertions set bits with
+ * atomic OR, a 64-bit word at a time, so no insertion is ever lost; queries never block,
+ * and find every element whose insertion happens before them in the sense of the C11
+ * memory model (e.g. because the inserting thread has since released a mutex that the
+ * querying thread has acquired). Insertions are somewhat slower in concurrent mode, so
+ * leave it off for filters with a single writer. Other functions that modify bf, such as
+ * hibp_bf_union and hibp_bf_apply_delta_file, still mustn't run concurrently with anything
+ * else, and nor must this one. A filter mapped with HIBP_MAP_LAZY_VERIFY is verified in
+ * full before entering concurrent mode; if that fails, HIBP_E_CHECKSUM or HIBP_E_NOMEM is
+ * returned, and bf is left as it was */
+hibp_status_t hibp_bf_set_concurrent(hibp_bloom_filter_t* bf, int concurrent);
+
+/* == Combining == */
+
+/* Make dst the union of dst and src, i.e. exactly the filter that would have resulted
+ * from inserting everything inserted into src into dst as well. The bit vectors are ORed
+ * word by word, on every available CPU. dst and src must have identical hash functions
+ * (see hibp_bf_new_like); otherwise HIBP_E_INVAL is returned and dst is unchanged. If
+ * either filter is being lazily verified (see HIBP_MAP_LAZY_VERIFY), the whole of it is
+ * verified first, and HIBP_E_CHECKSUM or HIBP_E_NOMEM is returned (leaving dst unchanged)
+ * if that fails. Returns HIBP_OK otherwise */
+hibp_status_t hibp_bf_union(hibp_bloom_filter_t* dst, const hibp_bloom_filter_t* src);
+
+/* As for hibp_bf_union, but make dst the intersection of dst and src. Every element
+ * inserted into both filters is present in the result. However, the intersection has a
+ * higher false positive rate than a filter built from the intersection of the underlying
+ * sets, since bits set by distinct elements of either filter can coincide */
+hibp_status_t hibp_bf_intersect(hibp_bloom_filter_t* dst, const hibp_bloom_filter_t* src);
+
+/* == Deltas == */
+
+/* To publish a new batch of elements without rewriting or redistributing a whole filter,
+ * start tracking changes to the filter, insert the new elements, and then either persist
+ * just the changed pages in place (hibp_bf_save_changes), or save them as a delta to be
+ * applied to other copies of the filter (hibp_bf_save_delta_file and
+ * hibp_bf_apply_delta_file). Deltas hold whole 4 KiB pages, and are applied with bitwise
+ * OR, so applying a delta more than once, or applying several in any order, is harmless */
+
+/* Start tracking which pages of bf are modified, by insertions, hibp_bf_union,
+ * hibp_bf_intersect, and hibp_bf_apply_delta*. If changes are already being tracked,
+ * forget about those made so far. Costs one byte of memory per 4 KiB of filter. Returns
+ * HIBP_E_NOMEM if memory allocation fails, HIBP_OK otherwise */
+hibp_status_t hibp_bf_track_changes(hibp_bloom_filter_t* bf);
+
+/* Write every page of bf modified since hibp_bf_track_changes to the given file (or
+ * stream, as for hibp_bf_save_writer) as a delta. Since deltas are applied with OR, they
+ * can only set bits: once hibp_bf_intersect has cleared any bit of a tracked filter, it
+ * can't be shipped as a delta until tracking is restarted (after redistributing the whole
+ * filter), though hibp_bf_save_changes still persists it in place. Returns HIBP_E_INVAL if
+ * changes aren't being tracked or bits have been cleared, HIBP_E_IO in the event of an IO
+ * error, and HIBP_OK otherwise */
+hibp_status_t hibp_bf_save_delta_file(const hibp_bloom_filter_t* bf, FILE* file);
+hibp_status_t hibp_bf_save_delta_writer(const hibp_bloom_filter_t* bf, void* ctx, hibp_write_t write);
+
+/* Read a delta from the given file (or stream, as for hibp_bf_load_reader), and apply it
+ * to bf. The delta must have been saved from a filter with the same hash functions as bf
+ * (see hibp_bf_new_like). Returns:
+ * - HIBP_E_VERSION if the file isn't a delta
+ * - HIBP_E_INVAL if the delta was saved from a filter with different hash functions, or
+ *   is corrupt
+ * - HIBP_E_CHECKSUM if a page of the delta is corrupt, or if bf is being lazily verified
+ *   and a page of the delta falls in a corrupt chunk
+ * - HIBP_E_IO in the event of an IO error (including premature EOF)
+ * - HIBP_OK otherwise
+ * On failure, some pages of the delta may have been applied, but since applying a delta
+ * is idempotent, it can simply be applied again */
+hibp_status_t hibp_bf_apply_delta_file(hibp_bloom_filter_t* bf, FILE* file);
+hibp_status_t hibp_bf_apply_delta_reader(hibp_bloom_filter_t* bf, void* ctx, hibp_read_t read);
+
+/* For a filter mapped with hibp_bf_map_file, write every page modified since
+ * hibp_bf_track_changes (or the last call to this function) back into the file with the
+ * given name, which must be the file that was mapped, and update its checksums. Only the
+ * modified pages are written. For the chunked formats, only the checksums of the modified
+ * chunks are recomputed; for the others, the whole filter is checksummed anew. The file
+ * is synced to disk before returning, but the update isn't atomic: if interrupted, the
+ * file fails checksum validation. Returns:
+ * - HIBP_E_INVAL if bf wasn't mapped, if changes aren't being tracked, or if the file
+ *   isn't the size of the mapping
+ * - HIBP_E_CHECKSUM if bf is being lazily verified, and a modified chunk is corrupt
+ * - HIBP_E_IO if the file can't be opened or written (errno is set)
+ * - HIBP_E_NOMEM if memory allocation fails
+ * - HIBP_OK otherwise */
+hibp_status_t hibp_bf_save_changes(hibp_bloom_filter_t* bf, const char* filename);
+
 /* == Querying == */
 
 /* All query functions have the same semantics: given (a representation of) some string,
@@ -228,4 +1014,359 @@ int hibp_bf_query_str(const hibp_bloom_filter_t* bf, const char* str);
  * present in the set with high probability */
 int hibp_bf_query_sha1(const hibp_bloom_filter_t* bf, const hibp_byte_t* sha);
 
+/* Batched counterparts of the above; see the comment on hibp_bf_insert_batch. Inputs are
+ * as for the corresponding batched insertion functions. results must have room for n
+ * ints; results[i] is populated with the result of querying for the i'th string */
+void hibp_bf_query_batch(const hibp_bloom_filter_t* bf, size_t n, const size_t* sizes,
+                         const hibp_byte_t* const* buffers, int* results);
+
+void hibp_bf_query_sha1_batch(const hibp_bloom_filter_t* bf, size_t n, const hibp_byte_t* shas,
+                              int* results);
+
+/* == Statistics == */
+
+/* Populate stats with the counters of bf (see hibp_filter_stats_t) and with figures
+ * computed from its bit vector. The latter means reading the whole bit vector, which is
+ * done with SIMD population counts where available, but takes time proportional to the
+ * size of the filter regardless. For a filter mapped with HIBP_MAP_LAZY_VERIFY, the
+ * chunks read aren't verified. May be called concurrently with queries and insertions, in
+ * which case the counters and the bits read needn't be consistent with one another */
+void hibp_bf_get_stats(hibp_filter_stats_t* stats, const hibp_bloom_filter_t* bf);
+
+/* Zero the counters and timings of bf. Must not run concurrently with anything else that
+ * counts towards them */
+void hibp_bf_reset_stats(hibp_bloom_filter_t* bf);
+
+/* The fraction of the bits of bf that are set, i.e. the fill_ratio of hibp_bf_get_stats,
+ * without the rest. A filter with the optimal number of hash functions
+ * for the elements inserted into it is about half full */
+double hibp_bf_fill_ratio(const hibp_bloom_filter_t* bf);
+
+/* Empirically estimate the false positive rate of bf by querying it for trials random
+ * elements, spread across n_threads threads (including the calling thread), or one per
+ * online CPU if n_threads is 0. Rather than hashing random strings, random 20-byte
+ * digests are drawn directly from a fast PRNG seeded with seed, and queried in batches;
+ * the outcome depends only on bf, trials, and seed, not on n_threads. Isn't counted
+ * towards the queries of hibp_bf_get_stats. Nothing can have been inserted into bf
+ * that's drawn by chance, so unless the filter was built from random digests, every
+ * positive is a false positive */
+void hibp_bf_estimate_fpr(hibp_fpr_estimate_t* estimate, const hibp_bloom_filter_t* bf, size_t trials,
+                          unsigned long long seed, size_t n_threads);
+
+/* == Sharded filters == */
+
+/* Initialize the sharded filter pointed to by sf, with 2**log2_shards shards, each being
+ * a new Bloom filter (with hash functions of its own) of n_hash_functions hash functions
+ * and 2**log2_bits bits. The hash functions of the shards never draw on the bits of the
+ * prefix, which are the same for every element of a shard. Returns HIBP_E_2BIG if
+ * log2_shards exceeds 20 or the shards would exceed the address space in total, and
+ * otherwise as for hibp_bf_new (respectively hibp_bf_new_blocked). In all cases except
+ * HIBP_OK, no call to hibp_sf_destroy is necessary */
+hibp_status_t hibp_sf_new(hibp_sharded_filter_t* sf, size_t log2_shards, size_t n_hash_functions,
+                          size_t log2_bits);
+hibp_status_t hibp_sf_new_blocked(hibp_sharded_filter_t* sf, size_t log2_shards, size_t n_hash_functions,
+                                  size_t log2_bits);
+
+/* Destroy every loaded shard of sf, and deallocate sf's own memory */
+void hibp_sf_destroy(hibp_sharded_filter_t* sf);
+
+/* The number of shards of sf, i.e. 2**log2_shards */
+size_t hibp_sf_n_shards(const hibp_sharded_filter_t* sf);
+
+/* The index of the shard responsible for the string with the given 20-byte binary SHA1
+ * hash, i.e. the first log2_shards bits of the hash read as a big-endian integer. This is
+ * where the query and insertion functions below route each element; callers spreading
+ * shards across nodes can use it to route requests to the right node */
+size_t hibp_sf_shard_of(const hibp_sharded_filter_t* sf, const hibp_byte_t* sha);
+
+/* The i'th shard of sf, or NULL if it isn't loaded (see hibp_sf_load_file). Any function
+ * taking a hibp_bloom_filter_t* can be used on it, except for hibp_bf_destroy */
+hibp_bloom_filter_t* hibp_sf_shard(hibp_sharded_filter_t* sf, size_t i);
+
+/* Save sf to the file with the given filename, which holds the manifest, and to one file
+ * per loaded shard in the given format, the i'th being named for filename followed by a
+ * dot and i in hexadecimal (zero-padded to ceil(log2_shards / 4) digits, so that with 20
+ * bits to the prefix the suffix is the range prefix of Have I Been Pwned). Shards are
+ * saved in parallel. Returns HIBP_E_IO if any file can't be opened or written (errno is
+ * set), and otherwise as for hibp_bf_save_file_format */
+hibp_status_t hibp_sf_save_file(const hibp_sharded_filter_t* sf, const char* filename, hibp_format_t format);
+
+/* Initialize sf from a manifest and shard files saved by hibp_sf_save_file, loading only
+ * the shards [first, first + n) (clipped to the number of shards; pass 0 and (size_t)-1
+ * for all of them) in parallel. The shards are read into memory as by hibp_bf_load_file,
+ * or mapped as by hibp_bf_map_file with the given flags. Returns:
+ * - HIBP_E_VERSION if the manifest isn't a manifest (or is from a later version)
+ * - HIBP_E_CHECKSUM if the manifest is corrupt, or as for loading a shard
+ * - HIBP_E_INVAL if a shard's parameters disagree with the manifest
+ * - HIBP_E_IO if any file can't be opened or read (errno is set)
+ * - otherwise, as for hibp_bf_load_file or hibp_bf_map_file
+ * In all cases except HIBP_OK, no call to hibp_sf_destroy is necessary */
+hibp_status_t hibp_sf_load_file(hibp_sharded_filter_t* sf, const char* filename, size_t first, size_t n);
+hibp_status_t hibp_sf_map_file(hibp_sharded_filter_t* sf, const char* filename, size_t first, size_t n,
+                               int flags);
+
+/* Counterparts of hibp_bf_insert{,_str,_sha1} and hibp_bf_query{,_str,_sha1} that route
+ * each element to its shard. Insertions into a shard that isn't loaded are dropped, and
+ * queries against such a shard report the element as present (so as never to yield a
+ * false negative) */
+void hibp_sf_insert(hibp_sharded_filter_t* sf, size_t size, const hibp_byte_t* buffer);
+void hibp_sf_insert_str(hibp_sharded_filter_t* sf, const char* str);
+void hibp_sf_insert_sha1(hibp_sharded_filter_t* sf, const hibp_byte_t* sha);
+
+int hibp_sf_query(const hibp_sharded_filter_t* sf, size_t size, const hibp_byte_t* buffer);
+int hibp_sf_query_str(const hibp_sharded_filter_t* sf, const char* str);
+int hibp_sf_query_sha1(const hibp_sharded_filter_t* sf, const hibp_byte_t* sha);
+
+/* Counterpart of hibp_bf_insert_sha1_parallel. The input is partitioned by shard, and
+ * the shards are then built independently on up to n_threads threads (or one per online
+ * CPU if n_threads is 0), without any need for atomic operations */
+void hibp_sf_insert_sha1_parallel(hibp_sharded_filter_t* sf, size_t n, const hibp_byte_t* shas,
+                                  size_t n_threads);
+
+/* Counterpart of hibp_bf_query_sha1_batch. The input is partitioned by shard, so that
+ * each shard is queried with a batch of its own */
+void hibp_sf_query_sha1_batch(const hibp_sharded_filter_t* sf, size_t n, const hibp_byte_t* shas,
+                              int* results);
+
+/* == Counting filters == */
+
+/* Initialize the counting filter pointed to by cf, with an underlying filter as created by
+ * hibp_bf_new_bits with the given parameters, and with every counter 0. Returns
+ * HIBP_E_2BIG if the counters would exceed the address space, and otherwise as for
+ * hibp_bf_new_bits. In all cases except HIBP_OK, no call to hibp_cf_destroy is
+ * necessary */
+hibp_status_t hibp_cf_new(hibp_counting_filter_t* cf, hibp_layout_t layout, hibp_hashing_t hashing,
+                          size_t n_hash_functions, size_t bits);
+
+/* Destroy the underlying filter of cf, and deallocate its counters */
+void hibp_cf_destroy(hibp_counting_filter_t* cf);
+
+/* The underlying filter of cf. It can be queried with any of the query functions, and
+ * saved in any format, e.g. HIBP_FORMAT_COMPACT for a fleet that only queries; the result
+ * is a filter like any other, and is loaded with hibp_bf_load_file. It mustn't be modified
+ * other than through the functions below, nor destroyed */
+const hibp_bloom_filter_t* hibp_cf_filter(const hibp_counting_filter_t* cf);
+
+/* Initialize dst as a copy of the underlying filter of cf, independent of cf thereafter,
+ * as by hibp_bf_new_copy */
+hibp_status_t hibp_cf_collapse(hibp_bloom_filter_t* dst, const hibp_counting_filter_t* cf);
+
+/* Counterparts of hibp_bf_insert{,_str,_sha1}, which also increment the counter of each
+ * bit set. A counter that reaches 15 is saturated, and stays at 15 for good, so that
+ * removals can never clear a bit that an element still in the filter needs. With the
+ * optimal number of hash functions, a counter saturates with probability on the order of
+ * 1e-15 per bit */
+void hibp_cf_insert(hibp_counting_filter_t* cf, size_t size, const hibp_byte_t* buffer);
+void hibp_cf_insert_str(hibp_counting_filter_t* cf, const char* str);
+void hibp_cf_insert_sha1(hibp_counting_filter_t* cf, const hibp_byte_t* sha);
+
+/* Remove an element from cf by decrementing the counter of each of its bits (other than
+ * saturated counters), clearing the bits whose counters reach 0. Returns HIBP_E_INVAL,
+ * leaving cf untouched, if the element is certainly not in cf (i.e. a query for it would
+ * be negative). Removing an element that was never inserted, but for which a query is
+ * (falsely) positive, can clear bits needed by other elements, which will then yield
+ * false negatives; only remove elements known to have been inserted. An element inserted
+ * several times must be removed as many times. Deltas can't carry removals, since they're
+ * applied with OR: once a removal clears a bit, hibp_bf_save_delta_* refuses the
+ * underlying filter until tracking is restarted (see hibp_bf_save_delta_file), so ship
+ * the whole filter instead */
+hibp_status_t hibp_cf_remove(hibp_counting_filter_t* cf, size_t size, const hibp_byte_t* buffer);
+hibp_status_t hibp_cf_remove_str(hibp_counting_filter_t* cf, const char* str);
+hibp_status_t hibp_cf_remove_sha1(hibp_counting_filter_t* cf, const hibp_byte_t* sha);
+
+/* Save cf, counters and all, such that it can be loaded with hibp_cf_load_file (or
+ * hibp_cf_load_reader). The underlying filter is saved in the compact format, and is
+ * followed by the counters and a CRC32C checksum of them. Returns as for
+ * hibp_bf_save_file */
+hibp_status_t hibp_cf_save_file(const hibp_counting_filter_t* cf, FILE* file);
+hibp_status_t hibp_cf_save_writer(const hibp_counting_filter_t* cf, void* ctx, hibp_write_t write);
+
+/* Initialize cf from a file or stream written by hibp_cf_save_file. Returns:
+ * - HIBP_E_VERSION if the file isn't a counting filter (or is from a later version)
+ * - HIBP_E_CHECKSUM if the counters are corrupt, or disagree with the bit vector
+ * - otherwise, as for hibp_bf_load_file
+ * In all cases except HIBP_OK, no call to hibp_cf_destroy is necessary */
+hibp_status_t hibp_cf_load_file(hibp_counting_filter_t* cf, FILE* file);
+hibp_status_t hibp_cf_load_reader(hibp_counting_filter_t* cf, void* ctx, hibp_read_t read);
+
+/* == Fuse filters == */
+
+/* Initialize the builder pointed to by b, for a fuse filter of 2**log2_shards shards
+ * with the given width of fingerprint. The builder holds 8 bytes per element added until
+ * hibp_ff_build, and construction then takes about 24 bytes per element of each shard
+ * under construction, so choose log2_shards such that a shard has at most a few million
+ * elements, e.g. 8 for the Pwned Passwords dump. Returns HIBP_E_INVAL if fingerprint_bits
+ * is neither 8 nor 16, HIBP_E_2BIG if log2_shards exceeds 20, HIBP_E_NOMEM if allocation
+ * fails, or HIBP_OK. In all cases except HIBP_OK, no call to hibp_ff_builder_destroy is
+ * necessary */
+hibp_status_t hibp_ff_builder_new(hibp_fuse_builder_t* b, size_t fingerprint_bits, size_t log2_shards);
+
+/* Like hibp_ff_builder_new, but for elements added in order of SHA1, as they are in the
+ * Pwned Passwords dump. Once the input has passed n_threads shards (or one per online CPU
+ * if n_threads is 0), they're built on as many threads there and then, and their elements
+ * released, so that the builder never holds more than about n_threads + 1 shards' worth
+ * of elements, however large the input. The result is the same filter as
+ * hibp_ff_builder_new would build. Returns as for hibp_ff_builder_new */
+hibp_status_t hibp_ff_builder_new_sorted(hibp_fuse_builder_t* b, size_t fingerprint_bits, size_t log2_shards,
+                                         size_t n_threads);
+
+/* Deallocate b, along with any elements that it still holds */
+void hibp_ff_builder_destroy(hibp_fuse_builder_t* b);
+
+/* Add the string with the given 20-byte binary SHA1 hash, or the n such hashes laid out
+ * back-to-back in shas, to b. Elements added more than once are built into the filter
+ * once. For a sorted builder, this may build the shards that the input has passed, and
+ * returns HIBP_E_INVAL, without adding it, for an element of a shard that the input has
+ * passed, or otherwise as for hibp_ff_build if building fails, in which case b is of no
+ * further use (other than to destroy it). Returns HIBP_E_NOMEM or HIBP_OK otherwise; on
+ * failure, some of the elements may have been added */
+hibp_status_t hibp_ff_builder_add_sha1(hibp_fuse_builder_t* b, const hibp_byte_t* sha);
+hibp_status_t hibp_ff_builder_add_sha1_batch(hibp_fuse_builder_t* b, size_t n, const hibp_byte_t* shas);
+
+/* Build ff from every element added to b, on up to n_threads threads (or one per online
+ * CPU if n_threads is 0), each building one shard at a time; the elements of a shard are
+ * released as soon as the shard is built, so b is left empty, but must still be
+ * destroyed. For a sorted builder, only the shards not already built are built here. The
+ * result depends only on the elements added, not on their order, on n_threads, or on the
+ * kind of builder. Returns HIBP_E_2BIG if a shard has too many elements (more than about
+ * 3.5 billion), HIBP_E_INVAL if construction of a shard fails with each of 100 seeds
+ * (which is vanishingly unlikely), HIBP_E_NOMEM if allocation fails, or HIBP_OK. In all
+ * cases except HIBP_OK, no call to hibp_ff_destroy is necessary */
+hibp_status_t hibp_ff_build(hibp_fuse_filter_t* ff, hibp_fuse_builder_t* b, size_t n_threads);
+
+/* Deallocate ff */
+void hibp_ff_destroy(hibp_fuse_filter_t* ff);
+
+/* The number of bytes taken by the fingerprints of ff */
+size_t hibp_ff_size(const hibp_fuse_filter_t* ff);
+
+/* Counterparts of hibp_bf_query{,_str,_sha1} and hibp_bf_query_sha1_batch. The batched
+ * function computes the slots of a window of elements and prefetches them before reading
+ * any, as for Bloom filters */
+int hibp_ff_query(const hibp_fuse_filter_t* ff, size_t size, const hibp_byte_t* buffer);
+int hibp_ff_query_str(const hibp_fuse_filter_t* ff, const char* str);
+int hibp_ff_query_sha1(const hibp_fuse_filter_t* ff, const hibp_byte_t* sha);
+void hibp_ff_query_sha1_batch(const hibp_fuse_filter_t* ff, size_t n, const hibp_byte_t* shas, int* results);
+
+/* Save ff, in a format of its own, with a CRC32C checksum of the whole. Returns HIBP_E_IO
+ * if writing fails, or HIBP_OK */
+hibp_status_t hibp_ff_save_file(const hibp_fuse_filter_t* ff, FILE* file);
+hibp_status_t hibp_ff_save_writer(const hibp_fuse_filter_t* ff, void* ctx, hibp_write_t write);
+
+/* Initialize ff from a file or stream written by hibp_ff_save_file. Returns:
+ * - HIBP_E_VERSION if the file isn't a fuse filter (or is from a later version)
+ * - HIBP_E_IO if reading fails, or the file ends early
+ * - HIBP_E_CHECKSUM if the checksum doesn't match, or the parameters are inconsistent
+ * - HIBP_E_NOMEM if allocation fails
+ * - HIBP_OK otherwise, in which case ff must eventually be destroyed */
+hibp_status_t hibp_ff_load_file(hibp_fuse_filter_t* ff, FILE* file);
+hibp_status_t hibp_ff_load_reader(hibp_fuse_filter_t* ff, void* ctx, hibp_read_t read);
+
+/* == Scalable filters == */
+
+/* Initialize the scalable filter pointed to by sc, with a single layer sized for capacity
+ * elements (or 128, if that's more, since smaller layers are too coarse to meet their
+ * false positive rates), using the given layout and hash family for every layer. Returns
+ * HIBP_E_INVAL if capacity is 0 or fp isn't strictly between 0 and 1, and otherwise as
+ * for hibp_bf_new_bits. In all cases except HIBP_OK, no call to hibp_sc_destroy is
+ * necessary */
+hibp_status_t hibp_sc_new(hibp_scalable_filter_t* sc, hibp_layout_t layout, hibp_hashing_t hashing,
+                          size_t capacity, double fp);
+
+/* Destroy every layer of sc */
+void hibp_sc_destroy(hibp_scalable_filter_t* sc);
+
+/* The number of layers of sc, and the i'th of them, oldest first. A layer can be queried
+ * or saved like any other filter, but mustn't be modified or destroyed */
+size_t hibp_sc_n_layers(const hibp_scalable_filter_t* sc);
+const hibp_bloom_filter_t* hibp_sc_layer(const hibp_scalable_filter_t* sc, size_t i);
+
+/* The number of elements inserted into sc, less those that were already (or falsely
+ * appeared to be) present */
+size_t hibp_sc_count(const hibp_scalable_filter_t* sc);
+
+/* The probability that a query for an element not in sc is positive, estimated from the
+ * number of bits set in each layer so far, as for hibp_bf_get_stats, though without
+ * rescanning any layer. For the blocked layout, whose bits are set unevenly, this treats
+ * them as set uniformly, so it's an underestimate; see hibp_bf_get_stats of each layer for
+ * a closer one */
+double hibp_sc_estimated_fpr(const hibp_scalable_filter_t* sc);
+
+/* Counterparts of hibp_bf_insert{,_str,_sha1}. An element for which a query is already
+ * positive isn't inserted again, so that duplicates don't use up capacity. Returns
+ * HIBP_E_NOMEM if a new layer was needed but couldn't be allocated, or HIBP_E_2BIG if
+ * it would have exceeded the address space, in either of which cases the element isn't
+ * inserted; HIBP_OK otherwise */
+hibp_status_t hibp_sc_insert(hibp_scalable_filter_t* sc, size_t size, const hibp_byte_t* buffer);
+hibp_status_t hibp_sc_insert_str(hibp_scalable_filter_t* sc, const char* str);
+hibp_status_t hibp_sc_insert_sha1(hibp_scalable_filter_t* sc, const hibp_byte_t* sha);
+
+/* Counterparts of hibp_bf_query{,_str,_sha1} and hibp_bf_query_sha1_batch. The batched
+ * function queries a window of elements against each layer in turn, as for Bloom
+ * filters, querying a layer only for those elements that every previous layer reported
+ * absent */
+int hibp_sc_query(const hibp_scalable_filter_t* sc, size_t size, const hibp_byte_t* buffer);
+int hibp_sc_query_str(const hibp_scalable_filter_t* sc, const char* str);
+int hibp_sc_query_sha1(const hibp_scalable_filter_t* sc, const hibp_byte_t* sha);
+void hibp_sc_query_sha1_batch(const hibp_scalable_filter_t* sc, size_t n, const hibp_byte_t* shas,
+                              int* results);
+
+/* Save sc, in a format of its own: its parameters and the number of elements in each
+ * layer, with a CRC32C checksum of them, and each layer in the compact format. Returns as
+ * for hibp_bf_save_file */
+hibp_status_t hibp_sc_save_file(const hibp_scalable_filter_t* sc, FILE* file);
+hibp_status_t hibp_sc_save_writer(const hibp_scalable_filter_t* sc, void* ctx, hibp_write_t write);
+
+/* Initialize sc from a file or stream written by hibp_sc_save_file, such that insertions
+ * carry on where they left off. Returns:
+ * - HIBP_E_VERSION if the file isn't a scalable filter (or is from a later version)
+ * - HIBP_E_CHECKSUM if the parameters are corrupt, or a layer disagrees with them
+ * - otherwise, as for hibp_bf_load_file
+ * In all cases except HIBP_OK, no call to hibp_sc_destroy is necessary */
+hibp_status_t hibp_sc_load_file(hibp_scalable_filter_t* sc, FILE* file);
+hibp_status_t hibp_sc_load_reader(hibp_scalable_filter_t* sc, void* ctx, hibp_read_t read);
+
+/* == Asynchronous queries == */
+
+/* Initialize qq to answer queries of bf on n_threads worker threads (one per online CPU
+ * if 0, and at most 64), each taking up to max_batch queries at a time (256 if 0). If
+ * complete is non-NULL, each result is passed to complete(ctx, tag, result) on the worker
+ * that answered it; otherwise results are queued until collected with hibp_qq_poll. bf
+ * must outlive qq, and mustn't be modified while qq has queries outstanding. Returns
+ * HIBP_E_NOMEM if memory allocation fails, HIBP_E_IO if the workers or the file
+ * descriptor of hibp_qq_fd can't be created, and HIBP_OK otherwise. In all cases except
+ * HIBP_OK, no call to hibp_qq_destroy is necessary */
+hibp_status_t hibp_qq_new(hibp_query_queue_t* qq, const hibp_bloom_filter_t* bf, size_t n_threads,
+                          size_t max_batch, void* ctx, hibp_complete_t complete);
+
+/* Wait for every query submitted to qq to be answered (as for hibp_qq_wait), then stop
+ * its workers and release it. Completions that haven't been polled are discarded */
+void hibp_qq_destroy(hibp_query_queue_t* qq);
+
+/* Submit a query for the given SHA1, or for n consecutive SHA1s with tags[i] for the
+ * i'th, to be answered by one of the workers. The SHA1s are copied, and the tags are
+ * opaque to the library. Never blocks on the filter, though it takes a lock shared with
+ * the workers. Safe to call from any number of threads at once. Returns HIBP_E_NOMEM if
+ * the queue couldn't grow to hold them, in which case none of them was submitted, and
+ * HIBP_OK otherwise */
+hibp_status_t hibp_qq_submit(hibp_query_queue_t* qq, const hibp_byte_t* sha, void* tag);
+hibp_status_t hibp_qq_submit_batch(hibp_query_queue_t* qq, size_t n, const hibp_byte_t* shas,
+                                   void* const* tags);
+
+/* For a queue without a callback, move up to max completions into completions, in the
+ * order in which they were answered (which needn't be the order in which they were
+ * submitted), and return how many were moved. Never blocks on the filter. Always 0 for a
+ * queue with a callback */
+size_t hibp_qq_poll(hibp_query_queue_t* qq, size_t max, hibp_completion_t* completions);
+
+/* For a queue without a callback, a file descriptor that's readable whenever completions
+ * are waiting to be polled, for an event loop to watch (with select, poll, epoll or the
+ * like); it stays readable until hibp_qq_poll has taken every completion. It mustn't be
+ * read from, written to, or closed. -1 for a queue with a callback */
+int hibp_qq_fd(const hibp_query_queue_t* qq);
+
+/* Block until every query submitted to qq so far has been answered, and its callback (if
+ * any) has returned */
+void hibp_qq_wait(hibp_query_queue_t* qq);
+
 #endif /* _HIBP_BLOOM_H_ */
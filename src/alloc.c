@@ -0,0 +1,225 @@
+/* For MAP_ANONYMOUS, MAP_HUGETLB, MADV_HUGEPAGE, syscall, and sysconf(_SC_PAGESIZE) */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>    /* FILE, which hibp-bloom.h assumes */
+#include <errno.h>    /* errno, EINVAL, ENOMEM */
+#include <stdint.h>   /* uintptr_t */
+#include <unistd.h>   /* sysconf, syscall */
+#include <sys/mman.h> /* mmap, munmap, madvise */
+
+#ifdef __linux__
+#include <sys/syscall.h> /* SYS_mbind, SYS_get_mempolicy, SYS_getcpu */
+#endif
+
+#include "hibp-bloom.h"
+#include "alloc.h"
+
+/* ================================================================
+ * NUMA
+ * ================================================================ */
+
+/* glibc has no wrappers for the NUMA system calls (libnuma does, but it's not worth the
+ * dependency for two calls), so we make them directly. From linux/mempolicy.h */
+#define MPOL_PREFERRED 1
+#define MPOL_INTERLEAVE 3
+#define MPOL_F_MEMS_ALLOWED (1 << 2)
+
+/* Enough for the largest kernel configuration (CONFIG_NODES_SHIFT = 10); get_mempolicy
+ * fails if the mask is smaller than the kernel's */
+#define MAX_NODES 1024
+#define BITS_PER_LONG (8 * sizeof(unsigned long))
+#define MASK_LONGS (MAX_NODES / BITS_PER_LONG)
+
+#if defined(__linux__) && defined(SYS_mbind) && defined(SYS_get_mempolicy)
+#define HAVE_MEMPOLICY 1
+#endif
+
+/* The nodes from which this process may allocate memory. Returns nonzero on failure
+ * (e.g. if the kernel was built without NUMA support, or a seccomp filter forbids it) */
+static int allowed_nodes(unsigned long* mask) {
+#ifdef HAVE_MEMPOLICY
+  return syscall(SYS_get_mempolicy, NULL, mask, (unsigned long)MAX_NODES, NULL,
+                 (unsigned long)MPOL_F_MEMS_ALLOWED) != 0;
+#else
+  (void)mask;
+  return 1;
+#endif
+}
+
+/* Apply a memory policy to [base, base + size) before any of it is touched. Advisory;
+ * the kernel's failure to comply is ignored */
+static void bind_pages(void* base, size_t size, int mode, const unsigned long* mask) {
+#ifdef HAVE_MEMPOLICY
+  /* The kernel reads maxnode - 1 bits of the mask */
+  syscall(SYS_mbind, base, (unsigned long)size, mode, mask, (unsigned long)MAX_NODES + 1, 0U);
+#else
+  (void)base;
+  (void)size;
+  (void)mode;
+  (void)mask;
+#endif
+}
+
+size_t hibp_numa_n_nodes(void) {
+  unsigned long mask[MASK_LONGS] = { 0 };
+
+  if(allowed_nodes(mask) != 0) {
+    return 1;
+  }
+
+  for(size_t i = MAX_NODES; i > 0; i --) {
+    if(mask[(i - 1) / BITS_PER_LONG] & (1UL << ((i - 1) % BITS_PER_LONG))) {
+      return i;
+    }
+  }
+
+  return 1;
+}
+
+int hibp_numa_node(void) {
+#if defined(__linux__) && defined(SYS_getcpu)
+  unsigned cpu;
+  unsigned node;
+
+  if(syscall(SYS_getcpu, &cpu, &node, NULL) == 0 && node < MAX_NODES) {
+    return (int)node;
+  }
+#endif
+
+  return 0;
+}
+
+/* ================================================================
+ * Pages
+ * ================================================================ */
+
+/* From linux/mman.h; the log2 of the huge page size goes in the high bits of the flags */
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+static const size_t HUGE_PAGE_SIZE = ((size_t)1) << 21;
+static const size_t GIGANTIC_PAGE_SIZE = ((size_t)1) << 30;
+
+static size_t page_size(void) {
+  const long size = sysconf(_SC_PAGESIZE);
+  return (size < 1) ? 4096 : (size_t)size;
+}
+
+/* Round size up to a multiple of alignment (a power of 2), failing on overflow */
+static int round_up(size_t* rounded, size_t size, size_t alignment) {
+  if(size > ~(size_t)0 - (alignment - 1)) {
+    return 1;
+  }
+
+  *rounded = (size + alignment - 1) & ~(alignment - 1);
+  return 0;
+}
+
+void* hibp_alloc_pages(size_t* mapped_size, size_t size, int flags, int node) {
+  const int hugetlb = flags & (HIBP_ALLOC_HUGETLB | HIBP_ALLOC_HUGETLB_1GB);
+
+  const int known = HIBP_ALLOC_HUGEPAGES | HIBP_ALLOC_HUGETLB | HIBP_ALLOC_HUGETLB_1GB |
+                    HIBP_ALLOC_INTERLEAVE | HIBP_ALLOC_NODE;
+
+  if((flags & ~known) != 0 ||
+     ((flags & HIBP_ALLOC_HUGETLB) && (flags & HIBP_ALLOC_HUGETLB_1GB)) ||
+     ((flags & HIBP_ALLOC_INTERLEAVE) && (flags & HIBP_ALLOC_NODE)) ||
+     ((flags & HIBP_ALLOC_NODE) && (node < 0 || node >= MAX_NODES))) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  int mmap_flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  size_t alignment = page_size();
+
+  if(hugetlb) {
+#ifdef MAP_HUGETLB
+    const int log2_page_size = (flags & HIBP_ALLOC_HUGETLB_1GB) ? 30 : 21;
+    mmap_flags |= MAP_HUGETLB | (log2_page_size << MAP_HUGE_SHIFT);
+    alignment = (flags & HIBP_ALLOC_HUGETLB_1GB) ? GIGANTIC_PAGE_SIZE : HUGE_PAGE_SIZE;
+#else
+    errno = EINVAL;
+    return NULL;
+#endif
+  }
+
+  size_t rounded;
+
+  if(round_up(&rounded, (size == 0) ? 1 : size, alignment) != 0) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  /* Transparent huge pages can only back the 2 MB-aligned parts of a mapping, and mmap
+   * only promises page alignment, so map an extra huge page's worth and trim the ends */
+  const int transparent = (flags & HIBP_ALLOC_HUGEPAGES) && !hugetlb;
+
+  if(transparent && round_up(&rounded, rounded, HUGE_PAGE_SIZE) != 0) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  const size_t slack = transparent ? HUGE_PAGE_SIZE : 0;
+
+  if(rounded > ~(size_t)0 - slack) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  unsigned char* mapping = (unsigned char*)mmap(NULL, rounded + slack, PROT_READ | PROT_WRITE,
+                                                mmap_flags, -1, 0);
+
+  if((void*)mapping == MAP_FAILED) {
+    /* An exhausted huge page pool is reported as ENOMEM or EINVAL, depending on the kernel.
+     * Either way, the caller is out of (huge) memory */
+    if(hugetlb) {
+      errno = ENOMEM;
+    }
+
+    return NULL;
+  }
+
+  unsigned char* base = mapping;
+
+  if(transparent) {
+    const size_t misalignment = (uintptr_t)mapping & (HUGE_PAGE_SIZE - 1);
+    const size_t head = (misalignment == 0) ? 0 : HUGE_PAGE_SIZE - misalignment;
+
+    base = mapping + head;
+
+    if(head != 0) {
+      munmap(mapping, head);
+    }
+
+    if(slack - head != 0) {
+      munmap(base + rounded, slack - head);
+    }
+
+#ifdef MADV_HUGEPAGE
+    /* Advisory; transparent huge pages may be disabled system-wide */
+    madvise(base, rounded, MADV_HUGEPAGE);
+#endif
+  }
+
+  /* The policy must be in place before the pages are first touched, which is when they're
+   * actually allocated */
+  if(flags & HIBP_ALLOC_INTERLEAVE) {
+    unsigned long mask[MASK_LONGS] = { 0 };
+
+    if(allowed_nodes(mask) == 0) {
+      bind_pages(base, rounded, MPOL_INTERLEAVE, mask);
+    }
+  } else if(flags & HIBP_ALLOC_NODE) {
+    unsigned long mask[MASK_LONGS] = { 0 };
+    mask[node / BITS_PER_LONG] = 1UL << (node % BITS_PER_LONG);
+    bind_pages(base, rounded, MPOL_PREFERRED, mask);
+  }
+
+  *mapped_size = rounded;
+  return base;
+}
+
+void hibp_free_pages(void* base, size_t mapped_size) {
+  munmap(base, mapped_size);
+}
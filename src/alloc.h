@@ -0,0 +1,18 @@
+#ifndef _ALLOC_H_
+#define _ALLOC_H_
+
+#include <stddef.h>
+
+/* Internal to the library. Allocate at least size bytes of zeroed memory directly from
+ * the kernel, as an anonymous mapping placed according to flags (a combination of
+ * hibp_alloc_flag_t) and, for HIBP_ALLOC_NODE, node. On success, return the base of the
+ * mapping and set *mapped_size to its length, to be passed to hibp_free_pages. On failure,
+ * return NULL with errno set: ENOMEM if memory (or the huge page pool) is exhausted, and
+ * EINVAL if flags can't be honoured on this platform. Placement on NUMA nodes is advisory;
+ * if the kernel won't have it, the pages are placed as usual */
+void* hibp_alloc_pages(size_t* mapped_size, size_t size, int flags, int node);
+
+/* Release a mapping returned by hibp_alloc_pages */
+void hibp_free_pages(void* base, size_t mapped_size);
+
+#endif
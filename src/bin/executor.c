@@ -1,3 +1,6 @@
+/* For strdup and sysconf(_SC_NPROCESSORS_ONLN) */
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -5,6 +8,8 @@
 #include <ctype.h>
 #include <errno.h>
 #include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <openssl/sha.h>
 
 #include "executor.h"
@@ -37,10 +42,18 @@ typedef struct {
 } command_t;
 
 static void exec_status(executor_t* ex, size_t arity, const token_t* args);
+static void exec_stats(executor_t* ex, size_t arity, const token_t* args);
 static void exec_create(executor_t* ex, size_t arity, const token_t* args);
 static void exec_create_auto(executor_t* ex, size_t arity, const token_t* args);
 static void exec_load(executor_t* ex, size_t arity, const token_t* args);
+static void exec_map(executor_t* ex, size_t arity, const token_t* args);
+static void exec_page(executor_t* ex, size_t arity, const token_t* args);
 static void exec_save(executor_t* ex, size_t arity, const token_t* args);
+static void exec_merge(executor_t* ex, size_t arity, const token_t* args);
+static void exec_track(executor_t* ex, size_t arity, const token_t* args);
+static void exec_save_delta(executor_t* ex, size_t arity, const token_t* args);
+static void exec_apply_delta(executor_t* ex, size_t arity, const token_t* args);
+static void exec_save_changes(executor_t* ex, size_t arity, const token_t* args);
 static void exec_unload(executor_t* ex, size_t arity, const token_t* args);
 static void exec_insert(executor_t* ex, size_t arity, const token_t* args);
 static void exec_insert_sha(executor_t* ex, size_t arity, const token_t* args);
@@ -64,23 +77,47 @@ static const command_t commands[] = {
     exec_status
   },
 
+  {
+    "stats",
+    "",
+    (
+      "Show statistics about the currently-loaded Bloom filter: the fraction of its bits\n"
+      "that are set, and the false positive rate and number of distinct elements\n"
+      "estimated from them (a filter is saturated once about half its bits are set, if\n"
+      "its number of hash functions was chosen for its cardinality). If hibp-bloom was\n"
+      "built with STATS=1, also show the queries, insertions, and probes counted since\n"
+      "the filter was created or loaded, and the time spent loading, verifying, and\n"
+      "saving it. Reads the whole filter, so takes time proportional to its size."
+    ),
+    0, 0,
+    true, false,
+    exec_stats
+  },
+
   {
     "create",
-    "<n_hash_functions> <log2_bits>",
+    "<n_hash_functions> <log2_bits> [<layout> [<hashing>]]",
     (
       "Intialize a Bloom filter with n_hash_functions randomly-chosen hash functions\n"
       "and a bit vector of size 2**log2_bits. Tuning these values requires prior\n"
       "knowledge of the literature; to initialize a filter with sane defaults, use\n"
-      "create-auto."
+      "create-auto. layout is either \"standard\" (default) or \"blocked\"; a blocked\n"
+      "filter confines the bits of each element to a single 64-byte block (selected by\n"
+      "the first hash function), so that queries cost one cache miss rather than one per\n"
+      "hash function, at the price of a slightly higher false positive rate. Blocked\n"
+      "filters require log2_bits >= 9 and n_hash_functions >= 2. hashing is either\n"
+      "\"random\" (default) or \"double\"; with double hashing, every hash function is\n"
+      "derived from two 64-bit words of the SHA1, so that nothing need be stored and each\n"
+      "probe costs a multiply-add, rather than a few table lookups per hash function."
     ),
-    2, 2,
+    2, 4,
     false, true,
     exec_create
   },
 
   {
     "create-auto",
-    "<count> <rate> [<max_memory>]",
+    "<count> <rate> [<max_memory>] [<layout> [<hashing>]]",
     (
       "Initialize a Bloom filter with an approximate goal false positive rate and an\n"
       "optional maximum permissable memory consumption (default 100MB), given the\n"
@@ -88,10 +125,11 @@ static const command_t commands[] = {
       "the given memory limit, the best-performing parameters within the memory limit\n"
       "shall be selected. max_memory can be given either as an integer number of\n"
       "bytes, or as a real number followed by a suffix indicating the units (e.g. 10M\n"
-      "10gb, 0.5k, etc.). After creating a filter, try falsepos to empirically check\n"
-      "the false positive rate."
+      "10gb, 0.5k, etc.). layout and hashing are as for create. Unlike create, the bit\n"
+      "vector needn't be a power of 2 in size. After creating a filter, try falsepos to\n"
+      "empirically check the false positive rate."
     ),
-    2, 2,
+    2, 5,
     false, true,
     exec_create_auto
   },
@@ -105,13 +143,126 @@ static const command_t commands[] = {
     exec_load
   },
 
+  {
+    "map",
+    "<filename> [<option> ...]",
+    (
+      "Like load, but map the file into memory rather than reading it, so that loading\n"
+      "a large filter is close to instantaneous and its pages are shared with any other\n"
+      "process mapping the same file. Insertions don't modify the file (but see\n"
+      "save-changes). Options are any of \"populate\" (prefault the whole file up\n"
+      "front), \"hugepages\" (request huge pages from the kernel), \"noverify\" (skip\n"
+      "checksum validation), and \"lazy\" (validate each chunk of a chunked file when\n"
+      "it's first accessed)."
+    ),
+    1, 5,
+    false, true,
+    exec_map
+  },
+
+  {
+    "page",
+    "<filename> [<cache_size>]",
+    (
+      "Like map, but for filters too large for memory: read the filter's bits from the\n"
+      "file a page at a time as queries need them, keeping the most recently used in a\n"
+      "cache of cache_size (default 64M; a quantity of memory, as for create-auto).\n"
+      "query-file reads the pages of many queries at once. Best suited to blocked\n"
+      "filters, whose queries each touch a single page. A paged filter can only be\n"
+      "queried; its checksums aren't verified, and status shows the cache's hits and\n"
+      "misses."
+    ),
+    1, 2,
+    false, true,
+    exec_page
+  },
+
   {
     "save",
+    "<filename> [<format>]",
+    (
+      "Save the currently-loaded Bloom filter to disk. format is one of \"compact\"\n"
+      "(default), which is readable by older versions of hibp-bloom; \"aligned\", which\n"
+      "pads the file so that the bit vector starts on a 4 KiB boundary (best for filters\n"
+      "that are to be loaded with map); \"chunked\" or \"chunked-sha1\", which are\n"
+      "aligned, and checksum each 4 MiB chunk with CRC32C or SHA1 respectively, so that\n"
+      "checksums are computed in parallel and can be verified lazily by map; and\n"
+      "\"compressed\", which LZ4-compresses each 4 MiB chunk (worthwhile for sparsely\n"
+      "populated filters, e.g. for distribution; can be loaded, but not mapped)."
+    ),
+    1, 2,
+    true, false,
+    exec_save
+  },
+
+  {
+    "merge",
+    "<filename> [... <filename>]",
+    (
+      "Merge one or several previously-saved Bloom filters into the currently-loaded\n"
+      "Bloom filter, such that it contains everything inserted into any of them. The\n"
+      "filters must share the hash functions of the currently-loaded filter, i.e. they\n"
+      "must all descend from the same saved filter. To build a large filter across\n"
+      "several machines, create it and save it while it's still empty; then on each\n"
+      "machine, load that file, insert a share of the data, and save the result; and\n"
+      "finally merge all of the results together."
+    ),
+    1, SIZE_MAX,
+    true, false,
+    exec_merge
+  },
+
+  {
+    "track",
+    "",
+    (
+      "Start keeping track of which 4 KiB pages of the currently-loaded Bloom filter are\n"
+      "modified by insertions, merges, and apply-delta, so that they can be persisted\n"
+      "with save-delta or save-changes. If changes are already being tracked, forget\n"
+      "them and start afresh."
+    ),
+    0, 0,
+    true, false,
+    exec_track
+  },
+
+  {
+    "save-delta",
+    "<filename>",
+    (
+      "Save the pages modified since track (or the last save-changes) as a delta, which\n"
+      "can be applied to other copies of the saved filter with apply-delta, rather than\n"
+      "shipping the whole filter. Deltas are applied by setting bits, never clearing\n"
+      "them, so applying a delta more than once is harmless."
+    ),
+    1, 1,
+    true, false,
+    exec_save_delta
+  },
+
+  {
+    "apply-delta",
+    "<filename> [... <filename>]",
+    (
+      "Apply one or several deltas (see save-delta) to the currently-loaded Bloom\n"
+      "filter, which must share the hash functions of the filter they were saved from."
+    ),
+    1, SIZE_MAX,
+    true, false,
+    exec_apply_delta
+  },
+
+  {
+    "save-changes",
     "<filename>",
-    "Save the currently-loaded Bloom filter to disk.",
+    (
+      "Write the pages modified since track (or the last save-changes) back into the\n"
+      "file from which the currently-loaded Bloom filter was mapped, in place, along\n"
+      "with any checksums they invalidate; unmodified pages aren't rewritten."
+    ),
     1, 1,
     true, false,
-    exec_save
+    exec_save_changes
   },
 
   {
@@ -143,14 +294,18 @@ static const command_t commands[] = {
 
   {
     "insert-file",
-    "<filename> [<format>]",
+    "<filename> [<format>] [--threads=<n>] [--min-count=<n>]",
     (
       "Insert a sequence of strings from the given file according to the specified\n"
       "format. format is either \"strings\" (default, whitespace-delimited strings),\n"
-      "\"lines\" (full lines including leading/trailing whitespace), or \"shas\" (space-\n"
-      "or comma-separated SHA1 hashes)."
+      "\"lines\" (full lines including leading/trailing whitespace), \"shas\" (space-\n"
+      "or comma-separated SHA1 hashes), or \"hibp\" (SHA1:COUNT lines, as in the Pwned\n"
+      "Passwords dump). The file is read in batches, the next while the last is being\n"
+      "inserted. With --threads, elements are hashed and inserted by n threads at\n"
+      "once (n = 0 means one per CPU), which speeds up building a large filter\n"
+      "considerably. With --min-count, hibp entries with a count below n are skipped."
     ),
-    1, 2,
+    1, 4,
     true, false,
     exec_insert_file
   },
@@ -178,26 +333,34 @@ static const command_t commands[] = {
 
   {
     "query-file",
-    "<filename> [<format>]",
+    "<filename> [<format>] [--threads=<n>] [--min-count=<n>] [--only-positive]",
     (
       "Query for the presence of a sequence of strings from the given file according to\n"
       "the specified format. format is either \"strings\" (default, whitespace-delimited\n"
-      "strings), \"lines\" (full lines including leading/trailing whitespace), or \"shas\"\n"
-      "(space- or comma-separated SHA1 hashes)."
+      "strings), \"lines\" (full lines including leading/trailing whitespace), \"shas\"\n"
+      "(space- or comma-separated SHA1 hashes), or \"hibp\" (SHA1:COUNT lines, as in the\n"
+      "Pwned Passwords dump). The file is read in batches, which n threads (n = 0, the\n"
+      "default, means one per CPU) hash and query while the next batches are read, and\n"
+      "results are printed in the order of the file. With --min-count, hibp entries\n"
+      "with a count below n are skipped. With --only-positive, only elements found to\n"
+      "be present are printed."
     ),
-    1, 2,
+    1, 5,
     true, false,
     exec_query_file
   },
 
   {
     "falsepos",
-    "[<trials>]",
+    "[<trials>] [--threads=<n>] [--seed=<n>]",
     (
-      "Empirically test the false positive rate of the currently-loaded Bloom\n"
-      "filter by repeated random trials."
+      "Empirically test the false positive rate of the currently-loaded Bloom filter by\n"
+      "querying it for trials (default 1000000) random SHA1 hashes, and print the rate\n"
+      "observed along with a 95% confidence interval. Trials are run by n threads at\n"
+      "once (n = 0, the default, means one per CPU). The hashes are drawn from a PRNG\n"
+      "seeded with --seed (default 0), so the outcome is reproducible."
     ),
-    0, 1,
+    0, 3,
     true, false,
     exec_falsepos
   },
@@ -308,7 +471,7 @@ static inline int ex_next_token(token_t* token, executor_t* ex) {
   return -1;
 }
 
-static inline const char* hibp_strerror(hibp_status_t status) {
+const char* hibp_strerror(hibp_status_t status) {
   /* FIXME: think about these messages a bit more */
   switch(status) {
     case HIBP_E_NOMEM:
@@ -354,6 +517,120 @@ const command_t* find_command(executor_t* ex, const token_t* token) {
   return NULL;
 }
 
+static inline int ex_token2layout(hibp_layout_t* layout, executor_t* ex, const token_t* token) {
+  if(token_eq(token, "standard")) {
+    (*layout) = HIBP_LAYOUT_STANDARD;
+    return 0;
+  }
+
+  if(token_eq(token, "blocked")) {
+    (*layout) = HIBP_LAYOUT_BLOCKED;
+    return 0;
+  }
+
+  char* str = token2str(token);
+
+  /* Swallow any allocation errors from token2str */
+  fail(
+    ex, EX_E_RECOVERABLE, token,
+    "Invalid layout %s; expected standard or blocked",
+    ((str == NULL) ? "" : str)
+  );
+
+  free(str);
+
+  return -1;
+}
+
+static inline int ex_token2hashing(hibp_hashing_t* hashing, executor_t* ex, const token_t* token) {
+  if(token_eq(token, "random")) {
+    (*hashing) = HIBP_HASHING_RANDOM;
+    return 0;
+  }
+
+  if(token_eq(token, "double")) {
+    (*hashing) = HIBP_HASHING_DOUBLE;
+    return 0;
+  }
+
+  char* str = token2str(token);
+
+  /* Swallow any allocation errors from token2str */
+  fail(
+    ex, EX_E_RECOVERABLE, token,
+    "Invalid hashing %s; expected random or double",
+    ((str == NULL) ? "" : str)
+  );
+
+  free(str);
+
+  return -1;
+}
+
+static inline int ex_token2file_format(hibp_format_t* format, executor_t* ex, const token_t* token) {
+  if(token_eq(token, "compact")) {
+    (*format) = HIBP_FORMAT_COMPACT;
+    return 0;
+  }
+
+  if(token_eq(token, "aligned")) {
+    (*format) = HIBP_FORMAT_ALIGNED;
+    return 0;
+  }
+
+  if(token_eq(token, "chunked")) {
+    (*format) = HIBP_FORMAT_CHUNKED;
+    return 0;
+  }
+
+  if(token_eq(token, "chunked-sha1")) {
+    (*format) = HIBP_FORMAT_CHUNKED_SHA1;
+    return 0;
+  }
+
+  if(token_eq(token, "compressed")) {
+    (*format) = HIBP_FORMAT_COMPRESSED;
+    return 0;
+  }
+
+  char* str = token2str(token);
+
+  /* Swallow any allocation errors from token2str */
+  fail(
+    ex, EX_E_RECOVERABLE, token,
+    "Invalid format %s; expected compact, aligned, chunked, chunked-sha1, or compressed",
+    ((str == NULL) ? "" : str)
+  );
+
+  free(str);
+
+  return -1;
+}
+
+static inline const char* layout2str(hibp_layout_t layout) {
+  switch(layout) {
+    case HIBP_LAYOUT_STANDARD:
+      return "standard";
+    case HIBP_LAYOUT_BLOCKED:
+      return "blocked";
+    default:
+      assert(0);
+      return NULL;
+  }
+}
+
+static inline const char* hashing2str(hibp_hashing_t hashing) {
+  switch(hashing) {
+    case HIBP_HASHING_RANDOM:
+      return "random";
+    case HIBP_HASHING_DOUBLE:
+      return "double";
+    default:
+      assert(0);
+      return NULL;
+  }
+}
+
 static inline FILE* ex_fopen(executor_t* ex, const token_t* token, bool in, bool binary) {
   const char* mode;
 
@@ -432,7 +709,8 @@ static inline void ex_fclose(FILE* file) {
 typedef enum {
   SF_FORMAT_STRINGS,
   SF_FORMAT_LINES,
-  SF_FORMAT_SHAS
+  SF_FORMAT_SHAS,
+  SF_FORMAT_HIBP
 } stringfile_format_t;
 
 static inline int ex_token2format(stringfile_format_t* format, executor_t* ex, const token_t* token) {
@@ -451,12 +729,17 @@ static inline int ex_token2format(stringfile_format_t* format, executor_t* ex, c
     return 0;
   }
 
+  if(token_eq(token, "hibp")) {
+    (*format) = SF_FORMAT_HIBP;
+    return 0;
+  }
+
   char* str = token2str(token);
 
   /* Swallow any allocation errors from token2str */
   fail(
     ex, EX_E_RECOVERABLE, token,
-    "Invalid format %s; expected strings, lines, or shas",
+    "Invalid format %s; expected strings, lines, shas, or hibp",
     ((str == NULL) ? "" : str)
   );
 
@@ -521,46 +804,31 @@ static inline int stringfile_skip(stream_t* stream, stringfile_format_t format)
   return stream_peek(stream);
 }
 
-static inline int ex_stringfile_next_string(token_t* string, executor_t* ex, stream_t* stream) {
-  for(;;) {
-    const int c = stream_peek(stream);
-
-    if(c == EOF || isspace(c)) {
-      break;
-    }
-
-    if(token_pushc(string, c) == -1) {
-      fail(ex, EX_E_FATAL, NULL, OUT_OF_MEMORY_MESSAGE);
-      return -1;
-    }
-
-    stream_getc(stream);
-  }
-
-  assert(string->length > 0);
+/* Consume the next string or line, according to format, from stream. On success, returns
+ * 1 and points *string at it, without copying; it's valid until the next read from the
+ * stream. Blank lines are skipped. Returns 0 at EOF, or -1 on error */
+static inline int ex_stringfile_next(const char** string, size_t* length, executor_t* ex,
+                                     stream_t* stream, stringfile_format_t format) {
+  assert(format == SF_FORMAT_STRINGS || format == SF_FORMAT_LINES);
 
-  return 0;
-}
+  const stream_span_t kind = (format == SF_FORMAT_STRINGS) ? STREAM_SPAN_STRING : STREAM_SPAN_LINE;
 
-static inline int ex_stringfile_next_line(token_t* line, executor_t* ex, stream_t* stream) {
   for(;;) {
-    const int c = stream_peek(stream);
-
-    if(c == EOF || c == '\n') {
-      break;
+    if(stringfile_skip(stream, format) == EOF) {
+      return 0;
     }
 
-    if(token_pushc(line, c) == -1) {
+    const int status = stream_next_span(stream, kind, string, length);
+
+    if(status == -1) {
       fail(ex, EX_E_FATAL, NULL, OUT_OF_MEMORY_MESSAGE);
       return -1;
     }
 
-    stream_getc(stream);
+    if(status == 0 || *length > 0) {
+      return status;
+    }
   }
-
-  assert(line->length > 0);
-
-  return 0;
 }
 
 static inline int ex_stringfile_next_sha(hibp_byte_t* sha, executor_t* ex, stream_t* stream) {
@@ -594,167 +862,1292 @@ static inline int ex_stringfile_next_sha(hibp_byte_t* sha, executor_t* ex, strea
   return 0;
 }
 
-/* ================================================================
- * Command callbacks
- * ================================================================ */
+/* SHAs are read from files in batches of this size, so that they can be fed to the
+ * batched insertion and query functions. Batches for the parallel insertion functions
+ * need to be much larger, to make it worth starting the threads */
+#define SHA_BATCH_SIZE 1024
+#define SHA_PARALLEL_BATCH_SIZE 65536
 
-static void exec_status(executor_t* ex, size_t arity, const token_t* args) {
-  assert(ex->filter_initialized);
-  assert(arity == 0);
-  (void)arity;
-  (void)args;
+/* Read up to capacity SHAs from stream into shas, returning the number read. *done is set
+ * if the stream was exhausted or if a parse error occurred (in which case the SHAs
+ * preceding the error are still returned) */
+static inline size_t ex_stringfile_next_sha_batch(hibp_byte_t* shas, size_t capacity, bool* done,
+                                                  executor_t* ex, stream_t* stream) {
+  size_t n = 0;
 
-  const char* format =
-    "n_hash_functions:  %u\n"
-    "log2_bits:         %u\n"
-    "Bits:              %u\n"
-    "Total memory:      %.2lf MB\n";
+  *done = false;
 
-  hibp_filter_info_t info;
-  hibp_bf_get_info(&info, &ex->filter);
+  while(n < capacity) {
+    if(stringfile_skip(stream, SF_FORMAT_SHAS) == EOF) {
+      *done = true;
+      break;
+    }
 
-  printf(
-    format,
-    (unsigned long)info.n_hash_functions,
-    (unsigned long)info.log2_bits,
-    (unsigned long)info.bits,
-    info.memory / (double)(1024 * 1024)
-  );
+    if(ex_stringfile_next_sha(shas + n * SHA1_BYTES, ex, stream) == -1) {
+      *done = true;
+      break;
+    }
+
+    n ++;
+  }
+
+  return n;
 }
 
-static void exec_create(executor_t* ex, size_t arity, const token_t* args) {
-  assert(!ex->filter_initialized);
-  assert(arity == 2);
-  (void)arity;
+/* Strings and lines are likewise read in batches, so that they can be fed to the batched
+ * functions, which hash them several at a time. Spans of the stream don't outlive the next
+ * read, so each batch is copied into a buffer of its own; a batch ends after capacity
+ * strings or once the buffer holds STRING_BATCH_BYTES bytes, whichever comes first */
+#define STRING_BATCH_BYTES (1 << 20)
 
-  size_t n_hash_functions;
-  size_t log2_bits;
+typedef struct {
+  char* data;
+  size_t data_capacity;
+  size_t* offsets;
+  size_t* sizes;
+  const hibp_byte_t** buffers;
+} string_batch_t;
+
+/* On failure, the batch must still be destroyed */
+static inline int string_batch_new(string_batch_t* batch, size_t capacity) {
+  batch->data = NULL;
+  batch->data_capacity = 0;
+  batch->offsets = (size_t*)malloc(capacity * sizeof(size_t));
+  batch->sizes = (size_t*)malloc(capacity * sizeof(size_t));
+  batch->buffers = (const hibp_byte_t**)malloc(capacity * sizeof(const hibp_byte_t*));
+
+  return (batch->offsets == NULL || batch->sizes == NULL || batch->buffers == NULL) ? -1 : 0;
+}
 
-  /* Parse parameters */
+static inline void string_batch_destroy(string_batch_t* batch) {
+  free(batch->data);
+  free(batch->offsets);
+  free(batch->sizes);
+  free(batch->buffers);
+}
 
-  if(token2size(&n_hash_functions, &args[0]) == -1 || n_hash_functions == 0) {
-    fail(ex, EX_E_RECOVERABLE, &args[0], "n_hash_functions must be a positive integer");
-    return;
-  }
+/* Read up to capacity strings or lines, according to format, from stream into batch,
+ * returning the number read; the i'th is then the batch->sizes[i] bytes at
+ * batch->buffers[i]. *done is set if the stream was exhausted or if an error occurred */
+static inline size_t ex_stringfile_next_batch(string_batch_t* batch, size_t capacity, bool* done,
+                                              executor_t* ex, stream_t* stream,
+                                              stringfile_format_t format) {
+  size_t n = 0;
+  size_t used = 0;
 
-  if(token2size(&log2_bits, &args[1]) == -1 || n_hash_functions == 0) {
-    fail(ex, EX_E_RECOVERABLE, &args[1], "log2_bits must be a positive integer");
-    return;
-  }
+  *done = false;
 
-  /* Initialize filter */
+  while(n < capacity && used < STRING_BATCH_BYTES) {
+    const char* string;
+    size_t length;
 
-  hibp_status_t status = hibp_bf_new(&ex->filter, n_hash_functions, log2_bits);
+    if(ex_stringfile_next(&string, &length, ex, stream, format) != 1) {
+      *done = true;
+      break;
+    }
 
-  if(status == HIBP_OK) {
-    ex->filter_initialized = true;
-    return;
-  }
+    /* Only a string longer than STRING_BATCH_BYTES can overflow the buffer */
+    if(used + length > batch->data_capacity) {
+      size_t data_capacity = (batch->data_capacity == 0) ? STRING_BATCH_BYTES : 2 * batch->data_capacity;
 
-  fail(
-    ex, ((status == HIBP_E_NOMEM) ? EX_E_FATAL : EX_E_RECOVERABLE), NULL,
-    hibp_strerror(status)
-  );
-}
+      while(data_capacity < used + length) {
+        data_capacity *= 2;
+      }
 
-static void exec_create_auto(executor_t* ex, size_t arity, const token_t* args) {
-  assert(!ex->filter_initialized);
-  assert(arity == 2 || arity == 3);
+      char* data = (char*)realloc(batch->data, data_capacity);
 
-  size_t count;
-  double rate;
-  size_t maxmem;
+      if(data == NULL) {
+        fail(ex, EX_E_FATAL, NULL, OUT_OF_MEMORY_MESSAGE);
+        *done = true;
+        break;
+      }
 
-  /* Parse parameters */
+      batch->data = data;
+      batch->data_capacity = data_capacity;
+    }
 
-  if(token2size(&count, &args[0]) == -1) {
-    fail(ex, EX_E_RECOVERABLE, &args[0], "count must be a non-negative integer");
-    return;
+    memcpy(batch->data + used, string, length);
+    batch->offsets[n] = used;
+    batch->sizes[n] = length;
+    used += length;
+    n ++;
   }
 
-  if(token2double(&rate, &args[1]) == -1) {
-    fail(ex, EX_E_RECOVERABLE, &args[1], "rate must be a non-negative real number");
+  for(size_t i = 0; i < n; i ++) {
+    batch->buffers[i] = (const hibp_byte_t*)(batch->data + batch->offsets[i]);
   }
 
-  if(arity == 3) {
-    if(token2memsize(&maxmem, &args[2]) == -1) {
-      fail(ex, EX_E_RECOVERABLE, &args[2], "maxmem must be a quantity of memory");
-      return;
-    }
-  } else {
-    maxmem = 100 * 1024 * 1024;
-  }
+  return n;
+}
 
-  size_t n_hash_functions;
-  size_t log2_bits;
+/* The Pwned Passwords dump consists of lines of the form SHA1:COUNT\r\n, where COUNT is the
+ * number of times the password was seen in breaches. The dump runs to tens of gigabytes, so
+ * rather than going through the stream character by character we take it a line at a
+ * time, and parse each line in place */
 
-  /* Compute the parameters that would (with high probability) give a false positive
-   * rate of rate (assuming that the cardinality of the underlying set is count) */
+typedef struct {
+  stream_t* stream;
+
+  /* Number of the line being parsed, for error messages */
+  size_t line;
+
+  /* Entries with a count below min_count are dropped, and tallied in skipped */
+  size_t min_count;
+  size_t skipped;
+} hibpfile_t;
+
+/* Table-driven hex decoding: the low nybble of hex_values[c] is the value of the digit c,
+ * and bit 8 is set iff c is a hex digit at all */
+static const unsigned short hex_values[256] = {
+  ['0'] = 0x100, ['1'] = 0x101, ['2'] = 0x102, ['3'] = 0x103, ['4'] = 0x104,
+  ['5'] = 0x105, ['6'] = 0x106, ['7'] = 0x107, ['8'] = 0x108, ['9'] = 0x109,
+  ['A'] = 0x10a, ['B'] = 0x10b, ['C'] = 0x10c, ['D'] = 0x10d, ['E'] = 0x10e, ['F'] = 0x10f,
+  ['a'] = 0x10a, ['b'] = 0x10b, ['c'] = 0x10c, ['d'] = 0x10d, ['e'] = 0x10e, ['f'] = 0x10f
+};
 
-  hibp_compute_optimal_params(&n_hash_functions, &log2_bits, count, rate);
+/* Decode 40 hex digits into sha, without branching per character. Returns false if any
+ * of the characters isn't a hex digit */
+static inline bool decode_sha(hibp_byte_t* sha, const char* hex) {
+  unsigned int valid = 0x100;
 
-  const size_t memory = hibp_compute_total_size(n_hash_functions, log2_bits);
+  for(size_t i = 0; i < SHA1_BYTES; i ++) {
+    const unsigned int hi = hex_values[(unsigned char)hex[2 * i]];
+    const unsigned int lo = hex_values[(unsigned char)hex[2 * i + 1]];
 
-  /* If satisfying rate would eat too much memory, fall back on the best possible
-   * false positive rate that fits within the limit */
+    valid &= hi & lo;
+    sha[i] = (hibp_byte_t)(((hi & 0xf) << 4) | (lo & 0xf));
+  }
+
+  return valid != 0;
+}
+
+static inline void hibpfile_new(hibpfile_t* hf, stream_t* stream, size_t min_count) {
+  hf->stream = stream;
+  hf->line = 0;
+  hf->min_count = min_count;
+  hf->skipped = 0;
+}
+
+/* Parse a line into sha. Returns 1 if the entry is to be kept, 0 if the line is blank or
+ * the entry's count is below the minimum, or -1 on error. The count is only parsed if
+ * there's a minimum */
+static inline int ex_hibpfile_parse_line(hibp_byte_t* sha, executor_t* ex, hibpfile_t* hf,
+                                         const char* line, size_t length) {
+  if(length > 0 && line[length - 1] == '\r') {
+    length --;
+  }
+
+  if(length == 0) {
+    return 0;
+  }
+
+  if(length < 2 * SHA1_BYTES || !decode_sha(sha, line)) {
+    fail(
+      ex, EX_E_RECOVERABLE, NULL,
+      "malformed SHA1 hash in %s at line %lu",
+      hf->stream->name, (unsigned long)hf->line
+    );
+    return -1;
+  }
+
+  if(length == 2 * SHA1_BYTES || line[2 * SHA1_BYTES] != ':') {
+    fail(
+      ex, EX_E_RECOVERABLE, NULL,
+      "expected SHA1:COUNT in %s at line %lu",
+      hf->stream->name, (unsigned long)hf->line
+    );
+    return -1;
+  }
+
+  if(hf->min_count == 0) {
+    return 1;
+  }
+
+  token_t count_token;
+  count_token.buffer = (char*)line + 2 * SHA1_BYTES + 1;
+  count_token.length = length - 2 * SHA1_BYTES - 1;
+
+  size_t count;
+
+  if(token2size(&count, &count_token) == -1) {
+    fail(
+      ex, EX_E_RECOVERABLE, NULL,
+      "malformed count in %s at line %lu",
+      hf->stream->name, (unsigned long)hf->line
+    );
+    return -1;
+  }
+
+  if(count < hf->min_count) {
+    hf->skipped ++;
+    return 0;
+  }
+
+  return 1;
+}
+
+/* Counterpart of ex_stringfile_next_sha_batch for the hibp format */
+static inline size_t ex_hibpfile_next_sha_batch(hibp_byte_t* shas, size_t capacity, bool* done,
+                                                executor_t* ex, hibpfile_t* hf) {
+  size_t n = 0;
+
+  *done = false;
+
+  while(n < capacity) {
+    const char* line;
+    size_t length;
+
+    hf->line = hf->stream->line;
+
+    const int status = stream_next_span(hf->stream, STREAM_SPAN_LINE, &line, &length);
+
+    if(status == -1) {
+      fail(ex, EX_E_FATAL, NULL, OUT_OF_MEMORY_MESSAGE);
+    }
+
+    if(status != 1) {
+      *done = true;
+      break;
+    }
+
+    const int keep = ex_hibpfile_parse_line(shas + n * SHA1_BYTES, ex, hf, line, length);
+
+    if(keep == -1) {
+      *done = true;
+      break;
+    }
+
+    n += keep;
+  }
+
+  return n;
+}
+
+/* Common argument parsing for insert-file and query-file: <filename> [<format>] [<options>],
+ * where options are any of --threads=<n> and --min-count=<n>, and for query-file,
+ * --only-positive */
+
+typedef struct {
+  stringfile_format_t format;
+  bool parallel;
+  size_t n_threads;
+  size_t min_count;
+  bool only_positive;
+} stringfile_args_t;
+
+/* If token is an option of the form <name>=<n>, parse its value. Returns 1 if so, 0 if
+ * token is some other argument, or -1 if the value is malformed */
+static inline int ex_token2option(size_t* value, executor_t* ex, const token_t* token,
+                                  const char* name) {
+  const size_t name_length = strlen(name);
+
+  if(token->length <= name_length || memcmp(token->buffer, name, name_length) != 0 ||
+     token->buffer[name_length] != '=') {
+    return 0;
+  }
+
+  token_t value_token;
+  value_token.buffer = token->buffer + name_length + 1;
+  value_token.length = token->length - name_length - 1;
+
+  if(token2size(value, &value_token) == -1) {
+    fail(ex, EX_E_RECOVERABLE, token, "expected %s=<n>", name);
+    return -1;
+  }
+
+  return 1;
+}
+
+static inline int ex_parse_stringfile_args(stringfile_args_t* sf, executor_t* ex, size_t arity,
+                                           const token_t* args, bool querying) {
+  sf->format = SF_FORMAT_STRINGS;
+  sf->parallel = false;
+  sf->n_threads = 0;
+  sf->min_count = 0;
+  sf->only_positive = false;
+
+  bool has_min_count = false;
+
+  for(size_t i = 1; i < arity; i ++) {
+    const token_t* token = &args[i];
+
+    if(token->length < 2 || memcmp(token->buffer, "--", 2) != 0) {
+      if(ex_token2format(&sf->format, ex, token) == -1) {
+        return -1;
+      }
+
+      continue;
+    }
+
+    if(querying && token_eq(token, "--only-positive")) {
+      sf->only_positive = true;
+      continue;
+    }
+
+    int matched = ex_token2option(&sf->n_threads, ex, token, "--threads");
+    sf->parallel = sf->parallel || (matched == 1);
+
+    if(matched == 0) {
+      matched = ex_token2option(&sf->min_count, ex, token, "--min-count");
+      has_min_count = has_min_count || (matched == 1);
+    }
+
+    if(matched == -1) {
+      return -1;
+    }
+
+    if(matched == 0) {
+      char* str = token2str(token);
+
+      /* Swallow any allocation errors from token2str */
+      fail(ex, EX_E_RECOVERABLE, token, "Invalid option %s", ((str == NULL) ? "" : str));
+
+      free(str);
+
+      return -1;
+    }
+  }
+
+  if(has_min_count && sf->format != SF_FORMAT_HIBP) {
+    fail(ex, EX_E_RECOVERABLE, NULL, "--min-count is only supported for the hibp format");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* ================================================================
+ * File pipeline
+ * ================================================================ */
+
+/* insert-file and query-file run as a pipeline, so that reading and parsing the file,
+ * hashing and probing (or setting bits of) the filter, and writing the results all
+ * overlap: the calling thread parses the file into batches, which workers take in turn,
+ * and a writer emits the output of each batch in the order in which the batches were
+ * read. Each batch lives in one of a ring of slots, whose buffers are reused from batch to
+ * batch, so that once the pipeline is warm nothing is allocated per element. Queries run
+ * on as many workers as there are threads; insertions run on a single worker, in order,
+ * since the filter isn't safe to insert into from several threads at once (but with
+ * --threads, each batch is inserted by the parallel insertion functions) */
+
+/* There's little to gain from more query workers than this */
+#define PIPELINE_MAX_WORKERS 64
+
+/* A slot is filled by the reader, worked on by a worker, and (for queries) written out by
+ * the writer, and then free to be filled again. Only the thread whose turn it is touches
+ * a slot, so only its state is guarded by the pipeline's lock */
+typedef enum {
+  SLOT_FREE,
+  SLOT_FILLED,
+  SLOT_WORKING,
+  SLOT_DONE
+} slot_state_t;
+
+typedef struct {
+  slot_state_t state;
+
+  /* n SHAs, or n strings */
+  size_t n;
+  hibp_byte_t* shas;
+  string_batch_t strings;
+  int* results;
+
+  /* The output of the batch, and whether it was too large to buffer */
+  char* out;
+  size_t out_size;
+  size_t out_capacity;
+  bool failed;
+} pipeline_slot_t;
+
+typedef struct {
+  hibp_bloom_filter_t* filter;
+  bool querying;
+  bool strings;
+  bool only_positive;
+  bool parallel;
+  size_t n_threads;
+
+  pthread_mutex_t lock;
+
+  /* Broadcast whenever a slot changes state, or reading finishes */
+  pthread_cond_t changed;
+
+  size_t n_slots;
+  pipeline_slot_t* slots;
+
+  /* The sequence numbers of the next batches to be filled, worked on, and written; batch
+   * i lives in slot i % n_slots */
+  size_t next_fill;
+  size_t next_work;
+  size_t next_write;
+  bool reading_done;
+
+  /* Set if the output of a batch couldn't be buffered, so that the reader stops */
+  bool failed;
+
+  size_t n_workers;
+  size_t n_started;
+  pthread_t workers[PIPELINE_MAX_WORKERS];
+  bool writer_started;
+  pthread_t writer;
+} pipeline_t;
+
+/* Ensure that a slot's output buffer has room for extra more bytes. Returns 0 on
+ * success, -1 if it couldn't grow */
+static int slot_reserve(pipeline_slot_t* slot, size_t extra) {
+  if(slot->out_capacity - slot->out_size >= extra) {
+    return 0;
+  }
+
+  size_t capacity = (slot->out_capacity == 0) ? STRING_BATCH_BYTES : 2 * slot->out_capacity;
+
+  while(capacity - slot->out_size < extra) {
+    capacity *= 2;
+  }
+
+  char* out = (char*)realloc(slot->out, capacity);
+
+  if(out == NULL) {
+    return -1;
+  }
+
+  slot->out = out;
+  slot->out_capacity = capacity;
+
+  return 0;
+}
+
+/* Query a batch, and format the results into its output buffer */
+static void pipeline_query(const pipeline_t* p, pipeline_slot_t* slot) {
+  const size_t n = slot->n;
+
+  if(p->strings) {
+    hibp_bf_query_batch(p->filter, n, slot->strings.sizes, slot->strings.buffers, slot->results);
+  } else {
+    hibp_bf_query_sha1_batch(p->filter, n, slot->shas, slot->results);
+  }
+
+  slot->out_size = 0;
+  slot->failed = false;
+
+  for(size_t i = 0; i < n; i ++) {
+    if(p->only_positive && !slot->results[i]) {
+      continue;
+    }
+
+    const char* suffix = slot->results[i] ? "  true\n" : "  false\n";
+    const size_t suffix_length = strlen(suffix);
+
+    /* For the sake of token2buf */
+    token_t token;
+    size_t length = 2 * SHA1_BYTES;
+
+    if(p->strings) {
+      token.buffer = (char*)slot->strings.buffers[i];
+      token.length = slot->strings.sizes[i];
+      length = token2buf(NULL, &token);
+    }
+
+    if(slot_reserve(slot, length + suffix_length) == -1) {
+      slot->failed = true;
+      return;
+    }
+
+    char* out = slot->out + slot->out_size;
+
+    if(p->strings) {
+      token2buf(out, &token);
+    } else {
+      const hibp_byte_t* sha = slot->shas + i * SHA1_BYTES;
+
+      for(size_t j = 0; j < SHA1_BYTES; j ++) {
+        out[2 * j] = HEX(sha[j] >> 4);
+        out[2 * j + 1] = HEX(sha[j] & 0xf);
+      }
+    }
+
+    memcpy(out + length, suffix, suffix_length);
+    slot->out_size += length + suffix_length;
+  }
+}
+
+static void pipeline_insert(const pipeline_t* p, pipeline_slot_t* slot) {
+  const size_t n = slot->n;
+
+  if(p->strings && p->parallel) {
+    hibp_bf_insert_parallel(p->filter, n, slot->strings.sizes, slot->strings.buffers, p->n_threads);
+  } else if(p->strings) {
+    hibp_bf_insert_batch(p->filter, n, slot->strings.sizes, slot->strings.buffers);
+  } else if(p->parallel) {
+    hibp_bf_insert_sha1_parallel(p->filter, n, slot->shas, p->n_threads);
+  } else {
+    hibp_bf_insert_sha1_batch(p->filter, n, slot->shas);
+  }
+}
+
+static void* pipeline_work(void* arg) {
+  pipeline_t* p = (pipeline_t*)arg;
+
+  pthread_mutex_lock(&p->lock);
+
+  for(;;) {
+    while(p->next_work == p->next_fill && !p->reading_done) {
+      pthread_cond_wait(&p->changed, &p->lock);
+    }
+
+    if(p->next_work == p->next_fill) {
+      break;
+    }
+
+    pipeline_slot_t* slot = &p->slots[p->next_work % p->n_slots];
+    assert(slot->state == SLOT_FILLED);
+
+    slot->state = SLOT_WORKING;
+    p->next_work ++;
+
+    pthread_mutex_unlock(&p->lock);
+
+    if(p->querying) {
+      pipeline_query(p, slot);
+    } else {
+      pipeline_insert(p, slot);
+    }
+
+    pthread_mutex_lock(&p->lock);
+
+    slot->state = p->querying ? SLOT_DONE : SLOT_FREE;
+    pthread_cond_broadcast(&p->changed);
+  }
+
+  pthread_mutex_unlock(&p->lock);
+
+  return NULL;
+}
+
+static void* pipeline_write(void* arg) {
+  pipeline_t* p = (pipeline_t*)arg;
+
+  pthread_mutex_lock(&p->lock);
+
+  for(;;) {
+    while(p->next_write < p->next_fill ? p->slots[p->next_write % p->n_slots].state != SLOT_DONE
+                                       : !p->reading_done) {
+      pthread_cond_wait(&p->changed, &p->lock);
+    }
+
+    if(p->next_write == p->next_fill) {
+      break;
+    }
+
+    pipeline_slot_t* slot = &p->slots[p->next_write % p->n_slots];
+
+    pthread_mutex_unlock(&p->lock);
+
+    if(!slot->failed) {
+      fwrite(slot->out, 1, slot->out_size, stdout);
+    }
+
+    pthread_mutex_lock(&p->lock);
+
+    p->failed = p->failed || slot->failed;
+    slot->state = SLOT_FREE;
+    p->next_write ++;
+    pthread_cond_broadcast(&p->changed);
+  }
+
+  pthread_mutex_unlock(&p->lock);
+
+  return NULL;
+}
+
+static void pipeline_destroy(pipeline_t* p) {
+  for(size_t i = 0; i < p->n_slots; i ++) {
+    pipeline_slot_t* slot = &p->slots[i];
+
+    free(slot->shas);
+    string_batch_destroy(&slot->strings);
+    free(slot->results);
+    free(slot->out);
+  }
+
+  free(p->slots);
+  pthread_cond_destroy(&p->changed);
+  pthread_mutex_destroy(&p->lock);
+}
+
+/* Set up a pipeline, with slots for batches of up to capacity elements, but don't start
+ * it. Returns 0 on success, or -1 if allocation fails */
+static int pipeline_new(pipeline_t* p, hibp_bloom_filter_t* filter, const stringfile_args_t* sf,
+                        bool querying, size_t capacity) {
+  p->filter = filter;
+  p->querying = querying;
+  p->strings = (sf->format == SF_FORMAT_STRINGS || sf->format == SF_FORMAT_LINES);
+  p->only_positive = sf->only_positive;
+  p->parallel = sf->parallel;
+  p->n_threads = sf->n_threads;
+  p->n_workers = 1;
+
+  if(querying) {
+    const long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    p->n_workers = (sf->n_threads != 0) ? sf->n_threads : (n_cpus < 1) ? 1 : (size_t)n_cpus;
+
+    if(p->n_workers > PIPELINE_MAX_WORKERS) {
+      p->n_workers = PIPELINE_MAX_WORKERS;
+    }
+  }
+
+  /* A slot for every worker, the reader, and the writer, and as many again so that a
+   * slow batch doesn't stall the rest */
+  p->n_slots = 2 * (p->n_workers + 2);
+  p->next_fill = 0;
+  p->next_work = 0;
+  p->next_write = 0;
+  p->reading_done = false;
+  p->failed = false;
+  p->n_started = 0;
+  p->writer_started = false;
+
+  if(pthread_mutex_init(&p->lock, NULL) != 0) {
+    return -1;
+  }
+
+  if(pthread_cond_init(&p->changed, NULL) != 0) {
+    pthread_mutex_destroy(&p->lock);
+    return -1;
+  }
+
+  p->slots = (pipeline_slot_t*)calloc(p->n_slots, sizeof(pipeline_slot_t));
+
+  if(p->slots == NULL) {
+    p->n_slots = 0;
+    pipeline_destroy(p);
+    return -1;
+  }
+
+  bool failed = false;
+
+  for(size_t i = 0; i < p->n_slots; i ++) {
+    pipeline_slot_t* slot = &p->slots[i];
+
+    slot->state = SLOT_FREE;
+
+    if(p->strings) {
+      failed = (string_batch_new(&slot->strings, capacity) == -1) || failed;
+    } else {
+      slot->shas = (hibp_byte_t*)malloc(capacity * SHA1_BYTES);
+      failed = (slot->shas == NULL) || failed;
+    }
+
+    if(querying) {
+      slot->results = (int*)malloc(capacity * sizeof(int));
+      failed = (slot->results == NULL) || failed;
+    }
+  }
+
+  if(failed) {
+    pipeline_destroy(p);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Start the workers and the writer. Returns -1 if the pipeline couldn't make progress
+ * with the threads that could be started (fewer workers than planned is fine) */
+static int pipeline_start(pipeline_t* p) {
+  for(; p->n_started < p->n_workers; p->n_started ++) {
+    if(pthread_create(&p->workers[p->n_started], NULL, pipeline_work, p) != 0) {
+      break;
+    }
+  }
+
+  if(p->querying) {
+    p->writer_started = (pthread_create(&p->writer, NULL, pipeline_write, p) == 0);
+  }
+
+  return (p->n_started == 0 || (p->querying && !p->writer_started)) ? -1 : 0;
+}
+
+/* Wait for the slot of the next batch to be free, returning it, or NULL if the pipeline
+ * has failed */
+static pipeline_slot_t* pipeline_next_slot(pipeline_t* p) {
+  pthread_mutex_lock(&p->lock);
+
+  pipeline_slot_t* slot = &p->slots[p->next_fill % p->n_slots];
+
+  while(slot->state != SLOT_FREE && !p->failed) {
+    pthread_cond_wait(&p->changed, &p->lock);
+  }
+
+  const bool failed = p->failed;
+
+  pthread_mutex_unlock(&p->lock);
+
+  return failed ? NULL : slot;
+}
+
+/* Hand the next batch, of n elements, over to the workers */
+static void pipeline_submit(pipeline_t* p, pipeline_slot_t* slot, size_t n) {
+  if(n == 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&p->lock);
+  slot->n = n;
+  slot->state = SLOT_FILLED;
+  p->next_fill ++;
+  pthread_cond_broadcast(&p->changed);
+  pthread_mutex_unlock(&p->lock);
+}
+
+/* Wait for every batch submitted to be worked on and written, and stop the threads.
+ * Returns -1 if any batch's output couldn't be buffered, and 0 otherwise */
+static int pipeline_finish(pipeline_t* p) {
+  pthread_mutex_lock(&p->lock);
+  p->reading_done = true;
+  pthread_cond_broadcast(&p->changed);
+  pthread_mutex_unlock(&p->lock);
+
+  for(size_t i = 0; i < p->n_started; i ++) {
+    pthread_join(p->workers[i], NULL);
+  }
+
+  if(p->writer_started) {
+    pthread_join(p->writer, NULL);
+  }
+
+  return p->failed ? -1 : 0;
+}
+
+/* Run insert-file (or query-file, if querying) on the open stream: parse it into batches
+ * on the calling thread, and feed them through a pipeline. Returns the number of elements
+ * read */
+static size_t ex_run_pipeline(executor_t* ex, stream_t* stream, hibpfile_t* hf, const stringfile_args_t* sf,
+                              bool querying) {
+  const stringfile_format_t format = sf->format;
+
+  /* Queries are spread across the workers a batch at a time, so their batches are
+   * modest; parallel insertions need much larger ones */
+  const size_t capacity = (!querying && sf->parallel) ? SHA_PARALLEL_BATCH_SIZE : SHA_BATCH_SIZE;
+
+  pipeline_t p;
+
+  if(pipeline_new(&p, &ex->filter, sf, querying, capacity) == -1) {
+    fail(ex, EX_E_FATAL, NULL, OUT_OF_MEMORY_MESSAGE);
+    return 0;
+  }
+
+  if(pipeline_start(&p) == -1) {
+    pipeline_finish(&p);
+    pipeline_destroy(&p);
+    fail(ex, EX_E_FATAL, NULL, "couldn't start threads for %s", (querying ? "query-file" : "insert-file"));
+    return 0;
+  }
+
+  size_t total = 0;
+  bool done = false;
+
+  while(!done) {
+    pipeline_slot_t* slot = pipeline_next_slot(&p);
+
+    if(slot == NULL) {
+      break;
+    }
+
+    size_t n;
+
+    if(format == SF_FORMAT_HIBP) {
+      n = ex_hibpfile_next_sha_batch(slot->shas, capacity, &done, ex, hf);
+    } else if(format == SF_FORMAT_SHAS) {
+      n = ex_stringfile_next_sha_batch(slot->shas, capacity, &done, ex, stream);
+    } else {
+      n = ex_stringfile_next_batch(&slot->strings, capacity, &done, ex, stream, format);
+    }
+
+    pipeline_submit(&p, slot, n);
+    total += n;
+  }
+
+  if(pipeline_finish(&p) == -1) {
+    fail(ex, EX_E_FATAL, NULL, OUT_OF_MEMORY_MESSAGE);
+  }
+
+  pipeline_destroy(&p);
+
+  return total;
+}
+
+/* ================================================================
+ * Command callbacks
+ * ================================================================ */
+
+/* Fail if the loaded filter was paged, so that its bits aren't in memory to be read in
+ * full or modified. Returns 0 if they are, -1 if not */
+static int ex_require_resident(executor_t* ex, const char* name) {
+  if(ex->filter.pager == NULL) {
+    return 0;
+  }
+
+  fail(ex, EX_E_RECOVERABLE, NULL, "%s requires a loaded or mapped Bloom filter, not a paged one", name);
+  return -1;
+}
+
+static void exec_status(executor_t* ex, size_t arity, const token_t* args) {
+  assert(ex->filter_initialized);
+  assert(arity == 0);
+  (void)arity;
+  (void)args;
+
+  const char* format =
+    "Layout:            %s\n"
+    "Hashing:           %s\n"
+    "n_hash_functions:  %u\n"
+    "log2_bits:         %u\n"
+    "Bits:              %u\n"
+    "Total memory:      %.2lf MB\n";
+
+  hibp_filter_info_t info;
+  hibp_bf_get_info(&info, &ex->filter);
+
+  printf(
+    format,
+    layout2str(info.layout),
+    hashing2str(info.hashing),
+    (unsigned long)info.n_hash_functions,
+    (unsigned long)info.log2_bits,
+    (unsigned long)info.bits,
+    info.memory / (double)(1024 * 1024)
+  );
+
+  if(ex->filter.pager != NULL) {
+    size_t hits;
+    size_t misses;
+    size_t errors;
+    hibp_bf_page_counts(&ex->filter, &hits, &misses, &errors);
+
+    printf(
+      "Page hits:         %lu\n"
+      "Page misses:       %lu\n"
+      "Page read errors:  %lu\n",
+      (unsigned long)hits,
+      (unsigned long)misses,
+      (unsigned long)errors
+    );
+  }
+}
+
+static void exec_stats(executor_t* ex, size_t arity, const token_t* args) {
+  assert(ex->filter_initialized);
+  assert(arity == 0);
+  (void)arity;
+  (void)args;
+
+  if(ex_require_resident(ex, "stats") == -1) {
+    return;
+  }
+
+  hibp_filter_stats_t stats;
+  hibp_bf_get_stats(&stats, &ex->filter);
+
+  printf(
+    "Bits set:          %lu\n"
+    "Fill ratio:        %.6lf\n"
+    "Estimated FPR:     %.6le\n"
+    "Est. cardinality:  %.0lf\n",
+    (unsigned long)stats.bits_set,
+    stats.fill_ratio,
+    stats.estimated_fpr,
+    stats.estimated_cardinality
+  );
+
+  if(!stats.counters_enabled) {
+    printf("Counters:          disabled (build with STATS=1)\n");
+    return;
+  }
+
+  printf(
+    "Queries:           %llu\n"
+    "Positives:         %llu\n"
+    "Probes:            %llu (%.3lf per query)\n"
+    "Insertions:        %llu\n"
+    "Load time:         %.6lf s\n"
+    "Verify time:       %.6lf s\n"
+    "Save time:         %.6lf s\n",
+    stats.n_queries,
+    stats.n_positives,
+    stats.n_probes,
+    (stats.n_queries == 0) ? 0.0 : (double)stats.n_probes / stats.n_queries,
+    stats.n_inserts,
+    stats.load_seconds,
+    stats.verify_seconds,
+    stats.save_seconds
+  );
+}
+
+static void exec_create(executor_t* ex, size_t arity, const token_t* args) {
+  assert(!ex->filter_initialized);
+  assert(2 <= arity && arity <= 4);
+
+  size_t n_hash_functions;
+  size_t log2_bits;
+  hibp_layout_t layout = HIBP_LAYOUT_STANDARD;
+  hibp_hashing_t hashing = HIBP_HASHING_RANDOM;
+
+  /* Parse parameters */
+
+  if(token2size(&n_hash_functions, &args[0]) == -1 || n_hash_functions == 0) {
+    fail(ex, EX_E_RECOVERABLE, &args[0], "n_hash_functions must be a positive integer");
+    return;
+  }
+
+  if(token2size(&log2_bits, &args[1]) == -1 || n_hash_functions == 0) {
+    fail(ex, EX_E_RECOVERABLE, &args[1], "log2_bits must be a positive integer");
+    return;
+  }
+
+  if(arity >= 3 && ex_token2layout(&layout, ex, &args[2]) == -1) {
+    return;
+  }
+
+  if(arity == 4 && ex_token2hashing(&hashing, ex, &args[3]) == -1) {
+    return;
+  }
+
+  /* Initialize filter */
+
+  hibp_status_t status = hibp_bf_new_hashing(&ex->filter, layout, hashing, n_hash_functions, log2_bits);
+
+  if(status == HIBP_OK) {
+    ex->filter_initialized = true;
+    return;
+  }
+
+  fail(
+    ex, ((status == HIBP_E_NOMEM) ? EX_E_FATAL : EX_E_RECOVERABLE), NULL,
+    hibp_strerror(status)
+  );
+}
+
+static void exec_create_auto(executor_t* ex, size_t arity, const token_t* args) {
+  assert(!ex->filter_initialized);
+  assert(2 <= arity && arity <= 5);
+
+  size_t count;
+  double rate;
+  size_t maxmem = 100 * 1024 * 1024;
+  hibp_layout_t layout = HIBP_LAYOUT_STANDARD;
+  hibp_hashing_t hashing = HIBP_HASHING_RANDOM;
+
+  /* Parse parameters */
+
+  if(token2size(&count, &args[0]) == -1) {
+    fail(ex, EX_E_RECOVERABLE, &args[0], "count must be a non-negative integer");
+    return;
+  }
+
+  if(token2double(&rate, &args[1]) == -1) {
+    fail(ex, EX_E_RECOVERABLE, &args[1], "rate must be a non-negative real number");
+    return;
+  }
+
+  /* max_memory, layout and hashing are all optional, but come in that order. max_memory
+   * must be present if all three are, and otherwise is if it parses */
+  size_t next = 2;
+  const int maxmem_parsed = (arity >= 3 && token2memsize(&maxmem, &args[2]) != -1);
+
+  if(arity == 5 || maxmem_parsed) {
+    if(!maxmem_parsed) {
+      fail(ex, EX_E_RECOVERABLE, &args[2], "maxmem must be a quantity of memory");
+      return;
+    }
+
+    next ++;
+  }
+
+  if(next < arity && ex_token2layout(&layout, ex, &args[next]) == -1) {
+    return;
+  }
+
+  if(next + 1 < arity && ex_token2hashing(&hashing, ex, &args[next + 1]) == -1) {
+    return;
+  }
+
+  size_t n_hash_functions;
+  size_t bits;
+
+  /* Compute the parameters that would (with high probability) give a false positive
+   * rate of rate (assuming that the cardinality of the underlying set is count). The
+   * filter is sized exactly, rather than to a power of 2 */
+
+  hibp_compute_optimal_bits(layout, &n_hash_functions, &bits, count, rate);
+
+  const size_t memory = hibp_compute_total_size_bits(layout, hashing, n_hash_functions, bits);
+
+  /* If satisfying rate would eat too much memory, fall back on the best possible
+   * false positive rate that fits within the limit */
 
   if(memory > maxmem) {
-    hibp_compute_constrained_params(&n_hash_functions, &log2_bits, count, maxmem);
+    hibp_compute_constrained_bits(layout, &n_hash_functions, &bits, count, maxmem);
+  }
+
+  /* Initialize filter */
+
+  hibp_status_t status = hibp_bf_new_bits(&ex->filter, layout, hashing, n_hash_functions, bits);
+
+  if(status == HIBP_OK) {
+    ex->filter_initialized = true;
+    return;
+  }
+
+  fail(
+    ex, ((status == HIBP_E_NOMEM) ? EX_E_FATAL : EX_E_RECOVERABLE), NULL,
+    hibp_strerror(status)
+  );
+}
+
+static void exec_load(executor_t* ex, size_t arity, const token_t* args) {
+  assert(!ex->filter_initialized);
+  assert(arity == 1);
+  (void)arity;
+
+  FILE* file = ex_fopen(ex, &args[0], true, true);
+
+  if(file == NULL) {
+    return;
+  }
+
+  const hibp_status_t status = hibp_bf_load_file(&ex->filter, file);
+
+  ex_fclose(file);
+
+  if(status == HIBP_OK) {
+    ex->filter_initialized = 1;
+    return;
+  }
+
+  if(status != HIBP_E_IO) {
+    fail(ex, EX_E_RECOVERABLE, &args[0], "%s", hibp_strerror(status));
+    return;
+  }
+
+  /* FIXME: errno isn't necessarily set by fwrite and friends */
+  fail(ex, EX_E_RECOVERABLE, &args[0], "%s", strerror(errno));
+}
+
+static void exec_map(executor_t* ex, size_t arity, const token_t* args) {
+  assert(!ex->filter_initialized);
+  assert(arity >= 1 && arity <= 5);
+
+  int flags = 0;
+
+  for(size_t i = 1; i < arity; i ++) {
+    if(token_eq(&args[i], "populate")) {
+      flags |= HIBP_MAP_POPULATE;
+    } else if(token_eq(&args[i], "hugepages")) {
+      flags |= HIBP_MAP_HUGEPAGES;
+    } else if(token_eq(&args[i], "noverify")) {
+      flags |= HIBP_MAP_NO_VERIFY;
+    } else if(token_eq(&args[i], "lazy")) {
+      flags |= HIBP_MAP_LAZY_VERIFY;
+    } else {
+      char* str = token2str(&args[i]);
+
+      /* Swallow any allocation errors from token2str */
+      fail(
+        ex, EX_E_RECOVERABLE, &args[i],
+        "Invalid option %s; expected populate, hugepages, noverify, or lazy",
+        ((str == NULL) ? "" : str)
+      );
+
+      free(str);
+      return;
+    }
   }
 
-  /* Initialize filter */
+  char* filename = token2str(&args[0]);
+
+  if(filename == NULL) {
+    fail(ex, EX_E_FATAL, NULL, OUT_OF_MEMORY_MESSAGE);
+    return;
+  }
+
+  errno = 0;
+
+  const hibp_status_t status = hibp_bf_map_file(&ex->filter, filename, flags);
 
-  hibp_status_t status = hibp_bf_new(&ex->filter, n_hash_functions, log2_bits);
+  free(filename);
 
   if(status == HIBP_OK) {
-    ex->filter_initialized = true;
+    ex->filter_initialized = 1;
     return;
   }
 
-  fail(
-    ex, ((status == HIBP_E_NOMEM) ? EX_E_FATAL : EX_E_RECOVERABLE), NULL,
-    hibp_strerror(status)
-  );
+  /* A truncated file is reported as HIBP_E_IO without setting errno */
+  if(status == HIBP_E_IO && errno != 0) {
+    fail(ex, EX_E_RECOVERABLE, &args[0], "%s", strerror(errno));
+  } else {
+    fail(ex, EX_E_RECOVERABLE, &args[0], "%s", hibp_strerror(status));
+  }
 }
 
-static void exec_load(executor_t* ex, size_t arity, const token_t* args) {
+static void exec_page(executor_t* ex, size_t arity, const token_t* args) {
   assert(!ex->filter_initialized);
-  assert(arity == 1);
-  (void)arity;
+  assert(arity == 1 || arity == 2);
 
-  FILE* file = ex_fopen(ex, &args[0], true, true);
+  hibp_page_params_t params = { 0, 0, 0 };
+
+  if(arity == 2 && (token2memsize(&params.cache_size, &args[1]) == -1 || params.cache_size == 0)) {
+    fail(ex, EX_E_RECOVERABLE, &args[1], "cache_size must be a quantity of memory");
+    return;
+  }
+
+  char* filename = token2str(&args[0]);
+
+  if(filename == NULL) {
+    fail(ex, EX_E_FATAL, NULL, OUT_OF_MEMORY_MESSAGE);
+    return;
+  }
+
+  errno = 0;
+
+  const hibp_status_t status = hibp_bf_page_file(&ex->filter, filename, &params);
+
+  free(filename);
+
+  if(status == HIBP_OK) {
+    ex->filter_initialized = 1;
+    return;
+  }
+
+  /* As for map */
+  if(status == HIBP_E_IO && errno != 0) {
+    fail(ex, EX_E_RECOVERABLE, &args[0], "%s", strerror(errno));
+  } else {
+    fail(ex, EX_E_RECOVERABLE, &args[0], "%s", hibp_strerror(status));
+  }
+}
+
+static void exec_save(executor_t* ex, size_t arity, const token_t* args) {
+  assert(ex->filter_initialized);
+  assert(arity == 1 || arity == 2);
+
+  if(ex_require_resident(ex, "save") == -1) {
+    return;
+  }
+
+  hibp_format_t format = HIBP_FORMAT_COMPACT;
+
+  if(arity == 2 && ex_token2file_format(&format, ex, &args[1]) == -1) {
+    return;
+  }
+
+  FILE* file = ex_fopen(ex, &args[0], false, true);
 
   if(file == NULL) {
     return;
   }
 
-  const hibp_status_t status = hibp_bf_load_file(&ex->filter, file);
+  const hibp_status_t status = hibp_bf_save_file_format(&ex->filter, file, format);
 
   ex_fclose(file);
 
   if(status == HIBP_OK) {
-    ex->filter_initialized = 1;
     return;
   }
 
-  assert(status == HIBP_E_IO);
+  if(status != HIBP_E_IO) {
+    fail(ex, EX_E_RECOVERABLE, &args[0], "%s", hibp_strerror(status));
+    return;
+  }
 
   /* FIXME: errno isn't necessarily set by fwrite and friends */
   fail(ex, EX_E_RECOVERABLE, &args[0], "%s", strerror(errno));
 }
 
-static void exec_save(executor_t* ex, size_t arity, const token_t* args) {
+static void exec_merge(executor_t* ex, size_t arity, const token_t* args) {
+  assert(ex->filter_initialized);
+
+  if(ex_require_resident(ex, "merge") == -1) {
+    return;
+  }
+
+  for(size_t i = 0; i < arity; i ++) {
+    FILE* file = ex_fopen(ex, &args[i], true, true);
+
+    if(file == NULL) {
+      return;
+    }
+
+    hibp_bloom_filter_t other;
+    hibp_status_t status = hibp_bf_load_file(&other, file);
+
+    ex_fclose(file);
+
+    if(status == HIBP_E_IO) {
+      /* FIXME: errno isn't necessarily set by fwrite and friends */
+      fail(ex, EX_E_RECOVERABLE, &args[i], "%s", strerror(errno));
+      return;
+    }
+
+    if(status != HIBP_OK) {
+      fail(ex, EX_E_RECOVERABLE, &args[i], "%s", hibp_strerror(status));
+      return;
+    }
+
+    status = hibp_bf_union(&ex->filter, &other);
+
+    hibp_bf_destroy(&other);
+
+    if(status == HIBP_E_INVAL) {
+      fail(
+        ex, EX_E_RECOVERABLE, &args[i],
+        "Bloom filter has different hash functions from the currently-loaded filter"
+      );
+      return;
+    }
+
+    if(status != HIBP_OK) {
+      fail(ex, EX_E_RECOVERABLE, &args[i], "%s", hibp_strerror(status));
+      return;
+    }
+  }
+}
+
+static void exec_track(executor_t* ex, size_t arity, const token_t* args) {
+  assert(ex->filter_initialized);
+  assert(arity == 0);
+  (void)arity;
+  (void)args;
+
+  if(ex_require_resident(ex, "track") == -1) {
+    return;
+  }
+
+  const hibp_status_t status = hibp_bf_track_changes(&ex->filter);
+
+  if(status != HIBP_OK) {
+    fail(ex, EX_E_FATAL, NULL, "%s", hibp_strerror(status));
+  }
+}
+
+static void exec_save_delta(executor_t* ex, size_t arity, const token_t* args) {
   assert(ex->filter_initialized);
   assert(arity == 1);
   (void)arity;
 
+  if(ex->filter.tracker == NULL) {
+    fail(ex, EX_E_RECOVERABLE, NULL, "Changes aren't being tracked; use track first");
+    return;
+  }
+
   FILE* file = ex_fopen(ex, &args[0], false, true);
 
   if(file == NULL) {
     return;
   }
 
-  const hibp_status_t status = hibp_bf_save_file(&ex->filter, file);
+  const hibp_status_t status = hibp_bf_save_delta_file(&ex->filter, file);
 
   ex_fclose(file);
 
@@ -762,12 +2155,99 @@ static void exec_save(executor_t* ex, size_t arity, const token_t* args) {
     return;
   }
 
-  assert(status == HIBP_E_IO);
+  if(status != HIBP_E_IO) {
+    fail(ex, EX_E_RECOVERABLE, &args[0], "%s", hibp_strerror(status));
+    return;
+  }
 
   /* FIXME: errno isn't necessarily set by fwrite and friends */
   fail(ex, EX_E_RECOVERABLE, &args[0], "%s", strerror(errno));
 }
 
+static void exec_apply_delta(executor_t* ex, size_t arity, const token_t* args) {
+  assert(ex->filter_initialized);
+
+  if(ex_require_resident(ex, "apply-delta") == -1) {
+    return;
+  }
+
+  for(size_t i = 0; i < arity; i ++) {
+    FILE* file = ex_fopen(ex, &args[i], true, true);
+
+    if(file == NULL) {
+      return;
+    }
+
+    errno = 0;
+
+    const hibp_status_t status = hibp_bf_apply_delta_file(&ex->filter, file);
+
+    ex_fclose(file);
+
+    if(status == HIBP_OK) {
+      continue;
+    }
+
+    if(status == HIBP_E_INVAL) {
+      fail(
+        ex, EX_E_RECOVERABLE, &args[i],
+        "Delta is for a Bloom filter with different hash functions from the currently-loaded filter"
+      );
+      return;
+    }
+
+    /* A truncated delta is reported as HIBP_E_IO without setting errno */
+    if(status == HIBP_E_IO && errno != 0) {
+      fail(ex, EX_E_RECOVERABLE, &args[i], "%s", strerror(errno));
+    } else {
+      fail(ex, EX_E_RECOVERABLE, &args[i], "%s", hibp_strerror(status));
+    }
+
+    return;
+  }
+}
+
+static void exec_save_changes(executor_t* ex, size_t arity, const token_t* args) {
+  assert(ex->filter_initialized);
+  assert(arity == 1);
+  (void)arity;
+
+  if(ex->filter.mapping == NULL) {
+    fail(ex, EX_E_RECOVERABLE, NULL, "Bloom filter wasn't mapped; use save instead");
+    return;
+  }
+
+  if(ex->filter.tracker == NULL) {
+    fail(ex, EX_E_RECOVERABLE, NULL, "Changes aren't being tracked; use track first");
+    return;
+  }
+
+  char* filename = token2str(&args[0]);
+
+  if(filename == NULL) {
+    fail(ex, EX_E_FATAL, NULL, OUT_OF_MEMORY_MESSAGE);
+    return;
+  }
+
+  errno = 0;
+
+  const hibp_status_t status = hibp_bf_save_changes(&ex->filter, filename);
+
+  free(filename);
+
+  if(status == HIBP_OK) {
+    return;
+  }
+
+  if(status == HIBP_E_INVAL) {
+    fail(ex, EX_E_RECOVERABLE, &args[0], "File isn't the one the Bloom filter was mapped from");
+  } else if(status == HIBP_E_IO && errno != 0) {
+    fail(ex, EX_E_RECOVERABLE, &args[0], "%s", strerror(errno));
+  } else {
+    fail(ex, EX_E_RECOVERABLE, &args[0], "%s", hibp_strerror(status));
+  }
+}
+
 static void exec_unload(executor_t* ex, size_t arity, const token_t* args) {
   assert(ex->filter_initialized);
   assert(arity == 0);
@@ -782,6 +2262,10 @@ static void exec_insert(executor_t* ex, size_t arity, const token_t* args) {
   assert(ex->filter_initialized);
   assert(arity > 0);
 
+  if(ex_require_resident(ex, "insert") == -1) {
+    return;
+  }
+
   for(size_t i = 0; i < arity; i ++) {
     const token_t* token = &args[i];
     hibp_bf_insert(&ex->filter, token->length, (hibp_byte_t*)token->buffer);
@@ -792,6 +2276,10 @@ static void exec_insert_sha(executor_t* ex, size_t arity, const token_t* args) {
   assert(ex->filter_initialized);
   assert(arity > 0);
 
+  if(ex_require_resident(ex, "insert-sha") == -1) {
+    return;
+  }
+
   for(size_t i = 0; i < arity; i ++) {
     const token_t* token = &args[i];
 
@@ -807,74 +2295,46 @@ static void exec_insert_sha(executor_t* ex, size_t arity, const token_t* args) {
 
 static void exec_insert_file(executor_t* ex, size_t arity, const token_t* args) {
   assert(ex->filter_initialized);
-  assert(arity == 1 || arity == 2);
-
-  stringfile_format_t format;
+  assert(1 <= arity && arity <= 4);
 
-  if(arity == 2) {
-    if(ex_token2format(&format, ex, &args[1]) == -1) {
-      return;
-    }
-  } else {
-    format = SF_FORMAT_STRINGS;
+  if(ex_require_resident(ex, "insert-file") == -1) {
+    return;
   }
 
-  stream_t stream;
+  stringfile_args_t sf;
 
-  if(ex_open_stringfile(&stream, ex, &args[0]) == -1) {
+  if(ex_parse_stringfile_args(&sf, ex, arity, args, false) == -1) {
     return;
   }
 
-  size_t inserted = 0;
-
-  for(;;) {
-    if(stringfile_skip(&stream, format) == EOF) {
-      break;
-    }
-
-    if(format == SF_FORMAT_SHAS) {
-      hibp_byte_t sha[SHA1_BYTES];
-
-      if(ex_stringfile_next_sha(sha, ex, &stream) == -1) {
-        break;
-      }
-
-      hibp_bf_insert_sha1(&ex->filter, sha);
-    } else {
-      token_t token;
-      token_new(&token);
-
-      if(format == SF_FORMAT_STRINGS) {
-        if(ex_stringfile_next_string(&token, ex, &stream) == -1) {
-          token_destroy(&token);
-          break;
-        }
-      } else {
-        assert(format == SF_FORMAT_LINES);
+  const stringfile_format_t format = sf.format;
 
-        if(ex_stringfile_next_line(&token, ex, &stream) == -1) {
-          token_destroy(&token);
-          break;
-        }
-      }
+  stream_t stream;
 
-      hibp_bf_insert(&ex->filter, token.length, (hibp_byte_t*)token.buffer);
+  if(ex_open_stringfile(&stream, ex, &args[0]) == -1) {
+    return;
+  }
 
-      token_destroy(&token);
-    }
+  hibpfile_t hf;
+  hibpfile_new(&hf, &stream, sf.min_count);
 
-    inserted ++;
-  }
+  const size_t inserted = ex_run_pipeline(ex, &stream, &hf, &sf, false);
 
   /* FIXME: every size_t => unsigned long cast is suspicious. Wish C stdlib sucked less */
   printf(
-    "insert-file: inserted %lu %s%s from %s.\n",
+    "insert-file: inserted %lu %s%s from %s",
     (unsigned long)inserted,
-    ((format == SF_FORMAT_SHAS) ? "SHA" : "string"),
+    ((format == SF_FORMAT_SHAS || format == SF_FORMAT_HIBP) ? "SHA" : "string"),
     ((inserted == 1) ? "" : "s"),
     stream.name
   );
 
+  if(format == SF_FORMAT_HIBP && hf.skipped > 0) {
+    printf(" (skipped %lu with count below %lu)", (unsigned long)hf.skipped, (unsigned long)hf.min_count);
+  }
+
+  puts(".");
+
   close_stringfile(&stream);
 }
 
@@ -924,16 +2384,12 @@ static void exec_query_sha(executor_t* ex, size_t arity, const token_t* args) {
 
 static void exec_query_file(executor_t* ex, size_t arity, const token_t* args) {
   assert(ex->filter_initialized);
-  assert(arity == 1 || arity == 2);
+  assert(1 <= arity && arity <= 5);
 
-  stringfile_format_t format;
+  stringfile_args_t sf;
 
-  if(arity == 2) {
-    if(ex_token2format(&format, ex, &args[1]) == -1) {
-      return;
-    }
-  } else {
-    format = SF_FORMAT_STRINGS;
+  if(ex_parse_stringfile_args(&sf, ex, arity, args, true) == -1) {
+    return;
   }
 
   stream_t stream;
@@ -942,92 +2398,61 @@ static void exec_query_file(executor_t* ex, size_t arity, const token_t* args) {
     return;
   }
 
-  for(;;) {
-    if(stringfile_skip(&stream, format) == EOF) {
-      close_stringfile(&stream);
-      return;
-    }
-
-    if(format == SF_FORMAT_SHAS) {
-      hibp_byte_t sha[SHA1_BYTES];
+  hibpfile_t hf;
+  hibpfile_new(&hf, &stream, sf.min_count);
 
-      if(ex_stringfile_next_sha(sha, ex, &stream) == -1) {
-        close_stringfile(&stream);
-        return;
-      }
-
-      const bool found = hibp_bf_query_sha1(&ex->filter, sha);
-
-      for(size_t i = 0; i < SHA1_BYTES; i ++) {
-        putchar(HEX(sha[i] >> 4));
-        putchar(HEX(sha[i] & 0xf));
-      }
+  ex_run_pipeline(ex, &stream, &hf, &sf, true);
 
-      puts(found ? "  true" : "  false");
-    } else {
-      token_t token;
-      token_new(&token);
+  close_stringfile(&stream);
+}
 
-      if(format == SF_FORMAT_STRINGS) {
-        if(ex_stringfile_next_string(&token, ex, &stream) == -1) {
-          token_destroy(&token);
-          close_stringfile(&stream);
-          return;
-        }
-      } else {
-        assert(format == SF_FORMAT_LINES);
+static void exec_falsepos(executor_t* ex, size_t arity, const token_t* args) {
+  assert(ex->filter_initialized);
+  assert(arity <= 3);
 
-        if(ex_stringfile_next_line(&token, ex, &stream) == -1) {
-          token_destroy(&token);
-          close_stringfile(&stream);
-          return;
-        }
-      }
+  size_t trials = 1000000;
+  size_t n_threads = 0;
+  size_t seed = 0;
 
-      char* str = token2str(&token);
+  for(size_t i = 0; i < arity; i ++) {
+    const token_t* token = &args[i];
 
-      if(str == NULL) {
-        token_destroy(&token);
-        close_stringfile(&stream);
+    if(token->length < 2 || memcmp(token->buffer, "--", 2) != 0) {
+      if(i != 0 || token2size(&trials, token) == -1 || trials == 0) {
+        fail(ex, EX_E_RECOVERABLE, token, "trials must be a positive integer");
         return;
       }
 
-      const bool found = hibp_bf_query(&ex->filter, token.length, (hibp_byte_t*)token.buffer);
-
-      printf("%s  %s\n", str, (found ? "true" : "false"));
-
-      free(str);
-      token_destroy(&token);
+      continue;
     }
-  }
-}
 
-static void exec_falsepos(executor_t* ex, size_t arity, const token_t* args) {
-  assert(ex->filter_initialized);
-  assert(arity == 0 || arity == 1);
+    int matched = ex_token2option(&n_threads, ex, token, "--threads");
 
-  size_t trials = 10000;
+    if(matched == 0) {
+      matched = ex_token2option(&seed, ex, token, "--seed");
+    }
 
-  if(arity == 1) {
-    if(token2size(&trials, &args[0]) == -1) {
-      fail(ex, EX_E_RECOVERABLE, &args[0], "trials must be a positive integer");
+    if(matched == -1) {
       return;
     }
-  }
 
-  size_t positive = 0;
+    if(matched == 0) {
+      char* str = token2str(token);
 
-  for(size_t i = 0; i < trials; i ++) {
-    hibp_byte_t value[100];
+      /* Swallow any allocation errors from token2str */
+      fail(ex, EX_E_RECOVERABLE, token, "Invalid option %s", ((str == NULL) ? "" : str));
 
-    for(size_t j = 0; j < sizeof(value); j ++) {
-      value[j] = rand() % 256;
-    }
+      free(str);
 
-    positive += hibp_bf_query(&ex->filter, sizeof(value), value);
+      return;
+    }
   }
 
-  printf("%lf\n", (double)positive / trials);
+  hibp_fpr_estimate_t estimate;
+  hibp_bf_estimate_fpr(&estimate, &ex->filter, trials, seed, n_threads);
+
+  printf("%lf (95%% CI: %lf - %lf, %lu of %lu trials)\n", estimate.rate, estimate.lower, estimate.upper,
+         (unsigned long)estimate.positives, (unsigned long)estimate.trials);
 }
 
 
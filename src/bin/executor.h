@@ -33,4 +33,7 @@ void executor_destroy(executor_t* ex);
 void executor_exec_one(executor_t* ex);
 void executor_drain_line(executor_t* ex);
 
+/* A human-readable description of a failed status, for error messages */
+const char* hibp_strerror(hibp_status_t status);
+
 #endif
@@ -8,6 +8,7 @@
 
 #include "executor.h"
 #include "stream.h"
+#include "server.h"
 
 static const char* usage =
   "OVERVIEW: command-line tool for building and querying Bloom filters\n\n"
@@ -15,8 +16,15 @@ static const char* usage =
   "  %s                start an interactive session\n"
   "  %s -              read and run a script from the standard input\n"
   "  %s <filename>     read and run the script specified by filename\n"
-  "  %s -c <commands>  run a sequence of commands from the second argument\n\n"
-  "Run `help` in an interactive session to learn about the scripting language\n";
+  "  %s -c <commands>  run a sequence of commands from the second argument\n"
+  "  %s -s <address> <filename> [<threads>]\n"
+  "                    serve queries against the filter at filename over a socket\n\n"
+  "Run `help` in an interactive session to learn about the scripting language\n\n"
+  "In server mode, address is unix:<path> for a Unix domain socket or [<host>:]<port>\n"
+  "for TCP. The filter (or sharded filter manifest) is mapped once, and queries are\n"
+  "answered by the given number of worker threads (default: one per CPU). To update\n"
+  "the filter, rename a new one over filename and send SIGHUP; send SIGINT or SIGTERM\n"
+  "to stop. See src/bin/server.h for the protocol\n";
 
 static const char* banner =
   "======================================================================\n"
@@ -29,8 +37,22 @@ static const char* banner =
 static void prompt(void);
 
 int main(int argc, char** argv) {
+  if(argc >= 2 && strcmp(argv[1], "-s") == 0) {
+    /* `bin/hibp-bloom -s address filename [threads]`. Serve queries until interrupted */
+
+    char* end = NULL;
+    const unsigned long n_threads = (argc == 5) ? strtoul(argv[4], &end, 10) : 0;
+
+    if((argc != 4 && argc != 5) || (end != NULL && (*end != '\0' || end == argv[4]))) {
+      fprintf(stderr, usage, argv[0], argv[0], argv[0], argv[0], argv[0]);
+      return 1;
+    }
+
+    return server_run(argv[2], argv[3], (size_t)n_threads);
+  }
+
   if(argc > 3 || (argc == 3 && strcmp(argv[1], "-c") != 0)) {
-    fprintf(stderr, usage, argv[0], argv[0], argv[0], argv[0]);
+    fprintf(stderr, usage, argv[0], argv[0], argv[0], argv[0], argv[0]);
     return 1;
   }
 
@@ -117,4 +139,8 @@ int main(int argc, char** argv) {
 
 static void prompt(void) {
   fputs(">> ", stdout);
+
+  /* The stream reads straight from the file descriptor, so stdio won't flush the prompt
+   * for us before blocking on the standard input */
+  fflush(stdout);
 }
@@ -0,0 +1,875 @@
+/* For accept4, SOCK_NONBLOCK, SOCK_CLOEXEC, and EPOLLEXCLUSIVE */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "hibp-bloom.h"
+#include "executor.h"
+#include "server.h"
+
+#define SHA1_BYTES 20
+#define HEADER_SIZE 8
+
+/* Stop reading requests from a connection while this many bytes of responses are waiting
+ * to be sent to it, so that a client that never reads can't make us buffer without bound */
+#define OUT_LIMIT (1 << 20)
+
+#define MIN_IN_CAPACITY (1 << 16)
+#define MAX_EVENTS 64
+
+/* ================================================================
+ * Served filters
+ * ================================================================ */
+
+/* A filter, or a sharded filter, with a count of the references to it. The server holds
+ * one reference to the current filter, and each request being answered holds another, so
+ * that a reload can replace the filter without pulling it from under those requests */
+typedef struct {
+  bool sharded;
+  hibp_bloom_filter_t bf;
+  hibp_sharded_filter_t sf;
+  size_t refs;
+} served_t;
+
+typedef struct {
+  const char* filename;
+
+  /* Guards served, and the reference counts of every served_t */
+  pthread_mutex_t lock;
+  served_t* served;
+
+  int listener;
+
+  /* An eventfd that becomes (and stays) readable when the server is shutting down */
+  int stop;
+} server_t;
+
+typedef struct connection_st {
+  int fd;
+  bool eof;
+  bool broken;
+
+  /* Events for which the connection is currently registered with epoll */
+  unsigned interest;
+
+  /* Bytes received but not yet answered */
+  hibp_byte_t* in;
+  size_t in_size;
+  size_t in_capacity;
+
+  /* Responses not yet sent, starting at out_begin */
+  hibp_byte_t* out;
+  size_t out_begin;
+  size_t out_size;
+  size_t out_capacity;
+
+  /* Every connection of a worker is on a list, so that they can be closed on shutdown */
+  struct connection_st* prev;
+  struct connection_st* next;
+} connection_t;
+
+typedef struct {
+  server_t* server;
+  int epoll;
+  pthread_t thread;
+  connection_t* connections;
+
+  /* Scratch space for the results of a batch */
+  int* results;
+} worker_t;
+
+/* Distinct addresses with which to tag the listener and the eventfd in epoll */
+static char LISTENER_TAG;
+static char STOP_TAG;
+
+/* Load the filter with the given filename into *served, mapping it into memory (and
+ * populating the mapping, since a server would otherwise take page faults on its first
+ * requests). A file that isn't a filter is tried as a sharded filter manifest */
+static hibp_status_t served_load(served_t* served, const char* filename) {
+  hibp_status_t status = hibp_bf_map_file(&served->bf, filename, HIBP_MAP_POPULATE);
+  served->sharded = false;
+
+  if(status == HIBP_E_VERSION) {
+    status = hibp_sf_map_file(&served->sf, filename, 0, (size_t)-1, HIBP_MAP_POPULATE);
+    served->sharded = true;
+  }
+
+  served->refs = 1;
+
+  return status;
+}
+
+static served_t* served_acquire(server_t* server) {
+  pthread_mutex_lock(&server->lock);
+  served_t* served = server->served;
+  served->refs ++;
+  pthread_mutex_unlock(&server->lock);
+
+  return served;
+}
+
+static void served_release(server_t* server, served_t* served) {
+  pthread_mutex_lock(&server->lock);
+  const bool last = (-- served->refs == 0);
+  pthread_mutex_unlock(&server->lock);
+
+  if(!last) {
+    return;
+  }
+
+  if(served->sharded) {
+    hibp_sf_destroy(&served->sf);
+  } else {
+    hibp_bf_destroy(&served->bf);
+  }
+
+  free(served);
+}
+
+static void report_load_failure(const char* filename, hibp_status_t status) {
+  if(status == HIBP_E_IO) {
+    fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+  } else {
+    fprintf(stderr, "%s: %s\n", filename, hibp_strerror(status));
+  }
+}
+
+/* Replace the server's filter with a freshly-loaded one, or keep the old one if the new
+ * one can't be loaded */
+static void reload(server_t* server) {
+  served_t* served = malloc(sizeof(served_t));
+
+  if(served == NULL) {
+    fprintf(stderr, "%s: %s\n", server->filename, strerror(ENOMEM));
+    return;
+  }
+
+  const hibp_status_t status = served_load(served, server->filename);
+
+  if(status != HIBP_OK) {
+    report_load_failure(server->filename, status);
+    fprintf(stderr, "%s: keeping the filter loaded previously\n", server->filename);
+    free(served);
+    return;
+  }
+
+  pthread_mutex_lock(&server->lock);
+  served_t* old = server->served;
+  server->served = served;
+  pthread_mutex_unlock(&server->lock);
+
+  served_release(server, old);
+
+  fprintf(stderr, "%s: reloaded\n", server->filename);
+}
+
+/* ================================================================
+ * Listening
+ * ================================================================ */
+
+/* Bind and listen on a Unix domain socket at path. A socket file left behind by a previous
+ * server is replaced, but no other kind of file is */
+static int listen_unix(const char* path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+
+  if(strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  strcpy(addr.sun_path, path);
+
+  struct stat st;
+
+  if(lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(path);
+  }
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+  if(fd < 0) {
+    return -1;
+  }
+
+  if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+    const int error = errno;
+    close(fd);
+    errno = error;
+    return -1;
+  }
+
+  return fd;
+}
+
+/* Bind and listen on a TCP socket at [<host>:]<port>. Returns -1 and sets *gai_error if
+ * the address can't be resolved, or returns -1 and sets errno otherwise */
+static int listen_tcp(const char* address, int* gai_error) {
+  char* copy = strdup(address);
+
+  if(copy == NULL) {
+    return -1;
+  }
+
+  char* host = NULL;
+  char* port = copy;
+  char* colon = strrchr(copy, ':');
+
+  if(colon != NULL) {
+    *colon = '\0';
+    host = copy;
+    port = colon + 1;
+
+    /* [::1]:1337 */
+    const size_t length = strlen(host);
+
+    if(length >= 2 && host[0] == '[' && host[length - 1] == ']') {
+      host[length - 1] = '\0';
+      host ++;
+    }
+
+    if(*host == '\0') {
+      host = NULL;
+    }
+  }
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  struct addrinfo* addrs;
+  *gai_error = getaddrinfo(host, port, &hints, &addrs);
+  free(copy);
+
+  if(*gai_error != 0) {
+    return -1;
+  }
+
+  int fd = -1;
+  int error = 0;
+
+  for(struct addrinfo* addr = addrs; addr != NULL; addr = addr->ai_next) {
+    fd = socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, addr->ai_protocol);
+
+    if(fd < 0) {
+      error = errno;
+      continue;
+    }
+
+    const int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if(bind(fd, addr->ai_addr, addr->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0) {
+      break;
+    }
+
+    error = errno;
+    close(fd);
+    fd = -1;
+  }
+
+  freeaddrinfo(addrs);
+
+  if(fd < 0) {
+    errno = error;
+  }
+
+  return fd;
+}
+
+/* ================================================================
+ * Connections
+ * ================================================================ */
+
+static void put_be32(hibp_byte_t* p, size_t x) {
+  p[0] = (hibp_byte_t)(x >> 24);
+  p[1] = (hibp_byte_t)(x >> 16);
+  p[2] = (hibp_byte_t)(x >> 8);
+  p[3] = (hibp_byte_t)x;
+}
+
+static size_t get_be32(const hibp_byte_t* p) {
+  return ((size_t)p[0] << 24) | ((size_t)p[1] << 16) | ((size_t)p[2] << 8) | (size_t)p[3];
+}
+
+/* Reserve room for size more bytes of responses, returning a pointer to them, or NULL if
+ * memory allocation fails */
+static hibp_byte_t* reserve_out(connection_t* conn, size_t size) {
+  /* Reclaim the space taken by responses already sent */
+  if(conn->out_begin != 0) {
+    memmove(conn->out, conn->out + conn->out_begin, conn->out_size - conn->out_begin);
+    conn->out_size -= conn->out_begin;
+    conn->out_begin = 0;
+  }
+
+  if(conn->out_capacity - conn->out_size < size) {
+    size_t capacity = (conn->out_capacity == 0) ? MIN_IN_CAPACITY : conn->out_capacity;
+
+    while(capacity - conn->out_size < size) {
+      capacity *= 2;
+    }
+
+    hibp_byte_t* out = realloc(conn->out, capacity);
+
+    if(out == NULL) {
+      return NULL;
+    }
+
+    conn->out = out;
+    conn->out_capacity = capacity;
+  }
+
+  return conn->out + conn->out_size;
+}
+
+/* Append a response with an empty payload. If even that much memory can't be had, the
+ * connection is broken off */
+static void respond_empty(connection_t* conn, server_status_t status) {
+  hibp_byte_t* header = reserve_out(conn, HEADER_SIZE);
+
+  if(header == NULL) {
+    conn->broken = true;
+    return;
+  }
+
+  memset(header, 0, HEADER_SIZE);
+  header[0] = (hibp_byte_t)status;
+  conn->out_size += HEADER_SIZE;
+}
+
+static void answer_query(worker_t* w, connection_t* conn, size_t n, const hibp_byte_t* shas) {
+  const size_t payload_size = (n + 7) / 8;
+  hibp_byte_t* response = reserve_out(conn, HEADER_SIZE + payload_size);
+
+  if(response == NULL) {
+    respond_empty(conn, SERVER_E_INTERNAL);
+    return;
+  }
+
+  served_t* served = served_acquire(w->server);
+
+  if(served->sharded) {
+    hibp_sf_query_sha1_batch(&served->sf, n, shas, w->results);
+  } else {
+    hibp_bf_query_sha1_batch(&served->bf, n, shas, w->results);
+  }
+
+  served_release(w->server, served);
+
+  memset(response, 0, HEADER_SIZE + payload_size);
+  response[0] = SERVER_OK;
+  put_be32(response + 4, payload_size);
+
+  for(size_t i = 0; i < n; i ++) {
+    response[HEADER_SIZE + i / 8] |= (hibp_byte_t)((w->results[i] != 0) << (i % 8));
+  }
+
+  conn->out_size += HEADER_SIZE + payload_size;
+}
+
+static size_t write_out(void* ctx, const void* buffer, size_t size) {
+  connection_t* conn = (connection_t*)ctx;
+  hibp_byte_t* out = reserve_out(conn, size);
+
+  if(out == NULL) {
+    return 0;
+  }
+
+  memcpy(out, buffer, size);
+  conn->out_size += size;
+
+  return size;
+}
+
+static void answer_range(worker_t* w, connection_t* conn, size_t prefix) {
+  served_t* served = served_acquire(w->server);
+
+  hibp_bloom_filter_t* shard = NULL;
+
+  if(served->sharded && prefix < hibp_sf_n_shards(&served->sf)) {
+    shard = hibp_sf_shard(&served->sf, prefix);
+  }
+
+  if(shard == NULL) {
+    served_release(w->server, served);
+    respond_empty(conn, SERVER_E_NOT_FOUND);
+    return;
+  }
+
+  /* The header is filled in once the size of the payload is known. An offset rather than
+   * a pointer, since the buffer may move as the shard is written (reserve_out leaves
+   * out_begin at 0, so the offset stays put) */
+  if(reserve_out(conn, HEADER_SIZE) == NULL) {
+    served_release(w->server, served);
+    respond_empty(conn, SERVER_E_INTERNAL);
+    return;
+  }
+
+  const size_t header = conn->out_size;
+  conn->out_size += HEADER_SIZE;
+
+  const hibp_status_t status = hibp_bf_save_writer_format(shard, conn, write_out, HIBP_FORMAT_COMPRESSED);
+  served_release(w->server, served);
+
+  if(status != HIBP_OK || conn->out_size - header - HEADER_SIZE > 0xffffffff) {
+    conn->out_size = header;
+    respond_empty(conn, SERVER_E_INTERNAL);
+    return;
+  }
+
+  memset(conn->out + header, 0, HEADER_SIZE);
+  conn->out[header] = SERVER_OK;
+  put_be32(conn->out + header + 4, conn->out_size - header - HEADER_SIZE);
+}
+
+/* The size of the request starting with the given size bytes, if its header is among
+ * them, or 0 if it's malformed; or HEADER_SIZE otherwise */
+static size_t request_size(const hibp_byte_t* header, size_t size) {
+  if(size < HEADER_SIZE) {
+    return HEADER_SIZE;
+  }
+
+  if(header[1] != 0 || header[2] != 0 || header[3] != 0) {
+    return 0;
+  }
+
+  switch(header[0]) {
+  case SERVER_QUERY: {
+    const size_t n = get_be32(header + 4);
+    return (n <= SERVER_MAX_BATCH) ? HEADER_SIZE + n * SHA1_BYTES : 0;
+  }
+
+  case SERVER_RANGE:
+    return HEADER_SIZE;
+
+  default:
+    return 0;
+  }
+}
+
+/* Answer every request received in full, until too many responses are waiting */
+static void answer_requests(worker_t* w, connection_t* conn) {
+  size_t offset = 0;
+
+  while(!conn->broken && conn->out_size - conn->out_begin <= OUT_LIMIT) {
+    const hibp_byte_t* request = conn->in + offset;
+
+    if(conn->in_size - offset < HEADER_SIZE) {
+      break;
+    }
+
+    const size_t size = request_size(request, conn->in_size - offset);
+
+    if(size == 0) {
+      respond_empty(conn, SERVER_E_BAD_REQUEST);
+      conn->broken = true;
+      break;
+    }
+
+    if(conn->in_size - offset < size) {
+      break;
+    }
+
+    if(request[0] == SERVER_QUERY) {
+      answer_query(w, conn, get_be32(request + 4), request + HEADER_SIZE);
+    } else {
+      answer_range(w, conn, get_be32(request + 4));
+    }
+
+    offset += size;
+  }
+
+  memmove(conn->in, conn->in + offset, conn->in_size - offset);
+  conn->in_size -= offset;
+}
+
+/* Send as many of the pending responses as the socket will take. Returns nonzero on
+ * failure */
+static int send_responses(connection_t* conn) {
+  while(conn->out_begin < conn->out_size) {
+    const ssize_t sent = send(conn->fd, conn->out + conn->out_begin, conn->out_size - conn->out_begin,
+                              MSG_NOSIGNAL);
+
+    if(sent < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+
+      return !(errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+
+    conn->out_begin += (size_t)sent;
+  }
+
+  conn->out_begin = 0;
+  conn->out_size = 0;
+
+  return 0;
+}
+
+/* Read, answer, and send until the socket would block. Returns nonzero if the connection
+ * should be closed */
+static int service(worker_t* w, connection_t* conn) {
+  for(;;) {
+    answer_requests(w, conn);
+
+    if(send_responses(conn) != 0) {
+      return 1;
+    }
+
+    const size_t pending = conn->out_size - conn->out_begin;
+
+    if(pending > OUT_LIMIT) {
+      break;
+    }
+
+    /* answer_requests stops at OUT_LIMIT, possibly short of requests already received in
+     * full (and perhaps with the buffer full of them), so answer those before reading any
+     * more, or concluding that the client, having half-closed its end, is done */
+    const size_t next_size = request_size(conn->in, conn->in_size);
+
+    if(!conn->broken && conn->in_size >= next_size) {
+      continue;
+    }
+
+    if((conn->eof || conn->broken) && pending == 0) {
+      return 1;
+    }
+
+    if(conn->eof || conn->broken) {
+      break;
+    }
+
+    /* Make room for the whole of the request at the front of the buffer. Since it's
+     * incomplete, that's more than in_size, so recv is never asked for 0 bytes (which
+     * would be taken for EOF) */
+    size_t needed = next_size;
+
+    if(needed < MIN_IN_CAPACITY) {
+      needed = MIN_IN_CAPACITY;
+    }
+
+    if(conn->in_capacity < needed) {
+      hibp_byte_t* in = realloc(conn->in, needed);
+
+      if(in == NULL) {
+        return 1;
+      }
+
+      conn->in = in;
+      conn->in_capacity = needed;
+    }
+
+    const ssize_t received = recv(conn->fd, conn->in + conn->in_size, conn->in_capacity - conn->in_size, 0);
+
+    if(received > 0) {
+      conn->in_size += (size_t)received;
+    } else if(received == 0) {
+      /* The client may half-close its end once it's sent its last request, so answer what's
+       * been received before closing */
+      conn->eof = true;
+    } else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+      break;
+    } else if(errno != EINTR) {
+      return 1;
+    }
+  }
+
+  const size_t pending = conn->out_size - conn->out_begin;
+  const unsigned interest = ((pending != 0) ? EPOLLOUT : 0) |
+                            ((!conn->eof && !conn->broken && pending <= OUT_LIMIT) ? EPOLLIN : 0);
+
+  if(interest != conn->interest) {
+    struct epoll_event event;
+    event.events = interest;
+    event.data.ptr = conn;
+
+    if(epoll_ctl(w->epoll, EPOLL_CTL_MOD, conn->fd, &event) != 0) {
+      return 1;
+    }
+
+    conn->interest = interest;
+  }
+
+  return 0;
+}
+
+static void close_connection(worker_t* w, connection_t* conn) {
+  if(conn->prev != NULL) {
+    conn->prev->next = conn->next;
+  } else {
+    w->connections = conn->next;
+  }
+
+  if(conn->next != NULL) {
+    conn->next->prev = conn->prev;
+  }
+
+  close(conn->fd);
+  free(conn->in);
+  free(conn->out);
+  free(conn);
+}
+
+static void accept_connections(worker_t* w) {
+  for(;;) {
+    const int fd = accept4(w->server->listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if(fd < 0) {
+      if(errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+
+      /* EAGAIN, or e.g. EMFILE, in which case the connection waits in the backlog */
+      return;
+    }
+
+    connection_t* conn = calloc(1, sizeof(connection_t));
+
+    if(conn == NULL) {
+      close(fd);
+      continue;
+    }
+
+    conn->fd = fd;
+    conn->interest = EPOLLIN;
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = conn;
+
+    if(epoll_ctl(w->epoll, EPOLL_CTL_ADD, fd, &event) != 0) {
+      close(fd);
+      free(conn);
+      continue;
+    }
+
+    conn->next = w->connections;
+
+    if(w->connections != NULL) {
+      w->connections->prev = conn;
+    }
+
+    w->connections = conn;
+  }
+}
+
+/* ================================================================
+ * Workers
+ * ================================================================ */
+
+static void* work(void* ctx) {
+  worker_t* w = (worker_t*)ctx;
+  struct epoll_event events[MAX_EVENTS];
+
+  for(;;) {
+    const int n = epoll_wait(w->epoll, events, MAX_EVENTS, -1);
+
+    if(n < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+
+      perror("epoll_wait");
+      break;
+    }
+
+    for(int i = 0; i < n; i ++) {
+      void* tag = events[i].data.ptr;
+
+      if(tag == &STOP_TAG) {
+        goto stop;
+      }
+
+      if(tag == &LISTENER_TAG) {
+        accept_connections(w);
+        continue;
+      }
+
+      connection_t* conn = (connection_t*)tag;
+
+      if((events[i].events & EPOLLERR) || service(w, conn) != 0) {
+        close_connection(w, conn);
+      }
+    }
+  }
+
+stop:
+  while(w->connections != NULL) {
+    close_connection(w, w->connections);
+  }
+
+  return NULL;
+}
+
+static int worker_new(worker_t* w, server_t* server) {
+  w->server = server;
+  w->connections = NULL;
+  w->results = malloc(SERVER_MAX_BATCH * sizeof(int));
+  w->epoll = epoll_create1(EPOLL_CLOEXEC);
+
+  if(w->results == NULL || w->epoll < 0) {
+    goto fail;
+  }
+
+  /* With EPOLLEXCLUSIVE, only one of the workers blocked in epoll_wait is woken for each
+   * new connection, which then belongs to that worker for good */
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLEXCLUSIVE;
+  event.data.ptr = &LISTENER_TAG;
+
+  if(epoll_ctl(w->epoll, EPOLL_CTL_ADD, server->listener, &event) != 0) {
+    goto fail;
+  }
+
+  event.events = EPOLLIN;
+  event.data.ptr = &STOP_TAG;
+
+  if(epoll_ctl(w->epoll, EPOLL_CTL_ADD, server->stop, &event) != 0) {
+    goto fail;
+  }
+
+  if(pthread_create(&w->thread, NULL, work, w) != 0) {
+    goto fail;
+  }
+
+  return 0;
+
+fail:
+  free(w->results);
+
+  if(w->epoll >= 0) {
+    close(w->epoll);
+  }
+
+  return -1;
+}
+
+/* ================================================================
+ * server_run
+ * ================================================================ */
+
+int server_run(const char* address, const char* filename, size_t n_threads) {
+  if(n_threads == 0) {
+    const long n = sysconf(_SC_NPROCESSORS_ONLN);
+    n_threads = (n < 1) ? 1 : (size_t)n;
+  }
+
+  server_t server;
+  server.filename = filename;
+  server.served = malloc(sizeof(served_t));
+
+  if(server.served == NULL) {
+    fprintf(stderr, "%s: %s\n", filename, strerror(ENOMEM));
+    return 1;
+  }
+
+  const hibp_status_t status = served_load(server.served, filename);
+
+  if(status != HIBP_OK) {
+    report_load_failure(filename, status);
+    free(server.served);
+    return 1;
+  }
+
+  const bool unix_socket = (strncmp(address, "unix:", 5) == 0);
+  int gai_error = 0;
+
+  server.listener = unix_socket ? listen_unix(address + 5) : listen_tcp(address, &gai_error);
+
+  if(server.listener < 0) {
+    fprintf(stderr, "%s: %s\n", address, (gai_error != 0) ? gai_strerror(gai_error) : strerror(errno));
+    served_release(&server, server.served);
+    return 1;
+  }
+
+  /* Signals are handled synchronously by this thread alone; the workers inherit the mask */
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGHUP);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  pthread_mutex_init(&server.lock, NULL);
+  server.stop = eventfd(0, EFD_CLOEXEC);
+
+  worker_t* workers = malloc(n_threads * sizeof(worker_t));
+  size_t n_workers = 0;
+
+  if(server.stop >= 0 && workers != NULL) {
+    while(n_workers < n_threads && worker_new(&workers[n_workers], &server) == 0) {
+      n_workers ++;
+    }
+  }
+
+  int exit_status = 0;
+
+  if(n_workers == 0) {
+    fprintf(stderr, "%s: couldn't start any worker threads\n", address);
+    exit_status = 1;
+  } else {
+    fprintf(stderr, "%s: serving %s on %lu threads\n", address, filename, (unsigned long)n_workers);
+
+    for(;;) {
+      int signal;
+
+      if(sigwait(&signals, &signal) != 0) {
+        continue;
+      }
+
+      if(signal == SIGHUP) {
+        reload(&server);
+        continue;
+      }
+
+      break;
+    }
+
+    const uint64_t one = 1;
+
+    if(write(server.stop, &one, sizeof(one)) != sizeof(one)) {
+      perror("write");
+    }
+
+    for(size_t i = 0; i < n_workers; i ++) {
+      pthread_join(workers[i].thread, NULL);
+      close(workers[i].epoll);
+      free(workers[i].results);
+    }
+  }
+
+  free(workers);
+
+  if(server.stop >= 0) {
+    close(server.stop);
+  }
+
+  close(server.listener);
+
+  if(unix_socket) {
+    unlink(address + 5);
+  }
+
+  served_release(&server, server.served);
+  pthread_mutex_destroy(&server.lock);
+
+  return exit_status;
+}
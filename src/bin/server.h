@@ -0,0 +1,57 @@
+#ifndef _SERVER_H_
+#define _SERVER_H_
+
+#include <stddef.h>
+
+/* Load (or rather map) the filter or sharded filter manifest with the given filename once,
+ * and answer queries against it over a socket until interrupted (by SIGINT or SIGTERM).
+ * address is either unix:<path> for a Unix domain socket, or [<host>:]<port> for TCP (with
+ * IPv6 hosts in square brackets, e.g. [::1]:1337). Connections are spread over n_threads
+ * worker threads (or one per online CPU if n_threads is 0), each running an epoll event
+ * loop. SIGHUP reloads the filter from filename; requests in flight are answered by the
+ * old filter, which is destroyed once the last of them is done, and the old filter is
+ * kept if the new one can't be loaded. Since the filter is mapped, a new filter must
+ * replace the old by renaming it over filename, not by overwriting filename in place.
+ * Returns an exit status for main.
+ *
+ * The protocol is binary. Every request and every response is a frame, consisting of an
+ * 8-byte header followed by a payload. All integers are big-endian.
+ *
+ * A request header is a type byte, three zero bytes, and a 4-byte argument:
+ * - SERVER_QUERY: the argument is the number of SHA1s to query, n, which may be at most
+ *   SERVER_MAX_BATCH, and the payload is the n 20-byte binary SHA1s back-to-back
+ * - SERVER_RANGE: for the k-anonymity model of Have I Been Pwned, wherein the client only
+ *   discloses a prefix of the hash. The argument is a prefix, i.e. the index of a shard of
+ *   a sharded filter (see hibp_sf_shard_of), and there's no payload
+ *
+ * A response header is a status byte (see server_status_t), three zero bytes, and the
+ * 4-byte size of the payload. Responses are sent in the order of their requests, so
+ * requests may be pipelined freely. On SERVER_OK, the payload is:
+ * - for SERVER_QUERY, a bitmap of ceil(n / 8) bytes, wherein the i'th SHA1 is present in the
+ *   filter iff bit i % 8 (counting from the least significant) of byte i / 8 is set
+ * - for SERVER_RANGE, the shard saved with HIBP_FORMAT_COMPRESSED, which the client can load
+ *   with hibp_bf_load_reader and query locally
+ * Otherwise, the payload is empty. After SERVER_E_BAD_REQUEST (sent for an unknown request
+ * type, nonzero reserved bytes, or an oversized batch) the server closes the connection */
+int server_run(const char* address, const char* filename, size_t n_threads);
+
+#define SERVER_MAX_BATCH 65536
+
+typedef enum {
+  SERVER_QUERY = 1,
+  SERVER_RANGE = 2
+} server_request_t;
+
+typedef enum {
+  SERVER_OK = 0,
+  SERVER_E_BAD_REQUEST = 1,
+
+  /* SERVER_RANGE for a filter that isn't sharded, a prefix that's out of range, or a shard
+   * that isn't loaded */
+  SERVER_E_NOT_FOUND = 2,
+
+  /* Out of memory, in practice */
+  SERVER_E_INTERNAL = 3
+} server_status_t;
+
+#endif
@@ -1,44 +1,79 @@
+/* For fileno and read(2) */
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
 #include <assert.h>
+#include <unistd.h>
 
 #include "stream.h"
 
+/* Initial size of the buffer of a stream backed by a file. It's doubled as necessary to
+ * accommodate long spans */
+#define BUFFER_SIZE (64 * 1024)
+
 /* ================================================================
  * Plumbing
  * ================================================================ */
 
 /* Common initialization for both stream constructors */
 static inline void stream_new(stream_t* stream, const char* name) {
-  stream->c = EOF;
+  stream->begin = 0;
   stream->eof = 0;
+  stream->prompted = 0;
   stream->name = name;
   stream->line = 1;
   stream->column = 1;
   stream->prompt = NULL;
 }
 
-/* Given a stream backed a by a null-terminated string, extract a character from
- * the string and increment the pointer */
-static int stream_str_getc(stream_t* stream) {
-  const char* str = (const char*)stream->ctx;
-  const int c = *str;
+/* Read more input into the buffer, after whatever is already buffered. The buffered
+ * input is first moved to the front of the buffer, which is grown if it's full. Returns
+ * the number of characters read (0 at EOF), or -1 if the buffer couldn't be grown */
+static long stream_fill(stream_t* stream) {
+  if(stream->file == NULL) {
+    return 0;
+  }
 
-  if(c == 0) {
-    return EOF;
+  const size_t buffered = stream->end - stream->begin;
+
+  memmove(stream->buffer, stream->buffer + stream->begin, buffered);
+  stream->begin = 0;
+  stream->end = buffered;
+
+  if(buffered == stream->capacity) {
+    const size_t capacity = (stream->capacity == 0) ? BUFFER_SIZE : 2 * stream->capacity;
+    char* buffer = (char*)realloc(stream->buffer, capacity);
+
+    if(buffer == NULL) {
+      return -1;
+    }
+
+    stream->buffer = buffer;
+    stream->capacity = capacity;
   }
 
-  stream->ctx = (void*)(str + 1);
-  return c;
-}
+  const int fd = fileno(stream->file);
 
-/* Given a stream backed by a FILE, extract a character from the file */
-static int stream_file_getc(stream_t* stream) {
-  return fgetc((FILE*)stream->ctx);
-}
+  for(;;) {
+    const ssize_t n = read(fd, stream->buffer + stream->end, stream->capacity - stream->end);
+
+    if(n == -1 && errno == EINTR) {
+      continue;
+    }
+
+    /* FIXME: read errors are treated as EOF, as they were in the days of fgetc */
+    if(n <= 0) {
+      return 0;
+    }
 
-/* Given a stream backed by a FILE, destroy the FILE */
-static void stream_file_close(stream_t* stream) {
-  fclose((FILE*)stream->ctx);
+    stream->end += (size_t)n;
+
+    return (long)n;
+  }
 }
 
 /* ================================================================
@@ -47,23 +82,27 @@ static void stream_file_close(stream_t* stream) {
 
 void stream_new_file(stream_t* stream, FILE* file, const char* name) {
   stream_new(stream, name);
-  stream->ctx = (void*)file;
-  stream->my_getc = stream_file_getc;
-  stream->my_close = stream_file_close;
+  stream->buffer = NULL;
+  stream->end = 0;
+  stream->capacity = 0;
+  stream->file = file;
 }
 
 void stream_new_str(stream_t* stream, const char* str, const char* name) {
   stream_new(stream, name);
-  stream->ctx = (void*)str;
-  stream->my_getc = stream_str_getc;
-  stream->my_close = NULL;
+  stream->buffer = (char*)str;
+  stream->end = strlen(str);
+  stream->capacity = stream->end;
+  stream->file = NULL;
 }
 
 void stream_close(stream_t* stream) {
-  if(stream->my_close == NULL) {
+  if(stream->file == NULL) {
     return;
   }
-  stream->my_close(stream);
+
+  free(stream->buffer);
+  fclose(stream->file);
 }
 
 int stream_peek(stream_t* stream) {
@@ -72,26 +111,22 @@ int stream_peek(stream_t* stream) {
     return EOF;
   }
 
-  /* Return the buffer character, if any. We use EOF to indicate the absence of a
-   * buffered character - it's not necessarily an actual end-of-file */
-  if(stream->c != EOF) {
-    return stream->c;
-  }
-
-  /* Dispatch prompt hook if necessary */
-  if(stream->prompt && stream->column == 1) {
-    stream->prompt();
+  if(stream->begin == stream->end) {
+    /* Dispatch prompt hook if necessary */
+    if(stream->prompt && stream->column == 1 && !stream->prompted) {
+      stream->prompt();
+      stream->prompted = 1;
+    }
+
+    /* Real EOF. We can't distinguish a failure to grow the buffer from an EOF here, but
+     * the buffer is empty, so it can't need growing */
+    if(stream_fill(stream) <= 0) {
+      stream->eof = 1;
+      return EOF;
+    }
   }
 
-  /* Fetch and buffer a character */
-  stream->c = stream->my_getc(stream);
-
-  /* Real EOF */
-  if(stream->c == EOF) {
-    stream->eof = 1;
-  }
-
-  return stream->c;
+  return (unsigned char)stream->buffer[stream->begin];
 }
 
 int stream_getc(stream_t* stream) {
@@ -104,12 +139,68 @@ int stream_getc(stream_t* stream) {
   if(c == '\n') {
     stream->line ++;
     stream->column = 1;
+    stream->prompted = 0;
   } else if(c != EOF) {
     stream->column ++;
   }
 
-  /* Remove the currently-buffered character */
-  stream->c = EOF;
+  /* Remove the character from the buffer */
+  if(c != EOF) {
+    stream->begin ++;
+  }
 
   return c;
 }
+
+int stream_next_span(stream_t* stream, stream_span_t kind, const char** span, size_t* length) {
+  if(stream_peek(stream) == EOF) {
+    return 0;
+  }
+
+  /* Scan for the end of the span, refilling the buffer until we find it or hit EOF.
+   * Refilling may move the buffered input, so we work with offsets from begin */
+  size_t n = 0;
+
+  for(;;) {
+    const char* begin = stream->buffer + stream->begin;
+    const size_t buffered = stream->end - stream->begin;
+
+    if(kind == STREAM_SPAN_LINE) {
+      const char* newline = (const char*)memchr(begin + n, '\n', buffered - n);
+      n = (newline == NULL) ? buffered : (size_t)(newline - begin);
+    } else {
+      assert(kind == STREAM_SPAN_STRING);
+
+      while(n < buffered && !isspace((unsigned char)begin[n])) {
+        n ++;
+      }
+    }
+
+    if(n < buffered) {
+      break;
+    }
+
+    const long status = stream_fill(stream);
+
+    if(status == -1) {
+      return -1;
+    }
+
+    if(status == 0) {
+      break;
+    }
+  }
+
+  (*span) = stream->buffer + stream->begin;
+  (*length) = n;
+
+  stream->begin += n;
+  stream->column += n;
+
+  /* Consume the newline terminating a line */
+  if(kind == STREAM_SPAN_LINE && stream->begin < stream->end) {
+    stream_getc(stream);
+  }
+
+  return 1;
+}
@@ -8,17 +8,23 @@
  * values for error messaging, etc. */
 
 typedef struct st_stream {
-  /* If only there was some language that had polymorphism and vtables... :) */
-  void* ctx;
-  int (*my_getc)(struct st_stream*);
-  void (*my_close)(struct st_stream*);
+  /* Buffered input is buffer[begin..end). For a stream backed by a file, the buffer is
+   * ours, and is refilled with read(2); for a stream backed by a string, it's the string
+   * itself, so there's never anything to refill */
+  char* buffer;
+  size_t begin;
+  size_t end;
+  size_t capacity;
 
-  /* Character buffered by stream_peek */
-  int c;
+  /* NULL for a stream backed by a string */
+  FILE* file;
 
   /* EOF indicator */
   int eof;
 
+  /* Has the prompt hook been dispatched for the current line? */
+  int prompted;
+
   /* Everything below is public */
 
   /* name is informational. It's passed into the constructors */
@@ -31,6 +37,17 @@ typedef struct st_stream {
   void (*prompt)(void);
 } stream_t;
 
+/* Kinds of span returned by stream_next_span */
+typedef enum {
+  /* A maximal run of non-whitespace characters. The terminating whitespace character
+   * isn't consumed */
+  STREAM_SPAN_STRING,
+
+  /* Everything up to the next newline or EOF. The newline is consumed, but isn't part of
+   * the span */
+  STREAM_SPAN_LINE
+} stream_span_t;
+
 /* Public interface. Hopefully self-explanatory */
 
 void stream_new_file(stream_t* stream, FILE* file, const char* name);
@@ -40,4 +57,10 @@ void stream_close(stream_t* stream);
 int stream_peek(stream_t* stream);
 int stream_getc(stream_t* stream);
 
+/* Bulk alternative to stream_getc: consume the next span of the given kind, and point
+ * *span at it, without copying. The span lives in the stream's buffer and is valid only
+ * until the next call on the stream. Returns 1 on success, 0 at EOF (in which case
+ * nothing was consumed), or -1 if the buffer couldn't be grown to hold the span */
+int stream_next_span(stream_t* stream, stream_span_t kind, const char** span, size_t* length);
+
 #endif
@@ -1,3 +1,6 @@
+/* For strdup */
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -215,9 +218,13 @@ void drain_line(stream_t* stream) {
   }
 }
 
-char* token2str(const token_t* token) {
+size_t token2buf(char* buffer, const token_t* token) {
   if(token->length == 0) {
-    return strdup("\"\"");
+    if(buffer != NULL) {
+      memcpy(buffer, "\"\"", 2);
+    }
+
+    return 2;
   }
 
   int needs_quoting = 0;
@@ -244,14 +251,12 @@ char* token2str(const token_t* token) {
     str_length += 2;
   }
 
-  char* str = (char*)malloc(str_length + 1);
-
-  if(str == NULL) {
-    return NULL;
+  if(buffer == NULL) {
+    return str_length;
   }
 
   if(needs_quoting) {
-    str[0] = '"';
+    buffer[0] = '"';
 
     size_t k = 1;
 
@@ -259,28 +264,40 @@ char* token2str(const token_t* token) {
       const int c = token->buffer[i];
 
       if(c == '"') {
-        str[k ++] = '\\';
-        str[k ++] = '"';
+        buffer[k ++] = '\\';
+        buffer[k ++] = '"';
       } else if(c == '\n') {
-        str[k ++] = '\\';
-        str[k ++] = 'n';
+        buffer[k ++] = '\\';
+        buffer[k ++] = 'n';
       } else if(!isprint(c)) {
-        str[k ++] = '\\';
-        str[k ++] = 'x';
-        str[k ++] = int2hex((c >> 4) & 0x0f);
-        str[k ++] = int2hex(c & 0x0f);
+        buffer[k ++] = '\\';
+        buffer[k ++] = 'x';
+        buffer[k ++] = int2hex((c >> 4) & 0x0f);
+        buffer[k ++] = int2hex(c & 0x0f);
       } else {
-        str[k ++] = c;
+        buffer[k ++] = c;
       }
     }
 
     assert(k == str_length - 1);
-    str[k] = '"';
+    buffer[k] = '"';
   } else {
     assert(str_length == token->length);
-    memcpy(str, token->buffer, str_length);
+    memcpy(buffer, token->buffer, str_length);
+  }
+
+  return str_length;
+}
+
+char* token2str(const token_t* token) {
+  const size_t str_length = token2buf(NULL, token);
+  char* str = (char*)malloc(str_length + 1);
+
+  if(str == NULL) {
+    return NULL;
   }
 
+  token2buf(str, token);
   str[str_length] = 0;
 
   return str;
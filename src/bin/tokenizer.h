@@ -46,4 +46,9 @@ void drain_line(stream_t* stream);
  * because it's basically the inverse of next_token */
 char* token2str(const token_t* token);
 
+/* Non-allocating counterpart of token2str: write the same string, without the null
+ * terminator, into buffer, and return its length. If buffer is NULL, just return the
+ * length, so that the caller can make room */
+size_t token2buf(char* buffer, const token_t* token);
+
 #endif
@@ -0,0 +1,110 @@
+#include <string.h>  /* memcpy */
+#include <pthread.h> /* pthread_once */
+
+#include "crc32c.h"
+
+/* Reversed representation of the Castagnoli polynomial */
+static const uint32_t POLYNOMIAL = 0x82f63b78;
+
+/* ================================================================
+ * Table-driven implementation
+ * ================================================================ */
+
+/* Slicing-by-8: tables[k][b] is the CRC of byte b followed by k zero bytes, so that 8
+ * bytes can be folded into the CRC with 8 independent table lookups */
+static uint32_t tables[8][256];
+
+static void init_tables(void) {
+  for(size_t b = 0; b < 256; b ++) {
+    uint32_t crc = b;
+
+    for(size_t i = 0; i < 8; i ++) {
+      crc = (crc >> 1) ^ ((crc & 1) ? POLYNOMIAL : 0);
+    }
+
+    tables[0][b] = crc;
+  }
+
+  for(size_t b = 0; b < 256; b ++) {
+    for(size_t k = 1; k < 8; k ++) {
+      const uint32_t prev = tables[k - 1][b];
+      tables[k][b] = (prev >> 8) ^ tables[0][prev & 0xff];
+    }
+  }
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char* buffer, size_t size) {
+  while(size >= 8) {
+    const uint32_t lo = crc ^ (buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | ((uint32_t)buffer[3] << 24));
+
+    crc = tables[7][lo & 0xff] ^
+          tables[6][(lo >> 8) & 0xff] ^
+          tables[5][(lo >> 16) & 0xff] ^
+          tables[4][lo >> 24] ^
+          tables[3][buffer[4]] ^
+          tables[2][buffer[5]] ^
+          tables[1][buffer[6]] ^
+          tables[0][buffer[7]];
+
+    buffer += 8;
+    size -= 8;
+  }
+
+  for(size_t i = 0; i < size; i ++) {
+    crc = (crc >> 8) ^ tables[0][(crc ^ buffer[i]) & 0xff];
+  }
+
+  return crc;
+}
+
+/* ================================================================
+ * SSE 4.2 implementation
+ * ================================================================ */
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HAVE_CRC32C_HW
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char* buffer, size_t size) {
+  unsigned long long crc64 = crc;
+
+  while(size >= 8) {
+    unsigned long long word;
+    memcpy(&word, buffer, 8);
+    crc64 = __builtin_ia32_crc32di(crc64, word);
+
+    buffer += 8;
+    size -= 8;
+  }
+
+  crc = (uint32_t)crc64;
+
+  for(size_t i = 0; i < size; i ++) {
+    crc = __builtin_ia32_crc32qi(crc, buffer[i]);
+  }
+
+  return crc;
+}
+#endif
+
+/* ================================================================
+ * Dispatch
+ * ================================================================ */
+
+static uint32_t (*implementation)(uint32_t, const unsigned char*, size_t) = crc32c_sw;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static void init(void) {
+  init_tables();
+
+#ifdef HAVE_CRC32C_HW
+  if(__builtin_cpu_supports("sse4.2")) {
+    implementation = crc32c_hw;
+  }
+#endif
+}
+
+uint32_t hibp_crc32c(uint32_t crc, const unsigned char* buffer, size_t size) {
+  pthread_once(&once, init);
+  return ~implementation(~crc, buffer, size);
+}
@@ -0,0 +1,13 @@
+#ifndef _CRC32C_H_
+#define _CRC32C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Internal to the library. CRC-32C (Castagnoli), as used by iSCSI, ext4, etc. Given the
+ * CRC of some prefix (or 0 for the empty prefix), return the CRC of that prefix followed
+ * by the size bytes of buffer. Uses the SSE 4.2 crc32 instruction where available, and a
+ * table-driven implementation otherwise */
+uint32_t hibp_crc32c(uint32_t crc, const unsigned char* buffer, size_t size);
+
+#endif
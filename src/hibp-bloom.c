@@ -1,11 +1,30 @@
+/* For the mmap family, as well as MAP_POPULATE and MADV_HUGEPAGE where available */
+#define _DEFAULT_SOURCE
+
 #include <openssl/sha.h>  /* SHA1 */
 #include <openssl/rand.h> /* RAND_pseudo_bytes */
 #include <stdio.h>        /* EOF, FILE, fread, fwrite */
+#include <stdlib.h>       /* malloc, calloc, free */
 #include <string.h>       /* memcpy, memcmp, strlen */
+#include <stdint.h>       /* uint64_t, uintptr_t */
 #include <math.h>         /* log, pow */
 #include <assert.h>       /* assert */
+#include <errno.h>        /* errno, ENOMEM */
+#include <fcntl.h>        /* open */
+#include <unistd.h>       /* close, pwrite, fdatasync */
+#include <sys/mman.h>     /* mmap, munmap, madvise */
+#include <sys/stat.h>     /* fstat */
+#include <time.h>         /* clock_gettime */
+#include <pthread.h>      /* pthread_* */
 
 #include "hibp-bloom.h"
+#include "crc32c.h"
+#include "lz4.h"
+#include "parallel.h"
+#include "alloc.h"
+#include "sha1.h"
+#include "popcount.h"
+#include "pager.h"
 
 /* ================================================================
  * Types and constants
@@ -18,10 +37,21 @@ typedef hibp_status_t       status;
 typedef hibp_prng_t         prng_t;
 typedef hibp_getc_t         getc_t;
 typedef hibp_putc_t         putc_t;
+typedef hibp_read_t         read_t;
+typedef hibp_write_t        write_t;
+typedef hibp_allocator_t    allocator_t;
 
 /* So the compile can populate some constants at compile time
  * (and hopefully elide them) */
 #define MIN(x, y) (((x) <= (y)) ? (x) : (y))
+#define MAX(x, y) (((x) >= (y)) ? (x) : (y))
+
+/* Hint that the cache line containing address will be read soon. Purely advisory */
+#if defined(__GNUC__)
+#define PREFETCH(address) __builtin_prefetch((address))
+#else
+#define PREFETCH(address) ((void)(address))
+#endif
 
 /* SIZE_MAX isn't present on all platforms */
 #undef SIZE_MAX
@@ -30,6 +60,8 @@ static const size_t SIZE_MAX = ~(size_t)0;
 static const size_t SHA1_BYTES = HIBP_SHA1_BYTES;
 static const size_t SHA1_BITS = 8 * HIBP_SHA1_BYTES;
 
+static const size_t SIZE_BITS = 8 * sizeof(size_t);
+
 /* Our implementations depends on being able to address 2**log2_bits bits, hence
  * necessarily log2_bits can't exceed the number of bits in a size_t. Moreover, it's
  * senseless to create a Bloom filter larger than the number of elements in the domain */
@@ -45,36 +77,317 @@ static const size_t N_HASH_FUNCTIONS_MAX = MIN(SIZE_MAX, 0xffffffffffffffff);
  * size of the buffer doesn't exceed SIZE_MAX. OFC. on 64-bit systems this isn't
  * a practical concern, but I err on the side of strict correctness */
 
-/* Magic version string. Appears at the start of every file */
-static const byte VERSION[] = { 0xb1, 0x00, 0x13, 0x37 };
+/* In the blocked layout, the first hash function selects a block of 2**LOG2_BLOCK_BITS
+ * bits (i.e. one 64-byte cache line), and every other hash function selects a bit within
+ * that block; hence a query touches exactly one cache line */
+static const size_t LOG2_BLOCK_BITS = 9;
+
+/* Magic version strings; every file starts with one of these. In the compact format,
+ * filters with the standard layout are written in the original format (VERSION_1) so that
+ * they remain readable by older builds. VERSION_2 is identical except that it also records
+ * the layout. VERSION_3 is the aligned format, VERSION_4 the chunked format, and VERSION_5
+ * the compressed format; see load_reader */
+#define VERSION_SIZE 4
+static const byte VERSION_1[VERSION_SIZE] = { 0xb1, 0x00, 0x13, 0x37 };
+static const byte VERSION_2[VERSION_SIZE] = { 0xb1, 0x01, 0x13, 0x37 };
+static const byte VERSION_3[VERSION_SIZE] = { 0xb1, 0x02, 0x13, 0x37 };
+static const byte VERSION_4[VERSION_SIZE] = { 0xb1, 0x03, 0x13, 0x37 };
+static const byte VERSION_5[VERSION_SIZE] = { 0xb1, 0x04, 0x13, 0x37 };
+
+/* In the aligned format, the header is followed by enough zero padding that the bit vector
+ * starts at a multiple of ALIGNMENT bytes from the start of the file. 4 KiB is the page
+ * size (and the O_DIRECT granularity) on every platform of interest */
+static const size_t ALIGNMENT = 4096;
+
+/* Version string, n_hash_functions, log2_bits, layout, vector size, and checksum */
+#define ALIGNED_HEADER_SIZE (VERSION_SIZE + 8 + 1 + 1 + 8 + HIBP_SHA1_BYTES)
+
+/* The chunked format is also aligned, but rather than a single SHA1 over the whole buffer
+ * it stores one digest for every chunk of 2**log2_chunk_size bytes of the buffer (the last
+ * chunk may be short). Chunks can then be checksummed in parallel, or verified one at a
+ * time as they're first accessed. These are the checksum algorithms, as recorded on disk */
+#define CHECKSUM_CRC32C 0
+#define CHECKSUM_SHA1   1
+
+/* We write 4 MiB chunks, and accept anything from one page up to whatever we can shift by */
+static const size_t LOG2_CHUNK_SIZE = 22;
+static const size_t LOG2_CHUNK_SIZE_MIN = 12;
+static const size_t LOG2_CHUNK_SIZE_MAX = 8 * sizeof(size_t) - 1;
+
+/* Everything in the header up to the digests: version string, n_hash_functions,
+ * log2_bits, layout, vector size, checksum algorithm, and log2_chunk_size */
+#define CHUNKED_HEADER_SIZE (VERSION_SIZE + 8 + 1 + 1 + 8 + 1 + 1)
+
+/* In the compressed format, the buffer is cut into chunks of 2**log2_chunk_size bytes
+ * (within the same limits as for the chunked format), which are compressed independently
+ * so that they can be (de)compressed in parallel. These are the codecs, as recorded on
+ * disk. Chunks are processed COMPRESSION_BATCH_SIZE at a time, which bounds the memory
+ * needed for compressed data in flight */
+#define COMPRESSION_LZ4 0
+
+#define COMPRESSION_BATCH_SIZE 16
+
+/* Each chunk is preceded by its stored size and the CRC32C of its uncompressed contents */
+#define COMPRESSED_FRAME_SIZE (8 + 4)
+
+/* States of a chunk of a lazily-verified filter */
+#define CHUNK_UNVERIFIED 0
+#define CHUNK_OK         1
+#define CHUNK_CORRUPT    2
+
+/* Where to find, and how to check, the checksums of a filter loaded with
+ * hibp_bf_map_file. The legacy formats are treated as having a single SHA1-checksummed
+ * chunk that spans the whole buffer */
+struct hibp_verifier_st {
+  int algorithm;
+  size_t chunk_size;
+  size_t n_chunks;
+
+  /* The stored digests, n_chunks of them, within the mapping */
+  const byte* digests;
+
+  /* For HIBP_MAP_LAZY_VERIFY, the CHUNK_* state of each chunk; otherwise NULL. Accessed
+   * atomically, since queries (which can run concurrently) update it */
+  byte* states;
+};
+
+/* A lazily-verified filter's verifier, or NULL if the filter isn't being lazily verified */
+static inline struct hibp_verifier_st* lazy_verifier(const bloom_filter* bf) {
+  return (bf->verifier != NULL && bf->verifier->states != NULL) ? bf->verifier : NULL;
+}
+
+/* How the buffer of a filter was allocated, if not on the heap; see hibp_allocator_t */
+struct hibp_allocation_st {
+  /* The user's release function and its ctx, or NULL if buffer is the base of an
+   * anonymous mapping that we made with hibp_alloc_pages */
+  hibp_free_t free;
+  void* ctx;
+
+  /* The size asked of the user's allocation function, or the length of our mapping */
+  size_t size;
+};
+
+/* Which pages of a filter's buffer have been written since hibp_bf_track_changes; see
+ * hibp_bf_save_delta and hibp_bf_save_changes */
+struct hibp_tracker_st {
+  size_t n_pages;
+
+  /* Nonzero for each page that has been written. Bytes rather than bits, so that
+   * concurrent insertions can mark pages with a plain (atomic) store */
+  byte* dirty;
+
+  /* Nonzero if any bit has been cleared, which a delta (applied with OR) can't convey */
+  byte cleared;
+};
+
+/* Change tracking and deltas work in pages of this many bytes of the buffer */
+#define LOG2_DIRTY_PAGE_SIZE 12
+#define DIRTY_PAGE_SIZE (((size_t)1) << LOG2_DIRTY_PAGE_SIZE)
+
+/* Note that the byte at offset within the buffer of a tracked filter has been written */
+static inline void mark_dirty(const bloom_filter* bf, size_t offset) {
+  __atomic_store_n(&bf->tracker->dirty[offset >> LOG2_DIRTY_PAGE_SIZE], 1, __ATOMIC_RELAXED);
+}
+
+/* Note that a bit of the byte at offset within the buffer of a tracked filter has been
+ * cleared, so that the filter can no longer be shipped as a delta */
+static inline void mark_cleared(const bloom_filter* bf, size_t offset) {
+  mark_dirty(bf, offset);
+  __atomic_store_n(&bf->tracker->cleared, 1, __ATOMIC_RELAXED);
+}
+
+/* Counters and timings of a filter, if the library is built with HIBP_STATS; see
+ * hibp_filter_stats_t. Updated with relaxed atomic additions, since queries (and, in
+ * concurrent mode, insertions) can run concurrently. Padded to, and allocated on, a cache
+ * line of its own, so that counting doesn't contend with reading the filter */
+#define STATS_ALIGNMENT 64
+
+struct hibp_stats_st {
+  uint64_t n_queries;
+  uint64_t n_positives;
+  uint64_t n_probes;
+  uint64_t n_inserts;
+  uint64_t load_ns;
+  uint64_t verify_ns;
+  uint64_t save_ns;
+  uint64_t padding;
+};
+
+#ifdef HIBP_STATS
+/* Add n to the given counter of bf, if bf has counters */
+#define STATS_ADD(bf, counter, n) \
+  do { \
+    if((bf)->stats != NULL) { \
+      __atomic_fetch_add(&(bf)->stats->counter, (uint64_t)(n), __ATOMIC_RELAXED); \
+    } \
+  } while(0)
+
+/* Nanoseconds on a monotonic clock, for timing loads, verification, and saves */
+#define STATS_CLOCK() stats_clock()
+
+static inline uint64_t stats_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/* Where a query function should count its probes; see count_probes */
+#define STATS_PROBES(probes) (probes)
+#else
+/* Counting compiles away entirely */
+#define STATS_ADD(bf, counter, n) ((void)(bf), (void)(n))
+#define STATS_CLOCK() ((uint64_t)0)
+#define STATS_PROBES(probes) ((void)(probes), (size_t*)NULL)
+#endif
+
+/* The query functions take a probes argument, and if it's non-NULL, report through it
+ * how many bits they tested. Always NULL unless the library is built with HIBP_STATS, in
+ * which case the counting is inlined away */
+static inline void count_probes(size_t* probes, size_t n) {
+  if(probes != NULL) {
+    (*probes) = n;
+  }
+}
+
+static inline void count_queries(const bloom_filter* bf, size_t n, size_t n_positives, size_t n_probes) {
+  STATS_ADD(bf, n_queries, n);
+  STATS_ADD(bf, n_positives, n_positives);
+  STATS_ADD(bf, n_probes, n_probes);
+}
+
+/* Give a newly-initialized filter (whose stats are NULL) counters of its own, if the
+ * library is built with HIBP_STATS. Best-effort: if allocation fails, the filter simply
+ * goes uncounted */
+static inline void attach_stats(bloom_filter* bf) {
+#ifdef HIBP_STATS
+  void* stats;
+
+  if(posix_memalign(&stats, STATS_ALIGNMENT, sizeof(struct hibp_stats_st)) == 0) {
+    memset(stats, 0, sizeof(struct hibp_stats_st));
+    bf->stats = stats;
+  }
+#else
+  (void)bf;
+#endif
+}
+
+/* attach_stats for a newly-loaded (or mapped) filter, crediting it with the time since
+ * start (per STATS_CLOCK), verify_ns of which was spent verifying it */
+static inline void attach_load_stats(bloom_filter* bf, uint64_t start, uint64_t verify_ns) {
+  attach_stats(bf);
+  STATS_ADD(bf, load_ns, STATS_CLOCK() - start);
+  STATS_ADD(bf, verify_ns, verify_ns);
+}
 
 /* ================================================================
  * Internal utility functions
  * ================================================================ */
 
-/* Each of the first bf->n_hash_functions slices of size bf->log2_bits of
- * bf->buffer encodes a Bloom filter hash function */
+/* Width in bits of the k'th hash function of a filter with the given parameters. In the
+ * standard layout every hash function yields a value log2_bits bits long. In the blocked
+ * layout the first hash function is just wide enough to address any block, and the rest
+ * are just wide enough to address any bit within a block */
+static inline size_t hash_function_width(hibp_layout_t layout, size_t log2_bits, size_t k) {
+  if(layout == HIBP_LAYOUT_BLOCKED) {
+    return (k == 0) ? log2_bits - LOG2_BLOCK_BITS : LOG2_BLOCK_BITS;
+  }
+
+  return log2_bits;
+}
+
+/* The first bit-selecting hash function; in the blocked layout, the first hash function
+ * selects a block rather than a bit */
+static inline size_t first_probe(const bloom_filter* bf) {
+  return (bf->layout == HIBP_LAYOUT_BLOCKED);
+}
+
+/* Offset of the k'th hash function within the buffer. Hash functions are laid out
+ * back-to-back, so the offset of the n_hash_functions'th "hash function" is the total
+ * size of the hash functions. Double hashing stores nothing. Doesn't check for overflow;
+ * see compute_buffer_size */
+static inline size_t hash_function_offset(hibp_layout_t layout, hibp_hashing_t hashing,
+                                          size_t log2_bits, size_t k) {
+  if(hashing == HIBP_HASHING_DOUBLE) {
+    return 0;
+  }
+
+  if(layout == HIBP_LAYOUT_BLOCKED && k > 0) {
+    return (log2_bits - LOG2_BLOCK_BITS) + (k - 1) * LOG2_BLOCK_BITS;
+  }
+
+  return k * log2_bits;
+}
+
+/* 2**log2_bits, or 0 if that isn't representable */
+static inline size_t pow2_bits(size_t log2_bits) {
+  return (log2_bits < SIZE_BITS) ? (((size_t)1) << log2_bits) : 0;
+}
+
+/* The least log2_bits such that 2**log2_bits >= bits */
+static inline size_t ceil_log2(size_t bits) {
+  size_t log2_bits = 0;
+
+  while(log2_bits < SIZE_BITS && pow2_bits(log2_bits) < bits) {
+    log2_bits ++;
+  }
+
+  return log2_bits;
+}
+
+/* Does bf have exactly 2**log2_bits bits? A filter created with hibp_bf_new_bits needn't;
+ * its hash functions are still log2_bits wide, but their values are then mapped onto
+ * [0, bits) by reduce */
+static inline int pow2_sized(const bloom_filter* bf) {
+  return bf->bits == pow2_bits(bf->log2_bits);
+}
+
+/* On disk, the byte recording the layout also records the hash family in bits 4 through
+ * 6, and in bit 7 whether it's followed by the number of bits (8 bytes, little-endian),
+ * which is only recorded if it isn't 2**log2_bits. Filters of the random family and of
+ * power-of-2 size are then recorded exactly as they were before there were alternatives,
+ * and older builds reject the others as being of some unknown layout */
+#define LAYOUT_HAS_BITS 0x80
+
+static inline byte encode_layout(const bloom_filter* bf) {
+  return (byte)(bf->layout | (bf->hashing << 4) | (pow2_sized(bf) ? 0 : LAYOUT_HAS_BITS));
+}
+
+/* Returns nonzero if the number of bits follows */
+static inline int decode_layout(bloom_filter* bf, byte c) {
+  bf->layout = (hibp_layout_t)(c & 0xf);
+  bf->hashing = (hibp_hashing_t)((c >> 4) & 0x7);
+  return (c & LAYOUT_HAS_BITS) != 0;
+}
+
+/* Size of the number of bits in bf's header; see encode_layout */
+static inline size_t bits_field_size(const bloom_filter* bf) {
+  return pow2_sized(bf) ? 0 : 8;
+}
+
+/* The first bytes of bf->buffer encode the Bloom filter hash functions, the k'th hash
+ * function being a slice of width hash_function_width */
 static inline byte* nth_hash_function(const bloom_filter* bf, size_t k) {
-  return bf->buffer + k * bf->log2_bits;
+  return bf->buffer + hash_function_offset(bf->layout, bf->hashing, bf->log2_bits, k);
 }
 
 /* Immediately following the last hash function is the Bloom filter bit vector */
 static inline byte* bvector(const bloom_filter* bf) {
-  return bf->buffer + bf->n_hash_functions * bf->log2_bits;
+  return nth_hash_function(bf, bf->n_hash_functions);
 }
 
 /* Evaluate the k'th hash function of bf against the given sha */
 static inline size_t eval_nth_hash_function(const bloom_filter* bf, size_t k, const byte* sha) {
   const byte* indices = nth_hash_function(bf, k);
+  const size_t width = hash_function_width(bf->layout, bf->log2_bits, k);
 
   /* For our purposes, a hash function takes some sha and concatenates together some
    * permutation of some subset of the bits of sha. In particular each hash function
-   * yields a value log2_bits bits long. Each hash function is encoded as a simple array
+   * yields a value width bits long. Each hash function is encoded as a simple array
    * of indices, each index indicating some bit to concatenate onto the hash value next */
 
   size_t value = 0;
 
-  for(size_t i = 0; i < bf->log2_bits; i++) {
+  for(size_t i = 0; i < width; i++) {
     const byte index = indices[i];
     assert(index < SHA1_BITS);
 
@@ -85,229 +398,1034 @@ static inline size_t eval_nth_hash_function(const bloom_filter* bf, size_t k, co
     value |= (bit << i);
   }
 
-  assert(value < (((size_t)1) << bf->log2_bits));
+  assert(width == SIZE_BITS || value < (((size_t)1) << width));
 
   return value;
 }
 
-/* Given n_hash_functions and log2_bits, determine whether the parameters are valid,
- * returning HIBP_E_INVAL, HIBP_E_2BIG, or HIBP_OK. buffer_size is populated with the
- * total size to allocate for the Bloom filter's buffer, if indeed the parameters were
- * valid */
-static inline status compute_buffer_size(size_t* buffer_size, size_t n_hash_functions, size_t log2_bits) {
-  if(n_hash_functions == 0) {
-    return HIBP_E_INVAL;
-  }
+/* eval_nth_hash_function is the canonical definition of our hash functions, but it
+ * costs a shift and a mask per bit, which adds up fast. Observe that the value of a hash
+ * function is the bitwise OR of the contributions of the individual bytes of sha, and that
+ * the contribution of some byte depends only on the value of that byte. Hence for each byte
+ * that a hash function draws on, we can precompute a 256-entry table of contributions, and
+ * evaluate the function with one lookup per byte rather than a few operations per bit.
+ * Better yet, for any reasonably-sized filter several hash functions fit side-by-side in
+ * a single size_t, so we pack them into groups and evaluate a whole group with the same
+ * handful of lookups */
+struct hibp_compiled_st {
+  size_t n_groups;
 
-  if(log2_bits > LOG2_BITS_MAX || n_hash_functions > N_HASH_FUNCTIONS_MAX) {
-    return HIBP_E_2BIG;
-  }
+  /* The hash functions of the g'th group are [group_firsts[g], group_firsts[g + 1]) */
+  size_t* group_firsts;
 
-  /* First, check if the hash functions by themselves already exceed SIZE_MAX */
-  if(log2_bits > SIZE_MAX / n_hash_functions) {
-    return HIBP_E_2BIG;
-  }
+  /* The tables of the g'th group are [group_starts[g], group_starts[g + 1]) */
+  size_t* group_starts;
 
-  /* Won't overflow */
-  const size_t hash_functions_size = log2_bits * n_hash_functions;
+  /* Within the value of its group, the value of the i'th hash function is
+   * (value >> shifts[i]) & masks[i] */
+  byte* shifts;
+  size_t* masks;
 
-  /* Also won't overflow */
-  const size_t vector_bits = (((size_t)1) << log2_bits);
+  /* The byte of sha by which each table is indexed */
+  byte* table_bytes;
 
-  /* Can't do (vector_bits + 7) / 8 because the addition might overflow */
-  const size_t vector_size = (vector_bits / 8) + (vector_bits % 8 != 0);
+  size_t (*tables)[256];
 
-  if(hash_functions_size > SIZE_MAX - vector_size) {
-    return HIBP_E_2BIG;
-  }
+  /* In the blocked layout the first hash function selects a block rather than a bit, so
+   * the first bit-selecting hash function is number 1 rather than number 0 */
+  size_t first_probe;
+};
 
-  *buffer_size = hash_functions_size + vector_size;
+typedef struct hibp_compiled_st compiled;
 
-  return HIBP_OK;
+static inline void free_compiled(compiled* c) {
+  if(c == NULL) {
+    return;
+  }
+
+  free(c->group_firsts);
+  free(c->group_starts);
+  free(c->shifts);
+  free(c->masks);
+  free(c->table_bytes);
+  free(c->tables);
+  free(c);
 }
 
-/* Plumbing for hibp_bf_load_stream */
-static inline int my_read(byte* buffer, size_t size, void* ctx, getc_t getc) {
-  for(size_t i = 0; i < size; i ++) {
-    int c = getc(ctx);
+/* Does any of the hash functions [first, last) of bf draw on the given byte of sha? */
+static inline int hash_functions_use_byte(const bloom_filter* bf, size_t first, size_t last, size_t byte_index) {
+  const byte* begin = nth_hash_function(bf, first);
+  const byte* end = nth_hash_function(bf, last);
 
-    if(c == EOF) {
-      return -1;
+  for(const byte* index = begin; index < end; index ++) {
+    if(*index / 8 == byte_index) {
+      return 1;
     }
-
-    buffer[i] = (byte)c;
   }
 
   return 0;
 }
 
-/* Plumbing for hibp_bf_save_stream */
-static inline int my_write(const byte* buffer, size_t size, void* ctx, putc_t putc) {
-  for(size_t i = 0; i < size; i ++) {
-    if(putc(buffer[i], ctx) == EOF) {
-      return -1;
-    }
+/* Compile the hash functions of bf into lookup tables, populating bf->compiled. There's
+ * nothing to compile for double hashing. Returns HIBP_E_NOMEM or HIBP_OK */
+static status compile_hash_functions(bloom_filter* bf) {
+  const size_t n_hash_functions = bf->n_hash_functions;
+
+  if(bf->hashing == HIBP_HASHING_DOUBLE) {
+    bf->compiled = NULL;
+    return HIBP_OK;
   }
 
-  return 0;
-}
+  compiled* c = (compiled*)calloc(1, sizeof(compiled));
 
-/* Given an 8-byte buffer encoding a little-endian unsigned integer, populate a size_t
- * with the value. Return -1 if the value does not fit into a size_t. Plumbing for
- * hipb_bf_load_* */
-static inline int le_8_bytes_to_size_t(size_t* size, const byte* buffer) {
-  if(sizeof(size_t) < 8) {
-    for(size_t i = sizeof(size_t); i < 8; i ++) {
-      if(buffer[i] != 0) {
-        return -1;
-      }
-    }
+  if(c == NULL) {
+    return HIBP_E_NOMEM;
   }
 
-  (*size) = 0;
+  c->first_probe = first_probe(bf);
 
-  for(size_t i = 0; i < sizeof(size_t); i ++) {
-    (*size) |= (((size_t)buffer[i]) << (i * 8));
+  if(n_hash_functions >= SIZE_MAX / sizeof(size_t)) {
+    free_compiled(c);
+    return HIBP_E_NOMEM;
   }
 
-  return 0;
-}
+  /* We can't have more groups than hash functions */
+  c->group_firsts = (size_t*)malloc(sizeof(size_t) * (n_hash_functions + 1));
+  c->group_starts = (size_t*)malloc(sizeof(size_t) * (n_hash_functions + 1));
+  c->shifts = (byte*)malloc(n_hash_functions);
+  c->masks = (size_t*)malloc(sizeof(size_t) * n_hash_functions);
 
-/* Given a size_t, encode it as 8 bytes in little-endian order. Plumbing for
- * hipb_bf_save_* */
-static inline void size_t_to_le_8_bytes(byte* buffer, size_t size) {
-  for(size_t i = 0; i < 8; i ++) {
-    buffer[i] = (size & 0xff);
-    size >>= 8;
+  if(c->group_firsts == NULL || c->group_starts == NULL || c->shifts == NULL || c->masks == NULL) {
+    free_compiled(c);
+    return HIBP_E_NOMEM;
   }
 
-  /* We should never be attempting to apply this function to a size_t
-   * greater than 2**64 - 1 */
-  assert(size == 0);
-}
+  /* First pass: greedily pack the hash functions into groups, and figure out which bytes
+   * each group draws on (and hence how many tables we need in total). Zero-width hash
+   * functions always evaluate to zero and pack for free */
 
-static inline void sha1(byte* sha, size_t size, const byte* buffer) {
-  /* Strictly speaking, the contract of SHA1 (and SHA1_Init) dictates that it can
-   * fail, but i) having audited the source, it cannot do so in practice in the current
-   * implementation; ii) it's hard to imagine a world where it could */
-  const int okay = (SHA1(buffer, size, sha) != NULL);
-  (void)okay;
-  assert(okay);
-}
+  size_t n_tables = 0;
+  c->n_groups = 0;
 
-/* Returns a pseudo-random number (nominally) uniformly distributed on [0, SIZE_MAX].
- * If *use_openssl, try OpenSSL's RAND_pseudo_bytes first (setting *use_openssl = 0
- * if it fails). Use stdlib's rand if the initial call to RAND_pseudo_bytes fails, or
- * if *use_openssl was zero in the first place */
-static inline size_t my_rand(int* use_openssl) {
-  size_t number;
+  for(size_t first = 0, last; first < n_hash_functions; first = last) {
+    size_t used = 0;
 
-  if(*use_openssl) {
-    number = 0; /* Prevent a spurious valgrind error */
-    *use_openssl = (RAND_pseudo_bytes((byte*)&number, sizeof(size_t)) != -1);
-  }
+    for(last = first; last < n_hash_functions; last ++) {
+      const size_t width = hash_function_width(bf->layout, bf->log2_bits, last);
 
-  if(!*use_openssl) {
-    number = 0;
+      if(last > first && used + width > SIZE_BITS) {
+        break;
+      }
 
-    /* This deliberately clobbers previously-written bits. I don't know if that's
-     * actually useful, but YOLO */
-    for(size_t i = 0; i < sizeof(size_t); i ++) {
-      number = ((number << 8) | (size_t)rand());
+      c->shifts[last] = used;
+      c->masks[last] = (width == SIZE_BITS) ? SIZE_MAX : ((((size_t)1) << width) - 1);
+      used += width;
+    }
+
+    c->group_firsts[c->n_groups] = first;
+    c->group_starts[c->n_groups] = n_tables;
+    c->n_groups ++;
+
+    for(size_t j = 0; j < SHA1_BYTES; j ++) {
+      n_tables += hash_functions_use_byte(bf, first, last, j);
     }
   }
 
-  return number;
-}
+  c->group_firsts[c->n_groups] = n_hash_functions;
+  c->group_starts[c->n_groups] = n_tables;
 
-/* Default prng for hibp_bf_new */
-static size_t default_prng(void* ctx, size_t upper_bound) {
-  (void)ctx;
-  assert(upper_bound > 0);
+  if(n_tables > SIZE_MAX / sizeof(*c->tables)) {
+    free_compiled(c);
+    return HIBP_E_NOMEM;
+  }
 
-  /* Flag indicating whether to attempt to use the OpenSSL PRNG. If and when the OpenSSL
-   * PRNG fails, my_rand will set the flag to zero and all subsequent RNG will be done
-   * with sdtlib's rand */
-  int use_openssl = 1;
+  c->table_bytes = (byte*)malloc(n_tables);
+  c->tables = (size_t(*)[256])malloc(n_tables * sizeof(*c->tables));
 
-  if(upper_bound == SIZE_MAX) {
-    return my_rand(&use_openssl);
+  if(n_tables != 0 && (c->table_bytes == NULL || c->tables == NULL)) {
+    free_compiled(c);
+    return HIBP_E_NOMEM;
   }
 
-  /* Because SIZE_MAX isn't necessarily divisible by upper_bound, my_rand(use_openssl) %
-   * upper_bound isn't necessarily uniformly distributed (there's potentially a slight
-   * bias to lower numbers). We can rectify this by discarding the highest numbers from
-   * the range of my_rand */
+  /* Second pass: populate the tables. The contribution of byte j having value v is
+   * exactly the value of the hash function for a sha that is zero everywhere except at
+   * byte j, so we can just lean on eval_nth_hash_function */
 
-  /* This is just a rounding down to the nearest multiple of upper_bound */
-  const size_t limit = SIZE_MAX / upper_bound * upper_bound;
+  for(size_t g = 0; g < c->n_groups; g ++) {
+    const size_t first = c->group_firsts[g];
+    const size_t last = c->group_firsts[g + 1];
 
-  size_t number;
+    size_t t = c->group_starts[g];
 
-  /* Find some random number uniformly distributed on [0, limit) */
-  do {
-    number = my_rand(&use_openssl);
-  } while(number >= limit);
+    for(size_t j = 0; j < SHA1_BYTES; j ++) {
+      if(!hash_functions_use_byte(bf, first, last, j)) {
+        continue;
+      }
 
-  /* Since [0, limit) has cardinality that is a multiple of upper_bound, and since number
-   * is uniformly distributed on that range, number % upper_bound is uniformly
-   * distributed on [0, upper_bound) */
-  return number % upper_bound;
+      c->table_bytes[t] = j;
+
+      byte sha[HIBP_SHA1_BYTES] = { 0 };
+
+      for(size_t v = 0; v < 256; v ++) {
+        sha[j] = v;
+
+        size_t value = 0;
+
+        for(size_t i = first; i < last; i ++) {
+          value |= (eval_nth_hash_function(bf, i, sha) << c->shifts[i]);
+        }
+
+        c->tables[t][v] = value;
+      }
+
+      t ++;
+    }
+
+    assert(t == c->group_starts[g + 1]);
+  }
+
+  bf->compiled = c;
+
+  return HIBP_OK;
 }
 
-static inline size_t min(size_t x, size_t y) {
-  return (x <= y) ? x : y;
+/* Total memory consumed by c */
+static inline size_t compiled_size(const compiled* c, size_t n_hash_functions) {
+  if(c == NULL) {
+    return 0;
+  }
+
+  const size_t n_tables = c->group_starts[c->n_groups];
+
+  return sizeof(*c) +
+    2 * sizeof(size_t) * (n_hash_functions + 1) +
+    (1 + sizeof(size_t)) * n_hash_functions +
+    (1 + sizeof(*c->tables)) * n_tables;
 }
 
-/* ================================================================
- * Public API
- * ================================================================ */
+/* Evaluate every hash function of the g'th group of c against the given sha; see the
+ * comment on shifts and masks for how to extract the value of any one function */
+static inline size_t eval_nth_group(const compiled* c, size_t g, const byte* sha) {
+  size_t value = 0;
 
-/* FIXME */
-void hibp_bf_get_info(hibp_filter_info_t* info, const hibp_bloom_filter_t* bf) {
-  size_t buffer_size;
-  compute_buffer_size(&buffer_size, bf->n_hash_functions, bf->log2_bits);
+  for(size_t t = c->group_starts[g]; t < c->group_starts[g + 1]; t ++) {
+    value |= c->tables[t][sha[c->table_bytes[t]]];
+  }
 
-  info->n_hash_functions = bf->n_hash_functions;
-  info->log2_bits = bf->log2_bits;
-  info->bits = (((size_t)1) << bf->log2_bits);
-  info->memory = sizeof(*bf) + buffer_size;
+  return value;
 }
 
-/* FIXME, part 2: electric boogaloo */
-size_t hibp_compute_total_size(size_t n_hash_functions, size_t log2_bits) {
-  size_t buffer_size;
-  compute_buffer_size(&buffer_size, n_hash_functions, log2_bits);
-  return buffer_size + sizeof(hibp_bloom_filter_t);
+/* The high 64 bits of the 128-bit product of x and y */
+static inline uint64_t mul_high_64(uint64_t x, uint64_t y) {
+#ifdef __SIZEOF_INT128__
+  __extension__ typedef unsigned __int128 uint128_t;
+  return (uint64_t)(((uint128_t)x * y) >> 64);
+#else
+  const uint64_t x_lo = x & 0xffffffff, x_hi = x >> 32;
+  const uint64_t y_lo = y & 0xffffffff, y_hi = y >> 32;
+  const uint64_t lo_lo = x_lo * y_lo;
+  const uint64_t cross = (lo_lo >> 32) + (x_hi * y_lo & 0xffffffff) + x_lo * y_hi;
+  return x_hi * y_hi + (x_hi * y_lo >> 32) + (cross >> 32);
+#endif
 }
 
-/* == Utilities == */
+/* Map value, which is log2 bits wide, onto [0, n) for some n <= 2**log2 by multiply-shift,
+ * per Lemire ("A fast alternative to the modulo reduction"): value * n / 2**log2, rounded
+ * down. That's one multiplication rather than a division, and just as uniform */
+static inline size_t reduce(size_t value, size_t log2, size_t n) {
+  assert(log2 > 0 && log2 <= 64);
+  return (size_t)mul_high_64(((uint64_t)value) << (64 - log2), n);
+}
 
-void hibp_compute_optimal_params(size_t* n_hash_functions, size_t* log2_bits, size_t count, double fp) {
-  /* From Wikipedia:
-   * ... The optimal number of bits per element is -1.44 log_2 p
-   * ... with the corresponding number of hash functions ... - log_2 p */
+/* The bit selected by the value k of a hash function in the standard layout */
+static inline size_t select_bit(const bloom_filter* bf, size_t k) {
+  return pow2_sized(bf) ? k : reduce(k, bf->log2_bits, bf->bits);
+}
 
-  const double eps = 1e-8;
-  const double ln_of_2 = log(2);
-  const double log2_of_fp = log(fp + eps) / ln_of_2;
+/* The first bit of the block selected by the value k of the block-selecting hash function
+ * in the blocked layout */
+static inline size_t select_block(const bloom_filter* bf, size_t k) {
+  const size_t block = pow2_sized(bf)
+    ? k
+    : reduce(k, bf->log2_bits - LOG2_BLOCK_BITS, bf->bits >> LOG2_BLOCK_BITS);
 
-  const double bits_per_elem = -1 * 1.44 * log2_of_fp;
-  const double bits = bits_per_elem * count;
-  const double double_log2_bits = ceil(log(bits) / ln_of_2 + eps);
+  return block << LOG2_BLOCK_BITS;
+}
 
-  const double double_n_hash_functions = ceil(-1 * log2_of_fp);
+/* The bit selected by the value k of a bit-selecting hash function, base being the first
+ * bit of the selected block in the blocked layout */
+static inline size_t select_probe(const bloom_filter* bf, size_t base, size_t k) {
+  return (bf->layout == HIBP_LAYOUT_BLOCKED) ? base + k : select_bit(bf, k);
+}
 
-  if(double_n_hash_functions > N_HASH_FUNCTIONS_MAX) {
-    *n_hash_functions = N_HASH_FUNCTIONS_MAX;
-  } else {
-    *n_hash_functions = (size_t)double_n_hash_functions;
-  }
+/* Double hashing draws h1 and h2 from the last 16 bytes of sha, little-endian. h2 is made
+ * odd, and hence coprime to the (power-of-2) number of bits that a probe chooses from, so
+ * that h1 + i * h2 never repeats itself before it has to. In the blocked layout, the bits
+ * of h1 above the ninth select the block, and probes 1 through n_hash_functions - 1
+ * select bits within it */
+typedef struct {
+  uint64_t h1;
+  uint64_t h2;
+  uint64_t mask;
+  size_t base;
+} double_hash_t;
 
-  if(double_log2_bits > LOG2_BITS_MAX) {
-    *log2_bits = LOG2_BITS_MAX;
-  } else {
-    *log2_bits = (size_t)double_log2_bits;
+static inline uint64_t le_8_bytes_to_uint64(const byte* buffer) {
+  uint64_t value = 0;
+
+  for(size_t i = 8; i -- > 0; ) {
+    value = (value << 8) | buffer[i];
+  }
+
+  return value;
+}
+
+static inline void init_double_hash(double_hash_t* dh, const bloom_filter* bf, const byte* sha) {
+  dh->h1 = le_8_bytes_to_uint64(sha + SHA1_BYTES - 16);
+  dh->h2 = le_8_bytes_to_uint64(sha + SHA1_BYTES - 8) | 1;
+
+  if(bf->layout == HIBP_LAYOUT_BLOCKED) {
+    const uint64_t block_mask = (((uint64_t)1) << (bf->log2_bits - LOG2_BLOCK_BITS)) - 1;
+    dh->base = select_block(bf, (size_t)((dh->h1 >> LOG2_BLOCK_BITS) & block_mask));
+    dh->mask = (((uint64_t)1) << LOG2_BLOCK_BITS) - 1;
+  } else {
+    dh->base = 0;
+    dh->mask = (bf->log2_bits == 64) ? UINT64_MAX : (((uint64_t)1) << bf->log2_bits) - 1;
+  }
+}
+
+/* The bit selected by the i'th hash function */
+static inline size_t nth_double_probe(const bloom_filter* bf, const double_hash_t* dh, size_t i) {
+  return select_probe(bf, dh->base, (size_t)((dh->h1 + i * dh->h2) & dh->mask));
+}
+
+/* Evaluate every hash function of bf against sha, populating probes with the index of
+ * every bit that is set for sha (one per hash function, less the block-selecting hash
+ * function in the blocked layout). Returns the number of probes */
+static inline size_t compute_probes(size_t* probes, const bloom_filter* bf, const byte* sha) {
+  if(bf->hashing == HIBP_HASHING_DOUBLE) {
+    double_hash_t dh;
+    init_double_hash(&dh, bf, sha);
+
+    size_t n_probes = 0;
+
+    for(size_t i = first_probe(bf); i < bf->n_hash_functions; i ++) {
+      probes[n_probes ++] = nth_double_probe(bf, &dh, i);
+    }
+
+    return n_probes;
+  }
+
+  const compiled* c = bf->compiled;
+
+  size_t base = 0;
+  size_t n_probes = 0;
+
+  for(size_t g = 0; g < c->n_groups; g ++) {
+    const size_t values = eval_nth_group(c, g, sha);
+
+    for(size_t i = c->group_firsts[g]; i < c->group_firsts[g + 1]; i ++) {
+      const size_t k = (values >> c->shifts[i]) & c->masks[i];
+      assert(k == eval_nth_hash_function(bf, i, sha));
+
+      if(i < c->first_probe) {
+        base = select_block(bf, k);
+        continue;
+      }
+
+      probes[n_probes ++] = select_probe(bf, base, k);
+    }
+  }
+
+  return n_probes;
+}
+
+/* The batched APIs work through their input in windows: compute every probe for every
+ * sha in the window, prefetch all of the corresponding cache lines, and only then touch
+ * the bit vector. That way the cache misses for the whole window are in flight at once,
+ * rather than one after another. The window is bounded by the total number of probes
+ * (so that we can keep them on the stack) and by the number of outstanding misses the
+ * hardware can plausibly track */
+#define BATCH_WINDOW_SHAS 16
+#define BATCH_WINDOW_PROBES 512
+
+/* See query_sha1_lookahead. Deeper lookahead does better still for elements that are
+ * present, but worse for those that aren't, since by the time the first unset bit is
+ * tested, misses for the probes after it are already under way. Filters of fewer than
+ * 2**LOG2_QUERY_LOOKAHEAD_BITS bits mostly fit in cache, and don't benefit */
+#define QUERY_LOOKAHEAD 2
+#define LOG2_QUERY_LOOKAHEAD_BITS 23
+
+/* How many shas fit in a window for bf? Zero if even one sha has too many probes */
+static inline size_t probe_window_size(const bloom_filter* bf) {
+  return MIN(BATCH_WINDOW_SHAS, BATCH_WINDOW_PROBES / bf->n_hash_functions);
+}
+
+/* How many shas to a window for bf? Zero if even one sha has too many probes, or if the
+ * filter is being verified lazily, in which case the batched APIs fall back on the
+ * unbatched ones */
+static inline size_t batch_window_size(const bloom_filter* bf) {
+  if(lazy_verifier(bf) != NULL || bf->pager != NULL) {
+    return 0;
+  }
+
+  return probe_window_size(bf);
+}
+
+/* Compute and prefetch all the probes of a window of n shas. The probes of the i'th sha
+ * are [probes + starts[i], probes + starts[i + 1]) */
+static inline void prefetch_window(size_t* probes, size_t* starts, const bloom_filter* bf,
+                                   size_t n, const byte* shas) {
+  const byte* vector = bvector(bf);
+
+  starts[0] = 0;
+
+  for(size_t i = 0; i < n; i ++) {
+    const size_t n_probes = compute_probes(probes + starts[i], bf, shas + i * SHA1_BYTES);
+    starts[i + 1] = starts[i] + n_probes;
+
+    /* All the probes of a blocked filter share a cache line */
+    const size_t n_prefetches = (bf->layout == HIBP_LAYOUT_BLOCKED) ? MIN(n_probes, 1) : n_probes;
+
+    for(size_t j = starts[i]; j < starts[i] + n_prefetches; j ++) {
+      PREFETCH(vector + probes[j] / 8);
+    }
+  }
+}
+
+/* In concurrent mode (and for parallel insertion), bits are set with atomic OR. Rather
+ * than one atomic per bit, the bits that an element sets are gathered by the aligned 64-bit
+ * word that they fall in, and each word is ORed once; in the blocked layout, where every
+ * bit of an element lies within a 64-byte block, that's at most nine atomics however many
+ * hash functions there are. A word_set_t holds the pending words, and is flushed once
+ * full */
+#define WORD_SET_SIZE 16
+
+typedef struct {
+  size_t n;
+  uint64_t* words[WORD_SET_SIZE];
+  uint64_t masks[WORD_SET_SIZE];
+} word_set_t;
+
+static inline void flush_words(word_set_t* ws) {
+  for(size_t i = 0; i < ws->n; i ++) {
+    /* Once a filter fills up, most bits are already set; skip the read-modify-write (and
+     * the exclusive ownership of the cache line that it entails) when we can */
+    if((__atomic_load_n(ws->words[i], __ATOMIC_RELAXED) & ws->masks[i]) != ws->masks[i]) {
+      __atomic_fetch_or(ws->words[i], ws->masks[i], __ATOMIC_RELAXED);
+    }
+  }
+
+  ws->n = 0;
+}
+
+/* Set the given bit of a vector of size bytes atomically, by the time ws is next
+ * flushed */
+static inline void set_bit_atomically(word_set_t* ws, byte* vector, size_t size, size_t bit) {
+  byte* address = vector + bit / 8;
+  const size_t misalignment = (uintptr_t)address % sizeof(uint64_t);
+  uint64_t* word = (uint64_t*)(address - misalignment);
+
+  /* The vector isn't necessarily aligned, so the words at either end of it may straddle
+   * the hash functions or the end of the buffer; fall back on bytes */
+  if((byte*)word < vector || (byte*)(word + 1) > vector + size) {
+    const byte mask = 1 << (bit % 8);
+
+    if((__atomic_load_n(address, __ATOMIC_RELAXED) & mask) == 0) {
+      __atomic_fetch_or(address, mask, __ATOMIC_RELAXED);
+    }
+
+    return;
+  }
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  const uint64_t mask = ((uint64_t)1) << (8 * (sizeof(uint64_t) - 1 - misalignment) + bit % 8);
+#else
+  const uint64_t mask = ((uint64_t)1) << (8 * misalignment + bit % 8);
+#endif
+
+  for(size_t i = 0; i < ws->n; i ++) {
+    if(ws->words[i] == word) {
+      ws->masks[i] |= mask;
+      return;
+    }
+  }
+
+  if(ws->n == WORD_SET_SIZE) {
+    flush_words(ws);
+  }
+
+  ws->words[ws->n] = word;
+  ws->masks[ws->n] = mask;
+  ws->n ++;
+}
+
+/* Size in bytes of bf's bit vector */
+static inline size_t bvector_size(const bloom_filter* bf) {
+  return (bf->bits / 8) + (bf->bits % 8 != 0);
+}
+
+/* Test the given bit of a vector. The load is atomic, so that queries can run alongside
+ * concurrent insertions; being relaxed, it costs no more than a plain load */
+static inline int test_bit(const byte* vector, size_t bit) {
+  return (__atomic_load_n(vector + bit / 8, __ATOMIC_RELAXED) >> (bit % 8)) & 1;
+}
+
+/* If atomic, bits are set with atomic OR, so that several threads can insert at once */
+static inline void insert_sha1_window(bloom_filter* bf, size_t n, const byte* shas, int atomic) {
+  size_t probes[BATCH_WINDOW_PROBES];
+  size_t starts[BATCH_WINDOW_SHAS + 1];
+
+  prefetch_window(probes, starts, bf, n, shas);
+
+  byte* vector = bvector(bf);
+
+  if(atomic) {
+    const size_t size = bvector_size(bf);
+    word_set_t ws;
+    ws.n = 0;
+
+    for(size_t j = 0; j < starts[n]; j ++) {
+      set_bit_atomically(&ws, vector, size, probes[j]);
+    }
+
+    flush_words(&ws);
+  } else {
+    for(size_t j = 0; j < starts[n]; j ++) {
+      vector[probes[j] / 8] |= 1 << (probes[j] % 8);
+    }
+  }
+
+  /* Kept out of the loop above, so as not to slow down untracked filters */
+  if(bf->tracker != NULL) {
+    for(size_t j = 0; j < starts[n]; j ++) {
+      mark_dirty(bf, (vector - bf->buffer) + probes[j] / 8);
+    }
+  }
+
+  STATS_ADD(bf, n_inserts, n);
+}
+
+/* If n_probes is non-NULL, the number of bits tested is added to it */
+static inline void query_sha1_window(const bloom_filter* bf, size_t n, const byte* shas, int* results,
+                                     size_t* n_probes) {
+  size_t probes[BATCH_WINDOW_PROBES];
+  size_t starts[BATCH_WINDOW_SHAS + 1];
+
+  prefetch_window(probes, starts, bf, n, shas);
+
+  const byte* vector = bvector(bf);
+
+  for(size_t i = 0; i < n; i ++) {
+    results[i] = 1;
+
+    size_t j = starts[i];
+
+    for(; j < starts[i + 1]; j ++) {
+      if(!test_bit(vector, probes[j])) {
+        results[i] = 0;
+        j ++;
+        break;
+      }
+    }
+
+    if(n_probes != NULL) {
+      (*n_probes) += j - starts[i];
+    }
+  }
+}
+
+/* Given a layout, hash family, n_hash_functions, log2_bits and the number of bits,
+ * determine whether the parameters are valid, returning HIBP_E_INVAL, HIBP_E_2BIG, or
+ * HIBP_OK. buffer_size is populated with the total size to allocate for the Bloom filter's
+ * buffer, if indeed the parameters were valid. bits is ordinarily pow2_bits(log2_bits)
+ * (0 if that's too big), and must otherwise be such that log2_bits = ceil_log2(bits) */
+static inline status compute_buffer_size(size_t* buffer_size, hibp_layout_t layout, hibp_hashing_t hashing,
+                                         size_t n_hash_functions, size_t log2_bits, size_t bits) {
+  if(n_hash_functions == 0) {
+    return HIBP_E_INVAL;
+  }
+
+  if(layout != HIBP_LAYOUT_STANDARD && layout != HIBP_LAYOUT_BLOCKED) {
+    return HIBP_E_INVAL;
+  }
+
+  if(hashing != HIBP_HASHING_RANDOM && hashing != HIBP_HASHING_DOUBLE) {
+    return HIBP_E_INVAL;
+  }
+
+  /* A blocked filter needs at least one whole block, and at least one hash function to
+   * select a bit within the block */
+  if(layout == HIBP_LAYOUT_BLOCKED && (log2_bits < LOG2_BLOCK_BITS || n_hash_functions < 2)) {
+    return HIBP_E_INVAL;
+  }
+
+  if(log2_bits > LOG2_BITS_MAX || n_hash_functions > N_HASH_FUNCTIONS_MAX) {
+    return HIBP_E_2BIG;
+  }
+
+  if(bits == 0) {
+    return (log2_bits >= SIZE_BITS) ? HIBP_E_2BIG : HIBP_E_INVAL;
+  }
+
+  /* In the blocked layout, only whole blocks */
+  if(ceil_log2(bits) != log2_bits || (layout == HIBP_LAYOUT_BLOCKED && bits % (((size_t)1) << LOG2_BLOCK_BITS) != 0)) {
+    return HIBP_E_INVAL;
+  }
+
+  /* First, check if the hash functions by themselves already exceed SIZE_MAX */
+  if(layout == HIBP_LAYOUT_BLOCKED) {
+    if(n_hash_functions - 1 > (SIZE_MAX - (log2_bits - LOG2_BLOCK_BITS)) / LOG2_BLOCK_BITS) {
+      return HIBP_E_2BIG;
+    }
+  } else if(log2_bits > SIZE_MAX / n_hash_functions) {
+    return HIBP_E_2BIG;
+  }
+
+  /* Won't overflow */
+  const size_t hash_functions_size = hash_function_offset(layout, hashing, log2_bits, n_hash_functions);
+
+  /* Can't do (bits + 7) / 8 because the addition might overflow */
+  const size_t vector_size = (bits / 8) + (bits % 8 != 0);
+
+  if(hash_functions_size > SIZE_MAX - vector_size) {
+    return HIBP_E_2BIG;
+  }
+
+  *buffer_size = hash_functions_size + vector_size;
+
+  return HIBP_OK;
+}
+
+/* Number of padding bytes between a header of header_size bytes and the buffer of a
+ * filter with the given parameters, in the aligned and chunked formats */
+static inline size_t aligned_padding_size(size_t header_size, hibp_layout_t layout, hibp_hashing_t hashing,
+                                          size_t n_hash_functions, size_t log2_bits) {
+  const size_t hash_functions_size = hash_function_offset(layout, hashing, log2_bits, n_hash_functions);
+  const size_t unaligned = (header_size % ALIGNMENT + hash_functions_size % ALIGNMENT) % ALIGNMENT;
+  return (ALIGNMENT - unaligned) % ALIGNMENT;
+}
+
+
+/* Plumbing for hibp_bf_load_stream */
+static inline int my_read(byte* buffer, size_t size, void* ctx, getc_t getc) {
+  for(size_t i = 0; i < size; i ++) {
+    int c = getc(ctx);
+
+    if(c == EOF) {
+      return -1;
+    }
+
+    buffer[i] = (byte)c;
+  }
+
+  return 0;
+}
+
+/* Plumbing for hibp_bf_save_stream */
+static inline int my_write(const byte* buffer, size_t size, void* ctx, putc_t putc) {
+  for(size_t i = 0; i < size; i ++) {
+    if(putc(buffer[i], ctx) == EOF) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* Given an 8-byte buffer encoding a little-endian unsigned integer, populate a size_t
+ * with the value. Return -1 if the value does not fit into a size_t. Plumbing for
+ * hipb_bf_load_* */
+static inline int le_8_bytes_to_size_t(size_t* size, const byte* buffer) {
+  if(sizeof(size_t) < 8) {
+    for(size_t i = sizeof(size_t); i < 8; i ++) {
+      if(buffer[i] != 0) {
+        return -1;
+      }
+    }
+  }
+
+  (*size) = 0;
+
+  for(size_t i = 0; i < sizeof(size_t); i ++) {
+    (*size) |= (((size_t)buffer[i]) << (i * 8));
+  }
+
+  return 0;
+}
+
+/* Given a size_t, encode it as 8 bytes in little-endian order. Plumbing for
+ * hipb_bf_save_* */
+static inline void size_t_to_le_8_bytes(byte* buffer, size_t size) {
+  for(size_t i = 0; i < 8; i ++) {
+    buffer[i] = (size & 0xff);
+    size >>= 8;
+  }
+
+  /* We should never be attempting to apply this function to a size_t
+   * greater than 2**64 - 1 */
+  assert(size == 0);
+}
+
+static inline void sha1(byte* sha, size_t size, const byte* buffer) {
+  /* Strictly speaking, the contract of SHA1 (and SHA1_Init) dictates that it can
+   * fail, but i) having audited the source, it cannot do so in practice in the current
+   * implementation; ii) it's hard to imagine a world where it could */
+  const int okay = (SHA1(buffer, size, sha) != NULL);
+  (void)okay;
+  assert(okay);
+}
+
+/* == Chunked checksums == */
+
+static inline size_t digest_size(int algorithm) {
+  return (algorithm == CHECKSUM_SHA1) ? SHA1_BYTES : 4;
+}
+
+/* Number of chunks of 2**log2_chunk_size bytes needed to cover buffer_size bytes */
+static inline size_t count_chunks(size_t buffer_size, size_t log2_chunk_size) {
+  const size_t chunk_size = ((size_t)1) << log2_chunk_size;
+  return (buffer_size >> log2_chunk_size) + ((buffer_size & (chunk_size - 1)) != 0);
+}
+
+/* Given the on-disk checksum algorithm and log2_chunk_size of a chunked file, and the size
+ * of its buffer, validate the former and compute the size of the digests that follow.
+ * Returns HIBP_E_INVAL or HIBP_OK */
+static inline status compute_digests_size(size_t* digests_size, int algorithm, size_t log2_chunk_size,
+                                          size_t buffer_size) {
+  if(algorithm != CHECKSUM_CRC32C && algorithm != CHECKSUM_SHA1) {
+    return HIBP_E_INVAL;
+  }
+
+  if(log2_chunk_size < LOG2_CHUNK_SIZE_MIN || log2_chunk_size > LOG2_CHUNK_SIZE_MAX) {
+    return HIBP_E_INVAL;
+  }
+
+  /* Chunks are at least 4 KiB, so this can't overflow */
+  *digests_size = count_chunks(buffer_size, log2_chunk_size) * digest_size(algorithm);
+
+  return HIBP_OK;
+}
+
+static void compute_digest(byte* digest, int algorithm, size_t size, const byte* buffer) {
+  if(algorithm == CHECKSUM_SHA1) {
+    sha1(digest, size, buffer);
+    return;
+  }
+
+  assert(algorithm == CHECKSUM_CRC32C);
+
+  const uint32_t crc = hibp_crc32c(0, buffer, size);
+
+  for(size_t i = 0; i < 4; i ++) {
+    digest[i] = (crc >> (8 * i)) & 0xff;
+  }
+}
+
+/* Plumbing for compute_digests and check_digests */
+typedef struct {
+  int algorithm;
+  size_t chunk_size;
+  size_t n_chunks;
+  const byte* buffer;
+  size_t buffer_size;
+
+  /* For compute_digests, where to write the digests; for check_digests, the stored
+   * digests */
+  byte* digests;
+
+  /* For check_digests, the CHUNK_* state of each chunk */
+  byte* states;
+} digest_job_t;
+
+static inline size_t nth_chunk_size(const digest_job_t* job, size_t i) {
+  return MIN(job->chunk_size, job->buffer_size - i * job->chunk_size);
+}
+
+static void compute_nth_digest(void* ctx, size_t i) {
+  const digest_job_t* job = (const digest_job_t*)ctx;
+
+  compute_digest(
+    job->digests + i * digest_size(job->algorithm),
+    job->algorithm,
+    nth_chunk_size(job, i),
+    job->buffer + i * job->chunk_size
+  );
+}
+
+/* Verify the i'th chunk if it hasn't been already, and update its state */
+static void check_nth_digest(void* ctx, size_t i) {
+  const digest_job_t* job = (const digest_job_t*)ctx;
+
+  if(__atomic_load_n(&job->states[i], __ATOMIC_ACQUIRE) != CHUNK_UNVERIFIED) {
+    return;
+  }
+
+  const size_t size = digest_size(job->algorithm);
+
+  byte computed[SHA1_BYTES];
+  compute_digest(computed, job->algorithm, nth_chunk_size(job, i), job->buffer + i * job->chunk_size);
+
+  const int ok = (memcmp(computed, job->digests + i * size, size) == 0);
+  __atomic_store_n(&job->states[i], (ok ? CHUNK_OK : CHUNK_CORRUPT), __ATOMIC_RELEASE);
+}
+
+/* Compute the digest of every chunk of buffer, using every available CPU */
+static void compute_digests(byte* digests, int algorithm, size_t chunk_size, size_t n_chunks,
+                            const byte* buffer, size_t buffer_size) {
+  digest_job_t job = { algorithm, chunk_size, n_chunks, buffer, buffer_size, digests, NULL };
+  hibp_parallel_for(n_chunks, 0, compute_nth_digest, &job);
+}
+
+/* Verify every chunk of buffer whose state is CHUNK_UNVERIFIED against the stored
+ * digests, using every available CPU. If states is NULL, every chunk is verified.
+ * Returns HIBP_E_CHECKSUM if any chunk is (or was already known to be) corrupt,
+ * HIBP_E_NOMEM if we ran out of memory, and HIBP_OK otherwise */
+static status check_digests(const byte* digests, int algorithm, size_t chunk_size, size_t n_chunks,
+                            const byte* buffer, size_t buffer_size, byte* states) {
+  byte* my_states = NULL;
+
+  if(states == NULL) {
+    my_states = (byte*)calloc(n_chunks, 1);
+
+    if(my_states == NULL) {
+      return HIBP_E_NOMEM;
+    }
+
+    states = my_states;
+  }
+
+  digest_job_t job = { algorithm, chunk_size, n_chunks, buffer, buffer_size, (byte*)digests, states };
+  hibp_parallel_for(n_chunks, 0, check_nth_digest, &job);
+
+  status st = HIBP_OK;
+
+  for(size_t i = 0; i < n_chunks; i ++) {
+    if(__atomic_load_n(&states[i], __ATOMIC_ACQUIRE) == CHUNK_CORRUPT) {
+      st = HIBP_E_CHECKSUM;
+      break;
+    }
+  }
+
+  free(my_states);
+
+  return st;
+}
+
+/* Before accessing the byte at offset within the buffer of a lazily-verified filter, make
+ * sure that the chunk containing it has been verified. Returns 0 if it's corrupt */
+static int verify_lazily(const bloom_filter* bf, struct hibp_verifier_st* v, size_t offset) {
+  const size_t chunk = (v->n_chunks == 1) ? 0 : offset / v->chunk_size;
+  const byte state = __atomic_load_n(&v->states[chunk], __ATOMIC_ACQUIRE);
+
+  if(state != CHUNK_UNVERIFIED) {
+    return state == CHUNK_OK;
+  }
+
+  size_t buffer_size;
+  const status st = compute_buffer_size(&buffer_size, bf->layout, bf->hashing, bf->n_hash_functions, bf->log2_bits, bf->bits);
+  (void)st;
+  assert(st == HIBP_OK);
+
+  digest_job_t job = { v->algorithm, v->chunk_size, v->n_chunks, bf->buffer, buffer_size,
+                       (byte*)v->digests, v->states };
+
+  const uint64_t start = STATS_CLOCK();
+  check_nth_digest(&job, chunk);
+  STATS_ADD(bf, verify_ns, STATS_CLOCK() - start);
+
+  return __atomic_load_n(&v->states[chunk], __ATOMIC_ACQUIRE) == CHUNK_OK;
+}
+
+/* Returns a pseudo-random number (nominally) uniformly distributed on [0, SIZE_MAX].
+ * If *use_openssl, try OpenSSL's RAND_pseudo_bytes first (setting *use_openssl = 0
+ * if it fails). Use stdlib's rand if the initial call to RAND_pseudo_bytes fails, or
+ * if *use_openssl was zero in the first place */
+static inline size_t my_rand(int* use_openssl) {
+  size_t number;
+
+  if(*use_openssl) {
+    number = 0; /* Prevent a spurious valgrind error */
+    *use_openssl = (RAND_pseudo_bytes((byte*)&number, sizeof(size_t)) != -1);
+  }
+
+  if(!*use_openssl) {
+    number = 0;
+
+    /* This deliberately clobbers previously-written bits. I don't know if that's
+     * actually useful, but YOLO */
+    for(size_t i = 0; i < sizeof(size_t); i ++) {
+      number = ((number << 8) | (size_t)rand());
+    }
+  }
+
+  return number;
+}
+
+/* Default prng for hibp_bf_new */
+static size_t default_prng(void* ctx, size_t upper_bound) {
+  (void)ctx;
+  assert(upper_bound > 0);
+
+  /* Flag indicating whether to attempt to use the OpenSSL PRNG. If and when the OpenSSL
+   * PRNG fails, my_rand will set the flag to zero and all subsequent RNG will be done
+   * with sdtlib's rand */
+  int use_openssl = 1;
+
+  if(upper_bound == SIZE_MAX) {
+    return my_rand(&use_openssl);
+  }
+
+  /* Because SIZE_MAX isn't necessarily divisible by upper_bound, my_rand(use_openssl) %
+   * upper_bound isn't necessarily uniformly distributed (there's potentially a slight
+   * bias to lower numbers). We can rectify this by discarding the highest numbers from
+   * the range of my_rand */
+
+  /* This is just a rounding down to the nearest multiple of upper_bound */
+  const size_t limit = SIZE_MAX / upper_bound * upper_bound;
+
+  size_t number;
+
+  /* Find some random number uniformly distributed on [0, limit) */
+  do {
+    number = my_rand(&use_openssl);
+  } while(number >= limit);
+
+  /* Since [0, limit) has cardinality that is a multiple of upper_bound, and since number
+   * is uniformly distributed on that range, number % upper_bound is uniformly
+   * distributed on [0, upper_bound) */
+  return number % upper_bound;
+}
+
+static inline size_t min(size_t x, size_t y) {
+  return (x <= y) ? x : y;
+}
+
+/* In the blocked layout, each block is essentially a tiny standard Bloom filter of
+ * 2**LOG2_BLOCK_BITS bits, and the number of elements landing in any particular block is
+ * binomially (~ Poisson) distributed with mean count / n_blocks. The false positive rate
+ * of the whole filter is then the expected false positive rate of a block, weighted by
+ * that distribution. This is worse than the false positive rate of a standard filter of
+ * the same size, because of the few blocks that end up overloaded.
+ * Per Putze, Sanders, and Singler ("Cache-, Hash- and Space-Efficient Bloom Filters"),
+ * with n_probes being the number of bit-selecting hash functions */
+static double blocked_false_positive_rate(double n_blocks, size_t n_probes, size_t count) {
+  const double block_bits = pow(2, LOG2_BLOCK_BITS);
+  const double lambda = count / n_blocks;
+
+  /* Sum over all plausible block loads; the terms outside lambda +/- 10 standard
+   * deviations are vanishingly small */
+  const double spread = 10 * sqrt(lambda) + 10;
+  const double lowest = (lambda > spread) ? floor(lambda - spread) : 0;
+  const double highest = ceil(lambda + spread);
+
+  double rate = 0;
+
+  for(double i = lowest; i <= highest; i ++) {
+    const double log_poisson = -lambda + i * log(lambda) - lgamma(i + 1);
+    const double block_rate = pow(1 - pow(1 - 1 / block_bits, n_probes * i), n_probes);
+    rate += exp(log_poisson) * block_rate;
+  }
+
+  return rate;
+}
+
+/* Beyond this many bits per block there's nothing to be gained from additional hash
+ * functions for any sane false positive rate */
+#define BLOCKED_N_PROBES_MAX 32
+
+/* Given the number of blocks and count, pick the number of bit-selecting hash functions
+ * that minimizes the false positive rate of a blocked filter, returning that rate */
+static double best_blocked_n_probes(size_t* n_probes, double n_blocks, size_t count) {
+  double best_rate = 2;
+
+  for(size_t candidate = 1; candidate <= BLOCKED_N_PROBES_MAX; candidate ++) {
+    const double rate = blocked_false_positive_rate(n_blocks, candidate, count);
+
+    if(rate < best_rate) {
+      best_rate = rate;
+      *n_probes = candidate;
+    }
+  }
+
+  return best_rate;
+}
+
+/* ================================================================
+ * Public API
+ * ================================================================ */
+
+/* FIXME */
+void hibp_bf_get_info(hibp_filter_info_t* info, const hibp_bloom_filter_t* bf) {
+  size_t buffer_size;
+  compute_buffer_size(&buffer_size, bf->layout, bf->hashing, bf->n_hash_functions, bf->log2_bits, bf->bits);
+
+  info->layout = bf->layout;
+  info->hashing = bf->hashing;
+  info->n_hash_functions = bf->n_hash_functions;
+  info->log2_bits = bf->log2_bits;
+  info->bits = bf->bits;
+  info->memory = sizeof(*bf) + buffer_size + compiled_size(bf->compiled, bf->n_hash_functions);
+}
+
+/* FIXME, part 2: electric boogaloo */
+size_t hibp_compute_total_size(size_t n_hash_functions, size_t log2_bits) {
+  return hibp_compute_total_size_layout(HIBP_LAYOUT_STANDARD, n_hash_functions, log2_bits);
+}
+
+size_t hibp_compute_total_size_layout(hibp_layout_t layout, size_t n_hash_functions, size_t log2_bits) {
+  return hibp_compute_total_size_hashing(layout, HIBP_HASHING_RANDOM, n_hash_functions, log2_bits);
+}
+
+size_t hibp_compute_total_size_hashing(hibp_layout_t layout, hibp_hashing_t hashing,
+                                       size_t n_hash_functions, size_t log2_bits) {
+  size_t buffer_size;
+
+  if(compute_buffer_size(&buffer_size, layout, hashing, n_hash_functions, log2_bits, pow2_bits(log2_bits)) != HIBP_OK) {
+    return SIZE_MAX;
+  }
+
+  return buffer_size + sizeof(hibp_bloom_filter_t);
+}
+
+size_t hibp_compute_total_size_bits(hibp_layout_t layout, hibp_hashing_t hashing,
+                                    size_t n_hash_functions, size_t bits) {
+  size_t buffer_size;
+
+  if(compute_buffer_size(&buffer_size, layout, hashing, n_hash_functions, ceil_log2(bits), bits) != HIBP_OK) {
+    return SIZE_MAX;
+  }
+
+  return buffer_size + sizeof(hibp_bloom_filter_t);
+}
+
+/* == Utilities == */
+
+void hibp_compute_optimal_params(size_t* n_hash_functions, size_t* log2_bits, size_t count, double fp) {
+  /* From Wikipedia:
+   * ... The optimal number of bits per element is -1.44 log_2 p
+   * ... with the corresponding number of hash functions ... - log_2 p */
+
+  const double eps = 1e-8;
+  const double ln_of_2 = log(2);
+  const double log2_of_fp = log(fp + eps) / ln_of_2;
+
+  const double bits_per_elem = -1 * 1.44 * log2_of_fp;
+  const double bits = bits_per_elem * count;
+  const double double_log2_bits = ceil(log(bits) / ln_of_2 + eps);
+
+  const double double_n_hash_functions = ceil(-1 * log2_of_fp);
+
+  if(double_n_hash_functions > N_HASH_FUNCTIONS_MAX) {
+    *n_hash_functions = N_HASH_FUNCTIONS_MAX;
+  } else {
+    *n_hash_functions = (size_t)double_n_hash_functions;
+  }
+
+  if(double_log2_bits > LOG2_BITS_MAX) {
+    *log2_bits = LOG2_BITS_MAX;
+  } else {
+    *log2_bits = (size_t)double_log2_bits;
   }
 }
 
@@ -315,233 +1433,5732 @@ void hibp_compute_constrained_params(size_t* n_hash_functions, size_t* log2_bits
   /* We could do something highly intelligent here with a binary search or some such, but
    * given that we only have to iterate over < 40 values let's not bother */
 
-  /* In any practical application the memory consumed by the bit vector is going to be
-   * much greater than the memory consumed by the hash functions, so let's just tune that
-   * knob. Iterate over possible values of log2_bits, selecting at each iteration the
-   * optimal number of hash functions to minimize false positives; compute the size of the
-   * requisite buffer, and select the largest value log2_bits that is within the constraint.
-   * At minimum, set log2_bits to 8 (even if that doesn't satisfy the constriant) */
+  /* In any practical application the memory consumed by the bit vector is going to be
+   * much greater than the memory consumed by the hash functions, so let's just tune that
+   * knob. Iterate over possible values of log2_bits, selecting at each iteration the
+   * optimal number of hash functions to minimize false positives; compute the size of the
+   * requisite buffer, and select the largest value log2_bits that is within the constraint.
+   * At minimum, set log2_bits to 8 (even if that doesn't satisfy the constriant) */
+
+  const double ln_of_2 = log(2);
+  const double eps = 1e-6;
+
+  for(size_t candidate_log2_bits = 8;; candidate_log2_bits ++) {
+    /* From Wikipedia:
+     * ... for a given m and n, the value of k that minimizes the false positive probability is
+     * k = m / n * ln 2
+     * k is the number of hash functions, m is the number of bits, n is the number of elements */
+
+    const double bits = pow(2, candidate_log2_bits);
+    const double double_candidate_n_hash_functions = ceil(bits / count * ln_of_2 + eps);
+
+    size_t candidate_n_hash_functions = (double_candidate_n_hash_functions > N_HASH_FUNCTIONS_MAX)
+      ? N_HASH_FUNCTIONS_MAX
+      : double_candidate_n_hash_functions;
+
+    size_t buffer_size;
+
+    if(compute_buffer_size(&buffer_size, HIBP_LAYOUT_STANDARD, HIBP_HASHING_RANDOM, candidate_n_hash_functions,
+                           candidate_log2_bits, pow2_bits(candidate_log2_bits)) != HIBP_OK) {
+      buffer_size = SIZE_MAX;
+    }
+
+    if(buffer_size > max_memory && candidate_log2_bits > 8) {
+      break;
+    }
+
+    *n_hash_functions = candidate_n_hash_functions;
+    *log2_bits = candidate_log2_bits;
+  }
+}
+
+void hibp_compute_optimal_blocked_params(size_t* n_hash_functions, size_t* log2_bits, size_t count, double fp) {
+  /* There's no closed form for the blocked layout, so search upwards from the optimal
+   * size for the standard layout (which is a lower bound), stopping at the first size
+   * for which some number of hash functions satisfies fp */
+
+  size_t standard_n_hash_functions;
+  size_t candidate_log2_bits;
+
+  hibp_compute_optimal_params(&standard_n_hash_functions, &candidate_log2_bits, count, fp);
+
+  if(candidate_log2_bits < LOG2_BLOCK_BITS) {
+    candidate_log2_bits = LOG2_BLOCK_BITS;
+  }
+
+  for(;; candidate_log2_bits ++) {
+    size_t n_probes = 1;
+    const double rate = best_blocked_n_probes(&n_probes, pow(2, candidate_log2_bits - LOG2_BLOCK_BITS), count);
+
+    /* One extra hash function to select the block */
+    *n_hash_functions = n_probes + 1;
+    *log2_bits = candidate_log2_bits;
+
+    if(rate <= fp || candidate_log2_bits >= LOG2_BITS_MAX) {
+      break;
+    }
+  }
+}
+
+void hibp_compute_constrained_blocked_params(size_t* n_hash_functions, size_t* log2_bits, size_t count, size_t max_memory) {
+  /* Same approach as hibp_compute_constrained_params: pick the largest log2_bits that
+   * fits (but at least one block), then the best number of hash functions for that size.
+   * The hash functions of a blocked filter are tiny, so it suffices to size them for the
+   * worst case */
+
+  size_t candidate_log2_bits = LOG2_BLOCK_BITS;
+
+  while(candidate_log2_bits < LOG2_BITS_MAX) {
+    const size_t memory = hibp_compute_total_size_layout(
+      HIBP_LAYOUT_BLOCKED,
+      BLOCKED_N_PROBES_MAX + 1,
+      candidate_log2_bits + 1
+    );
+
+    if(memory > max_memory) {
+      break;
+    }
+
+    candidate_log2_bits ++;
+  }
+
+  size_t n_probes = 1;
+  best_blocked_n_probes(&n_probes, pow(2, candidate_log2_bits - LOG2_BLOCK_BITS), count);
+
+  *n_hash_functions = n_probes + 1;
+  *log2_bits = candidate_log2_bits;
+}
+
+/* The optimal number of hash functions for a standard filter of the given size, per
+ * hibp_compute_constrained_params */
+static size_t optimal_n_hash_functions(size_t bits, size_t count) {
+  const double double_n_hash_functions = ceil((double)bits / count * log(2) + 1e-6);
+
+  return (double_n_hash_functions > N_HASH_FUNCTIONS_MAX)
+    ? N_HASH_FUNCTIONS_MAX
+    : (size_t)double_n_hash_functions;
+}
+
+void hibp_compute_optimal_bits(hibp_layout_t layout, size_t* n_hash_functions, size_t* bits,
+                               size_t count, double fp) {
+  /* As for hibp_compute_optimal_params, but without rounding the number of bits up to a
+   * power of 2 */
+
+  const double eps = 1e-8;
+  const double log2_of_fp = log(fp + eps) / log(2);
+  const double double_bits = ceil(-1 * 1.44 * log2_of_fp * count);
+  const double double_n_hash_functions = ceil(-1 * log2_of_fp);
+
+  *n_hash_functions = (double_n_hash_functions > N_HASH_FUNCTIONS_MAX)
+    ? N_HASH_FUNCTIONS_MAX
+    : (size_t)double_n_hash_functions;
+
+  if(double_bits >= (double)SIZE_MAX) {
+    *bits = SIZE_MAX;
+  } else {
+    *bits = (double_bits < 1) ? 1 : (size_t)double_bits;
+  }
+
+  if(layout != HIBP_LAYOUT_BLOCKED) {
+    return;
+  }
+
+  /* For the blocked layout, the standard size is a lower bound (as for
+   * hibp_compute_optimal_blocked_params). Find an upper bound by doubling, and then the
+   * fewest blocks that satisfy fp by bisection */
+
+  const size_t block_bits = ((size_t)1) << LOG2_BLOCK_BITS;
+  const size_t n_blocks_max = SIZE_MAX / block_bits;
+
+  size_t n_probes = 1;
+  size_t lo = MIN(MAX(*bits / block_bits, 1), n_blocks_max);
+  size_t hi = lo;
+
+  while(best_blocked_n_probes(&n_probes, hi, count) > fp && hi < n_blocks_max) {
+    lo = hi + 1;
+    hi = (hi > n_blocks_max / 2) ? n_blocks_max : 2 * hi;
+  }
+
+  while(lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+
+    if(best_blocked_n_probes(&n_probes, mid, count) <= fp) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+
+  best_blocked_n_probes(&n_probes, hi, count);
+
+  /* One extra hash function to select the block */
+  *n_hash_functions = n_probes + 1;
+  *bits = hi * block_bits;
+}
+
+void hibp_compute_constrained_bits(hibp_layout_t layout, size_t* n_hash_functions, size_t* bits,
+                                   size_t count, size_t max_memory) {
+  /* As for hibp_compute_constrained_params (respectively the blocked variant), but finding
+   * the largest number of bits (respectively blocks) that fits by bisection. Memory
+   * consumption only grows with the number of bits, hash functions included. At minimum,
+   * pick 2**8 bits (respectively one block) */
+
+  const int blocked = (layout == HIBP_LAYOUT_BLOCKED);
+  const size_t unit = blocked ? (((size_t)1) << LOG2_BLOCK_BITS) : 1;
+
+  size_t lo = blocked ? 1 : 256;
+  size_t hi = MAX(lo, MIN(max_memory, SIZE_MAX / 8) * 8 / unit);
+
+  while(lo < hi) {
+    const size_t mid = hi - (hi - lo) / 2;
+
+    const size_t memory = blocked
+      ? hibp_compute_total_size_bits(layout, HIBP_HASHING_RANDOM, BLOCKED_N_PROBES_MAX + 1, mid * unit)
+      : hibp_compute_total_size_bits(layout, HIBP_HASHING_RANDOM, optimal_n_hash_functions(mid, count), mid);
+
+    if(memory <= max_memory) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+
+  *bits = lo * unit;
+
+  if(blocked) {
+    size_t n_probes = 1;
+    best_blocked_n_probes(&n_probes, lo, count);
+    *n_hash_functions = n_probes + 1;
+  } else {
+    *n_hash_functions = optimal_n_hash_functions(lo, count);
+  }
+}
+
+status hibp_sha1_hex2bin(byte* bin, const char* hex) {
+  for(int i = 0; i < 20; i ++) {
+    bin[i] = 0;
+
+    for(int k = i; k <= i + 1; k ++) {
+      bin[i] <<= 4;
+
+      if('0' <= hex[k] && hex[k] <= '9') {
+        bin[i] |= (hex[k] - '0');
+      } else if('a' <= hex[k] && hex[k] <= 'f') {
+        bin[i] |= (0xa + hex[k] - 'a');
+      } else if('A' <= hex[k] && hex[k] <= 'F') {
+        bin[i] |= (0xa + hex[k] - 'A');
+      } else {
+        return HIBP_E_INVAL;
+      }
+    }
+  }
+
+  return HIBP_OK;
+}
+
+/* Release the mapping and verifier of a filter loaded with hibp_bf_map_file */
+static void unmap(bloom_filter* bf) {
+  if(bf->verifier != NULL) {
+    free(bf->verifier->states);
+    free(bf->verifier);
+  }
+
+  munmap(bf->mapping, bf->mapping_size);
+}
+
+/* == Lifecyle == */
+
+/* Allocate size bytes for the buffer of bf as directed by allocator (the heap, if NULL),
+ * recording how in bf->allocation. Unless zero is nonzero, a heap allocation isn't zeroed;
+ * the others always are */
+static status alloc_buffer(bloom_filter* bf, size_t size, const allocator_t* allocator, int zero) {
+  bf->allocation = NULL;
+
+  if(allocator == NULL || (allocator->alloc == NULL && allocator->flags == 0)) {
+    /* calloc to save us memsetting the bit vector. On some systems it's actually faster */
+    bf->buffer = (byte*)(zero ? calloc(size, 1) : malloc(size));
+    return (bf->buffer == NULL) ? HIBP_E_NOMEM : HIBP_OK;
+  }
+
+  /* Otherwise free_buffer would hand the user's buffer to hibp_free_pages */
+  if(allocator->alloc != NULL && allocator->free == NULL) {
+    return HIBP_E_INVAL;
+  }
+
+  struct hibp_allocation_st* a = (struct hibp_allocation_st*)malloc(sizeof(struct hibp_allocation_st));
+
+  if(a == NULL) {
+    return HIBP_E_NOMEM;
+  }
+
+  if(allocator->alloc != NULL) {
+    a->free = allocator->free;
+    a->ctx = allocator->ctx;
+    a->size = size;
+    bf->buffer = (byte*)allocator->alloc(allocator->ctx, size);
+  } else {
+    a->free = NULL;
+    a->ctx = NULL;
+    bf->buffer = (byte*)hibp_alloc_pages(&a->size, size, allocator->flags, allocator->node);
+  }
+
+  if(bf->buffer == NULL) {
+    const status st = (allocator->alloc == NULL && errno == EINVAL) ? HIBP_E_INVAL : HIBP_E_NOMEM;
+    free(a);
+    return st;
+  }
+
+  bf->allocation = a;
+
+  return HIBP_OK;
+}
+
+/* Release the buffer of a filter that wasn't mapped from a file, however it was allocated */
+static void free_buffer(bloom_filter* bf) {
+  struct hibp_allocation_st* a = bf->allocation;
+
+  if(a == NULL) {
+    free(bf->buffer);
+    return;
+  }
+
+  if(a->free != NULL) {
+    a->free(a->ctx, bf->buffer, a->size);
+  } else {
+    hibp_free_pages(bf->buffer, a->size);
+  }
+
+  free(a);
+}
+
+/* Bit indices are numbered from the least significant bit of each byte of the SHA1, but
+ * the prefix of a SHA1 (as written in hexadecimal) runs from the most significant bit of
+ * its first byte. Is the index'th bit among the first prefix_bits bits of the prefix? */
+static inline int in_prefix(size_t index, size_t prefix_bits) {
+  return 8 * (index / 8) + (7 - index % 8) < prefix_bits;
+}
+
+/* Common implementation of hibp_bf_new* and hibp_sf_new*. The hash functions never draw on
+ * the first prefix_bits bits of the SHA1; these are constant across a shard of a sharded
+ * filter, and so are worthless within it. Double hashing has nothing to generate, and so
+ * ignores prng */
+static status new_prng(bloom_filter* bf, hibp_layout_t layout, hibp_hashing_t hashing,
+                       size_t n_hash_functions, size_t log2_bits, size_t bits, void* ctx,
+                       prng_t prng, size_t prefix_bits, const allocator_t* allocator) {
+  size_t buffer_size;
+  const status st = compute_buffer_size(&buffer_size, layout, hashing, n_hash_functions, log2_bits, bits);
+
+  if(st != HIBP_OK) {
+    return st;
+  }
+
+  bf->layout = layout;
+  bf->hashing = hashing;
+  bf->n_hash_functions = n_hash_functions;
+  bf->log2_bits = log2_bits;
+  bf->bits = bits;
+  bf->mapping = NULL;
+  bf->mapping_size = 0;
+  bf->verifier = NULL;
+  bf->tracker = NULL;
+  bf->pager = NULL;
+  bf->concurrent = 0;
+  bf->stats = NULL;
+
+  const status ast = alloc_buffer(bf, buffer_size, allocator, 1);
+
+  if(ast != HIBP_OK) {
+    return ast;
+  }
+
+  byte* hash_functions = nth_hash_function(bf, 0);
+  const size_t hash_functions_size = bvector(bf) - hash_functions;
+
+  /* Intuitively, if we have a small number of hash functions, we probably don't want
+   * them all to include the same bits over and over again when there are other bits
+   * of the SHA1 hash that aren't covered by any hash function. We can satisfy this
+   * criteria by making sure that all SHA1_BITS bits are covered before we reuse any;
+   * this can be accomplished easily by selecting indices from a permutation until it's
+   * exhausted, and repeating with a new permutation untill all the indices of all the
+   * hash functions have been selected.
+   *
+   * As an added bonus, because we encode the hash functions in a single flat array
+   * we can just repeatedly generate and memcpy permutations without worrying about
+   * the dileneation between the different hash functions */
+
+  /* Initialize the permutation */
+  byte permutation[SHA1_BITS];
+  size_t n_indices = 0;
+
+  for(size_t i = 0; i < SHA1_BITS; i++) {
+    if(!in_prefix(i, prefix_bits)) {
+      permutation[n_indices ++] = i;
+    }
+  }
+
+  assert(n_indices > 0);
+
+  /* Repeatedly generate a permutation with the Fisher-Yates shuffle, and copy as many
+   * indices as necessary into hash_functions. We need hash_functions_size indices
+   * in total, and each iteration generates n_indices of them */
+
+  for(size_t generated = 0; generated < hash_functions_size; generated += n_indices) {
+    for(size_t i = n_indices - 1; i > 0; i --) {
+      const size_t j = prng(ctx, i + 1);
+
+      const byte swap = permutation[i];
+      permutation[i] = permutation[j];
+      permutation[j] = swap;
+    }
+
+    const size_t copy_size = min(hash_functions_size - generated, n_indices);
+    memcpy(hash_functions + generated, permutation, copy_size);
+  }
+
+  if(compile_hash_functions(bf) != HIBP_OK) {
+    free_buffer(bf);
+    return HIBP_E_NOMEM;
+  }
+
+  attach_stats(bf);
+
+  return HIBP_OK;
+}
+
+status hibp_bf_new(bloom_filter* bf, size_t n_hash_functions, size_t log2_bits) {
+  return new_prng(bf, HIBP_LAYOUT_STANDARD, HIBP_HASHING_RANDOM, n_hash_functions, log2_bits, pow2_bits(log2_bits), NULL, default_prng, 0, NULL);
+}
+
+status hibp_bf_new_prng(bloom_filter* bf, size_t n_hash_functions, size_t log2_bits, void* ctx, prng_t prng) {
+  return new_prng(bf, HIBP_LAYOUT_STANDARD, HIBP_HASHING_RANDOM, n_hash_functions, log2_bits, pow2_bits(log2_bits), ctx, prng, 0, NULL);
+}
+
+status hibp_bf_new_blocked(bloom_filter* bf, size_t n_hash_functions, size_t log2_bits) {
+  return new_prng(bf, HIBP_LAYOUT_BLOCKED, HIBP_HASHING_RANDOM, n_hash_functions, log2_bits, pow2_bits(log2_bits), NULL, default_prng, 0, NULL);
+}
+
+status hibp_bf_new_blocked_prng(bloom_filter* bf, size_t n_hash_functions, size_t log2_bits,
+                                void* ctx, prng_t prng) {
+  return new_prng(bf, HIBP_LAYOUT_BLOCKED, HIBP_HASHING_RANDOM, n_hash_functions, log2_bits, pow2_bits(log2_bits), ctx, prng, 0, NULL);
+}
+
+status hibp_bf_new_hashing(bloom_filter* bf, hibp_layout_t layout, hibp_hashing_t hashing,
+                           size_t n_hash_functions, size_t log2_bits) {
+  return new_prng(bf, layout, hashing, n_hash_functions, log2_bits, pow2_bits(log2_bits), NULL, default_prng, 0, NULL);
+}
+
+status hibp_bf_new_bits(bloom_filter* bf, hibp_layout_t layout, hibp_hashing_t hashing,
+                        size_t n_hash_functions, size_t bits) {
+  return new_prng(bf, layout, hashing, n_hash_functions, ceil_log2(bits), bits, NULL, default_prng, 0, NULL);
+}
+
+status hibp_bf_new_alloc(bloom_filter* bf, hibp_layout_t layout, hibp_hashing_t hashing,
+                         size_t n_hash_functions, size_t bits, const allocator_t* allocator) {
+  return new_prng(bf, layout, hashing, n_hash_functions, ceil_log2(bits), bits, NULL, default_prng, 0, allocator);
+}
+
+status hibp_bf_new_like(bloom_filter* dst, const bloom_filter* src) {
+  size_t buffer_size;
+  const status st = compute_buffer_size(&buffer_size, src->layout, src->hashing, src->n_hash_functions, src->log2_bits, src->bits);
+  (void)st;
+  assert(st == HIBP_OK);
+
+  dst->layout = src->layout;
+  dst->hashing = src->hashing;
+  dst->n_hash_functions = src->n_hash_functions;
+  dst->log2_bits = src->log2_bits;
+  dst->bits = src->bits;
+  dst->mapping = NULL;
+  dst->mapping_size = 0;
+  dst->verifier = NULL;
+  dst->tracker = NULL;
+  dst->pager = NULL;
+  dst->concurrent = 0;
+  dst->stats = NULL;
+
+  if(alloc_buffer(dst, buffer_size, NULL, 1) != HIBP_OK) {
+    return HIBP_E_NOMEM;
+  }
+
+  memcpy(dst->buffer, src->buffer, bvector(src) - src->buffer);
+
+  if(compile_hash_functions(dst) != HIBP_OK) {
+    free_buffer(dst);
+    return HIBP_E_NOMEM;
+  }
+
+  attach_stats(dst);
+
+  return HIBP_OK;
+}
+
+status hibp_bf_new_copy(bloom_filter* dst, const bloom_filter* src, const allocator_t* allocator) {
+  /* Unverified chunks would be copied blindly, and could never be verified thereafter */
+  if(lazy_verifier(src) != NULL) {
+    const status st = hibp_bf_verify(src);
+
+    if(st != HIBP_OK) {
+      return st;
+    }
+  }
+
+  size_t buffer_size;
+  const status st = compute_buffer_size(&buffer_size, src->layout, src->hashing, src->n_hash_functions, src->log2_bits, src->bits);
+  (void)st;
+  assert(st == HIBP_OK);
+
+  dst->layout = src->layout;
+  dst->hashing = src->hashing;
+  dst->n_hash_functions = src->n_hash_functions;
+  dst->log2_bits = src->log2_bits;
+  dst->bits = src->bits;
+  dst->mapping = NULL;
+  dst->mapping_size = 0;
+  dst->verifier = NULL;
+  dst->tracker = NULL;
+  dst->pager = NULL;
+  dst->concurrent = 0;
+  dst->stats = NULL;
+
+  const status ast = alloc_buffer(dst, buffer_size, allocator, 0);
+
+  if(ast != HIBP_OK) {
+    return ast;
+  }
+
+  memcpy(dst->buffer, src->buffer, buffer_size);
+
+  if(compile_hash_functions(dst) != HIBP_OK) {
+    free_buffer(dst);
+    return HIBP_E_NOMEM;
+  }
+
+  attach_stats(dst);
+
+  return HIBP_OK;
+}
+
+void hibp_bf_destroy(bloom_filter* bf) {
+  free_compiled(bf->compiled);
+
+  if(bf->tracker != NULL) {
+    free(bf->tracker->dirty);
+    free(bf->tracker);
+  }
+
+  free(bf->stats);
+
+  if(bf->pager != NULL) {
+    hibp_pager_destroy(bf->pager);
+  }
+
+  if(bf->mapping != NULL) {
+    unmap(bf);
+  } else {
+    free_buffer(bf);
+  }
+}
+
+/* == IO == */
+
+/* Everything is read and written in blocks through hibp_read_t and hibp_write_t;
+ * stdio files and the byte-at-a-time callbacks are adapted to that interface. These
+ * helpers retry short reads and writes, which are the norm for sockets and the like */
+
+static int read_fully(void* ctx, read_t read, void* buffer, size_t size) {
+  byte* position = (byte*)buffer;
+
+  while(size > 0) {
+    const size_t n = read(ctx, position, size);
+
+    if(n == 0) {
+      return -1;
+    }
+
+    assert(n <= size);
+
+    position += n;
+    size -= n;
+  }
+
+  return 0;
+}
+
+static int write_fully(void* ctx, write_t write, const void* buffer, size_t size) {
+  const byte* position = (const byte*)buffer;
+
+  while(size > 0) {
+    const size_t n = write(ctx, position, size);
+
+    if(n == 0) {
+      return -1;
+    }
+
+    assert(n <= size);
+
+    position += n;
+    size -= n;
+  }
+
+  return 0;
+}
+
+/* Returns the byte read, or EOF */
+static inline int read_byte(void* ctx, read_t read) {
+  byte b;
+  return (read_fully(ctx, read, &b, 1) == 0) ? b : EOF;
+}
+
+static inline int write_byte(void* ctx, write_t write, int c) {
+  const byte b = (byte)c;
+  return write_fully(ctx, write, &b, 1);
+}
+
+/* Padding is at most ALIGNMENT bytes, frequently most of it */
+static int skip_fully(void* ctx, read_t read, size_t size) {
+  byte discard[512];
+
+  while(size > 0) {
+    const size_t n = MIN(size, sizeof(discard));
+
+    if(read_fully(ctx, read, discard, n) != 0) {
+      return -1;
+    }
+
+    size -= n;
+  }
+
+  return 0;
+}
+
+static int write_zeros(void* ctx, write_t write, size_t size) {
+  static const byte zeros[512] = { 0 };
+
+  while(size > 0) {
+    const size_t n = MIN(size, sizeof(zeros));
+
+    if(write_fully(ctx, write, zeros, n) != 0) {
+      return -1;
+    }
+
+    size -= n;
+  }
+
+  return 0;
+}
+
+static size_t file_read(void* ctx, void* buffer, size_t size) {
+  return fread(buffer, 1, size, (FILE*)ctx);
+}
+
+static size_t file_write(void* ctx, const void* buffer, size_t size) {
+  return fwrite(buffer, 1, size, (FILE*)ctx);
+}
+
+typedef struct {
+  void* ctx;
+  getc_t getc;
+} getc_reader_t;
+
+static size_t getc_read(void* ctx, void* buffer, size_t size) {
+  const getc_reader_t* reader = (const getc_reader_t*)ctx;
+  byte* bytes = (byte*)buffer;
+
+  for(size_t i = 0; i < size; i ++) {
+    const int c = reader->getc(reader->ctx);
+
+    if(c == EOF) {
+      return i;
+    }
+
+    bytes[i] = (byte)c;
+  }
+
+  return size;
+}
+
+typedef struct {
+  void* ctx;
+  putc_t putc;
+} putc_writer_t;
+
+static size_t putc_write(void* ctx, const void* buffer, size_t size) {
+  const putc_writer_t* writer = (const putc_writer_t*)ctx;
+  const byte* bytes = (const byte*)buffer;
+
+  for(size_t i = 0; i < size; i ++) {
+    if(writer->putc(bytes[i], writer->ctx) == EOF) {
+      return i;
+    }
+  }
+
+  return size;
+}
+
+/* Plumbing for write_compressed and read_compressed, which (de)compress a batch of chunks
+ * of buffer at a time, starting with chunk first */
+typedef struct {
+  size_t chunk_size;
+  byte* buffer;
+  size_t buffer_size;
+  size_t first;
+
+  /* COMPRESSION_BATCH_SIZE slots of chunk_size bytes for compressed chunks */
+  byte* staging;
+
+  /* For each chunk of the batch, its stored size, CRC32C, and (for read_compressed) the
+   * status of decompressing and verifying it */
+  size_t sizes[COMPRESSION_BATCH_SIZE];
+  byte crcs[COMPRESSION_BATCH_SIZE][4];
+  status statuses[COMPRESSION_BATCH_SIZE];
+} compression_job_t;
+
+static inline size_t batch_chunk_size(const compression_job_t* job, size_t k) {
+  return MIN(job->chunk_size, job->buffer_size - (job->first + k) * job->chunk_size);
+}
+
+static void compress_nth_chunk(void* ctx, size_t k) {
+  compression_job_t* job = (compression_job_t*)ctx;
+
+  const byte* chunk = job->buffer + (job->first + k) * job->chunk_size;
+  const size_t size = batch_chunk_size(job, k);
+
+  compute_digest(job->crcs[k], CHECKSUM_CRC32C, size, chunk);
+
+  /* Chunks that don't shrink are stored verbatim */
+  const size_t compressed_size = hibp_lz4_compress(job->staging + k * job->chunk_size, size - 1, chunk, size);
+  job->sizes[k] = (compressed_size == 0) ? size : compressed_size;
+}
+
+static void decompress_nth_chunk(void* ctx, size_t k) {
+  compression_job_t* job = (compression_job_t*)ctx;
+
+  byte* chunk = job->buffer + (job->first + k) * job->chunk_size;
+  const size_t size = batch_chunk_size(job, k);
+
+  /* Verbatim chunks were read straight into the buffer */
+  if(job->sizes[k] != size &&
+     hibp_lz4_decompress(chunk, size, job->staging + k * job->chunk_size, job->sizes[k]) != 0) {
+    job->statuses[k] = HIBP_E_CHECKSUM;
+    return;
+  }
+
+  byte crc[4];
+  compute_digest(crc, CHECKSUM_CRC32C, size, chunk);
+
+  job->statuses[k] = (memcmp(crc, job->crcs[k], 4) == 0) ? HIBP_OK : HIBP_E_CHECKSUM;
+}
+
+/* Write the chunks of buffer (everything after log2_chunk_size in the compressed format),
+ * compressing a batch at a time on every available CPU */
+static status write_compressed(void* ctx, write_t write, const byte* buffer, size_t buffer_size) {
+  const size_t chunk_size = ((size_t)1) << LOG2_CHUNK_SIZE;
+  const size_t n_chunks = count_chunks(buffer_size, LOG2_CHUNK_SIZE);
+
+  compression_job_t job;
+  job.chunk_size = chunk_size;
+  job.buffer = (byte*)buffer;
+  job.buffer_size = buffer_size;
+  job.staging = (byte*)malloc(MIN(COMPRESSION_BATCH_SIZE, n_chunks) * MIN(chunk_size, buffer_size));
+
+  if(job.staging == NULL) {
+    return HIBP_E_NOMEM;
+  }
+
+  for(job.first = 0; job.first < n_chunks; job.first += COMPRESSION_BATCH_SIZE) {
+    const size_t n = MIN(COMPRESSION_BATCH_SIZE, n_chunks - job.first);
+
+    hibp_parallel_for(n, 0, compress_nth_chunk, &job);
+
+    for(size_t k = 0; k < n; k ++) {
+      const size_t size = batch_chunk_size(&job, k);
+
+      byte frame[COMPRESSED_FRAME_SIZE];
+      size_t_to_le_8_bytes(frame, job.sizes[k]);
+      memcpy(frame + 8, job.crcs[k], 4);
+
+      const byte* data = (job.sizes[k] == size)
+        ? buffer + (job.first + k) * chunk_size
+        : job.staging + k * chunk_size;
+
+      if(write_fully(ctx, write, frame, COMPRESSED_FRAME_SIZE) != 0 ||
+         write_fully(ctx, write, data, job.sizes[k]) != 0) {
+        free(job.staging);
+        return HIBP_E_IO;
+      }
+    }
+  }
+
+  free(job.staging);
+
+  return HIBP_OK;
+}
+
+/* Counterpart of write_compressed: read the codec, log2_chunk_size, and chunks into
+ * buffer, decompressing and verifying a batch at a time on every available CPU */
+static status read_compressed(byte* buffer, size_t buffer_size, void* ctx, read_t read) {
+  const int codec = read_byte(ctx, read);
+  const int log2_chunk_size = read_byte(ctx, read);
+
+  if(codec == EOF || log2_chunk_size == EOF) {
+    return HIBP_E_IO;
+  }
+
+  if(codec != COMPRESSION_LZ4 ||
+     (size_t)log2_chunk_size < LOG2_CHUNK_SIZE_MIN || (size_t)log2_chunk_size > LOG2_CHUNK_SIZE_MAX) {
+    return HIBP_E_INVAL;
+  }
+
+  const size_t chunk_size = ((size_t)1) << log2_chunk_size;
+  const size_t n_chunks = count_chunks(buffer_size, log2_chunk_size);
+
+  compression_job_t job;
+  job.chunk_size = chunk_size;
+  job.buffer = buffer;
+  job.buffer_size = buffer_size;
+  job.staging = (byte*)malloc(MIN(COMPRESSION_BATCH_SIZE, n_chunks) * MIN(chunk_size, buffer_size));
+
+  if(job.staging == NULL) {
+    return HIBP_E_NOMEM;
+  }
+
+  status st = HIBP_OK;
+
+  for(job.first = 0; st == HIBP_OK && job.first < n_chunks; job.first += COMPRESSION_BATCH_SIZE) {
+    const size_t n = MIN(COMPRESSION_BATCH_SIZE, n_chunks - job.first);
+
+    for(size_t k = 0; st == HIBP_OK && k < n; k ++) {
+      const size_t size = batch_chunk_size(&job, k);
+
+      byte frame[COMPRESSED_FRAME_SIZE];
+
+      if(read_fully(ctx, read, frame, COMPRESSED_FRAME_SIZE) != 0) {
+        st = HIBP_E_IO;
+        break;
+      }
+
+      if(le_8_bytes_to_size_t(&job.sizes[k], frame) != 0 || job.sizes[k] == 0 || job.sizes[k] > size) {
+        st = HIBP_E_INVAL;
+        break;
+      }
+
+      memcpy(job.crcs[k], frame + 8, 4);
+
+      byte* data = (job.sizes[k] == size)
+        ? buffer + (job.first + k) * chunk_size
+        : job.staging + k * chunk_size;
+
+      if(read_fully(ctx, read, data, job.sizes[k]) != 0) {
+        st = HIBP_E_IO;
+      }
+    }
+
+    if(st != HIBP_OK) {
+      break;
+    }
+
+    hibp_parallel_for(n, 0, decompress_nth_chunk, &job);
+
+    for(size_t k = 0; k < n; k ++) {
+      if(job.statuses[k] != HIBP_OK) {
+        st = job.statuses[k];
+      }
+    }
+  }
+
+  free(job.staging);
+
+  return st;
+}
+
+static status load_reader(bloom_filter* bf, void* ctx, read_t read, const allocator_t* allocator) {
+  const uint64_t start = STATS_CLOCK();
+
+  /* The file format is layed out as follows ([bytes] description):
+   * [4]          version string
+   * [8]          n_hash_functions
+   * [1]          log2_bits
+   * [1]          layout and hash family, see encode_layout (VERSION_2 and later)
+   * [8]          number of bits, if not 2**log2_bits, see encode_layout (ditto)
+   * [8]          size of the bit vector in bytes (VERSION_3 and later)
+   * [1]          codec, COMPRESSION_* (VERSION_5 only)
+   * [1]          checksum algorithm, CHECKSUM_* (VERSION_4 only)
+   * [1]          log2_chunk_size (VERSION_4 and VERSION_5)
+   * [SHA1_BYTES] buffer SHA1 checksum (VERSION_1 through VERSION_3), or
+   * [...]        the digest of every chunk of the buffer in order, each 4 bytes
+   *              (CRC32C, little-endian) or SHA1_BYTES bytes (SHA1) (VERSION_4 only)
+   * [...]        zero padding, such that the bit vector starts at a multiple of
+   *              ALIGNMENT bytes from the start of the file (VERSION_3 and VERSION_4)
+   * [...]        buffer (VERSION_1 through VERSION_4), or
+   * [...]        for every chunk of the buffer in order, its stored size [8], the CRC32C of
+   *              its uncompressed contents [4] (little-endian), and the chunk itself,
+   *              compressed, or verbatim if its stored size is the uncompressed size
+   *              (VERSION_5 only) */
+
+  /* ================================
+   * Version string
+   * ================================ */
+
+  byte this_version[VERSION_SIZE];
+
+  if(read_fully(ctx, read, this_version, VERSION_SIZE) != 0) {
+    return HIBP_E_IO;
+  }
+
+  const int compressed = (memcmp(this_version, VERSION_5, VERSION_SIZE) == 0);
+  const int chunked = (memcmp(this_version, VERSION_4, VERSION_SIZE) == 0);
+  const int aligned = chunked || (memcmp(this_version, VERSION_3, VERSION_SIZE) == 0);
+  const int has_layout = compressed || aligned || (memcmp(this_version, VERSION_2, VERSION_SIZE) == 0);
+
+  if (!has_layout && memcmp(this_version, VERSION_1, VERSION_SIZE) != 0) {
+    return HIBP_E_VERSION;
+  }
+
+  /* ================================
+   * n_hash_functions
+   * ================================ */
+
+  byte n_hash_functions_bytes[8];
+
+  if(read_fully(ctx, read, n_hash_functions_bytes, 8) != 0) {
+    return HIBP_E_IO;
+  }
+
+  if(le_8_bytes_to_size_t(&bf->n_hash_functions, n_hash_functions_bytes) != 0) {
+    return HIBP_E_2BIG;
+  }
+
+  /* ================================
+   * log2_bits
+   * ================================ */
+
+  int c = read_byte(ctx, read);
+
+  if(c == EOF) {
+    return HIBP_E_IO;
+  }
+
+  assert(c == (c & 0xff));
+
+  /* Cast away signedness */
+  bf->log2_bits = (byte)c;
+
+  /* ================================
+   * Layout
+   * ================================ */
+
+  bf->layout = HIBP_LAYOUT_STANDARD;
+  bf->hashing = HIBP_HASHING_RANDOM;
+  bf->bits = pow2_bits(bf->log2_bits);
+
+  if(has_layout) {
+    c = read_byte(ctx, read);
+
+    if(c == EOF) {
+      return HIBP_E_IO;
+    }
+
+    /* Unknown layouts and families are rejected by compute_buffer_size */
+    if(decode_layout(bf, c)) {
+      byte bits_bytes[8];
+
+      if(read_fully(ctx, read, bits_bytes, 8) != 0) {
+        return HIBP_E_IO;
+      }
+
+      /* As is a number of bits inconsistent with log2_bits */
+      if(le_8_bytes_to_size_t(&bf->bits, bits_bytes) != 0) {
+        return HIBP_E_2BIG;
+      }
+    }
+  }
+
+  /* Can sanity check sizes and compute buffer size now */
+
+  size_t buffer_size;
+  const status st = compute_buffer_size(&buffer_size, bf->layout, bf->hashing, bf->n_hash_functions, bf->log2_bits, bf->bits);
+
+  if(st != HIBP_OK) {
+    return st;
+  }
+
+  /* ================================
+   * Vector size
+   * ================================ */
+
+  if(aligned || compressed) {
+    byte vector_size_bytes[8];
+
+    if(read_fully(ctx, read, vector_size_bytes, 8) != 0) {
+      return HIBP_E_IO;
+    }
+
+    const size_t hash_functions_size =
+      hash_function_offset(bf->layout, bf->hashing, bf->log2_bits, bf->n_hash_functions);
+
+    /* Redundant with log2_bits; a mismatch means the file is corrupt */
+    size_t vector_size;
+
+    if(le_8_bytes_to_size_t(&vector_size, vector_size_bytes) != 0 ||
+       vector_size != buffer_size - hash_functions_size) {
+      return HIBP_E_INVAL;
+    }
+  }
+
+  /* ================================
+   * Compressed chunks
+   * ================================ */
+
+  if(compressed) {
+    bf->mapping = NULL;
+    bf->mapping_size = 0;
+    bf->verifier = NULL;
+    bf->tracker = NULL;
+    bf->pager = NULL;
+    bf->concurrent = 0;
+    bf->stats = NULL;
+
+    const status ast = alloc_buffer(bf, buffer_size, allocator, 0);
+
+    if(ast != HIBP_OK) {
+      return ast;
+    }
+
+    const status rst = read_compressed(bf->buffer, buffer_size, ctx, read);
+
+    if(rst != HIBP_OK) {
+      free_buffer(bf);
+      return rst;
+    }
+
+    if(compile_hash_functions(bf) != HIBP_OK) {
+      free_buffer(bf);
+      return HIBP_E_NOMEM;
+    }
+
+    attach_load_stats(bf, start, 0);
+
+    return HIBP_OK;
+  }
+
+  /* ================================
+   * Checksum(s)
+   * ================================ */
+
+  /* The legacy formats are treated as having a single chunk spanning the whole buffer */
+  byte checksum[SHA1_BYTES];
+
+  int algorithm = CHECKSUM_SHA1;
+  size_t chunk_size = buffer_size;
+  size_t n_chunks = 1;
+  size_t digests_size = SHA1_BYTES;
+  byte* digests = checksum;
+
+  if(chunked) {
+    algorithm = read_byte(ctx, read);
+    c = read_byte(ctx, read);
+
+    if(algorithm == EOF || c == EOF) {
+      return HIBP_E_IO;
+    }
+
+    const status dst = compute_digests_size(&digests_size, algorithm, (size_t)c, buffer_size);
+
+    if(dst != HIBP_OK) {
+      return dst;
+    }
+
+    chunk_size = ((size_t)1) << c;
+    n_chunks = count_chunks(buffer_size, c);
+
+    digests = (byte*)malloc(digests_size);
+
+    if(digests == NULL) {
+      return HIBP_E_NOMEM;
+    }
+  }
+
+  if(read_fully(ctx, read, digests, digests_size) != 0) {
+    if(digests != checksum) {
+      free(digests);
+    }
+    return HIBP_E_IO;
+  }
+
+  /* ================================
+   * Padding
+   * ================================ */
+
+  if(aligned) {
+    const size_t header_size =
+      (chunked ? CHUNKED_HEADER_SIZE + digests_size : ALIGNED_HEADER_SIZE) + bits_field_size(bf);
+    const size_t padding_size =
+      aligned_padding_size(header_size, bf->layout, bf->hashing, bf->n_hash_functions, bf->log2_bits);
+
+    if(skip_fully(ctx, read, padding_size) != 0) {
+      if(digests != checksum) {
+        free(digests);
+      }
+      return HIBP_E_IO;
+    }
+  }
+
+  /* ================================
+   * buffer
+   * ================================ */
+
+  bf->mapping = NULL;
+  bf->mapping_size = 0;
+  bf->verifier = NULL;
+  bf->tracker = NULL;
+  bf->pager = NULL;
+  bf->concurrent = 0;
+  bf->stats = NULL;
+
+  const status ast = alloc_buffer(bf, buffer_size, allocator, 0);
+
+  if(ast != HIBP_OK) {
+    if(digests != checksum) {
+      free(digests);
+    }
+    return ast;
+  }
+
+  if(read_fully(ctx, read, bf->buffer, buffer_size) != 0) {
+    if(digests != checksum) {
+      free(digests);
+    }
+    free_buffer(bf);
+    return HIBP_E_IO;
+  }
+
+  /* Assert that the checksum(s) actually match */
+  const uint64_t verify_start = STATS_CLOCK();
+  const status cst = check_digests(digests, algorithm, chunk_size, n_chunks, bf->buffer, buffer_size, NULL);
+  const uint64_t verify_ns = STATS_CLOCK() - verify_start;
+
+  if(digests != checksum) {
+    free(digests);
+  }
+
+  if(cst != HIBP_OK) {
+    free_buffer(bf);
+    return cst;
+  }
+
+  /* ================================
+   * Compiled hash functions
+   * ================================ */
+
+  if(compile_hash_functions(bf) != HIBP_OK) {
+    free_buffer(bf);
+    return HIBP_E_NOMEM;
+  }
+
+  attach_load_stats(bf, start, verify_ns);
+
+  return HIBP_OK;
+}
+
+status hibp_bf_load_file(bloom_filter* bf, FILE* file) {
+  return load_reader(bf, file, file_read, NULL);
+}
+
+status hibp_bf_load_stream(bloom_filter* bf, void* ctx, getc_t getc) {
+  getc_reader_t reader = { ctx, getc };
+  return load_reader(bf, &reader, getc_read, NULL);
+}
+
+status hibp_bf_load_reader(bloom_filter* bf, void* ctx, read_t read) {
+  return load_reader(bf, ctx, read, NULL);
+}
+
+status hibp_bf_load_file_alloc(bloom_filter* bf, FILE* file, const allocator_t* allocator) {
+  return load_reader(bf, file, file_read, allocator);
+}
+
+status hibp_bf_load_reader_alloc(bloom_filter* bf, void* ctx, read_t read, const allocator_t* allocator) {
+  return load_reader(bf, ctx, read, allocator);
+}
+
+/* Parse the header of a saved filter from the first size bytes of data (i.e. everything
+ * up to the buffer; see load_reader for the layout), initializing the parameters of bf
+ * and the checksum parameters of v (save for states). On success, *offset is the offset of
+ * the buffer within data */
+static status parse_header(bloom_filter* bf, struct hibp_verifier_st* v, size_t* offset,
+                           const byte* data, size_t size) {
+  size_t i = 0;
+
+  /* Version string */
+
+  if(size < VERSION_SIZE) {
+    return HIBP_E_IO;
+  }
+
+  const int chunked = (memcmp(data, VERSION_4, VERSION_SIZE) == 0);
+  const int aligned = chunked || (memcmp(data, VERSION_3, VERSION_SIZE) == 0);
+  const int has_layout = aligned || (memcmp(data, VERSION_2, VERSION_SIZE) == 0);
+
+  if(!has_layout && memcmp(data, VERSION_1, VERSION_SIZE) != 0) {
+    return HIBP_E_VERSION;
+  }
+
+  i += VERSION_SIZE;
+
+  /* n_hash_functions, log2_bits, layout, vector size, checksum algorithm, and
+   * log2_chunk_size (and possibly the number of bits; see below) */
+
+  if(size - i < 8 + 1 + (size_t)has_layout + (aligned ? 8 : 0) + (chunked ? 2 : 0)) {
+    return HIBP_E_IO;
+  }
+
+  if(le_8_bytes_to_size_t(&bf->n_hash_functions, data + i) != 0) {
+    return HIBP_E_2BIG;
+  }
+
+  i += 8;
+
+  bf->log2_bits = data[i ++];
+  bf->layout = HIBP_LAYOUT_STANDARD;
+  bf->hashing = HIBP_HASHING_RANDOM;
+  bf->bits = pow2_bits(bf->log2_bits);
+
+  if(has_layout && decode_layout(bf, data[i ++])) {
+    if(size - i < 8 + (size_t)(aligned ? 8 : 0) + (chunked ? 2 : 0)) {
+      return HIBP_E_IO;
+    }
+
+    if(le_8_bytes_to_size_t(&bf->bits, data + i) != 0) {
+      return HIBP_E_2BIG;
+    }
+
+    i += 8;
+  }
+
+  size_t buffer_size;
+  status st = compute_buffer_size(&buffer_size, bf->layout, bf->hashing, bf->n_hash_functions, bf->log2_bits, bf->bits);
+
+  if(st != HIBP_OK) {
+    return st;
+  }
+
+  if(aligned) {
+    const size_t hash_functions_size =
+      hash_function_offset(bf->layout, bf->hashing, bf->log2_bits, bf->n_hash_functions);
+
+    size_t vector_size;
+
+    if(le_8_bytes_to_size_t(&vector_size, data + i) != 0 ||
+       vector_size != buffer_size - hash_functions_size) {
+      return HIBP_E_INVAL;
+    }
+
+    i += 8;
+  }
+
+  /* Checksum(s), followed by any padding, followed by the buffer */
+
+  size_t digests_size;
+
+  if(chunked) {
+    v->algorithm = data[i ++];
+    const size_t log2_chunk_size = data[i ++];
+
+    st = compute_digests_size(&digests_size, v->algorithm, log2_chunk_size, buffer_size);
+
+    if(st != HIBP_OK) {
+      return st;
+    }
+
+    v->chunk_size = ((size_t)1) << log2_chunk_size;
+    v->n_chunks = count_chunks(buffer_size, log2_chunk_size);
+  } else {
+    v->algorithm = CHECKSUM_SHA1;
+    v->chunk_size = buffer_size;
+    v->n_chunks = 1;
+    digests_size = SHA1_BYTES;
+  }
+
+  v->digests = data + i;
+
+  if(size - i < digests_size) {
+    return HIBP_E_IO;
+  }
+
+  i += digests_size;
+
+  const size_t padding_size = aligned
+    ? aligned_padding_size(i, bf->layout, bf->hashing, bf->n_hash_functions, bf->log2_bits)
+    : 0;
+
+  if(size - i < padding_size || size - i - padding_size < buffer_size) {
+    return HIBP_E_IO;
+  }
+
+  (*offset) = i + padding_size;
+
+  return HIBP_OK;
+}
+
+status hibp_bf_map_file(bloom_filter* bf, const char* filename, int flags) {
+  const uint64_t start = STATS_CLOCK();
+  uint64_t verify_ns = 0;
+
+  const int fd = open(filename, O_RDONLY);
+
+  if(fd == -1) {
+    return HIBP_E_IO;
+  }
+
+  struct stat st;
+
+  if(fstat(fd, &st) == -1) {
+    close(fd);
+    return HIBP_E_IO;
+  }
+
+  /* A zero-length mapping is an error in its own right, but the file is certainly
+   * truncated */
+  if(st.st_size <= 0) {
+    close(fd);
+    errno = EINVAL;
+    return HIBP_E_IO;
+  }
+
+  if((unsigned long long)st.st_size > SIZE_MAX) {
+    close(fd);
+    return HIBP_E_2BIG;
+  }
+
+  const size_t size = st.st_size;
+
+  int mmap_flags = MAP_PRIVATE;
+
+#ifdef MAP_POPULATE
+  if(flags & HIBP_MAP_POPULATE) {
+    mmap_flags |= MAP_POPULATE;
+  }
+#endif
+
+  /* Private and writable so that the filter can be inserted into without touching the
+   * file; pages are shared with the page cache until they're written */
+  void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, mmap_flags, fd, 0);
+
+  /* The mapping outlives the descriptor. Don't let close clobber errno */
+  const int mmap_errno = errno;
+  close(fd);
+  errno = mmap_errno;
+
+  if(mapping == MAP_FAILED) {
+    return (errno == ENOMEM) ? HIBP_E_NOMEM : HIBP_E_IO;
+  }
+
+#ifdef MADV_HUGEPAGE
+  if(flags & HIBP_MAP_HUGEPAGES) {
+    /* Advisory; failure (e.g. if the filesystem doesn't support it) is harmless */
+    madvise(mapping, size, MADV_HUGEPAGE);
+  }
+#endif
+
+  bf->mapping = mapping;
+  bf->mapping_size = size;
+  bf->allocation = NULL;
+  bf->tracker = NULL;
+  bf->pager = NULL;
+  bf->concurrent = 0;
+  bf->stats = NULL;
+  bf->verifier = (struct hibp_verifier_st*)malloc(sizeof(struct hibp_verifier_st));
+
+  if(bf->verifier == NULL) {
+    munmap(mapping, size);
+    return HIBP_E_NOMEM;
+  }
+
+  struct hibp_verifier_st* v = bf->verifier;
+  v->states = NULL;
+
+  size_t offset;
+  status s = parse_header(bf, v, &offset, (const byte*)mapping, size);
+
+  if(s != HIBP_OK) {
+    unmap(bf);
+    return s;
+  }
+
+  bf->buffer = (byte*)mapping + offset;
+
+  if(flags & HIBP_MAP_LAZY_VERIFY) {
+    v->states = (byte*)calloc(v->n_chunks, 1);
+
+    if(v->states == NULL) {
+      unmap(bf);
+      return HIBP_E_NOMEM;
+    }
+
+    /* We're about to read the hash functions, so verify them now */
+    const size_t hash_functions_size =
+      hash_function_offset(bf->layout, bf->hashing, bf->log2_bits, bf->n_hash_functions);
+
+    for(size_t i = 0; i < hash_functions_size; i += v->chunk_size) {
+      if(!verify_lazily(bf, v, i)) {
+        unmap(bf);
+        return HIBP_E_CHECKSUM;
+      }
+    }
+  } else if(!(flags & HIBP_MAP_NO_VERIFY)) {
+    /* bf isn't counted yet, so this is timed here */
+    const uint64_t verify_start = STATS_CLOCK();
+    s = hibp_bf_verify(bf);
+    verify_ns = STATS_CLOCK() - verify_start;
+
+    if(s != HIBP_OK) {
+      unmap(bf);
+      return s;
+    }
+  }
+
+  if(compile_hash_functions(bf) != HIBP_OK) {
+    unmap(bf);
+    return HIBP_E_NOMEM;
+  }
+
+  attach_load_stats(bf, start, verify_ns);
+
+  return HIBP_OK;
+}
+
+/* Defaults and limits for hibp_page_params_t */
+#define PAGE_CACHE_SIZE_DEFAULT (((size_t)64) << 20)
+#define PAGE_CACHE_PAGES_MIN 16
+#define LOG2_PAGE_SIZE_DEFAULT 12
+#define LOG2_PAGE_SIZE_MIN 9
+#define LOG2_PAGE_SIZE_MAX 16
+#define PAGE_IO_DEPTH_DEFAULT 32
+
+/* The fixed fields of a header take a few dozen bytes; this is plenty */
+#define PAGED_HEADER_READ_SIZE 256
+
+static int pread_fully(int fd, byte* buffer, size_t size, size_t offset) {
+  size_t done = 0;
+
+  while(done < size) {
+    const ssize_t n = pread(fd, buffer + done, size - done, (off_t)(offset + done));
+
+    if(n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if(n <= 0) {
+      return -1;
+    }
+
+    done += (size_t)n;
+  }
+
+  return 0;
+}
+
+status hibp_bf_page_file(bloom_filter* bf, const char* filename, const hibp_page_params_t* params) {
+  const uint64_t start = STATS_CLOCK();
+
+  const size_t cache_size = (params != NULL && params->cache_size != 0)
+    ? params->cache_size
+    : PAGE_CACHE_SIZE_DEFAULT;
+
+  const size_t log2_page_size = (params != NULL && params->log2_page_size != 0)
+    ? params->log2_page_size
+    : LOG2_PAGE_SIZE_DEFAULT;
+
+  const size_t io_depth = (params != NULL && params->io_depth != 0)
+    ? params->io_depth
+    : PAGE_IO_DEPTH_DEFAULT;
+
+  if(log2_page_size < LOG2_PAGE_SIZE_MIN || log2_page_size > LOG2_PAGE_SIZE_MAX) {
+    return HIBP_E_INVAL;
+  }
+
+  const int fd = open(filename, O_RDONLY);
+
+  if(fd == -1) {
+    return HIBP_E_IO;
+  }
+
+  struct stat st;
+
+  if(fstat(fd, &st) == -1 || st.st_size <= 0) {
+    close(fd);
+    return HIBP_E_IO;
+  }
+
+  if((unsigned long long)st.st_size > SIZE_MAX) {
+    close(fd);
+    return HIBP_E_2BIG;
+  }
+
+  const size_t size = st.st_size;
+
+  /* parse_header checks the fields against the size of the whole file, but only reads the
+   * fields themselves. It also finds the checksums, which we've no use for */
+  byte header[PAGED_HEADER_READ_SIZE];
+  struct hibp_verifier_st v;
+  size_t offset;
+
+  if(pread_fully(fd, header, MIN(size, PAGED_HEADER_READ_SIZE), 0) != 0) {
+    close(fd);
+    return HIBP_E_IO;
+  }
+
+  status s = parse_header(bf, &v, &offset, header, size);
+
+  if(s == HIBP_OK && bf->n_hash_functions > BATCH_WINDOW_PROBES) {
+    s = HIBP_E_2BIG;
+  }
+
+  if(s != HIBP_OK) {
+    close(fd);
+    return s;
+  }
+
+  size_t buffer_size;
+  s = compute_buffer_size(&buffer_size, bf->layout, bf->hashing, bf->n_hash_functions, bf->log2_bits, bf->bits);
+
+  if(s != HIBP_OK) {
+    close(fd);
+    return s;
+  }
+
+  /* Only the hash functions are kept in memory */
+  const size_t hash_functions_size =
+    hash_function_offset(bf->layout, bf->hashing, bf->log2_bits, bf->n_hash_functions);
+
+  bf->buffer = (byte*)malloc(MAX(hash_functions_size, 1));
+
+  if(bf->buffer == NULL) {
+    close(fd);
+    return HIBP_E_NOMEM;
+  }
+
+  if(pread_fully(fd, bf->buffer, hash_functions_size, offset) != 0) {
+    free(bf->buffer);
+    close(fd);
+    return HIBP_E_IO;
+  }
+
+  const size_t n_pages = MAX(cache_size >> log2_page_size, PAGE_CACHE_PAGES_MIN);
+
+  bf->pager = hibp_pager_new(fd, offset + hash_functions_size, buffer_size - hash_functions_size,
+                             log2_page_size, n_pages, io_depth);
+
+  if(bf->pager == NULL) {
+    free(bf->buffer);
+    close(fd);
+    return HIBP_E_NOMEM;
+  }
+
+  bf->mapping = NULL;
+  bf->mapping_size = 0;
+  bf->allocation = NULL;
+  bf->verifier = NULL;
+  bf->tracker = NULL;
+  bf->concurrent = 0;
+  bf->stats = NULL;
+
+  if(compile_hash_functions(bf) != HIBP_OK) {
+    hibp_pager_destroy(bf->pager);
+    free(bf->buffer);
+    return HIBP_E_NOMEM;
+  }
+
+  attach_load_stats(bf, start, 0);
+
+  return HIBP_OK;
+}
+
+void hibp_bf_page_counts(const bloom_filter* bf, size_t* hits, size_t* misses, size_t* errors) {
+  if(bf->pager == NULL) {
+    *hits = 0;
+    *misses = 0;
+    *errors = 0;
+    return;
+  }
+
+  hibp_pager_counts(bf->pager, hits, misses, errors);
+}
+
+status hibp_bf_verify(const bloom_filter* bf) {
+  const struct hibp_verifier_st* v = bf->verifier;
+
+  if(bf->pager != NULL) {
+    size_t hits;
+    size_t misses;
+    size_t errors;
+
+    hibp_pager_counts(bf->pager, &hits, &misses, &errors);
+
+    return (errors == 0) ? HIBP_OK : HIBP_E_IO;
+  }
+
+  if(v == NULL) {
+    return HIBP_OK;
+  }
+
+  size_t buffer_size;
+  const status st = compute_buffer_size(&buffer_size, bf->layout, bf->hashing, bf->n_hash_functions, bf->log2_bits, bf->bits);
+  (void)st;
+  assert(st == HIBP_OK);
+
+  const uint64_t start = STATS_CLOCK();
+  const status cst = check_digests(v->digests, v->algorithm, v->chunk_size, v->n_chunks, bf->buffer,
+                                   buffer_size, v->states);
+  STATS_ADD(bf, verify_ns, STATS_CLOCK() - start);
+
+  return cst;
+}
+
+static inline int valid_format(hibp_format_t format) {
+  return format == HIBP_FORMAT_COMPACT ||
+         format == HIBP_FORMAT_ALIGNED ||
+         format == HIBP_FORMAT_CHUNKED ||
+         format == HIBP_FORMAT_CHUNKED_SHA1 ||
+         format == HIBP_FORMAT_COMPRESSED;
+}
+
+status hibp_bf_save_file(const bloom_filter* bf, FILE* file) {
+  return hibp_bf_save_file_format(bf, file, HIBP_FORMAT_COMPACT);
+}
+
+status hibp_bf_save_stream(const bloom_filter* bf, void* ctx, putc_t putc) {
+  return hibp_bf_save_stream_format(bf, ctx, putc, HIBP_FORMAT_COMPACT);
+}
+
+static status write_filter(const bloom_filter* bf, void* ctx, write_t write, hibp_format_t format) {
+  if(!valid_format(format)) {
+    return HIBP_E_INVAL;
+  }
+
+  /* The file format is as described in load_reader. Buffer size is computed by
+   * compute_buffer_size (it's not obvious) */
+
+  size_t buffer_size;
+  const status st = compute_buffer_size(&buffer_size, bf->layout, bf->hashing, bf->n_hash_functions, bf->log2_bits, bf->bits);
+
+  assert(st == HIBP_OK);
+  (void)st;
+
+  /* ================================
+   * Version string
+   * ================================ */
+
+  const byte* version;
+
+  if(format == HIBP_FORMAT_COMPRESSED) {
+    version = VERSION_5;
+  } else if(format == HIBP_FORMAT_CHUNKED || format == HIBP_FORMAT_CHUNKED_SHA1) {
+    version = VERSION_4;
+  } else if(format == HIBP_FORMAT_ALIGNED) {
+    version = VERSION_3;
+  } else {
+    assert(format == HIBP_FORMAT_COMPACT);
+
+    /* Stick to the original format whenever it can represent the filter */
+    version = (bf->layout == HIBP_LAYOUT_STANDARD && bf->hashing == HIBP_HASHING_RANDOM && pow2_sized(bf))
+      ? VERSION_1
+      : VERSION_2;
+  }
+
+  if(write_fully(ctx, write, version, VERSION_SIZE) != 0) {
+    return HIBP_E_IO;
+  }
+
+  /* ================================
+   * n_hash_functions
+   * ================================ */
+
+  byte n_hash_functions_bytes[8];
+  size_t_to_le_8_bytes(n_hash_functions_bytes, bf->n_hash_functions);
+
+  if(write_fully(ctx, write, n_hash_functions_bytes, 8) != 0) {
+    return HIBP_E_IO;
+  }
+
+  /* ================================
+   * log2_bits
+   * ================================ */
+
+  assert(0 <= bf->log2_bits && bf->log2_bits <= 255);
+
+  if(write_byte(ctx, write, bf->log2_bits) != 0) {
+    return HIBP_E_IO;
+  }
+
+  /* ================================
+   * Layout
+   * ================================ */
+
+  if(version != VERSION_1 && write_byte(ctx, write, encode_layout(bf)) != 0) {
+    return HIBP_E_IO;
+  }
+
+  if(!pow2_sized(bf)) {
+    byte bits_bytes[8];
+    size_t_to_le_8_bytes(bits_bytes, bf->bits);
+
+    if(write_fully(ctx, write, bits_bytes, 8) != 0) {
+      return HIBP_E_IO;
+    }
+  }
+
+  /* ================================
+   * Vector size
+   * ================================ */
+
+  const int aligned = (version == VERSION_3 || version == VERSION_4);
+
+  if(aligned || version == VERSION_5) {
+    const size_t hash_functions_size =
+      hash_function_offset(bf->layout, bf->hashing, bf->log2_bits, bf->n_hash_functions);
+
+    byte vector_size_bytes[8];
+    size_t_to_le_8_bytes(vector_size_bytes, buffer_size - hash_functions_size);
+
+    if(write_fully(ctx, write, vector_size_bytes, 8) != 0) {
+      return HIBP_E_IO;
+    }
+  }
+
+  /* ================================
+   * Compressed chunks
+   * ================================ */
+
+  if(version == VERSION_5) {
+    if(write_byte(ctx, write, COMPRESSION_LZ4) != 0 || write_byte(ctx, write, LOG2_CHUNK_SIZE) != 0) {
+      return HIBP_E_IO;
+    }
+
+    return write_compressed(ctx, write, bf->buffer, buffer_size);
+  }
+
+  /* ================================
+   * Checksum(s)
+   * ================================ */
+
+  size_t header_size = ALIGNED_HEADER_SIZE + bits_field_size(bf);
+
+  if(version == VERSION_4) {
+    const int algorithm = (format == HIBP_FORMAT_CHUNKED_SHA1) ? CHECKSUM_SHA1 : CHECKSUM_CRC32C;
+
+    if(write_byte(ctx, write, algorithm) != 0 || write_byte(ctx, write, LOG2_CHUNK_SIZE) != 0) {
+      return HIBP_E_IO;
+    }
+
+    size_t digests_size;
+    const status dst = compute_digests_size(&digests_size, algorithm, LOG2_CHUNK_SIZE, buffer_size);
+
+    assert(dst == HIBP_OK);
+    (void)dst;
+
+    byte* digests = (byte*)malloc(digests_size);
+
+    if(digests == NULL) {
+      return HIBP_E_NOMEM;
+    }
+
+    compute_digests(
+      digests,
+      algorithm,
+      ((size_t)1) << LOG2_CHUNK_SIZE,
+      count_chunks(buffer_size, LOG2_CHUNK_SIZE),
+      bf->buffer,
+      buffer_size
+    );
+
+    const int failed = (write_fully(ctx, write, digests, digests_size) != 0);
+
+    free(digests);
+
+    if(failed) {
+      return HIBP_E_IO;
+    }
+
+    header_size = CHUNKED_HEADER_SIZE + bits_field_size(bf) + digests_size;
+  } else {
+    byte checksum[SHA1_BYTES];
+    sha1(checksum, buffer_size, bf->buffer);
+
+    if(write_fully(ctx, write, checksum, SHA1_BYTES) != 0) {
+      return HIBP_E_IO;
+    }
+  }
+
+  /* ================================
+   * Padding
+   * ================================ */
+
+  if(aligned) {
+    const size_t padding_size =
+      aligned_padding_size(header_size, bf->layout, bf->hashing, bf->n_hash_functions, bf->log2_bits);
+
+    if(write_zeros(ctx, write, padding_size) != 0) {
+      return HIBP_E_IO;
+    }
+  }
+
+  /* ================================
+   * buffer
+   * ================================ */
+
+  if(write_fully(ctx, write, bf->buffer, buffer_size) != 0) {
+    return HIBP_E_IO;
+  }
+
+  return HIBP_OK;
+}
+
+/* write_filter, timed */
+static status save_writer(const bloom_filter* bf, void* ctx, write_t write, hibp_format_t format) {
+  const uint64_t start = STATS_CLOCK();
+  const status st = write_filter(bf, ctx, write, format);
+  STATS_ADD(bf, save_ns, STATS_CLOCK() - start);
+  return st;
+}
+
+status hibp_bf_save_file_format(const bloom_filter* bf, FILE* file, hibp_format_t format) {
+  return save_writer(bf, file, file_write, format);
+}
+
+status hibp_bf_save_stream_format(const bloom_filter* bf, void* ctx, putc_t putc, hibp_format_t format) {
+  putc_writer_t writer = { ctx, putc };
+  return save_writer(bf, &writer, putc_write, format);
+}
+
+status hibp_bf_save_writer(const bloom_filter* bf, void* ctx, write_t write) {
+  return save_writer(bf, ctx, write, HIBP_FORMAT_COMPACT);
+}
+
+status hibp_bf_save_writer_format(const bloom_filter* bf, void* ctx, write_t write, hibp_format_t format) {
+  return save_writer(bf, ctx, write, format);
+}
+
+/* == Insertion == */
+
+void hibp_bf_insert(bloom_filter* bf, size_t size, const byte* buffer) {
+  byte sha[SHA1_BYTES];
+  sha1(sha, size, buffer);
+  hibp_bf_insert_sha1(bf, sha);
+}
+
+void hibp_bf_insert_str(bloom_filter* bf, const char* str) {
+  hibp_bf_insert(bf, strlen(str), (const byte*)str);
+}
+
+/* Set the given bit of the vector (of size bytes) of bf, by whatever means bf's mode calls
+ * for; see hibp_bf_insert_sha1 */
+static inline void insert_probe(bloom_filter* bf, struct hibp_verifier_st* lazy, word_set_t* ws,
+                                byte* vector, size_t size, size_t bit) {
+  /* Write to the chunk even if it's corrupt; hibp_bf_verify will report it */
+  if(lazy != NULL) {
+    verify_lazily(bf, lazy, (vector - bf->buffer) + bit / 8);
+  }
+
+  if(bf->concurrent) {
+    set_bit_atomically(ws, vector, size, bit);
+  } else {
+    vector[bit / 8] |= (1 << (bit % 8));
+  }
+
+  if(bf->tracker != NULL) {
+    mark_dirty(bf, (vector - bf->buffer) + bit / 8);
+  }
+}
+
+void hibp_bf_insert_sha1(bloom_filter* bf, const byte* sha) {
+  /* For every hash function h, set the bit h(sha) in the Bloom filter vector. In the
+   * blocked layout, the first hash function instead selects the block, and the bit
+   * selected by each other hash function is relative to the start of the block */
+
+  byte* vector = bvector(bf);
+  const compiled* c = bf->compiled;
+  struct hibp_verifier_st* lazy = lazy_verifier(bf);
+
+  word_set_t ws;
+  ws.n = 0;
+
+  const size_t size = bvector_size(bf);
+
+  STATS_ADD(bf, n_inserts, 1);
+
+  if(bf->hashing == HIBP_HASHING_DOUBLE) {
+    double_hash_t dh;
+    init_double_hash(&dh, bf, sha);
+
+    for(size_t i = first_probe(bf); i < bf->n_hash_functions; i ++) {
+      insert_probe(bf, lazy, &ws, vector, size, nth_double_probe(bf, &dh, i));
+    }
+
+    flush_words(&ws);
+    return;
+  }
+
+  size_t base = 0;
+
+  for(size_t g = 0; g < c->n_groups; g ++) {
+    const size_t values = eval_nth_group(c, g, sha);
+
+    for(size_t i = c->group_firsts[g]; i < c->group_firsts[g + 1]; i ++) {
+      const size_t k = (values >> c->shifts[i]) & c->masks[i];
+      assert(k == eval_nth_hash_function(bf, i, sha));
+
+      if(i < c->first_probe) {
+        base = select_block(bf, k);
+        continue;
+      }
+
+      insert_probe(bf, lazy, &ws, vector, size, select_probe(bf, base, k));
+    }
+  }
+
+  flush_words(&ws);
+}
+
+void hibp_bf_insert_batch(bloom_filter* bf, size_t n, const size_t* sizes, const byte* const* buffers) {
+  /* A window's worth of SHA1s at most, computed together (see hibp_sha1_batch) */
+  byte shas[BATCH_WINDOW_SHAS * HIBP_SHA1_BYTES];
+
+  for(size_t i = 0; i < n; i += BATCH_WINDOW_SHAS) {
+    const size_t m = MIN(BATCH_WINDOW_SHAS, n - i);
+
+    hibp_sha1_batch(shas, m, sizes + i, buffers + i);
+    hibp_bf_insert_sha1_batch(bf, m, shas);
+  }
+}
+
+void hibp_bf_insert_sha1_batch(bloom_filter* bf, size_t n, const byte* shas) {
+  const size_t window = batch_window_size(bf);
+
+  if(window == 0) {
+    for(size_t i = 0; i < n; i ++) {
+      hibp_bf_insert_sha1(bf, shas + i * SHA1_BYTES);
+    }
+    return;
+  }
+
+  for(size_t i = 0; i < n; i += window) {
+    insert_sha1_window(bf, MIN(window, n - i), shas + i * SHA1_BYTES, bf->concurrent);
+  }
+}
+
+/* The parallel insertion functions split their input into slices of this many elements.
+ * Large enough to amortize the bookkeeping, small enough to balance the load */
+#define PARALLEL_SLICE_SIZE 4096
+
+/* Plumbing for hibp_bf_insert{,_sha1}_parallel. Exactly one of shas and buffers is set */
+typedef struct {
+  bloom_filter* bf;
+  size_t n;
+  size_t window;
+  const size_t* sizes;
+  const byte* const* buffers;
+  const byte* shas;
+} insert_job_t;
+
+static void insert_nth_slice(void* ctx, size_t slice) {
+  const insert_job_t* job = (const insert_job_t*)ctx;
+
+  const size_t first = slice * PARALLEL_SLICE_SIZE;
+  const size_t last = MIN(job->n, first + PARALLEL_SLICE_SIZE);
+
+  if(job->shas != NULL) {
+    for(size_t i = first; i < last; i += job->window) {
+      insert_sha1_window(job->bf, MIN(job->window, last - i), job->shas + i * SHA1_BYTES, 1);
+    }
+
+    return;
+  }
+
+  /* The SHA1s are computed BATCH_WINDOW_SHAS at a time, however small the window, so that
+   * they can be computed together (see hibp_sha1_batch) */
+  byte shas[BATCH_WINDOW_SHAS * HIBP_SHA1_BYTES];
+
+  for(size_t i = first; i < last; i += BATCH_WINDOW_SHAS) {
+    const size_t m = MIN(BATCH_WINDOW_SHAS, last - i);
+
+    hibp_sha1_batch(shas, m, job->sizes + i, job->buffers + i);
+
+    for(size_t j = 0; j < m; j += job->window) {
+      insert_sha1_window(job->bf, MIN(job->window, m - j), shas + j * SHA1_BYTES, 1);
+    }
+  }
+}
+
+static void insert_parallel(bloom_filter* bf, size_t n, const size_t* sizes, const byte* const* buffers,
+                            const byte* shas, size_t n_threads) {
+  /* Having every chunk of a lazily-verified filter verified up front (in parallel, to
+   * boot) is no worse than verifying them one by one as we go */
+  if(lazy_verifier(bf) != NULL && hibp_bf_verify(bf) == HIBP_E_NOMEM) {
+    n_threads = 1;
+  }
+
+  const size_t window = probe_window_size(bf);
+
+  /* We need windows to set bits atomically (nor are we going to get much out of more
+   * threads with so many hash functions); fall back on the serial implementations */
+  if(n_threads == 1 || window == 0) {
+    if(shas != NULL) {
+      hibp_bf_insert_sha1_batch(bf, n, shas);
+    } else {
+      hibp_bf_insert_batch(bf, n, sizes, buffers);
+    }
+    return;
+  }
+
+  insert_job_t job = { bf, n, window, sizes, buffers, shas };
+
+  const size_t n_slices = (n / PARALLEL_SLICE_SIZE) + (n % PARALLEL_SLICE_SIZE != 0);
+  hibp_parallel_for(n_slices, n_threads, insert_nth_slice, &job);
+}
+
+void hibp_bf_insert_parallel(bloom_filter* bf, size_t n, const size_t* sizes, const byte* const* buffers,
+                             size_t n_threads) {
+  insert_parallel(bf, n, sizes, buffers, NULL, n_threads);
+}
+
+void hibp_bf_insert_sha1_parallel(bloom_filter* bf, size_t n, const byte* shas, size_t n_threads) {
+  insert_parallel(bf, n, NULL, NULL, shas, n_threads);
+}
+
+status hibp_bf_set_concurrent(bloom_filter* bf, int concurrent) {
+  /* Lazy verification hashes a chunk before its first write; another thread writing to the
+   * chunk in the meantime would have it reported as corrupt. So no chunk may be left
+   * unverified */
+  if(concurrent && lazy_verifier(bf) != NULL) {
+    const status st = hibp_bf_verify(bf);
+
+    if(st != HIBP_OK) {
+      return st;
+    }
+  }
+
+  bf->concurrent = (concurrent != 0);
+
+  return HIBP_OK;
+}
+
+/* == Combining == */
+
+/* hibp_bf_union and hibp_bf_intersect combine bit vectors in slices of this many bytes,
+ * spread across every CPU */
+#define COMBINE_SLICE_SIZE (((size_t)1) << LOG2_CHUNK_SIZE)
+
+/* Plumbing for hibp_bf_union and hibp_bf_intersect */
+typedef struct {
+  bloom_filter* bf;
+  byte* dst;
+  const byte* src;
+  size_t size;
+  int intersect;
+} combine_job_t;
+
+/* Combine size bytes of src into dst, returning nonzero if that changed anything. Simple
+ * enough that the compiler vectorizes these loops */
+static inline int combine_bytes(byte* restrict dst, const byte* restrict src, size_t size, int intersect) {
+  byte changed = 0;
+
+  if(intersect) {
+    for(size_t j = 0; j < size; j ++) {
+      changed |= dst[j] & ~src[j];
+      dst[j] &= src[j];
+    }
+  } else {
+    for(size_t j = 0; j < size; j ++) {
+      changed |= src[j] & ~dst[j];
+      dst[j] |= src[j];
+    }
+  }
+
+  return changed != 0;
+}
+
+static void combine_nth_slice(void* ctx, size_t i) {
+  const combine_job_t* job = (const combine_job_t*)ctx;
+
+  const size_t first = i * COMBINE_SLICE_SIZE;
+  const size_t size = MIN(COMBINE_SLICE_SIZE, job->size - first);
+
+  if(job->bf->tracker == NULL) {
+    combine_bytes(job->dst + first, job->src + first, size, job->intersect);
+    return;
+  }
+
+  /* Track changes page by page, so that a delta holds only the pages that changed. Pages
+   * are aligned relative to the start of the buffer rather than the bit vector */
+  const size_t offset = (job->dst - job->bf->buffer) + first;
+
+  for(size_t j = 0; j < size; ) {
+    const size_t n = MIN(size - j, DIRTY_PAGE_SIZE - (offset + j) % DIRTY_PAGE_SIZE);
+
+    if(!combine_bytes(job->dst + first + j, job->src + first + j, n, job->intersect)) {
+      /* Unchanged */
+    } else if(job->intersect) {
+      mark_cleared(job->bf, offset + j);
+    } else {
+      mark_dirty(job->bf, offset + j);
+    }
+
+    j += n;
+  }
+}
+
+static status combine(bloom_filter* dst, const bloom_filter* src, int intersect) {
+  const size_t hash_functions_size = bvector(src) - src->buffer;
+
+  if(dst->layout != src->layout || dst->hashing != src->hashing ||
+     dst->n_hash_functions != src->n_hash_functions || dst->log2_bits != src->log2_bits ||
+     dst->bits != src->bits || memcmp(dst->buffer, src->buffer, hash_functions_size) != 0) {
+    return HIBP_E_INVAL;
+  }
+
+  if(dst == src) {
+    return HIBP_OK;
+  }
+
+  /* Every chunk is about to be read (respectively written), so verify them all up front.
+   * A corrupt chunk of src would corrupt dst, and writing to an unverified chunk of dst
+   * would make it impossible to verify later */
+  if(lazy_verifier(src) != NULL) {
+    const status st = hibp_bf_verify(src);
+
+    if(st != HIBP_OK) {
+      return st;
+    }
+  }
+
+  if(lazy_verifier(dst) != NULL) {
+    const status st = hibp_bf_verify(dst);
+
+    if(st != HIBP_OK) {
+      return st;
+    }
+  }
+
+  size_t buffer_size;
+  const status st = compute_buffer_size(&buffer_size, dst->layout, dst->hashing, dst->n_hash_functions, dst->log2_bits, dst->bits);
+  (void)st;
+  assert(st == HIBP_OK);
+
+  combine_job_t job = { dst, bvector(dst), bvector(src), buffer_size - hash_functions_size, intersect };
+
+  const size_t n_slices = (job.size / COMBINE_SLICE_SIZE) + (job.size % COMBINE_SLICE_SIZE != 0);
+  hibp_parallel_for(n_slices, 0, combine_nth_slice, &job);
+
+  return HIBP_OK;
+}
+
+status hibp_bf_union(bloom_filter* dst, const bloom_filter* src) {
+  return combine(dst, src, 0);
+}
+
+status hibp_bf_intersect(bloom_filter* dst, const bloom_filter* src) {
+  return combine(dst, src, 1);
+}
+
+/* == Deltas == */
+
+/* A delta is layed out as follows ([bytes] description):
+ * [4]          version string
+ * [8]          n_hash_functions
+ * [1]          log2_bits
+ * [1]          layout and hash family (see encode_layout)
+ * [SHA1_BYTES] SHA1 of the hash functions, identifying the filters to which the delta
+ *              can be applied; if the number of bits isn't 2**log2_bits, it's instead
+ *              the SHA1 of that SHA1 followed by the number of bits (8 bytes,
+ *              little-endian)
+ * [8]          number of pages
+ * [...]        for every page, its index within the buffer [8], the CRC32C of the index
+ *              and the contents (little-endian) [4], and the contents (DIRTY_PAGE_SIZE bytes, or
+ *              fewer for the last page of the buffer).
+ * Pages hold their whole contents, and are applied with bitwise OR. So long as the
+ * target filter descends from the same filter as the source, that yields the same
+ * result however many times (and in whatever order) deltas are applied */
+static const byte DELTA_VERSION[VERSION_SIZE] = { 0xb1, 0xde, 0x13, 0x37 };
+
+#define DELTA_HEADER_SIZE (VERSION_SIZE + 8 + 1 + 1 + HIBP_SHA1_BYTES + 8)
+#define DELTA_FRAME_SIZE (8 + 4)
+
+static inline size_t count_pages(size_t buffer_size) {
+  return (buffer_size >> LOG2_DIRTY_PAGE_SIZE) + ((buffer_size & (DIRTY_PAGE_SIZE - 1)) != 0);
+}
+
+static inline size_t nth_page_size(size_t buffer_size, size_t i) {
+  return MIN(DIRTY_PAGE_SIZE, buffer_size - i * DIRTY_PAGE_SIZE);
+}
+
+status hibp_bf_track_changes(bloom_filter* bf) {
+  if(bf->tracker != NULL) {
+    memset(bf->tracker->dirty, 0, bf->tracker->n_pages);
+    bf->tracker->cleared = 0;
+    return HIBP_OK;
+  }
+
+  size_t buffer_size;
+  const status st = compute_buffer_size(&buffer_size, bf->layout, bf->hashing, bf->n_hash_functions, bf->log2_bits, bf->bits);
+  (void)st;
+  assert(st == HIBP_OK);
+
+  struct hibp_tracker_st* t = (struct hibp_tracker_st*)malloc(sizeof(struct hibp_tracker_st));
+
+  if(t == NULL) {
+    return HIBP_E_NOMEM;
+  }
+
+  t->n_pages = count_pages(buffer_size);
+  t->dirty = (byte*)calloc(t->n_pages, 1);
+  t->cleared = 0;
+
+  if(t->dirty == NULL) {
+    free(t);
+    return HIBP_E_NOMEM;
+  }
+
+  bf->tracker = t;
+
+  return HIBP_OK;
+}
+
+/* The header of a delta over n_pages pages of bf */
+static void encode_delta_header(byte* header, const bloom_filter* bf, size_t n_pages) {
+  memcpy(header, DELTA_VERSION, VERSION_SIZE);
+  size_t_to_le_8_bytes(header + VERSION_SIZE, bf->n_hash_functions);
+  header[VERSION_SIZE + 8] = (byte)bf->log2_bits;
+  header[VERSION_SIZE + 9] = encode_layout(bf);
+  sha1(header + VERSION_SIZE + 10, bvector(bf) - bf->buffer, bf->buffer);
+
+  if(!pow2_sized(bf)) {
+    byte chained[HIBP_SHA1_BYTES + 8];
+    memcpy(chained, header + VERSION_SIZE + 10, SHA1_BYTES);
+    size_t_to_le_8_bytes(chained + SHA1_BYTES, bf->bits);
+    sha1(header + VERSION_SIZE + 10, sizeof(chained), chained);
+  }
+
+  size_t_to_le_8_bytes(header + VERSION_SIZE + 10 + SHA1_BYTES, n_pages);
+}
+
+static void page_digest(byte* digest, const byte* index_bytes, const byte* page, size_t size) {
+  const uint32_t crc = hibp_crc32c(hibp_crc32c(0, index_bytes, 8), page, size);
+
+  for(size_t i = 0; i < 4; i ++) {
+    digest[i] = (crc >> (8 * i)) & 0xff;
+  }
+}
+
+static status save_delta(const bloom_filter* bf, void* ctx, write_t write) {
+  const struct hibp_tracker_st* t = bf->tracker;
+
+  if(t == NULL || t->cleared) {
+    return HIBP_E_INVAL;
+  }
+
+  size_t buffer_size;
+  const status st = compute_buffer_size(&buffer_size, bf->layout, bf->hashing, bf->n_hash_functions, bf->log2_bits, bf->bits);
+  (void)st;
+  assert(st == HIBP_OK);
+
+  size_t n_pages = 0;
+
+  for(size_t i = 0; i < t->n_pages; i ++) {
+    n_pages += (t->dirty[i] != 0);
+  }
+
+  byte header[DELTA_HEADER_SIZE];
+  encode_delta_header(header, bf, n_pages);
+
+  if(write_fully(ctx, write, header, DELTA_HEADER_SIZE) != 0) {
+    return HIBP_E_IO;
+  }
+
+  for(size_t i = 0; i < t->n_pages; i ++) {
+    if(!t->dirty[i]) {
+      continue;
+    }
+
+    const byte* page = bf->buffer + i * DIRTY_PAGE_SIZE;
+    const size_t size = nth_page_size(buffer_size, i);
+
+    byte frame[DELTA_FRAME_SIZE];
+    size_t_to_le_8_bytes(frame, i);
+    page_digest(frame + 8, frame, page, size);
+
+    if(write_fully(ctx, write, frame, DELTA_FRAME_SIZE) != 0 || write_fully(ctx, write, page, size) != 0) {
+      return HIBP_E_IO;
+    }
+  }
+
+  return HIBP_OK;
+}
+
+status hibp_bf_save_delta_file(const bloom_filter* bf, FILE* file) {
+  return save_delta(bf, file, file_write);
+}
+
+status hibp_bf_save_delta_writer(const bloom_filter* bf, void* ctx, write_t write) {
+  return save_delta(bf, ctx, write);
+}
+
+static status apply_delta(bloom_filter* bf, void* ctx, read_t read) {
+  size_t buffer_size;
+  const status st = compute_buffer_size(&buffer_size, bf->layout, bf->hashing, bf->n_hash_functions, bf->log2_bits, bf->bits);
+  (void)st;
+  assert(st == HIBP_OK);
+
+  /* ================================
+   * Header
+   * ================================ */
+
+  byte header[DELTA_HEADER_SIZE];
+
+  if(read_fully(ctx, read, header, DELTA_HEADER_SIZE) != 0) {
+    return HIBP_E_IO;
+  }
+
+  if(memcmp(header, DELTA_VERSION, VERSION_SIZE) != 0) {
+    return HIBP_E_VERSION;
+  }
+
+  size_t n_pages;
+
+  if(le_8_bytes_to_size_t(&n_pages, header + VERSION_SIZE + 10 + SHA1_BYTES) != 0) {
+    return HIBP_E_INVAL;
+  }
+
+  /* The rest of the header must match our own exactly */
+  byte expected[DELTA_HEADER_SIZE];
+  encode_delta_header(expected, bf, n_pages);
+
+  if(memcmp(header, expected, DELTA_HEADER_SIZE) != 0) {
+    return HIBP_E_INVAL;
+  }
+
+  /* ================================
+   * Pages
+   * ================================ */
+
+  struct hibp_verifier_st* lazy = lazy_verifier(bf);
+  const size_t max_index = count_pages(buffer_size);
+  const size_t vector_offset = bvector(bf) - bf->buffer;
+
+  byte page[DIRTY_PAGE_SIZE];
+
+  for(size_t k = 0; k < n_pages; k ++) {
+    byte frame[DELTA_FRAME_SIZE];
+
+    if(read_fully(ctx, read, frame, DELTA_FRAME_SIZE) != 0) {
+      return HIBP_E_IO;
+    }
+
+    size_t i;
+
+    if(le_8_bytes_to_size_t(&i, frame) != 0 || i >= max_index) {
+      return HIBP_E_INVAL;
+    }
+
+    const size_t size = nth_page_size(buffer_size, i);
+
+    if(read_fully(ctx, read, page, size) != 0) {
+      return HIBP_E_IO;
+    }
+
+    byte digest[4];
+    page_digest(digest, frame, page, size);
+
+    if(memcmp(digest, frame + 8, 4) != 0) {
+      return HIBP_E_CHECKSUM;
+    }
+
+    if(lazy != NULL && !verify_lazily(bf, lazy, i * DIRTY_PAGE_SIZE)) {
+      return HIBP_E_CHECKSUM;
+    }
+
+    /* The hash functions are identical, so only the bit vector can differ */
+    const size_t first = (i * DIRTY_PAGE_SIZE < vector_offset) ? MIN(vector_offset - i * DIRTY_PAGE_SIZE, size) : 0;
+
+    if(combine_bytes(bf->buffer + i * DIRTY_PAGE_SIZE + first, page + first, size - first, 0) &&
+       bf->tracker != NULL) {
+      mark_dirty(bf, i * DIRTY_PAGE_SIZE);
+    }
+  }
+
+  return HIBP_OK;
+}
+
+status hibp_bf_apply_delta_file(bloom_filter* bf, FILE* file) {
+  return apply_delta(bf, file, file_read);
+}
+
+status hibp_bf_apply_delta_reader(bloom_filter* bf, void* ctx, read_t read) {
+  return apply_delta(bf, ctx, read);
+}
+
+/* Write size bytes at the given offset of fd, retrying short writes */
+static int pwrite_fully(int fd, const byte* buffer, size_t size, size_t offset) {
+  while(size > 0) {
+    const ssize_t written = pwrite(fd, buffer, size, (off_t)offset);
+
+    if(written <= 0) {
+      return -1;
+    }
+
+    buffer += written;
+    size -= written;
+    offset += written;
+  }
+
+  return 0;
+}
+
+/* Plumbing for hibp_bf_save_changes, which recomputes the digests of the chunks indexed
+ * by stale */
+typedef struct {
+  digest_job_t digests;
+  const size_t* stale;
+} stale_digest_job_t;
+
+static void compute_nth_stale_digest(void* ctx, size_t k) {
+  const stale_digest_job_t* job = (const stale_digest_job_t*)ctx;
+  compute_nth_digest((void*)&job->digests, job->stale[k]);
+}
+
+status hibp_bf_save_changes(bloom_filter* bf, const char* filename) {
+  const struct hibp_tracker_st* t = bf->tracker;
+  struct hibp_verifier_st* v = bf->verifier;
+
+  if(bf->mapping == NULL || t == NULL) {
+    return HIBP_E_INVAL;
+  }
+
+  size_t buffer_size;
+  status st = compute_buffer_size(&buffer_size, bf->layout, bf->hashing, bf->n_hash_functions, bf->log2_bits, bf->bits);
+  assert(st == HIBP_OK);
+
+  /* ================================
+   * Which chunks need new digests?
+   * ================================ */
+
+  size_t* stale = (size_t*)malloc(v->n_chunks * sizeof(size_t));
+
+  if(stale == NULL) {
+    return HIBP_E_NOMEM;
+  }
+
+  size_t n_stale = 0;
+
+  for(size_t i = 0; i < t->n_pages; i ++) {
+    if(!t->dirty[i]) {
+      continue;
+    }
+
+    const size_t chunk = (v->n_chunks == 1) ? 0 : (i * DIRTY_PAGE_SIZE) / v->chunk_size;
+
+    /* Never bless a corrupt chunk with a fresh digest */
+    if(v->states != NULL && __atomic_load_n(&v->states[chunk], __ATOMIC_ACQUIRE) == CHUNK_CORRUPT) {
+      free(stale);
+      return HIBP_E_CHECKSUM;
+    }
+
+    /* Pages are visited in order, so the chunks of dirty pages are too */
+    if(n_stale == 0 || stale[n_stale - 1] != chunk) {
+      stale[n_stale ++] = chunk;
+    }
+  }
+
+  /* ================================
+   * Pages
+   * ================================ */
+
+  const int fd = open(filename, O_WRONLY);
+
+  if(fd == -1) {
+    free(stale);
+    return HIBP_E_IO;
+  }
+
+  struct stat file_st;
+
+  /* Crude, but catches the most likely mistake, namely the wrong file */
+  if(fstat(fd, &file_st) == -1 || (unsigned long long)file_st.st_size != bf->mapping_size) {
+    close(fd);
+    free(stale);
+    return HIBP_E_INVAL;
+  }
+
+  const size_t buffer_offset = bf->buffer - (byte*)bf->mapping;
+
+  st = HIBP_OK;
+
+  /* Write runs of consecutive dirty pages with a single call */
+  for(size_t i = 0; st == HIBP_OK && i < t->n_pages; ) {
+    if(!t->dirty[i]) {
+      i ++;
+      continue;
+    }
+
+    size_t j = i;
+
+    while(j < t->n_pages && t->dirty[j]) {
+      j ++;
+    }
+
+    const size_t size = (j - 1) * DIRTY_PAGE_SIZE + nth_page_size(buffer_size, j - 1) - i * DIRTY_PAGE_SIZE;
+
+    if(pwrite_fully(fd, bf->buffer + i * DIRTY_PAGE_SIZE, size, buffer_offset + i * DIRTY_PAGE_SIZE) != 0) {
+      st = HIBP_E_IO;
+    }
+
+    i = j;
+  }
+
+  /* ================================
+   * Digests
+   * ================================ */
+
+  if(st == HIBP_OK && n_stale > 0) {
+    /* The mapping is private, so the stored digests can be updated in place; the filter
+     * then verifies against its new contents, just as the file does */
+    byte* digests = (byte*)v->digests;
+    const size_t size = digest_size(v->algorithm);
+
+    stale_digest_job_t job = {
+      { v->algorithm, v->chunk_size, v->n_chunks, bf->buffer, buffer_size, digests, NULL },
+      stale
+    };
+
+    hibp_parallel_for(n_stale, 0, compute_nth_stale_digest, &job);
+
+    const size_t digests_offset = digests - (byte*)bf->mapping;
+
+    for(size_t k = 0; st == HIBP_OK && k < n_stale; k ++) {
+      const size_t i = stale[k];
+
+      if(pwrite_fully(fd, digests + i * size, size, digests_offset + i * size) != 0) {
+        st = HIBP_E_IO;
+      }
+    }
+  }
+
+  free(stale);
+
+  if(st == HIBP_OK && fdatasync(fd) != 0) {
+    st = HIBP_E_IO;
+  }
+
+  /* Don't let close clobber errno */
+  const int error = errno;
+
+  if(close(fd) != 0 && st == HIBP_OK) {
+    return HIBP_E_IO;
+  }
+
+  errno = error;
+
+  if(st == HIBP_OK) {
+    memset(t->dirty, 0, t->n_pages);
+    bf->tracker->cleared = 0;
+  }
+
+  return st;
+}
+
+/* == Querying == */
+
+int hibp_bf_query(const bloom_filter* bf, size_t size, const byte* buffer) {
+  byte sha[SHA1_BYTES];
+  sha1(sha, size, buffer);
+  return hibp_bf_query_sha1(bf, sha);
+}
+
+int hibp_bf_query_str(const bloom_filter* bf, const char* str) {
+  return hibp_bf_query(bf, strlen(str), (const byte*)str);
+}
+
+/* hibp_bf_query_sha1 for large filters in the standard layout, in which every probe is
+ * likely a cache miss of its own. Each probe is prefetched as soon as it's computed, but
+ * only tested QUERY_LOOKAHEAD probes later, so that several misses are in flight at once
+ * rather than being waited on one after another */
+static inline int lookahead_probe(const byte* vector, size_t* pending, size_t n_probes, size_t bit) {
+  PREFETCH(vector + bit / 8);
+
+  /* pending is a ring of the probes yet to be tested; this slot holds the probe from
+   * QUERY_LOOKAHEAD probes ago, if any */
+  size_t* slot = &pending[n_probes % QUERY_LOOKAHEAD];
+
+  if(n_probes >= QUERY_LOOKAHEAD && !test_bit(vector, *slot)) {
+    return 0;
+  }
+
+  (*slot) = bit;
+
+  return 1;
+}
+
+static inline int query_sha1_lookahead(const bloom_filter* bf, const byte* sha, size_t* probes) {
+  const byte* vector = bvector(bf);
+  const compiled* c = bf->compiled;
+
+  size_t pending[QUERY_LOOKAHEAD];
+  size_t n_probes = 0;
+
+  if(bf->hashing == HIBP_HASHING_DOUBLE) {
+    double_hash_t dh;
+    init_double_hash(&dh, bf, sha);
+
+    for(; n_probes < bf->n_hash_functions; n_probes ++) {
+      if(!lookahead_probe(vector, pending, n_probes, nth_double_probe(bf, &dh, n_probes))) {
+        count_probes(probes, n_probes - QUERY_LOOKAHEAD + 1);
+        return 0;
+      }
+    }
+  } else {
+    for(size_t g = 0; g < c->n_groups; g ++) {
+      const size_t values = eval_nth_group(c, g, sha);
+
+      for(size_t i = c->group_firsts[g]; i < c->group_firsts[g + 1]; i ++) {
+        const size_t k = (values >> c->shifts[i]) & c->masks[i];
+        assert(k == eval_nth_hash_function(bf, i, sha));
+
+        if(!lookahead_probe(vector, pending, n_probes, select_bit(bf, k))) {
+          count_probes(probes, n_probes - QUERY_LOOKAHEAD + 1);
+          return 0;
+        }
+
+        n_probes ++;
+      }
+    }
+  }
+
+  /* Test the rest in the order that they were computed */
+  for(size_t j = n_probes - MIN(n_probes, QUERY_LOOKAHEAD); j < n_probes; j ++) {
+    if(!test_bit(vector, pending[j % QUERY_LOOKAHEAD])) {
+      count_probes(probes, j + 1);
+      return 0;
+    }
+  }
+
+  count_probes(probes, n_probes);
+
+  return 1;
+}
+
+/* Test the given bits of a filter opened with hibp_bf_page_file in turn, reading whichever
+ * pages aren't cached, until one is unset. A bit whose page can't be read is taken to be
+ * set, so as never to yield a false negative (as for a corrupt chunk) */
+static int test_paged_bits(const bloom_filter* bf, const size_t* bits, size_t n, size_t* probes) {
+  for(size_t i = 0; i < n; i ++) {
+    if(hibp_pager_test_bit(bf->pager, bits[i]) == 0) {
+      count_probes(probes, i + 1);
+      return 0;
+    }
+  }
+
+  count_probes(probes, n);
+
+  return 1;
+}
+
+static int query_sha1_paged(const bloom_filter* bf, const byte* sha, size_t* probes) {
+  /* hibp_bf_page_file refuses filters with more hash functions than this */
+  size_t bits[BATCH_WINDOW_PROBES];
+  const size_t n_probes = compute_probes(bits, bf, sha);
+
+  return test_paged_bits(bf, bits, n_probes, probes);
+}
+
+/* A batched query of a paged filter computes the probes of a window of elements, reads
+ * every page that they fall on at once, and only then tests them, so that the reads
+ * overlap one another. The window is bounded by the total number of probes */
+#define PAGED_WINDOW_PROBES 1024
+
+static void query_sha1_batch_paged(const bloom_filter* bf, size_t n, const byte* shas, int* results,
+                                   size_t* probes) {
+  size_t bits[PAGED_WINDOW_PROBES];
+  size_t starts[PAGED_WINDOW_PROBES + 1];
+
+  const size_t window = MAX(PAGED_WINDOW_PROBES / bf->n_hash_functions, 1);
+
+  for(size_t i = 0; i < n; i += window) {
+    const size_t m = MIN(window, n - i);
+
+    starts[0] = 0;
+
+    for(size_t j = 0; j < m; j ++) {
+      starts[j + 1] = starts[j] + compute_probes(bits + starts[j], bf, shas + (i + j) * SHA1_BYTES);
+    }
+
+    hibp_pager_prefetch(bf->pager, starts[m], bits);
+
+    for(size_t j = 0; j < m; j ++) {
+      results[i + j] = test_paged_bits(bf, bits + starts[j], starts[j + 1] - starts[j], probes);
+    }
+  }
+}
+
+static inline int query_sha1(const bloom_filter* bf, const byte* sha, size_t* probes) {
+  /* If, for some hash function h, the bit h(sha) is unset in the Bloom filter
+   * vector, then sha is guaranteed not to be present in the set. Otherwise, sha
+   * is present _with high probability_ */
+
+  if(bf->pager != NULL) {
+    return query_sha1_paged(bf, sha, probes);
+  }
+
+  const byte* vector = bvector(bf);
+  const compiled* c = bf->compiled;
+  struct hibp_verifier_st* lazy = lazy_verifier(bf);
+
+  if(bf->layout == HIBP_LAYOUT_STANDARD && bf->log2_bits >= LOG2_QUERY_LOOKAHEAD_BITS && lazy == NULL) {
+    return query_sha1_lookahead(bf, sha, probes);
+  }
+
+  const size_t first = first_probe(bf);
+
+  if(bf->hashing == HIBP_HASHING_DOUBLE) {
+    double_hash_t dh;
+    init_double_hash(&dh, bf, sha);
+
+    for(size_t i = first; i < bf->n_hash_functions; i ++) {
+      const size_t bit = nth_double_probe(bf, &dh, i);
+
+      if(lazy != NULL && !verify_lazily(bf, lazy, (vector - bf->buffer) + bit / 8)) {
+        count_probes(probes, i - first + 1);
+        return 1;
+      }
+
+      if(!test_bit(vector, bit)) {
+        count_probes(probes, i - first + 1);
+        return 0;
+      }
+    }
+
+    count_probes(probes, bf->n_hash_functions - first);
+
+    return 1;
+  }
+
+  size_t base = 0;
+
+  for(size_t g = 0; g < c->n_groups; g ++) {
+    const size_t values = eval_nth_group(c, g, sha);
+
+    for(size_t i = c->group_firsts[g]; i < c->group_firsts[g + 1]; i ++) {
+      const size_t k = (values >> c->shifts[i]) & c->masks[i];
+      assert(k == eval_nth_hash_function(bf, i, sha));
+
+      if(i < c->first_probe) {
+        base = select_block(bf, k);
+        continue;
+      }
+
+      const size_t bit = select_probe(bf, base, k);
+      assert(bit < bf->bits);
+
+      /* Report a corrupt chunk as present, so as never to yield a false negative */
+      if(lazy != NULL && !verify_lazily(bf, lazy, (vector - bf->buffer) + bit / 8)) {
+        count_probes(probes, i - first + 1);
+        return 1;
+      }
+
+      if(!test_bit(vector, bit)) {
+        count_probes(probes, i - first + 1);
+        return 0;
+      }
+    }
+  }
+
+  count_probes(probes, bf->n_hash_functions - first);
+
+  return 1;
+}
+
+int hibp_bf_query_sha1(const bloom_filter* bf, const byte* sha) {
+  size_t probes = 0;
+  const int result = query_sha1(bf, sha, STATS_PROBES(&probes));
+  count_queries(bf, 1, result, probes);
+  return result;
+}
+
+void hibp_bf_query_batch(const bloom_filter* bf, size_t n, const size_t* sizes, const byte* const* buffers,
+                         int* results) {
+  /* As for hibp_bf_insert_batch */
+  byte shas[BATCH_WINDOW_SHAS * HIBP_SHA1_BYTES];
+
+  for(size_t i = 0; i < n; i += BATCH_WINDOW_SHAS) {
+    const size_t m = MIN(BATCH_WINDOW_SHAS, n - i);
+
+    hibp_sha1_batch(shas, m, sizes + i, buffers + i);
+    hibp_bf_query_sha1_batch(bf, m, shas, results + i);
+  }
+}
+
+void hibp_bf_query_sha1_batch(const bloom_filter* bf, size_t n, const byte* shas, int* results) {
+  const size_t window = batch_window_size(bf);
+
+  if(window == 0 && bf->pager == NULL) {
+    for(size_t i = 0; i < n; i ++) {
+      results[i] = hibp_bf_query_sha1(bf, shas + i * SHA1_BYTES);
+    }
+    return;
+  }
+
+  size_t probes = 0;
+
+  if(bf->pager != NULL) {
+    query_sha1_batch_paged(bf, n, shas, results, STATS_PROBES(&probes));
+  } else {
+    for(size_t i = 0; i < n; i += window) {
+      query_sha1_window(bf, MIN(window, n - i), shas + i * SHA1_BYTES, results + i, STATS_PROBES(&probes));
+    }
+  }
+
+  if(bf->stats != NULL) {
+    size_t n_positives = 0;
+
+    for(size_t i = 0; i < n; i ++) {
+      n_positives += results[i];
+    }
+
+    count_queries(bf, n, n_positives, probes);
+  }
+}
+
+/* == Statistics == */
+
+/* Estimate the false positive rate (returned) and cardinality of a filter with the standard
+ * layout, given the number of bits set; see hibp_bf_get_stats */
+static double estimate_standard(const bloom_filter* bf, size_t bits_set, double* cardinality) {
+  const double k = (double)(bf->n_hash_functions - first_probe(bf));
+
+  /* Unless the filter is of a power of 2 size, multiply-shift maps the 2**log2_bits
+   * values of a hash function onto the bits unevenly: heavy bits are selected by two
+   * values, and are set (and probed) twice as often as the rest. With u = exp(-a) the
+   * probability that one of the rest is unset, where a = k * n / 2**log2_bits, a heavy
+   * bit is unset with probability u**2, so expecting the number of bits set that we
+   * observe is a quadratic in u */
+  const size_t heavy = pow2_sized(bf) ? 0 : ((((size_t)1) << (bf->log2_bits - 1)) << 1) - bf->bits;
+  const double light = (double)(bf->bits - heavy);
+  const double unset = (double)(bf->bits - bits_set);
+  const double values = ldexp(1, bf->log2_bits);
+
+  const double u = 2 * unset / (light + sqrt(light * light + 4 * heavy * unset));
+  const double p = (light * (1 - u) + 2 * heavy * (1 - u * u)) / values;
+
+  *cardinality = (bits_set == bf->bits) ? HUGE_VAL : log(1 / u) * values / k;
+
+  return pow(p, k);
+}
+
+static inline uint64_t read_counter(const uint64_t* counter) {
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+void hibp_bf_get_stats(hibp_filter_stats_t* stats, const bloom_filter* bf) {
+  const struct hibp_stats_st* s = bf->stats;
+
+  stats->counters_enabled = (s != NULL);
+  stats->n_queries = (s != NULL) ? read_counter(&s->n_queries) : 0;
+  stats->n_positives = (s != NULL) ? read_counter(&s->n_positives) : 0;
+  stats->n_probes = (s != NULL) ? read_counter(&s->n_probes) : 0;
+  stats->n_inserts = (s != NULL) ? read_counter(&s->n_inserts) : 0;
+  stats->load_seconds = (s != NULL) ? read_counter(&s->load_ns) / 1e9 : 0;
+  stats->verify_seconds = (s != NULL) ? read_counter(&s->verify_ns) / 1e9 : 0;
+  stats->save_seconds = (s != NULL) ? read_counter(&s->save_ns) / 1e9 : 0;
+
+  /* Given a fraction p of bits set, a probe finds a set bit with probability p, so a false
+   * positive has probability p**k; and inserting n elements is expected to leave a bit
+   * unset with probability (1 - 1 / m)**(k * n) ~= exp(-k * n / m), which solved for n
+   * estimates the cardinality (per Swamidass and Baldi, "Mathematical Correction for
+   * Fingerprint Similarity Measures to Improve Chemical Retrieval") */
+  const double k = (double)(bf->n_hash_functions - first_probe(bf));
+  const byte* vector = bvector(bf);
+
+  if(bf->layout == HIBP_LAYOUT_STANDARD) {
+    const size_t bits_set = hibp_popcount(vector, bvector_size(bf), NULL);
+
+    stats->bits_set = bits_set;
+    stats->fill_ratio = (double)bits_set / bf->bits;
+    stats->estimated_fpr = estimate_standard(bf, bits_set, &stats->estimated_cardinality);
+    return;
+  }
+
+  /* Each element lands in a single block, so the estimates are made block by block and
+   * combined. As above, unless the filter is of a power of 2 size, heavy blocks are
+   * selected by two values of the block-selecting hash function rather than one; there
+   * are 2**(log2_bits - 9) - n_blocks of them in all, spread evenly. b * heavy_blocks is
+   * tracked as e * n_blocks + t, so that heavy blocks are those that increment ceil(b *
+   * heavy_blocks / n_blocks) */
+  const size_t block_bits = ((size_t)1) << LOG2_BLOCK_BITS;
+  const size_t n_blocks = bf->bits >> LOG2_BLOCK_BITS;
+  const size_t log2_blocks = bf->log2_bits - LOG2_BLOCK_BITS;
+  const size_t heavy_blocks = pow2_sized(bf) ? 0 : ((((size_t)1) << log2_blocks) - n_blocks);
+
+  /* The number of blocks, light and heavy, with each number of bits set. LOG2_BLOCK_BITS
+   * isn't a constant expression */
+  size_t histogram[2][512 + 1] = { { 0 } };
+  assert(block_bits == 512);
+
+  /* Popcounts are taken a stack's worth of blocks at a time */
+  unsigned short counts[1024];
+
+  size_t bits_set = 0;
+  size_t e = 0;
+  size_t t = 0;
+
+  for(size_t first = 0; first < n_blocks; first += 1024) {
+    const size_t n = MIN(1024, n_blocks - first);
+    bits_set += hibp_popcount(vector + first * (block_bits / 8), n * (block_bits / 8), counts);
+
+    for(size_t b = 0; b < n; b ++) {
+      const size_t before = e + (t != 0);
+
+      t += heavy_blocks;
+
+      if(t >= n_blocks) {
+        t -= n_blocks;
+        e ++;
+      }
+
+      histogram[e + (t != 0) - before][counts[b]] ++;
+    }
+  }
+
+  double fpr = 0;
+  double cardinality = 0;
+
+  for(size_t c = 0; c <= block_bits; c ++) {
+    const size_t h = histogram[0][c] + histogram[1][c];
+
+    if(h == 0) {
+      continue;
+    }
+
+    const double p = (double)c / block_bits;
+
+    fpr += (histogram[0][c] + 2 * histogram[1][c]) * pow(p, k);
+    cardinality += (c == block_bits) ? HUGE_VAL : h * -(block_bits / k) * log1p(-p);
+  }
+
+  stats->bits_set = bits_set;
+  stats->fill_ratio = (double)bits_set / bf->bits;
+  stats->estimated_fpr = fpr / (n_blocks + heavy_blocks);
+  stats->estimated_cardinality = cardinality;
+}
+
+void hibp_bf_reset_stats(bloom_filter* bf) {
+  if(bf->stats != NULL) {
+    memset(bf->stats, 0, sizeof(struct hibp_stats_st));
+  }
+}
+
+double hibp_bf_fill_ratio(const bloom_filter* bf) {
+  return (double)hibp_popcount(bvector(bf), bvector_size(bf), NULL) / bf->bits;
+}
+
+/* == False positive estimation == */
+
+/* hibp_bf_estimate_fpr splits its trials into slices of this many, each drawing from a
+ * PRNG of its own, so that the outcome doesn't depend on how slices are spread across
+ * threads */
+#define FPR_SLICE_SIZE 65536
+
+/* wyrand, per Wang Yi's wyhash: a 64-bit PRNG passing BigCrush and PractRand, at about a
+ * multiplication per output */
+static inline uint64_t wymix(uint64_t x, uint64_t y) {
+  return mul_high_64(x, y) ^ (x * y);
+}
+
+static inline uint64_t wyrand(uint64_t* state) {
+  (*state) += 0xa0761d6478bd642full;
+  return wymix(*state, (*state) ^ 0xe7037ed1a0b428dbull);
+}
+
+typedef struct {
+  const bloom_filter* bf;
+  size_t trials;
+  uint64_t seed;
+  size_t window;
+  size_t positives;
+} fpr_job_t;
+
+static void estimate_nth_slice(void* ctx, size_t slice) {
+  fpr_job_t* job = (fpr_job_t*)ctx;
+  const bloom_filter* bf = job->bf;
+
+  const size_t first = slice * FPR_SLICE_SIZE;
+  const size_t last = MIN(job->trials, first + FPR_SLICE_SIZE);
+
+  uint64_t state = wymix(job->seed ^ 0x8ebc6af09c88c6e3ull, slice ^ 0x589965cc75374cc3ull);
+
+  byte shas[BATCH_WINDOW_SHAS * HIBP_SHA1_BYTES];
+  int results[BATCH_WINDOW_SHAS];
+  size_t positives = 0;
+
+  for(size_t i = first; i < last; i += BATCH_WINDOW_SHAS) {
+    const size_t m = MIN(BATCH_WINDOW_SHAS, last - i);
+
+    for(size_t j = 0; j < m; j ++) {
+      byte* sha = shas + j * SHA1_BYTES;
+      const uint64_t words[3] = { wyrand(&state), wyrand(&state), wyrand(&state) };
+      memcpy(sha, words, SHA1_BYTES);
+    }
+
+    if(job->window == 0) {
+      for(size_t j = 0; j < m; j ++) {
+        positives += query_sha1(bf, shas + j * SHA1_BYTES, NULL);
+      }
+      continue;
+    }
+
+    for(size_t j = 0; j < m; j += job->window) {
+      const size_t w = MIN(job->window, m - j);
+      query_sha1_window(bf, w, shas + j * SHA1_BYTES, results, NULL);
+
+      for(size_t r = 0; r < w; r ++) {
+        positives += results[r];
+      }
+    }
+  }
+
+  __atomic_fetch_add(&job->positives, positives, __ATOMIC_RELAXED);
+}
+
+void hibp_bf_estimate_fpr(hibp_fpr_estimate_t* estimate, const bloom_filter* bf, size_t trials,
+                          unsigned long long seed, size_t n_threads) {
+  fpr_job_t job = { bf, trials, (uint64_t)seed, batch_window_size(bf), 0 };
+
+  const size_t n_slices = (trials / FPR_SLICE_SIZE) + (trials % FPR_SLICE_SIZE != 0);
+  hibp_parallel_for(n_slices, n_threads, estimate_nth_slice, &job);
+
+  estimate->trials = trials;
+  estimate->positives = job.positives;
+
+  if(trials == 0) {
+    estimate->rate = 0;
+    estimate->lower = 0;
+    estimate->upper = 1;
+    return;
+  }
+
+  /* Wilson score interval, for z = 1.96 (i.e. 95% confidence) */
+  const double z = 1.959963984540054;
+  const double n = (double)trials;
+  const double p = (double)job.positives / n;
+  const double center = (p + z * z / (2 * n)) / (1 + z * z / n);
+  const double margin = (z / (1 + z * z / n)) * sqrt(p * (1 - p) / n + z * z / (4 * n * n));
+
+  estimate->rate = p;
+  estimate->lower = MAX(0, center - margin);
+  estimate->upper = MIN(1, center + margin);
+}
+
+/* == Sharded filters == */
+
+typedef hibp_sharded_filter_t sharded_filter;
+
+/* 2**20 shards is as fine-grained as the range API of HIBP, and already more files than is
+ * sensible. Also lets hibp_sf_shard_of get away with reading three bytes of the SHA1 */
+static const size_t LOG2_SHARDS_MAX = 20;
+
+/* The manifest is layed out as follows ([bytes] description):
+ * [4] version string
+ * [1] log2_shards
+ * [1] layout
+ * [8] n_hash_functions
+ * [1] log2_bits (per shard)
+ * [4] CRC32C of everything above (little-endian) */
+static const byte MANIFEST_VERSION[VERSION_SIZE] = { 0xb1, 0x5d, 0x13, 0x37 };
+
+#define MANIFEST_SIZE (VERSION_SIZE + 1 + 1 + 8 + 1 + 4)
+
+/* ".", at most five hex digits, and a null terminator */
+#define SHARD_SUFFIX_SIZE 7
+
+/* Validate the parameters of a sharded filter, and allocate and populate everything except
+ * the shards themselves, none of which are loaded */
+static status new_manifest(sharded_filter* sf, size_t log2_shards, hibp_layout_t layout,
+                           size_t n_hash_functions, size_t log2_bits) {
+  size_t buffer_size;
+  const status st = compute_buffer_size(&buffer_size, layout, HIBP_HASHING_RANDOM, n_hash_functions, log2_bits,
+                                        pow2_bits(log2_bits));
+
+  if(st != HIBP_OK) {
+    return st;
+  }
+
+  if(log2_shards > LOG2_SHARDS_MAX) {
+    return HIBP_E_2BIG;
+  }
+
+  const size_t n_shards = ((size_t)1) << log2_shards;
+
+  if(buffer_size > SIZE_MAX / n_shards) {
+    return HIBP_E_2BIG;
+  }
+
+  sf->log2_shards = log2_shards;
+  sf->layout = layout;
+  sf->n_hash_functions = n_hash_functions;
+  sf->log2_bits = log2_bits;
+
+  sf->shards = (bloom_filter*)malloc(n_shards * sizeof(bloom_filter));
+  sf->loaded = (byte*)calloc(n_shards, 1);
+
+  if(sf->shards == NULL || sf->loaded == NULL) {
+    free(sf->shards);
+    free(sf->loaded);
+    return HIBP_E_NOMEM;
+  }
+
+  return HIBP_OK;
+}
+
+static status new_sharded(sharded_filter* sf, size_t log2_shards, hibp_layout_t layout,
+                          size_t n_hash_functions, size_t log2_bits) {
+  const status st = new_manifest(sf, log2_shards, layout, n_hash_functions, log2_bits);
+
+  if(st != HIBP_OK) {
+    return st;
+  }
+
+  for(size_t i = 0; i < hibp_sf_n_shards(sf); i ++) {
+    const status shard_st =
+      new_prng(&sf->shards[i], layout, HIBP_HASHING_RANDOM, n_hash_functions, log2_bits,
+               pow2_bits(log2_bits), NULL, default_prng, log2_shards, NULL);
+
+    if(shard_st != HIBP_OK) {
+      hibp_sf_destroy(sf);
+      return shard_st;
+    }
+
+    sf->loaded[i] = 1;
+  }
+
+  return HIBP_OK;
+}
+
+status hibp_sf_new(sharded_filter* sf, size_t log2_shards, size_t n_hash_functions, size_t log2_bits) {
+  return new_sharded(sf, log2_shards, HIBP_LAYOUT_STANDARD, n_hash_functions, log2_bits);
+}
+
+status hibp_sf_new_blocked(sharded_filter* sf, size_t log2_shards, size_t n_hash_functions,
+                           size_t log2_bits) {
+  return new_sharded(sf, log2_shards, HIBP_LAYOUT_BLOCKED, n_hash_functions, log2_bits);
+}
+
+void hibp_sf_destroy(sharded_filter* sf) {
+  for(size_t i = 0; i < hibp_sf_n_shards(sf); i ++) {
+    if(sf->loaded[i]) {
+      hibp_bf_destroy(&sf->shards[i]);
+    }
+  }
+
+  free(sf->shards);
+  free(sf->loaded);
+}
+
+size_t hibp_sf_n_shards(const sharded_filter* sf) {
+  return ((size_t)1) << sf->log2_shards;
+}
+
+size_t hibp_sf_shard_of(const sharded_filter* sf, const byte* sha) {
+  const size_t prefix = ((size_t)sha[0] << 16) | ((size_t)sha[1] << 8) | sha[2];
+  return prefix >> (24 - sf->log2_shards);
+}
+
+bloom_filter* hibp_sf_shard(sharded_filter* sf, size_t i) {
+  assert(i < hibp_sf_n_shards(sf));
+  return sf->loaded[i] ? &sf->shards[i] : NULL;
+}
+
+/* The name of the file holding the i'th shard, allocated with malloc, or NULL if
+ * allocation fails */
+static char* shard_filename(const sharded_filter* sf, const char* filename, size_t i) {
+  char* name = (char*)malloc(strlen(filename) + SHARD_SUFFIX_SIZE);
+
+  if(name != NULL) {
+    const int digits = (sf->log2_shards == 0) ? 1 : (int)((sf->log2_shards + 3) / 4);
+    sprintf(name, "%s.%0*lx", filename, digits, (unsigned long)i);
+  }
+
+  return name;
+}
+
+/* Plumbing for the per-shard IO of hibp_sf_save_file and hibp_sf_load_file. Each shard
+ * records its own status and errno, which is thread-local */
+typedef struct {
+  status st;
+  int error;
+} shard_result_t;
+
+typedef struct {
+  sharded_filter* sf;
+  const char* filename;
+  size_t first;
+  hibp_format_t format;
+  int map;
+  int flags;
+  shard_result_t* results;
+} shard_io_job_t;
+
+static void save_nth_shard(void* ctx, size_t i) {
+  const shard_io_job_t* job = (const shard_io_job_t*)ctx;
+  shard_result_t* result = &job->results[i];
+
+  result->st = HIBP_OK;
+  result->error = 0;
+
+  if(!job->sf->loaded[i]) {
+    return;
+  }
+
+  char* name = shard_filename(job->sf, job->filename, i);
+
+  if(name == NULL) {
+    result->st = HIBP_E_NOMEM;
+    return;
+  }
+
+  FILE* file = fopen(name, "wb");
+  free(name);
+
+  if(file == NULL) {
+    result->st = HIBP_E_IO;
+    result->error = errno;
+    return;
+  }
+
+  result->st = hibp_bf_save_file_format(&job->sf->shards[i], file, job->format);
+  result->error = errno;
+
+  if(fclose(file) != 0 && result->st == HIBP_OK) {
+    result->st = HIBP_E_IO;
+    result->error = errno;
+  }
+}
+
+static void load_nth_shard(void* ctx, size_t k) {
+  const shard_io_job_t* job = (const shard_io_job_t*)ctx;
+  shard_result_t* result = &job->results[k];
+
+  const size_t i = job->first + k;
+  bloom_filter* bf = &job->sf->shards[i];
+
+  result->error = 0;
+
+  char* name = shard_filename(job->sf, job->filename, i);
+
+  if(name == NULL) {
+    result->st = HIBP_E_NOMEM;
+    return;
+  }
+
+  if(job->map) {
+    result->st = hibp_bf_map_file(bf, name, job->flags);
+    result->error = errno;
+  } else {
+    FILE* file = fopen(name, "rb");
+
+    if(file == NULL) {
+      result->st = HIBP_E_IO;
+      result->error = errno;
+    } else {
+      result->st = hibp_bf_load_file(bf, file);
+      result->error = errno;
+      fclose(file);
+    }
+  }
+
+  free(name);
+
+  if(result->st != HIBP_OK) {
+    return;
+  }
+
+  if(bf->layout != job->sf->layout || bf->hashing != HIBP_HASHING_RANDOM ||
+     bf->n_hash_functions != job->sf->n_hash_functions || bf->log2_bits != job->sf->log2_bits) {
+    hibp_bf_destroy(bf);
+    result->st = HIBP_E_INVAL;
+    return;
+  }
+
+  job->sf->loaded[i] = 1;
+}
+
+/* The first failure among n results, if any; errno is restored from it */
+static status first_failure(const shard_result_t* results, size_t n) {
+  for(size_t i = 0; i < n; i ++) {
+    if(results[i].st != HIBP_OK) {
+      errno = results[i].error;
+      return results[i].st;
+    }
+  }
+
+  return HIBP_OK;
+}
+
+status hibp_sf_save_file(const sharded_filter* sf, const char* filename, hibp_format_t format) {
+  if(!valid_format(format)) {
+    return HIBP_E_INVAL;
+  }
+
+  byte manifest[MANIFEST_SIZE];
+  memcpy(manifest, MANIFEST_VERSION, VERSION_SIZE);
+  manifest[VERSION_SIZE] = (byte)sf->log2_shards;
+  manifest[VERSION_SIZE + 1] = (byte)sf->layout;
+  size_t_to_le_8_bytes(manifest + VERSION_SIZE + 2, sf->n_hash_functions);
+  manifest[VERSION_SIZE + 10] = (byte)sf->log2_bits;
+  compute_digest(manifest + MANIFEST_SIZE - 4, CHECKSUM_CRC32C, MANIFEST_SIZE - 4, manifest);
+
+  FILE* file = fopen(filename, "wb");
+
+  if(file == NULL) {
+    return HIBP_E_IO;
+  }
+
+  const int written = (fwrite(manifest, 1, MANIFEST_SIZE, file) == MANIFEST_SIZE);
+
+  if(fclose(file) != 0 || !written) {
+    return HIBP_E_IO;
+  }
+
+  const size_t n_shards = hibp_sf_n_shards(sf);
+  shard_result_t* results = (shard_result_t*)malloc(n_shards * sizeof(shard_result_t));
+
+  if(results == NULL) {
+    return HIBP_E_NOMEM;
+  }
+
+  /* Shards are only read, so casting away the const is harmless */
+  shard_io_job_t job = { (sharded_filter*)sf, filename, 0, format, 0, 0, results };
+  hibp_parallel_for(n_shards, 0, save_nth_shard, &job);
+
+  const status st = first_failure(results, n_shards);
+  free(results);
+
+  return st;
+}
+
+static status load_sharded(sharded_filter* sf, const char* filename, size_t first, size_t n,
+                           int map, int flags) {
+  /* ================================
+   * Manifest
+   * ================================ */
+
+  FILE* file = fopen(filename, "rb");
+
+  if(file == NULL) {
+    return HIBP_E_IO;
+  }
+
+  byte manifest[MANIFEST_SIZE];
+  const int read = (fread(manifest, 1, MANIFEST_SIZE, file) == MANIFEST_SIZE);
+  fclose(file);
+
+  if(!read) {
+    return HIBP_E_IO;
+  }
+
+  if(memcmp(manifest, MANIFEST_VERSION, VERSION_SIZE) != 0) {
+    return HIBP_E_VERSION;
+  }
+
+  byte crc[4];
+  compute_digest(crc, CHECKSUM_CRC32C, MANIFEST_SIZE - 4, manifest);
+
+  if(memcmp(crc, manifest + MANIFEST_SIZE - 4, 4) != 0) {
+    return HIBP_E_CHECKSUM;
+  }
+
+  size_t n_hash_functions;
+
+  if(le_8_bytes_to_size_t(&n_hash_functions, manifest + VERSION_SIZE + 2) != 0) {
+    return HIBP_E_2BIG;
+  }
+
+  const status st = new_manifest(sf, manifest[VERSION_SIZE], (hibp_layout_t)manifest[VERSION_SIZE + 1],
+                                 n_hash_functions, manifest[VERSION_SIZE + 10]);
+
+  if(st != HIBP_OK) {
+    return st;
+  }
+
+  /* ================================
+   * Shards
+   * ================================ */
+
+  const size_t n_shards = hibp_sf_n_shards(sf);
+
+  first = MIN(first, n_shards);
+  n = MIN(n, n_shards - first);
+
+  shard_result_t* results = (shard_result_t*)malloc((n == 0 ? 1 : n) * sizeof(shard_result_t));
+
+  if(results == NULL) {
+    hibp_sf_destroy(sf);
+    return HIBP_E_NOMEM;
+  }
+
+  shard_io_job_t job = { sf, filename, first, HIBP_FORMAT_COMPACT, map, flags, results };
+  hibp_parallel_for(n, 0, load_nth_shard, &job);
+
+  const status shard_st = first_failure(results, n);
+  free(results);
+
+  if(shard_st != HIBP_OK) {
+    const int error = errno;
+    hibp_sf_destroy(sf);
+    errno = error;
+  }
+
+  return shard_st;
+}
+
+status hibp_sf_load_file(sharded_filter* sf, const char* filename, size_t first, size_t n) {
+  return load_sharded(sf, filename, first, n, 0, 0);
+}
+
+status hibp_sf_map_file(sharded_filter* sf, const char* filename, size_t first, size_t n, int flags) {
+  return load_sharded(sf, filename, first, n, 1, flags);
+}
+
+void hibp_sf_insert(sharded_filter* sf, size_t size, const byte* buffer) {
+  byte sha[SHA1_BYTES];
+  sha1(sha, size, buffer);
+  hibp_sf_insert_sha1(sf, sha);
+}
+
+void hibp_sf_insert_str(sharded_filter* sf, const char* str) {
+  hibp_sf_insert(sf, strlen(str), (const byte*)str);
+}
+
+void hibp_sf_insert_sha1(sharded_filter* sf, const byte* sha) {
+  bloom_filter* bf = hibp_sf_shard(sf, hibp_sf_shard_of(sf, sha));
+
+  if(bf != NULL) {
+    hibp_bf_insert_sha1(bf, sha);
+  }
+}
+
+int hibp_sf_query(const sharded_filter* sf, size_t size, const byte* buffer) {
+  byte sha[SHA1_BYTES];
+  sha1(sha, size, buffer);
+  return hibp_sf_query_sha1(sf, sha);
+}
+
+int hibp_sf_query_str(const sharded_filter* sf, const char* str) {
+  return hibp_sf_query(sf, strlen(str), (const byte*)str);
+}
+
+int hibp_sf_query_sha1(const sharded_filter* sf, const byte* sha) {
+  const size_t i = hibp_sf_shard_of(sf, sha);
+  return sf->loaded[i] ? hibp_bf_query_sha1(&sf->shards[i], sha) : 1;
+}
+
+/* Partition n SHAs by shard with a counting sort, such that the indices of the SHAs of
+ * the s'th shard are (*order)[(*starts)[s] .. (*starts)[s + 1]). Returns HIBP_E_NOMEM or
+ * HIBP_OK; in the latter case, the caller frees *order and *starts */
+static status partition_by_shard(size_t** order, size_t** starts, const sharded_filter* sf,
+                                 size_t n, const byte* shas) {
+  const size_t n_shards = hibp_sf_n_shards(sf);
+
+  *order = (size_t*)malloc((n == 0 ? 1 : n) * sizeof(size_t));
+  *starts = (size_t*)calloc(n_shards + 1, sizeof(size_t));
+
+  if(*order == NULL || *starts == NULL) {
+    free(*order);
+    free(*starts);
+    return HIBP_E_NOMEM;
+  }
+
+  size_t* st = *starts;
+
+  for(size_t i = 0; i < n; i ++) {
+    st[hibp_sf_shard_of(sf, shas + i * SHA1_BYTES) + 1] ++;
+  }
+
+  for(size_t s = 0; s < n_shards; s ++) {
+    st[s + 1] += st[s];
+  }
+
+  /* Use st[s] as the cursor for the s'th shard. Once every index has been placed, st[s]
+   * is where the (s + 1)'th shard starts, so shift everything back by one */
+  for(size_t i = 0; i < n; i ++) {
+    (*order)[st[hibp_sf_shard_of(sf, shas + i * SHA1_BYTES)] ++] = i;
+  }
+
+  memmove(st + 1, st, n_shards * sizeof(size_t));
+  st[0] = 0;
+
+  return HIBP_OK;
+}
+
+/* Plumbing for hibp_sf_insert_sha1_parallel and hibp_sf_query_sha1_batch. results is NULL
+ * for insertion */
+typedef struct {
+  const sharded_filter* sf;
+  const byte* shas;
+  const size_t* order;
+  const size_t* starts;
+  int* results;
+} route_job_t;
+
+/* Insert or query the SHAs of the s'th shard, gathering them into batches */
+static void route_nth_shard(void* ctx, size_t s) {
+  const route_job_t* job = (const route_job_t*)ctx;
+
+  const size_t first = job->starts[s];
+  const size_t last = job->starts[s + 1];
+
+  if(!job->sf->loaded[s]) {
+    for(size_t i = first; job->results != NULL && i < last; i ++) {
+      job->results[job->order[i]] = 1;
+    }
+    return;
+  }
+
+  bloom_filter* bf = &job->sf->shards[s];
+
+  byte batch[BATCH_WINDOW_SHAS * HIBP_SHA1_BYTES];
+  int batch_results[BATCH_WINDOW_SHAS];
+
+  for(size_t i = first; i < last; i += BATCH_WINDOW_SHAS) {
+    const size_t m = MIN(BATCH_WINDOW_SHAS, last - i);
+
+    for(size_t j = 0; j < m; j ++) {
+      memcpy(batch + j * SHA1_BYTES, job->shas + job->order[i + j] * SHA1_BYTES, SHA1_BYTES);
+    }
+
+    if(job->results == NULL) {
+      hibp_bf_insert_sha1_batch(bf, m, batch);
+      continue;
+    }
+
+    hibp_bf_query_sha1_batch(bf, m, batch, batch_results);
+
+    for(size_t j = 0; j < m; j ++) {
+      job->results[job->order[i + j]] = batch_results[j];
+    }
+  }
+}
+
+void hibp_sf_insert_sha1_parallel(sharded_filter* sf, size_t n, const byte* shas, size_t n_threads) {
+  size_t* order;
+  size_t* starts;
+
+  if(partition_by_shard(&order, &starts, sf, n, shas) != HIBP_OK) {
+    for(size_t i = 0; i < n; i ++) {
+      hibp_sf_insert_sha1(sf, shas + i * SHA1_BYTES);
+    }
+    return;
+  }
+
+  /* Shards are disjoint, so no two threads ever touch the same filter */
+  route_job_t job = { sf, shas, order, starts, NULL };
+  hibp_parallel_for(hibp_sf_n_shards(sf), n_threads, route_nth_shard, &job);
+
+  free(order);
+  free(starts);
+}
+
+void hibp_sf_query_sha1_batch(const sharded_filter* sf, size_t n, const byte* shas, int* results) {
+  size_t* order;
+  size_t* starts;
+
+  /* Partitioning costs O(n_shards), which isn't worth it for a batch that's small by
+   * comparison */
+  if(n < hibp_sf_n_shards(sf) || partition_by_shard(&order, &starts, sf, n, shas) != HIBP_OK) {
+    for(size_t i = 0; i < n; i ++) {
+      results[i] = hibp_sf_query_sha1(sf, shas + i * SHA1_BYTES);
+    }
+    return;
+  }
+
+  route_job_t job = { sf, shas, order, starts, results };
+
+  for(size_t s = 0; s < hibp_sf_n_shards(sf); s ++) {
+    route_nth_shard(&job, s);
+  }
+
+  free(order);
+  free(starts);
+}
+
+/* == Counting filters == */
+
+typedef hibp_counting_filter_t counting_filter;
+
+/* A counting filter is saved as follows ([bytes] description):
+ * [4]           version string
+ * [...]         the underlying filter, in the compact format
+ * [8 * n_words] the counters, as little-endian 64-bit words
+ * [4]           CRC32C of the counters, as saved (little-endian) */
+static const byte COUNTING_VERSION[VERSION_SIZE] = { 0xb1, 0xcf, 0x13, 0x37 };
+
+#define COUNTER_BITS 4
+#define COUNTER_MAX 15
+#define COUNTERS_PER_WORD (64 / COUNTER_BITS)
+#define COUNTERS_ALIGNMENT 64
+
+/* Counters are saved and loaded this many words at a time */
+#define COUNTER_IO_WORDS 512
+
+static inline size_t counter_words(const bloom_filter* bf) {
+  return (bf->bits / COUNTERS_PER_WORD) + (bf->bits % COUNTERS_PER_WORD != 0);
+}
+
+static inline size_t nth_counter(const uint64_t* counters, size_t i) {
+  return (counters[i / COUNTERS_PER_WORD] >> (COUNTER_BITS * (i % COUNTERS_PER_WORD))) & COUNTER_MAX;
+}
+
+static status alloc_counters(counting_filter* cf) {
+  const size_t n_words = counter_words(&cf->filter);
+  void* counters;
+
+  if(posix_memalign(&counters, COUNTERS_ALIGNMENT, n_words * sizeof(uint64_t)) != 0) {
+    return HIBP_E_NOMEM;
+  }
+
+  cf->counters = (uint64_t*)counters;
+
+  return HIBP_OK;
+}
+
+status hibp_cf_new(counting_filter* cf, hibp_layout_t layout, hibp_hashing_t hashing,
+                   size_t n_hash_functions, size_t bits) {
+  /* Four bits of counter per bit of the vector */
+  if(bits > SIZE_MAX / COUNTER_BITS / 2) {
+    return HIBP_E_2BIG;
+  }
+
+  const status st = hibp_bf_new_bits(&cf->filter, layout, hashing, n_hash_functions, bits);
+
+  if(st != HIBP_OK) {
+    return st;
+  }
+
+  if(alloc_counters(cf) != HIBP_OK) {
+    hibp_bf_destroy(&cf->filter);
+    return HIBP_E_NOMEM;
+  }
+
+  memset(cf->counters, 0, counter_words(&cf->filter) * sizeof(uint64_t));
+
+  return HIBP_OK;
+}
+
+void hibp_cf_destroy(counting_filter* cf) {
+  free(cf->counters);
+  hibp_bf_destroy(&cf->filter);
+}
+
+const bloom_filter* hibp_cf_filter(const counting_filter* cf) {
+  return &cf->filter;
+}
+
+status hibp_cf_collapse(bloom_filter* dst, const counting_filter* cf) {
+  return hibp_bf_new_copy(dst, &cf->filter, NULL);
+}
+
+/* Add delta (either 1 or -1) to the counter of the given bit of the vector of cf, unless
+ * it's saturated (or, for -1, already 0), and set or clear the bit if the counter leaves
+ * or reaches 0 */
+static inline void update_counter(counting_filter* cf, byte* vector, size_t bit, int delta) {
+  bloom_filter* bf = &cf->filter;
+  uint64_t* word = &cf->counters[bit / COUNTERS_PER_WORD];
+  const size_t shift = COUNTER_BITS * (bit % COUNTERS_PER_WORD);
+  const size_t counter = ((*word) >> shift) & COUNTER_MAX;
+
+  if(counter == COUNTER_MAX || (counter == 0 && delta < 0)) {
+    return;
+  }
+
+  if(delta > 0) {
+    (*word) += ((uint64_t)1) << shift;
+  } else {
+    (*word) -= ((uint64_t)1) << shift;
+  }
+
+  if(counter == 0) {
+    vector[bit / 8] |= (1 << (bit % 8));
+
+    if(bf->tracker != NULL) {
+      mark_dirty(bf, (vector - bf->buffer) + bit / 8);
+    }
+  } else if(counter == 1 && delta < 0) {
+    vector[bit / 8] &= ~(1 << (bit % 8));
+
+    if(bf->tracker != NULL) {
+      mark_cleared(bf, (vector - bf->buffer) + bit / 8);
+    }
+  }
+}
+
+/* Apply update_counter to every bit that cf's filter sets for sha, evaluating the hash
+ * functions as hibp_bf_insert_sha1 does */
+static void update_counters(counting_filter* cf, const byte* sha, int delta) {
+  const bloom_filter* bf = &cf->filter;
+  byte* vector = bvector(bf);
+
+  if(bf->hashing == HIBP_HASHING_DOUBLE) {
+    double_hash_t dh;
+    init_double_hash(&dh, bf, sha);
+
+    for(size_t i = first_probe(bf); i < bf->n_hash_functions; i ++) {
+      update_counter(cf, vector, nth_double_probe(bf, &dh, i), delta);
+    }
+
+    return;
+  }
+
+  const compiled* c = bf->compiled;
+  size_t base = 0;
+
+  for(size_t g = 0; g < c->n_groups; g ++) {
+    const size_t values = eval_nth_group(c, g, sha);
+
+    for(size_t i = c->group_firsts[g]; i < c->group_firsts[g + 1]; i ++) {
+      const size_t k = (values >> c->shifts[i]) & c->masks[i];
+      assert(k == eval_nth_hash_function(bf, i, sha));
+
+      if(i < c->first_probe) {
+        base = select_block(bf, k);
+        continue;
+      }
+
+      update_counter(cf, vector, select_probe(bf, base, k), delta);
+    }
+  }
+}
+
+void hibp_cf_insert(counting_filter* cf, size_t size, const byte* buffer) {
+  byte sha[SHA1_BYTES];
+  sha1(sha, size, buffer);
+  hibp_cf_insert_sha1(cf, sha);
+}
+
+void hibp_cf_insert_str(counting_filter* cf, const char* str) {
+  hibp_cf_insert(cf, strlen(str), (const byte*)str);
+}
+
+void hibp_cf_insert_sha1(counting_filter* cf, const byte* sha) {
+  STATS_ADD(&cf->filter, n_inserts, 1);
+  update_counters(cf, sha, 1);
+}
+
+status hibp_cf_remove(counting_filter* cf, size_t size, const byte* buffer) {
+  byte sha[SHA1_BYTES];
+  sha1(sha, size, buffer);
+  return hibp_cf_remove_sha1(cf, sha);
+}
+
+status hibp_cf_remove_str(counting_filter* cf, const char* str) {
+  return hibp_cf_remove(cf, strlen(str), (const byte*)str);
+}
+
+status hibp_cf_remove_sha1(counting_filter* cf, const byte* sha) {
+  /* Since a bit is set exactly when its counter is nonzero, a negative query means that
+   * some counter is 0, and that the element can't have been inserted */
+  if(!query_sha1(&cf->filter, sha, NULL)) {
+    return HIBP_E_INVAL;
+  }
+
+  update_counters(cf, sha, -1);
+
+  return HIBP_OK;
+}
+
+static status save_counting(const counting_filter* cf, void* ctx, write_t write) {
+  if(write_fully(ctx, write, COUNTING_VERSION, VERSION_SIZE) != 0) {
+    return HIBP_E_IO;
+  }
+
+  const status st = save_writer(&cf->filter, ctx, write, HIBP_FORMAT_COMPACT);
+
+  if(st != HIBP_OK) {
+    return st;
+  }
+
+  const size_t n_words = counter_words(&cf->filter);
+  byte block[COUNTER_IO_WORDS * 8];
+  uint32_t crc = 0;
+
+  for(size_t i = 0; i < n_words; i += COUNTER_IO_WORDS) {
+    const size_t n = MIN(COUNTER_IO_WORDS, n_words - i);
+
+    for(size_t j = 0; j < n; j ++) {
+      const uint64_t word = cf->counters[i + j];
+
+      for(size_t b = 0; b < 8; b ++) {
+        block[8 * j + b] = (word >> (8 * b)) & 0xff;
+      }
+    }
+
+    crc = hibp_crc32c(crc, block, 8 * n);
+
+    if(write_fully(ctx, write, block, 8 * n) != 0) {
+      return HIBP_E_IO;
+    }
+  }
+
+  byte checksum[4];
+
+  for(size_t i = 0; i < 4; i ++) {
+    checksum[i] = (crc >> (8 * i)) & 0xff;
+  }
+
+  return (write_fully(ctx, write, checksum, 4) == 0) ? HIBP_OK : HIBP_E_IO;
+}
+
+status hibp_cf_save_file(const counting_filter* cf, FILE* file) {
+  return save_counting(cf, file, file_write);
+}
+
+status hibp_cf_save_writer(const counting_filter* cf, void* ctx, write_t write) {
+  return save_counting(cf, ctx, write);
+}
+
+/* Read the counters (and their checksum) of a counting filter whose underlying filter
+ * has just been loaded, and check them against its bit vector */
+static status read_counters(counting_filter* cf, void* ctx, read_t read) {
+  const bloom_filter* bf = &cf->filter;
+  const size_t n_words = counter_words(bf);
+  byte block[COUNTER_IO_WORDS * 8];
+  uint32_t crc = 0;
+
+  for(size_t i = 0; i < n_words; i += COUNTER_IO_WORDS) {
+    const size_t n = MIN(COUNTER_IO_WORDS, n_words - i);
+
+    if(read_fully(ctx, read, block, 8 * n) != 0) {
+      return HIBP_E_IO;
+    }
+
+    crc = hibp_crc32c(crc, block, 8 * n);
+
+    for(size_t j = 0; j < n; j ++) {
+      cf->counters[i + j] = le_8_bytes_to_uint64(block + 8 * j);
+    }
+  }
+
+  byte checksum[4];
+
+  if(read_fully(ctx, read, checksum, 4) != 0) {
+    return HIBP_E_IO;
+  }
+
+  for(size_t i = 0; i < 4; i ++) {
+    if(checksum[i] != ((crc >> (8 * i)) & 0xff)) {
+      return HIBP_E_CHECKSUM;
+    }
+  }
+
+  /* Every bit must be set exactly if its counter is nonzero, and there must be no
+   * counters past the end of the bit vector */
+  const byte* vector = bvector(bf);
+
+  for(size_t i = 0; i < bf->bits; i ++) {
+    if((nth_counter(cf->counters, i) != 0) != test_bit(vector, i)) {
+      return HIBP_E_CHECKSUM;
+    }
+  }
+
+  for(size_t i = bf->bits; i < n_words * COUNTERS_PER_WORD; i ++) {
+    if(nth_counter(cf->counters, i) != 0) {
+      return HIBP_E_CHECKSUM;
+    }
+  }
+
+  return HIBP_OK;
+}
+
+static status load_counting(counting_filter* cf, void* ctx, read_t read) {
+  byte version[VERSION_SIZE];
+
+  if(read_fully(ctx, read, version, VERSION_SIZE) != 0) {
+    return HIBP_E_IO;
+  }
+
+  if(memcmp(version, COUNTING_VERSION, VERSION_SIZE) != 0) {
+    return HIBP_E_VERSION;
+  }
+
+  const status st = load_reader(&cf->filter, ctx, read, NULL);
+
+  if(st != HIBP_OK) {
+    return st;
+  }
+
+  if(cf->filter.bits > SIZE_MAX / COUNTER_BITS / 2 || alloc_counters(cf) != HIBP_OK) {
+    hibp_bf_destroy(&cf->filter);
+    return HIBP_E_NOMEM;
+  }
+
+  const status cst = read_counters(cf, ctx, read);
+
+  if(cst != HIBP_OK) {
+    hibp_cf_destroy(cf);
+    return cst;
+  }
+
+  return HIBP_OK;
+}
+
+status hibp_cf_load_file(counting_filter* cf, FILE* file) {
+  return load_counting(cf, file, file_read);
+}
+
+status hibp_cf_load_reader(counting_filter* cf, void* ctx, read_t read) {
+  return load_counting(cf, ctx, read);
+}
+
+/* == Fuse filters == */
+
+typedef hibp_fuse_filter_t fuse_filter;
+typedef hibp_fuse_builder_t fuse_builder;
+
+/* A fuse filter is saved as follows ([bytes] description):
+ * [4] version string
+ * [1] fingerprint_bits
+ * [1] log2_shards
+ * then, for each shard:
+ * [8] seed
+ * [8] segment_length
+ * [8] segment_count_length
+ * [8] array_length
+ * [array_length * fingerprint_bits / 8] fingerprints (little-endian)
+ * and finally:
+ * [4] CRC32C of everything above (little-endian) */
+static const byte FUSE_VERSION[VERSION_SIZE] = { 0xb1, 0xf5, 0x13, 0x37 };
+
+#define FUSE_SHARD_HEADER_SIZE 32
+
+/* Per Graf and Lemire, segments of more than 2**18 slots don't help */
+#define FUSE_SEGMENT_LENGTH_MAX 262144
+
+/* Construction fails with probability well under 1% per seed; give up after this many */
+#define FUSE_MAX_ATTEMPTS 100
+
+/* The parameters and fingerprints of a shard of a fuse filter. The array of fingerprints
+ * is segment_count + 2 segments of segment_length slots each, and an element's three
+ * slots lie in three consecutive segments */
+struct hibp_fuse_shard_st {
+  uint64_t seed;
+  size_t segment_length;
+  size_t segment_length_mask;
+  size_t segment_count_length;
+  size_t array_length;
+
+  /* uint8_t or uint16_t, by fingerprint_bits. NULL if array_length is 0 */
+  void* fingerprints;
+};
+
+/* A growable array of the keys of a shard's elements */
+struct hibp_fuse_bucket_st {
+  uint64_t* keys;
+  size_t n;
+  size_t capacity;
+};
+
+/* The key of an element is 64 bits of its SHA1, disjoint from the prefix that selects its
+ * shard */
+static inline uint64_t fuse_key(const byte* sha) {
+  return le_8_bytes_to_uint64(sha + SHA1_BYTES - 8);
+}
+
+static inline size_t fuse_shard_of(size_t log2_shards, const byte* sha) {
+  const size_t prefix = ((size_t)sha[0] << 16) | ((size_t)sha[1] << 8) | sha[2];
+  return prefix >> (24 - log2_shards);
+}
+
+/* The finalizer of MurmurHash3, a bijection on 64-bit words */
+static inline uint64_t murmur64(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+static inline uint64_t splitmix64(uint64_t* state) {
+  uint64_t z = ((*state) += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+static inline uint32_t fuse_fingerprint(uint64_t hash) {
+  return (uint32_t)(hash ^ (hash >> 32));
+}
+
+/* The index'th slot (of 0, 1, 2) of the element with the given hash. The first slot lies
+ * anywhere in the first segment_count segments, and the others in the two segments after
+ * it, at offsets taken from the low 36 bits of the hash */
+static inline size_t fuse_slot(const struct hibp_fuse_shard_st* s, size_t index, uint64_t hash) {
+  size_t h = (size_t)mul_high_64(hash, s->segment_count_length) + index * s->segment_length;
+  const uint64_t low = hash & ((((uint64_t)1) << 36) - 1);
+  return h ^ (size_t)((low >> (36 - 18 * index)) & s->segment_length_mask);
+}
+
+static inline uint32_t get_fingerprint(const struct hibp_fuse_shard_st* s, size_t bits, size_t i) {
+  return (bits == 8) ? ((const uint8_t*)s->fingerprints)[i] : ((const uint16_t*)s->fingerprints)[i];
+}
+
+static inline void set_fingerprint(struct hibp_fuse_shard_st* s, size_t bits, size_t i, uint32_t f) {
+  if(bits == 8) {
+    ((uint8_t*)s->fingerprints)[i] = (uint8_t)f;
+  } else {
+    ((uint16_t*)s->fingerprints)[i] = (uint16_t)f;
+  }
+}
+
+/* Size the array of a shard for n elements, per Graf and Lemire's reference
+ * implementation */
+static void size_fuse_shard(struct hibp_fuse_shard_st* s, size_t n) {
+  const double log_n = log((double)MAX(n, 1));
+  size_t segment_length = ((size_t)1) << (size_t)floor(log_n / log(3.33) + 2.25);
+
+  segment_length = MIN(segment_length, FUSE_SEGMENT_LENGTH_MAX);
+
+  const double size_factor = (n <= 1) ? 0 : MAX(1.125, 0.875 + 0.25 * log(1000000.0) / log_n);
+  const size_t capacity = (size_t)round(n * size_factor);
+
+  /* At least one segment for the first slots, and two more for the others */
+  size_t segment_count = (capacity + segment_length - 1) / segment_length;
+  segment_count = (segment_count <= 2) ? 1 : segment_count - 2;
+
+  s->segment_length = segment_length;
+  s->segment_length_mask = segment_length - 1;
+  s->segment_count_length = segment_count * segment_length;
+  s->array_length = (segment_count + 2) * segment_length;
+}
+
+static int compare_keys(const void* x, const void* y) {
+  const uint64_t a = *(const uint64_t*)x;
+  const uint64_t b = *(const uint64_t*)y;
+  return (a > b) - (a < b);
+}
+
+/* Elements are first laid out in about as many blocks as s has segments, roughly in order
+ * of their first slot, which makes peeling much friendlier to the cache */
+static size_t fuse_log2_blocks(const struct hibp_fuse_shard_st* s) {
+  const size_t n_segments = s->segment_count_length / s->segment_length;
+  size_t log2_blocks = 1;
+
+  while((((size_t)1) << log2_blocks) < n_segments) {
+    log2_blocks ++;
+  }
+
+  return log2_blocks;
+}
+
+/* Build the fingerprints of s from n distinct keys, by peeling: repeatedly find a slot
+ * used by only one element, and set that element aside to be assigned that slot. If
+ * every element can be set aside, then assigning fingerprints in the reverse order never
+ * disturbs the slots of the elements already assigned. Returns 0 on success, or -1 if
+ * peeling fails with every seed tried. The scratch space is about 24 bytes per key; order
+ * has room for n + 1 hashes, and starts for one index per block (see fuse_log2_blocks) */
+static int populate_fuse_shard(struct hibp_fuse_shard_st* s, size_t fingerprint_bits, const uint64_t* keys,
+                               size_t n, uint64_t* order, byte* order_slots, uint32_t* alone, byte* counts,
+                               uint64_t* xors, size_t* starts) {
+  const size_t length = s->array_length;
+  const size_t log2_blocks = fuse_log2_blocks(s);
+  const size_t n_blocks = ((size_t)1) << log2_blocks;
+
+  uint64_t rng = 0x726b2b9d438b9d4dull;
+
+  for(size_t attempt = 0; attempt < FUSE_MAX_ATTEMPTS; attempt ++) {
+    s->seed = splitmix64(&rng);
+
+    /* order has a nonzero sentinel at the end, past which the probing below never goes */
+    memset(order, 0, n * sizeof(uint64_t));
+    order[n] = 1;
+    memset(counts, 0, length);
+    memset(xors, 0, length * sizeof(uint64_t));
+
+    for(size_t i = 0; i < n_blocks; i ++) {
+      starts[i] = (size_t)(((uint64_t)i * n) >> log2_blocks);
+    }
+
+    /* A hash of 0 marks an empty position, and murmur64 is a bijection, so the one key
+     * that hashes to 0 gets another seed */
+    int zero = 0;
+
+    for(size_t i = 0; i < n; i ++) {
+      const uint64_t hash = murmur64(keys[i] + s->seed);
+      size_t block = (size_t)(hash >> (64 - log2_blocks));
+
+      zero |= (hash == 0);
+
+      while(order[starts[block]] != 0) {
+        block = (block + 1) & (n_blocks - 1);
+      }
+
+      order[starts[block] ++] = hash;
+    }
+
+    if(zero) {
+      continue;
+    }
+
+    /* Each slot counts the elements using it (in the upper six bits) and XORs together
+     * their hashes and their indices of the slot (0, 1, or 2) in the lower two bits, so
+     * that once one element is left, the slot tells us which element, and which of its
+     * slots it is */
+    int overflow = 0;
+
+    for(size_t i = 0; i < n; i ++) {
+      const uint64_t hash = order[i];
+
+      for(size_t index = 0; index < 3; index ++) {
+        const size_t slot = fuse_slot(s, index, hash);
+        counts[slot] = (byte)((counts[slot] + 4) ^ index);
+        xors[slot] ^= hash;
+        overflow |= (counts[slot] < 4);
+      }
+    }
+
+    /* More than 63 elements in one slot */
+    if(overflow) {
+      continue;
+    }
+
+    size_t n_alone = 0;
+
+    for(size_t i = 0; i < length; i ++) {
+      alone[n_alone] = (uint32_t)i;
+      n_alone += ((counts[i] >> 2) == 1);
+    }
+
+    size_t n_peeled = 0;
+
+    while(n_alone > 0) {
+      const size_t slot = alone[-- n_alone];
+
+      if((counts[slot] >> 2) != 1) {
+        continue;
+      }
+
+      const uint64_t hash = xors[slot];
+      const size_t found = counts[slot] & 3;
+
+      order[n_peeled] = hash;
+      order_slots[n_peeled] = (byte)found;
+      n_peeled ++;
+
+      /* Take the element out of its other two slots */
+      for(size_t index = 0; index < 3; index ++) {
+        if(index == found) {
+          continue;
+        }
+
+        const size_t other = fuse_slot(s, index, hash);
+
+        alone[n_alone] = (uint32_t)other;
+        n_alone += ((counts[other] >> 2) == 2);
+
+        counts[other] = (byte)((counts[other] - 4) ^ index);
+        xors[other] ^= hash;
+      }
+    }
+
+    if(n_peeled != n) {
+      continue;
+    }
+
+    memset(s->fingerprints, 0, length * (fingerprint_bits / 8));
+
+    for(size_t i = n; i -- > 0; ) {
+      const uint64_t hash = order[i];
+      size_t slots[3];
+
+      for(size_t index = 0; index < 3; index ++) {
+        slots[index] = fuse_slot(s, index, hash);
+      }
+
+      const size_t found = order_slots[i];
+      uint32_t f = fuse_fingerprint(hash);
+
+      for(size_t index = 0; index < 3; index ++) {
+        if(index != found) {
+          f ^= get_fingerprint(s, fingerprint_bits, slots[index]);
+        }
+      }
+
+      set_fingerprint(s, fingerprint_bits, slots[found], f);
+    }
+
+    return 0;
+  }
+
+  return -1;
+}
+
+/* Build the shard of a fuse filter from the keys of a bucket, which are consumed */
+static status build_fuse_shard(struct hibp_fuse_shard_st* s, size_t fingerprint_bits,
+                               struct hibp_fuse_bucket_st* bucket) {
+  uint64_t* keys = bucket->keys;
+  size_t n = bucket->n;
+
+  bucket->keys = NULL;
+  bucket->n = 0;
+  bucket->capacity = 0;
+
+  /* Sorting removes duplicates, and makes the result independent of the order in which
+   * the keys were added */
+  qsort(keys, n, sizeof(uint64_t), compare_keys);
+
+  size_t n_distinct = 0;
+
+  for(size_t i = 0; i < n; i ++) {
+    if(n_distinct == 0 || keys[i] != keys[n_distinct - 1]) {
+      keys[n_distinct ++] = keys[i];
+    }
+  }
+
+  n = n_distinct;
+
+  size_fuse_shard(s, n);
+
+  /* Slots are indexed with 32 bits during construction */
+  if(s->array_length > 0xffffffff) {
+    free(keys);
+    return HIBP_E_2BIG;
+  }
+
+  const size_t length = s->array_length;
+
+  s->fingerprints = malloc(length * (fingerprint_bits / 8));
+
+  uint64_t* order = (uint64_t*)malloc((n + 1) * sizeof(uint64_t));
+  byte* order_slots = (byte*)malloc(MAX(n, 1));
+  uint32_t* alone = (uint32_t*)malloc(length * sizeof(uint32_t));
+  byte* counts = (byte*)malloc(length);
+  uint64_t* xors = (uint64_t*)malloc(length * sizeof(uint64_t));
+  size_t* starts = (size_t*)malloc((((size_t)1) << fuse_log2_blocks(s)) * sizeof(size_t));
+
+  status st = HIBP_E_NOMEM;
+
+  if(s->fingerprints != NULL && order != NULL && order_slots != NULL && alone != NULL && counts != NULL &&
+     xors != NULL && starts != NULL) {
+    st = (populate_fuse_shard(s, fingerprint_bits, keys, n, order, order_slots, alone, counts, xors, starts) == 0)
+           ? HIBP_OK
+           : HIBP_E_INVAL;
+  }
+
+  free(keys);
+  free(order);
+  free(order_slots);
+  free(alone);
+  free(counts);
+  free(xors);
+  free(starts);
+
+  if(st != HIBP_OK) {
+    free(s->fingerprints);
+    s->fingerprints = NULL;
+  }
+
+  return st;
+}
+
+status hibp_ff_builder_new(fuse_builder* b, size_t fingerprint_bits, size_t log2_shards) {
+  if(fingerprint_bits != 8 && fingerprint_bits != 16) {
+    return HIBP_E_INVAL;
+  }
+
+  if(log2_shards > LOG2_SHARDS_MAX) {
+    return HIBP_E_2BIG;
+  }
+
+  b->fingerprint_bits = fingerprint_bits;
+  b->log2_shards = log2_shards;
+  b->buckets = (struct hibp_fuse_bucket_st*)calloc(((size_t)1) << log2_shards, sizeof(struct hibp_fuse_bucket_st));
+  b->shards = NULL;
+  b->n_built = 0;
+  b->current = 0;
+  b->n_threads = 0;
+  b->status = HIBP_OK;
+
+  return (b->buckets == NULL) ? HIBP_E_NOMEM : HIBP_OK;
+}
+
+status hibp_ff_builder_new_sorted(fuse_builder* b, size_t fingerprint_bits, size_t log2_shards, size_t n_threads) {
+  const status st = hibp_ff_builder_new(b, fingerprint_bits, log2_shards);
+
+  if(st != HIBP_OK) {
+    return st;
+  }
+
+  b->shards = (struct hibp_fuse_shard_st*)calloc(((size_t)1) << log2_shards, sizeof(struct hibp_fuse_shard_st));
+
+  if(b->shards == NULL) {
+    free(b->buckets);
+    return HIBP_E_NOMEM;
+  }
+
+  b->n_threads = (n_threads == 0) ? hibp_n_cpus() : n_threads;
+
+  return HIBP_OK;
+}
+
+void hibp_ff_builder_destroy(fuse_builder* b) {
+  for(size_t i = 0; i < (((size_t)1) << b->log2_shards); i ++) {
+    free(b->buckets[i].keys);
+
+    if(b->shards != NULL) {
+      free(b->shards[i].fingerprints);
+    }
+  }
+
+  free(b->buckets);
+  free(b->shards);
+}
+
+/* Plumbing for build_fuse_shards */
+typedef struct {
+  struct hibp_fuse_shard_st* shards;
+  fuse_builder* b;
+  size_t first;
+  status* results;
+} fuse_build_job_t;
+
+static void build_nth_fuse_shard(void* ctx, size_t i) {
+  const fuse_build_job_t* job = (const fuse_build_job_t*)ctx;
+  const size_t k = job->first + i;
+  job->results[i] = build_fuse_shard(&job->shards[k], job->b->fingerprint_bits, &job->b->buckets[k]);
+}
+
+/* Build the n shards of shards from the first'th onwards, from the corresponding buckets
+ * of b, on up to n_threads threads */
+static status build_fuse_shards(struct hibp_fuse_shard_st* shards, fuse_builder* b, size_t first, size_t n,
+                                size_t n_threads) {
+  status* results = (status*)malloc(MAX(n, 1) * sizeof(status));
+
+  if(results == NULL) {
+    return HIBP_E_NOMEM;
+  }
+
+  fuse_build_job_t job = { shards, b, first, results };
+  hibp_parallel_for(n, n_threads, build_nth_fuse_shard, &job);
+
+  status st = HIBP_OK;
+
+  for(size_t i = 0; i < n && st == HIBP_OK; i ++) {
+    st = results[i];
+  }
+
+  free(results);
+
+  return st;
+}
+
+status hibp_ff_builder_add_sha1(fuse_builder* b, const byte* sha) {
+  const size_t shard = fuse_shard_of(b->log2_shards, sha);
+
+  /* A sorted builder builds the shards that the input has passed, n_threads at a time */
+  if(b->n_threads != 0) {
+    if(b->status != HIBP_OK) {
+      return (status)b->status;
+    }
+
+    if(shard < b->current || shard < b->n_built) {
+      return HIBP_E_INVAL;
+    }
+
+    b->current = shard;
+
+    if(b->current - b->n_built >= b->n_threads) {
+      b->status = build_fuse_shards(b->shards, b, b->n_built, b->current - b->n_built, b->n_threads);
+      b->n_built = b->current;
+
+      if(b->status != HIBP_OK) {
+        return (status)b->status;
+      }
+    }
+  }
+
+  struct hibp_fuse_bucket_st* bucket = &b->buckets[shard];
+
+  if(bucket->n == bucket->capacity) {
+    const size_t capacity = (bucket->capacity == 0) ? 1024 : 2 * bucket->capacity;
+
+    if(capacity > SIZE_MAX / sizeof(uint64_t)) {
+      return HIBP_E_NOMEM;
+    }
+
+    uint64_t* keys = (uint64_t*)realloc(bucket->keys, capacity * sizeof(uint64_t));
+
+    if(keys == NULL) {
+      return HIBP_E_NOMEM;
+    }
+
+    bucket->keys = keys;
+    bucket->capacity = capacity;
+  }
+
+  bucket->keys[bucket->n ++] = fuse_key(sha);
+
+  return HIBP_OK;
+}
+
+status hibp_ff_builder_add_sha1_batch(fuse_builder* b, size_t n, const byte* shas) {
+  for(size_t i = 0; i < n; i ++) {
+    const status st = hibp_ff_builder_add_sha1(b, shas + i * SHA1_BYTES);
+
+    if(st != HIBP_OK) {
+      return st;
+    }
+  }
+
+  return HIBP_OK;
+}
+
+status hibp_ff_build(fuse_filter* ff, fuse_builder* b, size_t n_threads) {
+  const size_t n_shards = ((size_t)1) << b->log2_shards;
+
+  if(b->status != HIBP_OK) {
+    return (status)b->status;
+  }
+
+  ff->fingerprint_bits = b->fingerprint_bits;
+  ff->log2_shards = b->log2_shards;
+
+  /* The shards of a sorted builder, some of them already built, pass to ff */
+  if(b->shards != NULL) {
+    ff->shards = b->shards;
+    b->shards = NULL;
+  } else {
+    ff->shards = (struct hibp_fuse_shard_st*)calloc(n_shards, sizeof(struct hibp_fuse_shard_st));
+
+    if(ff->shards == NULL) {
+      return HIBP_E_NOMEM;
+    }
+  }
+
+  const status st = build_fuse_shards(ff->shards, b, b->n_built, n_shards - b->n_built, n_threads);
+
+  if(b->n_threads != 0) {
+    b->n_built = n_shards;
+  }
+
+  if(st != HIBP_OK) {
+    hibp_ff_destroy(ff);
+  }
+
+  return st;
+}
+
+void hibp_ff_destroy(fuse_filter* ff) {
+  for(size_t i = 0; i < (((size_t)1) << ff->log2_shards); i ++) {
+    free(ff->shards[i].fingerprints);
+  }
+
+  free(ff->shards);
+}
+
+size_t hibp_ff_size(const fuse_filter* ff) {
+  size_t size = 0;
+
+  for(size_t i = 0; i < (((size_t)1) << ff->log2_shards); i ++) {
+    size += ff->shards[i].array_length * (ff->fingerprint_bits / 8);
+  }
+
+  return size;
+}
+
+int hibp_ff_query(const fuse_filter* ff, size_t size, const byte* buffer) {
+  byte sha[SHA1_BYTES];
+  sha1(sha, size, buffer);
+  return hibp_ff_query_sha1(ff, sha);
+}
+
+int hibp_ff_query_str(const fuse_filter* ff, const char* str) {
+  return hibp_ff_query(ff, strlen(str), (const byte*)str);
+}
+
+int hibp_ff_query_sha1(const fuse_filter* ff, const byte* sha) {
+  const struct hibp_fuse_shard_st* s = &ff->shards[fuse_shard_of(ff->log2_shards, sha)];
+  const size_t bits = ff->fingerprint_bits;
+
+  const uint64_t hash = murmur64(fuse_key(sha) + s->seed);
+  const uint32_t mask = (((uint32_t)1) << bits) - 1;
+
+  const uint32_t f = fuse_fingerprint(hash) ^ get_fingerprint(s, bits, fuse_slot(s, 0, hash)) ^
+                     get_fingerprint(s, bits, fuse_slot(s, 1, hash)) ^
+                     get_fingerprint(s, bits, fuse_slot(s, 2, hash));
+
+  return (f & mask) == 0;
+}
+
+void hibp_ff_query_sha1_batch(const fuse_filter* ff, size_t n, const byte* shas, int* results) {
+  const size_t bits = ff->fingerprint_bits;
+  const uint32_t mask = (((uint32_t)1) << bits) - 1;
+
+  for(size_t i = 0; i < n; i += BATCH_WINDOW_SHAS) {
+    const size_t m = MIN(BATCH_WINDOW_SHAS, n - i);
+
+    const struct hibp_fuse_shard_st* shards[BATCH_WINDOW_SHAS];
+    uint64_t hashes[BATCH_WINDOW_SHAS];
+    size_t slots[3 * BATCH_WINDOW_SHAS];
+
+    for(size_t j = 0; j < m; j ++) {
+      const byte* sha = shas + (i + j) * SHA1_BYTES;
+      const struct hibp_fuse_shard_st* s = &ff->shards[fuse_shard_of(ff->log2_shards, sha)];
+
+      shards[j] = s;
+      hashes[j] = murmur64(fuse_key(sha) + s->seed);
+
+      for(size_t index = 0; index < 3; index ++) {
+        slots[3 * j + index] = fuse_slot(s, index, hashes[j]);
+        PREFETCH((const byte*)s->fingerprints + slots[3 * j + index] * (bits / 8));
+      }
+    }
+
+    for(size_t j = 0; j < m; j ++) {
+      const uint32_t f = fuse_fingerprint(hashes[j]) ^ get_fingerprint(shards[j], bits, slots[3 * j]) ^
+                         get_fingerprint(shards[j], bits, slots[3 * j + 1]) ^
+                         get_fingerprint(shards[j], bits, slots[3 * j + 2]);
+
+      results[i + j] = ((f & mask) == 0);
+    }
+  }
+}
+
+/* Reads and writes of a fuse filter go through these, which keep a running CRC32C */
+typedef struct {
+  void* ctx;
+  read_t read;
+  write_t write;
+  uint32_t crc;
+} crc_stream_t;
+
+static int crc_write(crc_stream_t* cs, const byte* buffer, size_t size) {
+  cs->crc = hibp_crc32c(cs->crc, buffer, size);
+  return write_fully(cs->ctx, cs->write, buffer, size);
+}
+
+static int crc_read(crc_stream_t* cs, byte* buffer, size_t size) {
+  if(read_fully(cs->ctx, cs->read, buffer, size) != 0) {
+    return -1;
+  }
+
+  cs->crc = hibp_crc32c(cs->crc, buffer, size);
+
+  return 0;
+}
+
+/* Fingerprints are written and read this many at a time */
+#define FUSE_IO_FINGERPRINTS 2048
+
+static status save_fuse(const fuse_filter* ff, void* ctx, write_t write) {
+  crc_stream_t cs = { ctx, NULL, write, 0 };
+  const size_t bits = ff->fingerprint_bits;
+
+  byte header[VERSION_SIZE + 2];
+  memcpy(header, FUSE_VERSION, VERSION_SIZE);
+  header[VERSION_SIZE] = (byte)bits;
+  header[VERSION_SIZE + 1] = (byte)ff->log2_shards;
+
+  if(crc_write(&cs, header, sizeof(header)) != 0) {
+    return HIBP_E_IO;
+  }
+
+  byte block[FUSE_IO_FINGERPRINTS * 2];
+
+  for(size_t i = 0; i < (((size_t)1) << ff->log2_shards); i ++) {
+    const struct hibp_fuse_shard_st* s = &ff->shards[i];
+
+    byte shard_header[FUSE_SHARD_HEADER_SIZE];
+
+    for(size_t b = 0; b < 8; b ++) {
+      shard_header[b] = (s->seed >> (8 * b)) & 0xff;
+    }
+
+    size_t_to_le_8_bytes(shard_header + 8, s->segment_length);
+    size_t_to_le_8_bytes(shard_header + 16, s->segment_count_length);
+    size_t_to_le_8_bytes(shard_header + 24, s->array_length);
+
+    if(crc_write(&cs, shard_header, sizeof(shard_header)) != 0) {
+      return HIBP_E_IO;
+    }
+
+    for(size_t j = 0; j < s->array_length; j += FUSE_IO_FINGERPRINTS) {
+      const size_t n = MIN(FUSE_IO_FINGERPRINTS, s->array_length - j);
+
+      for(size_t k = 0; k < n; k ++) {
+        const uint32_t f = get_fingerprint(s, bits, j + k);
+
+        if(bits == 8) {
+          block[k] = (byte)f;
+        } else {
+          block[2 * k] = f & 0xff;
+          block[2 * k + 1] = f >> 8;
+        }
+      }
+
+      if(crc_write(&cs, block, n * (bits / 8)) != 0) {
+        return HIBP_E_IO;
+      }
+    }
+  }
+
+  byte checksum[4];
+
+  for(size_t i = 0; i < 4; i ++) {
+    checksum[i] = (cs.crc >> (8 * i)) & 0xff;
+  }
+
+  return (write_fully(ctx, write, checksum, 4) == 0) ? HIBP_OK : HIBP_E_IO;
+}
+
+status hibp_ff_save_file(const fuse_filter* ff, FILE* file) {
+  return save_fuse(ff, file, file_write);
+}
+
+status hibp_ff_save_writer(const fuse_filter* ff, void* ctx, write_t write) {
+  return save_fuse(ff, ctx, write);
+}
+
+/* Read the header and fingerprints of a shard, validating its parameters */
+static status read_fuse_shard(struct hibp_fuse_shard_st* s, size_t bits, crc_stream_t* cs) {
+  byte shard_header[FUSE_SHARD_HEADER_SIZE];
+
+  if(crc_read(cs, shard_header, sizeof(shard_header)) != 0) {
+    return HIBP_E_IO;
+  }
+
+  s->seed = le_8_bytes_to_uint64(shard_header);
+
+  if(le_8_bytes_to_size_t(&s->segment_length, shard_header + 8) != 0 ||
+     le_8_bytes_to_size_t(&s->segment_count_length, shard_header + 16) != 0 ||
+     le_8_bytes_to_size_t(&s->array_length, shard_header + 24) != 0) {
+    return HIBP_E_CHECKSUM;
+  }
+
+  /* A power of 2 segment length, a whole number of segments, and two more after them */
+  const size_t l = s->segment_length;
+
+  if(l == 0 || l > FUSE_SEGMENT_LENGTH_MAX || (l & (l - 1)) != 0 || s->segment_count_length == 0 ||
+     s->segment_count_length % l != 0 || s->array_length > 0xffffffff ||
+     s->array_length != s->segment_count_length + 2 * l) {
+    return HIBP_E_CHECKSUM;
+  }
+
+  s->segment_length_mask = l - 1;
+  s->fingerprints = malloc(s->array_length * (bits / 8));
+
+  if(s->fingerprints == NULL) {
+    return HIBP_E_NOMEM;
+  }
+
+  byte block[FUSE_IO_FINGERPRINTS * 2];
+
+  for(size_t j = 0; j < s->array_length; j += FUSE_IO_FINGERPRINTS) {
+    const size_t n = MIN(FUSE_IO_FINGERPRINTS, s->array_length - j);
+
+    if(crc_read(cs, block, n * (bits / 8)) != 0) {
+      return HIBP_E_IO;
+    }
+
+    for(size_t k = 0; k < n; k ++) {
+      const uint32_t f = (bits == 8) ? block[k] : (uint32_t)(block[2 * k] | (block[2 * k + 1] << 8));
+      set_fingerprint(s, bits, j + k, f);
+    }
+  }
+
+  return HIBP_OK;
+}
+
+static status load_fuse(fuse_filter* ff, void* ctx, read_t read) {
+  crc_stream_t cs = { ctx, read, NULL, 0 };
+
+  byte header[VERSION_SIZE + 2];
+
+  if(crc_read(&cs, header, sizeof(header)) != 0) {
+    return HIBP_E_IO;
+  }
+
+  if(memcmp(header, FUSE_VERSION, VERSION_SIZE) != 0) {
+    return HIBP_E_VERSION;
+  }
+
+  const size_t bits = header[VERSION_SIZE];
+  const size_t log2_shards = header[VERSION_SIZE + 1];
+
+  if((bits != 8 && bits != 16) || log2_shards > LOG2_SHARDS_MAX) {
+    return HIBP_E_CHECKSUM;
+  }
+
+  ff->fingerprint_bits = bits;
+  ff->log2_shards = log2_shards;
+  ff->shards = (struct hibp_fuse_shard_st*)calloc(((size_t)1) << log2_shards, sizeof(struct hibp_fuse_shard_st));
+
+  if(ff->shards == NULL) {
+    return HIBP_E_NOMEM;
+  }
+
+  status st = HIBP_OK;
+
+  for(size_t i = 0; i < (((size_t)1) << log2_shards) && st == HIBP_OK; i ++) {
+    st = read_fuse_shard(&ff->shards[i], bits, &cs);
+  }
+
+  byte checksum[4];
+
+  if(st == HIBP_OK && read_fully(ctx, read, checksum, 4) != 0) {
+    st = HIBP_E_IO;
+  }
+
+  for(size_t i = 0; i < 4 && st == HIBP_OK; i ++) {
+    if(checksum[i] != ((cs.crc >> (8 * i)) & 0xff)) {
+      st = HIBP_E_CHECKSUM;
+    }
+  }
+
+  if(st != HIBP_OK) {
+    hibp_ff_destroy(ff);
+  }
+
+  return st;
+}
+
+status hibp_ff_load_file(fuse_filter* ff, FILE* file) {
+  return load_fuse(ff, file, file_read);
+}
+
+status hibp_ff_load_reader(fuse_filter* ff, void* ctx, read_t read) {
+  return load_fuse(ff, ctx, read);
+}
+
+/* == Scalable filters == */
+
+typedef hibp_scalable_filter_t scalable_filter;
+
+/* A scalable filter is saved as follows ([bytes] description):
+ * [4]            version string
+ * [1]            layout
+ * [1]            hashing
+ * [8]            capacity of the first layer
+ * [8]            fp, as an IEEE 754 double (little-endian)
+ * [8]            n_layers
+ * [8 * n_layers] the number of elements in each layer, oldest first
+ * [4]            CRC32C of everything above (little-endian)
+ * then each layer, oldest first, in the compact format */
+static const byte SCALABLE_VERSION[VERSION_SIZE] = { 0xb1, 0x5c, 0x13, 0x37 };
+
+#define SCALABLE_HEADER_SIZE (VERSION_SIZE + 1 + 1 + 8 + 8 + 8)
+
+/* Each layer has twice the capacity of its predecessor, and a false positive rate
+ * SCALABLE_TIGHTENING times as large. Almeida et al. find that a tightening ratio of 0.8
+ * to 0.9 makes for the smallest filters as they grow */
+#define SCALABLE_GROWTH 2
+#define SCALABLE_TIGHTENING 0.85
+
+/* A single element sets several bits at once, so a layer sized for only a handful of
+ * elements overshoots its fill limit by far and misses its false positive rate */
+#define SCALABLE_CAPACITY_MIN 128
+
+/* Every layer has a capacity at least twice that of its predecessor, so there can't be
+ * more than this many before capacities overflow */
+#define SCALABLE_LAYERS_MAX (8 * sizeof(size_t))
+
+struct hibp_scalable_layer_st {
+  bloom_filter filter;
+
+  /* The number of elements inserted, and the number of bits set, so far. A layer is full
+   * once bits_set reaches fill_limit */
+  size_t count;
+  size_t bits_set;
+  size_t fill_limit;
+};
+
+/* The false positive rate of the i'th layer. The rates form a geometric series, which sums
+ * to fp */
+static inline double layer_fp(const scalable_filter* sc, size_t i) {
+  return sc->fp * (1 - SCALABLE_TIGHTENING) * pow(SCALABLE_TIGHTENING, (double)i);
+}
+
+/* For a layer with the blocked layout holding count elements, the false positive rate, and
+ * the expected number of bits set. As for hibp_bf_get_stats, unless the layer is of a power
+ * of 2 size, heavy blocks are selected by two values of the block-selecting hash function
+ * rather than one, and so take on twice the elements (and queries) of the rest. A block
+ * expecting lambda elements leaves a bit unset with probability
+ * exp(-lambda * (1 - (1 - 1 / 512)**k)) */
+static double blocked_layer_fpr(const bloom_filter* bf, size_t count) {
+  const size_t n_probes = bf->n_hash_functions - first_probe(bf);
+  const double values = ldexp(1, bf->log2_bits - LOG2_BLOCK_BITS);
+  const double heavy = values - (double)(bf->bits >> LOG2_BLOCK_BITS);
+  const double light = values - 2 * heavy;
+
+  return (light * blocked_false_positive_rate(values, n_probes, count) +
+          2 * heavy * blocked_false_positive_rate(values / 2, n_probes, count)) / values;
+}
+
+static double blocked_layer_bits_set(const bloom_filter* bf, size_t count) {
+  const double k = (double)(bf->n_hash_functions - first_probe(bf));
+  const double block_bits = ldexp(1, LOG2_BLOCK_BITS);
+  const double values = ldexp(1, bf->log2_bits - LOG2_BLOCK_BITS);
+  const double heavy = values - (double)(bf->bits >> LOG2_BLOCK_BITS);
+  const double light = values - 2 * heavy;
+  const double lambda = count / values;
+  const double per_element = -expm1(k * log1p(-1 / block_bits));
+
+  return block_bits * (light * -expm1(-lambda * per_element) + heavy * -expm1(-2 * lambda * per_element));
+}
+
+/* The number of bits set at which a layer is full: the fewest for which its estimated
+ * false positive rate reaches fp. With the standard layout, that's estimated from the
+ * number of bits set alone. The blocked layout's rate depends on how the elements are
+ * spread across blocks, too, so the number of elements at which it reaches fp is found
+ * instead, and the number of bits that they're expected to set taken. Either way, for a
+ * layer of other than a power of 2 size, that comes somewhat short of capacity */
+static size_t fill_limit(const bloom_filter* bf, size_t capacity, double fp) {
+  if(bf->layout == HIBP_LAYOUT_STANDARD) {
+    size_t lo = 1;
+    size_t hi = bf->bits;
+    double cardinality;
+
+    while(lo < hi) {
+      const size_t mid = lo + (hi - lo) / 2;
+
+      if(estimate_standard(bf, mid, &cardinality) >= fp) {
+        hi = mid;
+      } else {
+        lo = mid + 1;
+      }
+    }
+
+    return hi;
+  }
+
+  size_t lo = 1;
+  size_t hi = capacity;
+
+  while(blocked_layer_fpr(bf, hi) < fp && hi <= SIZE_MAX / 2) {
+    lo = hi + 1;
+    hi *= 2;
+  }
+
+  while(lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+
+    if(blocked_layer_fpr(bf, mid) >= fp) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+
+  return MIN((size_t)ceil(blocked_layer_bits_set(bf, hi)), bf->bits);
+}
+
+/* Append a layer for capacity elements to sc, which has room for it. Layers are inserted
+ * into without the window of probes that the batched APIs use, so a layer needing more
+ * probes than fit in one is refused with HIBP_E_2BIG */
+static status add_layer(scalable_filter* sc, size_t capacity) {
+  struct hibp_scalable_layer_st* layer = &sc->layers[sc->n_layers];
+
+  size_t n_hash_functions;
+  size_t bits;
+
+  hibp_compute_optimal_bits(sc->layout, &n_hash_functions, &bits, capacity, layer_fp(sc, sc->n_layers));
+
+  if(n_hash_functions > BATCH_WINDOW_PROBES) {
+    return HIBP_E_2BIG;
+  }
+
+  const status st = hibp_bf_new_bits(&layer->filter, sc->layout, sc->hashing, n_hash_functions, bits);
+
+  if(st != HIBP_OK) {
+    return st;
+  }
+
+  layer->count = 0;
+  layer->bits_set = 0;
+  layer->fill_limit = fill_limit(&layer->filter, capacity, layer_fp(sc, sc->n_layers));
+
+  /* An empty layer is queried last */
+  sc->order[sc->n_layers] = sc->n_layers;
+  sc->n_layers ++;
+
+  return HIBP_OK;
+}
+
+/* The capacity of the i'th layer, or 0 if it would overflow */
+static inline size_t layer_capacity(const scalable_filter* sc, size_t i) {
+  size_t capacity = sc->capacity;
+
+  for(size_t j = 0; j < i; j ++) {
+    if(capacity > SIZE_MAX / SCALABLE_GROWTH) {
+      return 0;
+    }
+
+    capacity *= SCALABLE_GROWTH;
+  }
+
+  return capacity;
+}
+
+/* Allocate room for every layer that sc could ever have, which is little enough that it
+ * isn't worth growing */
+static status alloc_layers(scalable_filter* sc) {
+  sc->n_layers = 0;
+  sc->layers = (struct hibp_scalable_layer_st*)malloc(SCALABLE_LAYERS_MAX * sizeof(struct hibp_scalable_layer_st));
+  sc->order = (size_t*)malloc(SCALABLE_LAYERS_MAX * sizeof(size_t));
+
+  if(sc->layers == NULL || sc->order == NULL) {
+    free(sc->layers);
+    free(sc->order);
+    return HIBP_E_NOMEM;
+  }
+
+  return HIBP_OK;
+}
+
+status hibp_sc_new(scalable_filter* sc, hibp_layout_t layout, hibp_hashing_t hashing,
+                   size_t capacity, double fp) {
+  if(capacity == 0 || !(fp > 0 && fp < 1)) {
+    return HIBP_E_INVAL;
+  }
+
+  sc->layout = layout;
+  sc->hashing = hashing;
+  sc->capacity = MAX(capacity, SCALABLE_CAPACITY_MIN);
+  sc->fp = fp;
+
+  if(alloc_layers(sc) != HIBP_OK) {
+    return HIBP_E_NOMEM;
+  }
+
+  const status st = add_layer(sc, sc->capacity);
+
+  if(st != HIBP_OK) {
+    hibp_sc_destroy(sc);
+    return st;
+  }
+
+  return HIBP_OK;
+}
+
+void hibp_sc_destroy(scalable_filter* sc) {
+  for(size_t i = 0; i < sc->n_layers; i ++) {
+    hibp_bf_destroy(&sc->layers[i].filter);
+  }
+
+  free(sc->layers);
+  free(sc->order);
+}
+
+size_t hibp_sc_n_layers(const scalable_filter* sc) {
+  return sc->n_layers;
+}
+
+const bloom_filter* hibp_sc_layer(const scalable_filter* sc, size_t i) {
+  assert(i < sc->n_layers);
+  return &sc->layers[i].filter;
+}
+
+size_t hibp_sc_count(const scalable_filter* sc) {
+  size_t count = 0;
+
+  for(size_t i = 0; i < sc->n_layers; i ++) {
+    count += sc->layers[i].count;
+  }
+
+  return count;
+}
+
+double hibp_sc_estimated_fpr(const scalable_filter* sc) {
+  /* A query is negative only if every layer's is */
+  double negative = 1;
+
+  for(size_t i = 0; i < sc->n_layers; i ++) {
+    const struct hibp_scalable_layer_st* layer = &sc->layers[i];
+    const bloom_filter* bf = &layer->filter;
+
+    if(bf->layout == HIBP_LAYOUT_STANDARD) {
+      double cardinality;
+      negative *= 1 - estimate_standard(bf, layer->bits_set, &cardinality);
+    } else {
+      const double k = (double)(bf->n_hash_functions - first_probe(bf));
+      negative *= 1 - pow((double)layer->bits_set / bf->bits, k);
+    }
+  }
+
+  return 1 - negative;
+}
+
+int hibp_sc_query(const scalable_filter* sc, size_t size, const byte* buffer) {
+  byte sha[SHA1_BYTES];
+  sha1(sha, size, buffer);
+  return hibp_sc_query_sha1(sc, sha);
+}
+
+int hibp_sc_query_str(const scalable_filter* sc, const char* str) {
+  return hibp_sc_query(sc, strlen(str), (const byte*)str);
+}
+
+int hibp_sc_query_sha1(const scalable_filter* sc, const byte* sha) {
+  for(size_t i = 0; i < sc->n_layers; i ++) {
+    if(query_sha1(&sc->layers[sc->order[i]].filter, sha, NULL)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+void hibp_sc_query_sha1_batch(const scalable_filter* sc, size_t n, const byte* shas, int* results) {
+  byte pending_shas[BATCH_WINDOW_SHAS * SHA1_BYTES];
+  size_t pending[BATCH_WINDOW_SHAS];
+  int pending_results[BATCH_WINDOW_SHAS];
+
+  for(size_t i = 0; i < n; i += BATCH_WINDOW_SHAS) {
+    const size_t window = MIN(BATCH_WINDOW_SHAS, n - i);
+
+    /* The indices within the window of the elements that every layer so far reported
+     * absent */
+    size_t n_pending = window;
+
+    for(size_t j = 0; j < window; j ++) {
+      results[i + j] = 0;
+      pending[j] = j;
+    }
+
+    for(size_t l = 0; l < sc->n_layers && n_pending != 0; l ++) {
+      const bloom_filter* bf = &sc->layers[sc->order[l]].filter;
+
+      for(size_t j = 0; j < n_pending; j ++) {
+        memcpy(pending_shas + j * SHA1_BYTES, shas + (i + pending[j]) * SHA1_BYTES, SHA1_BYTES);
+      }
+
+      /* Layers hold few enough hash functions for one element's worth of probes, but
+       * perhaps not a whole window's */
+      const size_t w = probe_window_size(bf);
+
+      for(size_t j = 0; j < n_pending; j += w) {
+        query_sha1_window(bf, MIN(w, n_pending - j), pending_shas + j * SHA1_BYTES, pending_results + j, NULL);
+      }
+
+      size_t still_pending = 0;
+
+      for(size_t j = 0; j < n_pending; j ++) {
+        if(pending_results[j]) {
+          results[i + pending[j]] = 1;
+        } else {
+          pending[still_pending ++] = pending[j];
+        }
+      }
+
+      n_pending = still_pending;
+    }
+  }
+}
+
+/* Set every bit of bf for sha, returning the number of bits that weren't already set.
+ * Layers are neither mapped, nor tracked, nor inserted into concurrently, so the bits are
+ * set directly */
+static size_t insert_sha1_counting_bits(bloom_filter* bf, const byte* sha) {
+  size_t probes[BATCH_WINDOW_PROBES];
+  const size_t n_probes = compute_probes(probes, bf, sha);
+  byte* vector = bvector(bf);
+  size_t newly_set = 0;
+
+  STATS_ADD(bf, n_inserts, 1);
+
+  for(size_t i = 0; i < n_probes; i ++) {
+    const size_t bit = probes[i];
+
+    if(!test_bit(vector, bit)) {
+      vector[bit / 8] |= (1 << (bit % 8));
+      newly_set ++;
+    }
+  }
+
+  return newly_set;
+}
+
+status hibp_sc_insert(scalable_filter* sc, size_t size, const byte* buffer) {
+  byte sha[SHA1_BYTES];
+  sha1(sha, size, buffer);
+  return hibp_sc_insert_sha1(sc, sha);
+}
+
+status hibp_sc_insert_str(scalable_filter* sc, const char* str) {
+  return hibp_sc_insert(sc, strlen(str), (const byte*)str);
+}
+
+status hibp_sc_insert_sha1(scalable_filter* sc, const byte* sha) {
+  if(hibp_sc_query_sha1(sc, sha)) {
+    return HIBP_OK;
+  }
+
+  if(sc->layers[sc->n_layers - 1].bits_set >= sc->layers[sc->n_layers - 1].fill_limit) {
+    const size_t capacity = layer_capacity(sc, sc->n_layers);
+
+    if(capacity == 0 || sc->n_layers == SCALABLE_LAYERS_MAX) {
+      return HIBP_E_2BIG;
+    }
+
+    const status st = add_layer(sc, capacity);
+
+    if(st != HIBP_OK) {
+      return st;
+    }
+  }
+
+  const size_t newest = sc->n_layers - 1;
+  struct hibp_scalable_layer_st* layer = &sc->layers[newest];
+
+  layer->bits_set += insert_sha1_counting_bits(&layer->filter, sha);
+  layer->count ++;
+
+  /* Only the newest layer's count changes, so keep the order (see order_layers) by moving
+   * it ahead of any layer that it now equals */
+  size_t rank = sc->n_layers - 1;
+
+  while(sc->order[rank] != newest) {
+    rank --;
+  }
+
+  while(rank > 0 && sc->layers[sc->order[rank - 1]].count <= layer->count) {
+    sc->order[rank] = sc->order[rank - 1];
+    rank --;
+  }
+
+  sc->order[rank] = newest;
+
+  return HIBP_OK;
+}
+
+/* Order layers by count, descending, and the newest first among equals */
+static void order_layers(scalable_filter* sc) {
+  for(size_t i = 0; i < sc->n_layers; i ++) {
+    size_t rank = i;
+
+    while(rank > 0 && sc->layers[sc->order[rank - 1]].count <= sc->layers[i].count) {
+      sc->order[rank] = sc->order[rank - 1];
+      rank --;
+    }
+
+    sc->order[rank] = i;
+  }
+}
+
+static status save_scalable(const scalable_filter* sc, void* ctx, write_t write) {
+  crc_stream_t cs = { ctx, NULL, write, 0 };
+
+  byte header[SCALABLE_HEADER_SIZE];
+  uint64_t fp_bits;
+
+  memcpy(&fp_bits, &sc->fp, sizeof(fp_bits));
+  memcpy(header, SCALABLE_VERSION, VERSION_SIZE);
+  header[VERSION_SIZE] = (byte)sc->layout;
+  header[VERSION_SIZE + 1] = (byte)sc->hashing;
+  size_t_to_le_8_bytes(header + VERSION_SIZE + 2, sc->capacity);
+
+  for(size_t b = 0; b < 8; b ++) {
+    header[VERSION_SIZE + 10 + b] = (fp_bits >> (8 * b)) & 0xff;
+  }
+
+  size_t_to_le_8_bytes(header + VERSION_SIZE + 18, sc->n_layers);
+
+  if(crc_write(&cs, header, sizeof(header)) != 0) {
+    return HIBP_E_IO;
+  }
+
+  for(size_t i = 0; i < sc->n_layers; i ++) {
+    byte count[8];
+    size_t_to_le_8_bytes(count, sc->layers[i].count);
+
+    if(crc_write(&cs, count, sizeof(count)) != 0) {
+      return HIBP_E_IO;
+    }
+  }
+
+  byte checksum[4];
+
+  for(size_t i = 0; i < 4; i ++) {
+    checksum[i] = (cs.crc >> (8 * i)) & 0xff;
+  }
+
+  if(write_fully(ctx, write, checksum, 4) != 0) {
+    return HIBP_E_IO;
+  }
+
+  for(size_t i = 0; i < sc->n_layers; i ++) {
+    const status st = save_writer(&sc->layers[i].filter, ctx, write, HIBP_FORMAT_COMPACT);
+
+    if(st != HIBP_OK) {
+      return st;
+    }
+  }
+
+  return HIBP_OK;
+}
 
-  const double ln_of_2 = log(2);
-  const double eps = 1e-6;
+status hibp_sc_save_file(const scalable_filter* sc, FILE* file) {
+  return save_scalable(sc, file, file_write);
+}
 
-  for(size_t candidate_log2_bits = 8;; candidate_log2_bits ++) {
-    /* From Wikipedia:
-     * ... for a given m and n, the value of k that minimizes the false positive probability is
-     * k = m / n * ln 2
-     * k is the number of hash functions, m is the number of bits, n is the number of elements */
+status hibp_sc_save_writer(const scalable_filter* sc, void* ctx, write_t write) {
+  return save_scalable(sc, ctx, write);
+}
 
-    const double bits = pow(2, candidate_log2_bits);
-    const double double_candidate_n_hash_functions = ceil(bits / count * ln_of_2 + eps);
+/* Read the header and counts of a scalable filter, up to and including their checksum,
+ * populating the parameters of sc and the counts of its layers */
+static status read_scalable_header(scalable_filter* sc, void* ctx, read_t read) {
+  crc_stream_t cs = { ctx, read, NULL, 0 };
 
-    size_t candidate_n_hash_functions = (double_candidate_n_hash_functions > N_HASH_FUNCTIONS_MAX)
-      ? N_HASH_FUNCTIONS_MAX
-      : double_candidate_n_hash_functions;
+  byte header[SCALABLE_HEADER_SIZE];
 
-    size_t buffer_size;
+  if(crc_read(&cs, header, sizeof(header)) != 0) {
+    return HIBP_E_IO;
+  }
 
-    if(compute_buffer_size(&buffer_size, candidate_n_hash_functions, candidate_log2_bits) != HIBP_OK) {
-      buffer_size = SIZE_MAX;
-    }
+  if(memcmp(header, SCALABLE_VERSION, VERSION_SIZE) != 0) {
+    return HIBP_E_VERSION;
+  }
 
-    if(buffer_size > max_memory && candidate_log2_bits > 8) {
-      break;
+  const uint64_t fp_bits = le_8_bytes_to_uint64(header + VERSION_SIZE + 10);
+  size_t n_layers;
+
+  sc->layout = (hibp_layout_t)header[VERSION_SIZE];
+  sc->hashing = (hibp_hashing_t)header[VERSION_SIZE + 1];
+  memcpy(&sc->fp, &fp_bits, sizeof(sc->fp));
+
+  if(le_8_bytes_to_size_t(&sc->capacity, header + VERSION_SIZE + 2) != 0 ||
+     le_8_bytes_to_size_t(&n_layers, header + VERSION_SIZE + 18) != 0 ||
+     n_layers == 0 || n_layers > SCALABLE_LAYERS_MAX) {
+    return HIBP_E_CHECKSUM;
+  }
+
+  for(size_t i = 0; i < n_layers; i ++) {
+    byte count[8];
+
+    if(crc_read(&cs, count, sizeof(count)) != 0) {
+      return HIBP_E_IO;
     }
 
-    *n_hash_functions = candidate_n_hash_functions;
-    *log2_bits = candidate_log2_bits;
+    if(le_8_bytes_to_size_t(&sc->layers[i].count, count) != 0) {
+      return HIBP_E_CHECKSUM;
+    }
   }
-}
 
-status hibp_sha1_hex2bin(byte* bin, const char* hex) {
-  for(int i = 0; i < 20; i ++) {
-    bin[i] = 0;
+  byte checksum[4];
 
-    for(int k = i; k <= i + 1; k ++) {
-      bin[i] <<= 4;
+  if(read_fully(ctx, read, checksum, 4) != 0) {
+    return HIBP_E_IO;
+  }
 
-      if('0' <= hex[k] && hex[k] <= '9') {
-        bin[i] |= (hex[k] - '0');
-      } else if('a' <= hex[k] && hex[k] <= 'f') {
-        bin[i] |= (0xa + hex[k] - 'a');
-      } else if('A' <= hex[k] && hex[k] <= 'F') {
-        bin[i] |= (0xa + hex[k] - 'A');
-      } else {
-        return HIBP_E_INVAL;
-      }
+  for(size_t i = 0; i < 4; i ++) {
+    if(checksum[i] != ((cs.crc >> (8 * i)) & 0xff)) {
+      return HIBP_E_CHECKSUM;
     }
   }
 
-  return HIBP_OK;
-}
+  if(sc->capacity == 0 || !(sc->fp > 0 && sc->fp < 1) || layer_capacity(sc, n_layers - 1) == 0) {
+    return HIBP_E_CHECKSUM;
+  }
 
-/* == Lifecyle == */
+  /* The layers themselves are yet to be read */
+  sc->n_layers = n_layers;
 
-status hibp_bf_new(bloom_filter* bf, size_t n_hash_functions, size_t log2_bits) {
-  return hibp_bf_new_prng(bf, n_hash_functions, log2_bits, NULL, default_prng);
+  return HIBP_OK;
 }
 
-status hibp_bf_new_prng(bloom_filter* bf, size_t n_hash_functions, size_t log2_bits, void* ctx, prng_t prng) {
-  size_t buffer_size;
-  const status st = compute_buffer_size(&buffer_size, n_hash_functions, log2_bits);
+/* Read the i'th layer of sc, whose count is already known, and recount its bits */
+static status read_layer(scalable_filter* sc, size_t i, void* ctx, read_t read) {
+  struct hibp_scalable_layer_st* layer = &sc->layers[i];
+  bloom_filter* bf = &layer->filter;
+
+  const status st = load_reader(bf, ctx, read, NULL);
 
   if(st != HIBP_OK) {
     return st;
   }
 
-  bf->n_hash_functions = n_hash_functions;
-  bf->log2_bits = log2_bits;
+  if(bf->layout != sc->layout || bf->hashing != sc->hashing || bf->n_hash_functions > BATCH_WINDOW_PROBES) {
+    hibp_bf_destroy(bf);
+    return HIBP_E_CHECKSUM;
+  }
 
-  /* calloc to save us memsetting the bit vector. On some systems it's actually faster */
-  bf->buffer = (byte*)calloc(buffer_size, 1);
+  layer->bits_set = hibp_popcount(bvector(bf), bvector_size(bf), NULL);
+  layer->fill_limit = fill_limit(bf, layer_capacity(sc, i), layer_fp(sc, i));
 
-  if(bf->buffer == NULL) {
+  return HIBP_OK;
+}
+
+static status load_scalable(scalable_filter* sc, void* ctx, read_t read) {
+  if(alloc_layers(sc) != HIBP_OK) {
     return HIBP_E_NOMEM;
   }
 
-  byte* hash_functions = nth_hash_function(bf, 0);
-  const size_t hash_functions_size = bf->log2_bits * bf->n_hash_functions;
-
-  /* Intuitively, if we have a small number of hash functions, we probably don't want
-   * them all to include the same bits over and over again when there are other bits
-   * of the SHA1 hash that aren't covered by any hash function. We can satisfy this
-   * criteria by making sure that all SHA1_BITS bits are covered before we reuse any;
-   * this can be accomplished easily by selecting indices from a permutation until it's
-   * exhausted, and repeating with a new permutation untill all the indices of all the
-   * hash functions have been selected.
-   *
-   * As an added bonus, because we encode the hash functions in a single flat array
-   * we can just repeatedly generate and memcpy permutations without worrying about
-   * the dileneation between the different hash functions */
+  status st = read_scalable_header(sc, ctx, read);
 
-  /* Initialize the permutation */
-  byte permutation[SHA1_BITS];
-  for(size_t i = 0; i < SHA1_BITS; i++) {
-    permutation[i] = i;
+  if(st != HIBP_OK) {
+    free(sc->layers);
+    free(sc->order);
+    return st;
   }
 
-  /* Repeatedly generate a permutation with the Fisher-Yates shuffle, and copy as many
-   * indices as necessary into hash_functions. We need hash_functions_size indices
-   * in total, and each iteration generates SHA1_BITS of them */
+  const size_t n_layers = sc->n_layers;
 
-  for(size_t generated = 0; generated < hash_functions_size; generated += SHA1_BITS) {
-    for(size_t i = SHA1_BITS - 1; i > 0; i --) {
-      const size_t j = prng(ctx, i + 1);
+  /* Only the layers read so far are to be destroyed should one fail */
+  sc->n_layers = 0;
 
-      const byte swap = permutation[i];
-      permutation[i] = permutation[j];
-      permutation[j] = swap;
+  for(size_t i = 0; i < n_layers; i ++) {
+    st = read_layer(sc, i, ctx, read);
+
+    if(st != HIBP_OK) {
+      hibp_sc_destroy(sc);
+      return st;
     }
 
-    const size_t copy_size = min(hash_functions_size - generated, SHA1_BITS);
-    memcpy(hash_functions + generated, permutation, copy_size);
+    sc->n_layers ++;
   }
 
+  order_layers(sc);
+
   return HIBP_OK;
 }
 
-void hibp_bf_destroy(bloom_filter* bf) {
-  free(bf->buffer);
+status hibp_sc_load_file(scalable_filter* sc, FILE* file) {
+  return load_scalable(sc, file, file_read);
 }
 
-/* == IO == */
+status hibp_sc_load_reader(scalable_filter* sc, void* ctx, read_t read) {
+  return load_scalable(sc, ctx, read);
+}
 
-/* It's trivial to just implement hibp_bf_load_file using hibp_bf_load_stream
- * as a building block, but then you're using fgetc rather than fread to read
- * a potentially huge buffer which seems like a serious tax to be paying.
- * We could also just implement the two separately, but it'd be pretty easy
- * to screw up. Instead, let's just stick the function body for hibp_bf_load_stream
- * in a header file, and use some macros to use it for hibp_bf_load_file
- * at no performance cost */
-status hibp_bf_load_file(bloom_filter* bf, FILE* file) {
+/* == Asynchronous queries == */
+
+typedef hibp_query_queue_t query_queue;
+
+/* Queries are taken off the queue this many at a time by default, which is enough to keep
+ * plenty of probes (or page reads) in flight without holding up the first of the batch */
+#define QUERY_QUEUE_BATCH_DEFAULT 256
+
+/* As for hibp_parallel_for */
+#define QUERY_QUEUE_THREADS_MAX 64
+
+/* A FIFO of fixed-size items in a circular buffer, which grows as needed */
+typedef struct {
+  byte* items;
+  size_t item_size;
+  size_t capacity;
+  size_t head;
+  size_t n;
+} ring_t;
+
+/* Ensure that the ring has room for extra more items. Returns 0 on success, -1 if it
+ * couldn't grow */
+static int ring_reserve(ring_t* r, size_t extra) {
+  if(r->capacity - r->n >= extra) {
+    return 0;
+  }
+
+  size_t capacity = MAX(r->capacity, 16);
+
+  while(capacity - r->n < extra) {
+    capacity *= 2;
+  }
+
+  byte* items = (byte*)malloc(capacity * r->item_size);
+
+  if(items == NULL) {
+    return -1;
+  }
 
-  #define ctx file
-  #define getc fgetc
-  #define my_read(buffer, size, file, _unused) (fread((buffer), 1, (size), (file)) != (size))
+  /* Unwrap the items as they're copied, so that they start at the beginning */
+  for(size_t i = 0; i < r->n; i ++) {
+    memcpy(items + i * r->item_size, r->items + ((r->head + i) % r->capacity) * r->item_size, r->item_size);
+  }
 
-  #include "load-stream.h"
+  free(r->items);
+  r->items = items;
+  r->capacity = capacity;
+  r->head = 0;
 
-  #undef ctx
-  #undef getc
-  #undef my_read
+  return 0;
+}
 
+/* Append an item, for which there must be room */
+static void ring_push(ring_t* r, const void* item) {
+  assert(r->n < r->capacity);
+  memcpy(r->items + ((r->head + r->n) % r->capacity) * r->item_size, item, r->item_size);
+  r->n ++;
 }
 
-status hibp_bf_load_stream(bloom_filter* bf, void* ctx, getc_t getc) {
-  #include "load-stream.h"
+/* Remove the oldest item, of which there must be one */
+static void ring_pop(ring_t* r, void* item) {
+  assert(r->n > 0);
+  memcpy(item, r->items + r->head * r->item_size, r->item_size);
+  r->head = (r->head + 1) % r->capacity;
+  r->n --;
 }
 
-/* Same as above - put the body of hibp_bf_save_stream in a header, then use it
- * for both implementations with some preprocessor magic */
-status hibp_bf_save_file(const bloom_filter* bf, FILE* file) {
+typedef struct {
+  byte sha[HIBP_SHA1_BYTES];
+  void* tag;
+} submission_t;
+
+struct hibp_query_queue_st;
+
+/* The batch that a worker is answering */
+typedef struct {
+  struct hibp_query_queue_st* q;
+  pthread_t thread;
+  byte* shas;
+  void** tags;
+  int* results;
+} query_worker_t;
+
+struct hibp_query_queue_st {
+  const bloom_filter* bf;
+  size_t max_batch;
+  void* ctx;
+  hibp_complete_t complete;
+
+  /* Guards everything below */
+  pthread_mutex_t lock;
+
+  /* Signalled when queries are submitted, and broadcast when the workers are to stop */
+  pthread_cond_t submitted;
+
+  /* Broadcast when the last outstanding query is answered */
+  pthread_cond_t answered;
+
+  /* Queries that no worker has taken yet, of submission_t */
+  ring_t pending;
+
+  /* Queries submitted but not yet answered, including those being answered now */
+  size_t n_outstanding;
+
+  /* Without a callback, answered queries that haven't been polled, of hibp_completion_t.
+   * Room is reserved for every outstanding query on submission, so that answering one
+   * never fails */
+  ring_t completions;
+
+  /* Without a callback, a pipe whose read end is readable if and only if notified is
+   * nonzero, which it is while there are completions */
+  int pipe[2];
+  int notified;
+
+  int stopping;
 
-  #define ctx file
-  #define putc fputc
-  #define my_write(buffer, size, file, _unused) (fwrite((buffer), 1, (size), (file)) != (size))
+  size_t n_workers;
+  query_worker_t* workers;
+};
 
-  #include "save-stream.h"
+static void* run_query_worker(void* arg) {
+  query_worker_t* w = (query_worker_t*)arg;
+  struct hibp_query_queue_st* q = w->q;
 
-  #undef ctx
-  #undef putc
-  #undef my_write
+  pthread_mutex_lock(&q->lock);
 
+  for(;;) {
+    while(q->pending.n == 0 && !q->stopping) {
+      pthread_cond_wait(&q->submitted, &q->lock);
+    }
+
+    /* Only stop once everything submitted has been taken */
+    if(q->pending.n == 0) {
+      break;
+    }
+
+    const size_t n = MIN(q->pending.n, q->max_batch);
+
+    for(size_t i = 0; i < n; i ++) {
+      submission_t sub;
+      ring_pop(&q->pending, &sub);
+      memcpy(w->shas + i * SHA1_BYTES, sub.sha, SHA1_BYTES);
+      w->tags[i] = sub.tag;
+    }
+
+    /* A single submission of many queries only wakes one worker; leave the rest to
+     * another */
+    if(q->pending.n > 0) {
+      pthread_cond_signal(&q->submitted);
+    }
+
+    pthread_mutex_unlock(&q->lock);
+
+    hibp_bf_query_sha1_batch(q->bf, n, w->shas, w->results);
+
+    if(q->complete != NULL) {
+      for(size_t i = 0; i < n; i ++) {
+        q->complete(q->ctx, w->tags[i], w->results[i]);
+      }
+    }
+
+    pthread_mutex_lock(&q->lock);
+
+    if(q->complete == NULL) {
+      for(size_t i = 0; i < n; i ++) {
+        const hibp_completion_t c = { w->tags[i], w->results[i] };
+        ring_push(&q->completions, &c);
+      }
+
+      if(!q->notified) {
+        const byte b = 0;
+        ssize_t written;
+
+        /* The pipe is empty, so this can't fill it */
+        do {
+          written = write(q->pipe[1], &b, 1);
+        } while(written == -1 && errno == EINTR);
+
+        q->notified = 1;
+      }
+    }
+
+    q->n_outstanding -= n;
+
+    if(q->n_outstanding == 0) {
+      pthread_cond_broadcast(&q->answered);
+    }
+  }
+
+  pthread_mutex_unlock(&q->lock);
+
+  return NULL;
 }
 
-status hibp_bf_save_stream(const bloom_filter* bf, void* ctx, putc_t putc) {
-  #include "save-stream.h"
+/* Release everything but the workers' threads and the pipe */
+static void free_query_queue(struct hibp_query_queue_st* q) {
+  for(size_t i = 0; i < q->n_workers; i ++) {
+    free(q->workers[i].shas);
+    free(q->workers[i].tags);
+    free(q->workers[i].results);
+  }
+
+  free(q->workers);
+  free(q->pending.items);
+  free(q->completions.items);
+  free(q);
 }
 
-/* == Insertion == */
+/* Stop and join the first n workers, which must have been started */
+static void stop_query_workers(struct hibp_query_queue_st* q, size_t n) {
+  pthread_mutex_lock(&q->lock);
+  q->stopping = 1;
+  pthread_cond_broadcast(&q->submitted);
+  pthread_mutex_unlock(&q->lock);
 
-void hibp_bf_insert(bloom_filter* bf, size_t size, const byte* buffer) {
-  byte sha[SHA1_BYTES];
-  sha1(sha, size, buffer);
-  hibp_bf_insert_sha1(bf, sha);
+  for(size_t i = 0; i < n; i ++) {
+    pthread_join(q->workers[i].thread, NULL);
+  }
 }
 
-void hibp_bf_insert_str(bloom_filter* bf, const char* str) {
-  hibp_bf_insert(bf, strlen(str), (const byte*)str);
+static void destroy_query_queue(struct hibp_query_queue_st* q) {
+  pthread_mutex_destroy(&q->lock);
+  pthread_cond_destroy(&q->submitted);
+  pthread_cond_destroy(&q->answered);
+
+  if(q->complete == NULL) {
+    close(q->pipe[0]);
+    close(q->pipe[1]);
+  }
+
+  free_query_queue(q);
 }
 
-void hibp_bf_insert_sha1(bloom_filter* bf, const byte* sha) {
-  /* For every hash function h, set the bit h(sha) in the Bloom filter vector */
+/* Open the pipe that signals completions. Neither end may block: the workers write to it
+ * with the lock held, and hibp_qq_poll reads from it. Returns 0 on success, -1 on failure */
+static int open_notify_pipe(int fds[2]) {
+  if(pipe(fds) == -1) {
+    return -1;
+  }
 
-  byte* vector = bvector(bf);
+  if(fcntl(fds[0], F_SETFL, O_NONBLOCK) == -1 || fcntl(fds[1], F_SETFL, O_NONBLOCK) == -1) {
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+
+  return 0;
+}
+
+status hibp_qq_new(query_queue* qq, const bloom_filter* bf, size_t n_threads, size_t max_batch, void* ctx,
+                   hibp_complete_t complete) {
+  if(n_threads == 0) {
+    n_threads = hibp_n_cpus();
+  }
+
+  n_threads = MIN(n_threads, QUERY_QUEUE_THREADS_MAX);
+
+  if(max_batch == 0) {
+    max_batch = QUERY_QUEUE_BATCH_DEFAULT;
+  }
+
+  if(max_batch > SIZE_MAX / SHA1_BYTES) {
+    return HIBP_E_2BIG;
+  }
+
+  struct hibp_query_queue_st* q = (struct hibp_query_queue_st*)calloc(1, sizeof(struct hibp_query_queue_st));
+
+  if(q == NULL) {
+    return HIBP_E_NOMEM;
+  }
+
+  q->bf = bf;
+  q->max_batch = max_batch;
+  q->ctx = ctx;
+  q->complete = complete;
+  q->pending.item_size = sizeof(submission_t);
+  q->completions.item_size = sizeof(hibp_completion_t);
+  q->n_workers = n_threads;
+  q->workers = (query_worker_t*)calloc(n_threads, sizeof(query_worker_t));
+
+  if(q->workers == NULL) {
+    free(q);
+    return HIBP_E_NOMEM;
+  }
+
+  for(size_t i = 0; i < n_threads; i ++) {
+    query_worker_t* w = &q->workers[i];
+
+    w->q = q;
+    w->shas = (byte*)malloc(max_batch * SHA1_BYTES);
+    w->tags = (void**)malloc(max_batch * sizeof(void*));
+    w->results = (int*)malloc(max_batch * sizeof(int));
+
+    if(w->shas == NULL || w->tags == NULL || w->results == NULL) {
+      free_query_queue(q);
+      return HIBP_E_NOMEM;
+    }
+  }
+
+  if(pthread_mutex_init(&q->lock, NULL) != 0) {
+    free_query_queue(q);
+    return HIBP_E_NOMEM;
+  }
+
+  if(pthread_cond_init(&q->submitted, NULL) != 0) {
+    pthread_mutex_destroy(&q->lock);
+    free_query_queue(q);
+    return HIBP_E_NOMEM;
+  }
+
+  if(pthread_cond_init(&q->answered, NULL) != 0) {
+    pthread_cond_destroy(&q->submitted);
+    pthread_mutex_destroy(&q->lock);
+    free_query_queue(q);
+    return HIBP_E_NOMEM;
+  }
+
+  if(complete == NULL && open_notify_pipe(q->pipe) == -1) {
+    pthread_cond_destroy(&q->answered);
+    pthread_cond_destroy(&q->submitted);
+    pthread_mutex_destroy(&q->lock);
+    free_query_queue(q);
+    return HIBP_E_IO;
+  }
 
-  for(size_t i = 0; i < bf->n_hash_functions; i++) {
-    const size_t k = eval_nth_hash_function(bf, i, sha);
-    vector[k / 8] |= (1 << (k % 8));
+  for(size_t i = 0; i < n_threads; i ++) {
+    if(pthread_create(&q->workers[i].thread, NULL, run_query_worker, &q->workers[i]) != 0) {
+      stop_query_workers(q, i);
+      destroy_query_queue(q);
+      return HIBP_E_IO;
+    }
   }
+
+  qq->filter = bf;
+  qq->state = q;
+
+  return HIBP_OK;
 }
 
-/* == Querying == */
+void hibp_qq_destroy(query_queue* qq) {
+  struct hibp_query_queue_st* q = qq->state;
 
-int hibp_bf_query(const bloom_filter* bf, size_t size, const byte* buffer) {
-  byte sha[SHA1_BYTES];
-  sha1(sha, size, buffer);
-  return hibp_bf_query_sha1(bf, sha);
+  /* The workers only stop once the queue is empty */
+  stop_query_workers(q, q->n_workers);
+  destroy_query_queue(q);
 }
 
-int hibp_bf_query_str(const bloom_filter* bf, const char* str) {
-  return hibp_bf_query(bf, strlen(str), (const byte*)str);
+status hibp_qq_submit(query_queue* qq, const byte* sha, void* tag) {
+  return hibp_qq_submit_batch(qq, 1, sha, &tag);
 }
 
-int hibp_bf_query_sha1(const bloom_filter* bf, const byte* sha) {
-  /* If, for some hash function h, the bit h(sha) is unset in the Bloom filter
-   * vector, then sha is guaranteed not to be present in the set. Otherwise, sha
-   * is present _with high probability_ */
+status hibp_qq_submit_batch(query_queue* qq, size_t n, const byte* shas, void* const* tags) {
+  struct hibp_query_queue_st* q = qq->state;
 
-  const byte* vector = bvector(bf);
+  pthread_mutex_lock(&q->lock);
+
+  if(ring_reserve(&q->pending, n) != 0 ||
+     (q->complete == NULL && ring_reserve(&q->completions, q->n_outstanding + n) != 0)) {
+    pthread_mutex_unlock(&q->lock);
+    return HIBP_E_NOMEM;
+  }
 
-  for(size_t i = 0; i < bf->n_hash_functions; i++) {
-    const size_t k = eval_nth_hash_function(bf, i, sha);
+  for(size_t i = 0; i < n; i ++) {
+    submission_t sub;
+    memcpy(sub.sha, shas + i * SHA1_BYTES, SHA1_BYTES);
+    sub.tag = tags[i];
+    ring_push(&q->pending, &sub);
+  }
 
-    assert(k < (((size_t)1) << bf->log2_bits));
+  q->n_outstanding += n;
 
-    if(((vector[k / 8] >> (k % 8)) & 1) == 0) {
-      return 0;
-    }
+  if(n > 0) {
+    pthread_cond_signal(&q->submitted);
   }
 
-  return 1;
+  pthread_mutex_unlock(&q->lock);
+
+  return HIBP_OK;
+}
+
+size_t hibp_qq_poll(query_queue* qq, size_t max, hibp_completion_t* completions) {
+  struct hibp_query_queue_st* q = qq->state;
+
+  if(q->complete != NULL) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&q->lock);
+
+  const size_t n = MIN(max, q->completions.n);
+
+  for(size_t i = 0; i < n; i ++) {
+    ring_pop(&q->completions, &completions[i]);
+  }
+
+  if(q->completions.n == 0 && q->notified) {
+    byte b;
+    ssize_t got;
+
+    do {
+      got = read(q->pipe[0], &b, 1);
+    } while(got == -1 && errno == EINTR);
+
+    q->notified = 0;
+  }
+
+  pthread_mutex_unlock(&q->lock);
+
+  return n;
+}
+
+int hibp_qq_fd(const query_queue* qq) {
+  return (qq->state->complete == NULL) ? qq->state->pipe[0] : -1;
+}
+
+void hibp_qq_wait(query_queue* qq) {
+  struct hibp_query_queue_st* q = qq->state;
+
+  pthread_mutex_lock(&q->lock);
+
+  while(q->n_outstanding > 0) {
+    pthread_cond_wait(&q->answered, &q->lock);
+  }
+
+  pthread_mutex_unlock(&q->lock);
 }
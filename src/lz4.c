@@ -0,0 +1,256 @@
+#include <string.h> /* memcpy, memset */
+#include <stdint.h> /* uint32_t */
+
+#include "lz4.h"
+
+/* A block is a sequence of sequences, each consisting of:
+ * [1]   token; the high nybble is the number of literals, the low nybble the match length
+ *       less MIN_MATCH. A nybble of 15 means the value continues in extension bytes
+ * [...] literal length extension bytes, if any; each is added, and 255 means more follow
+ * [...] literals
+ * [2]   match offset, little-endian; 1 means the byte preceding the match, etc.
+ * [...] match length extension bytes, as for literals
+ * The last sequence is truncated after its literals. To keep decoders simple, the last
+ * match must start at least MF_LIMIT bytes before the end of the block, and the last
+ * LAST_LITERALS bytes are always literals */
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MF_LIMIT 12
+#define MAX_OFFSET 65535
+
+/* The hash table maps 4-byte sequences to their most recent position; 2**14 entries keeps
+ * it comfortably on the stack of any thread */
+#define HASH_LOG 14
+
+static inline uint32_t read32(const unsigned char* p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static inline uint32_t hash(uint32_t v) {
+  return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+/* Emit a length continuation, where the nybble in the token was 15 */
+static inline unsigned char* put_length(unsigned char* op, size_t length) {
+  while(length >= 255) {
+    *op ++ = 255;
+    length -= 255;
+  }
+
+  *op ++ = (unsigned char)length;
+  return op;
+}
+
+/* Upper bound on the size of a sequence with the given number of literals */
+static inline size_t sequence_bound(size_t literals, size_t match_length) {
+  return 1 + (literals / 255 + 1) + literals + 2 + (match_length / 255 + 1);
+}
+
+static unsigned char* put_sequence(unsigned char* op, const unsigned char* literals, size_t n_literals,
+                                   size_t offset, size_t match_length) {
+  unsigned char* token = op ++;
+  const size_t ml = match_length - MIN_MATCH;
+
+  if(n_literals >= 15) {
+    *token = 15 << 4;
+    op = put_length(op, n_literals - 15);
+  } else {
+    *token = (unsigned char)(n_literals << 4);
+  }
+
+  memcpy(op, literals, n_literals);
+  op += n_literals;
+
+  *op ++ = (unsigned char)(offset & 0xff);
+  *op ++ = (unsigned char)(offset >> 8);
+
+  if(ml >= 15) {
+    *token |= 15;
+    op = put_length(op, ml - 15);
+  } else {
+    *token |= (unsigned char)ml;
+  }
+
+  return op;
+}
+
+size_t hibp_lz4_compress(unsigned char* dst, size_t capacity, const unsigned char* src, size_t size) {
+  uint32_t table[1 << HASH_LOG];
+  memset(table, 0, sizeof(table));
+
+  unsigned char* op = dst;
+  unsigned char* const op_end = dst + capacity;
+
+  size_t anchor = 0;
+
+  if(size >= MF_LIMIT + 1) {
+    const size_t match_limit = size - MF_LIMIT;
+    const size_t end_limit = size - LAST_LITERALS;
+
+    size_t ip = 1;
+
+    while(ip < match_limit) {
+      const uint32_t sequence = read32(src + ip);
+      const uint32_t h = hash(sequence);
+      size_t ref = table[h];
+      table[h] = (uint32_t)ip;
+
+      if(ref >= ip || ip - ref > MAX_OFFSET || read32(src + ref) != sequence) {
+        /* Skip ahead faster the longer we go without finding a match, so that
+         * incompressible input (e.g. a well-filled filter) costs little */
+        ip += 1 + ((ip - anchor) >> 6);
+        continue;
+      }
+
+      /* Extend the match forwards, then backwards */
+      size_t length = MIN_MATCH;
+
+      while(ip + length < end_limit && src[ref + length] == src[ip + length]) {
+        length ++;
+      }
+
+      while(ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+        ip --;
+        ref --;
+        length ++;
+      }
+
+      if((size_t)(op_end - op) < sequence_bound(ip - anchor, length)) {
+        return 0;
+      }
+
+      op = put_sequence(op, src + anchor, ip - anchor, ip - ref, length);
+
+      ip += length;
+      anchor = ip;
+
+      /* Seed the table near the end of the match, which tends to find the next one */
+      if(ip - 2 < match_limit) {
+        table[hash(read32(src + ip - 2))] = (uint32_t)(ip - 2);
+      }
+    }
+  }
+
+  /* Last literals */
+
+  const size_t n_literals = size - anchor;
+
+  if((size_t)(op_end - op) < 1 + (n_literals / 255 + 1) + n_literals) {
+    return 0;
+  }
+
+  if(n_literals >= 15) {
+    *op ++ = 15 << 4;
+    op = put_length(op, n_literals - 15);
+  } else {
+    *op ++ = (unsigned char)(n_literals << 4);
+  }
+
+  memcpy(op, src + anchor, n_literals);
+  op += n_literals;
+
+  return (size_t)(op - dst);
+}
+
+/* Read a length continuation into *length; returns -1 if it runs off the end of input */
+static inline int get_length(size_t* length, const unsigned char** ip, const unsigned char* ip_end) {
+  unsigned char b;
+
+  do {
+    if(*ip == ip_end) {
+      return -1;
+    }
+
+    b = *(*ip) ++;
+    (*length) += b;
+  } while(b == 255);
+
+  return 0;
+}
+
+int hibp_lz4_decompress(unsigned char* dst, size_t dst_size, const unsigned char* src, size_t size) {
+  const unsigned char* ip = src;
+  const unsigned char* const ip_end = src + size;
+
+  unsigned char* op = dst;
+  unsigned char* const op_end = dst + dst_size;
+
+  for(;;) {
+    if(ip == ip_end) {
+      return -1;
+    }
+
+    const unsigned char token = *ip ++;
+
+    /* Literals */
+
+    size_t n_literals = token >> 4;
+
+    if(n_literals == 15 && get_length(&n_literals, &ip, ip_end) != 0) {
+      return -1;
+    }
+
+    if((size_t)(ip_end - ip) < n_literals || (size_t)(op_end - op) < n_literals) {
+      return -1;
+    }
+
+    memcpy(op, ip, n_literals);
+    ip += n_literals;
+    op += n_literals;
+
+    /* The last sequence has no match */
+    if(ip == ip_end) {
+      break;
+    }
+
+    /* Match */
+
+    if(ip_end - ip < 2) {
+      return -1;
+    }
+
+    const size_t offset = ip[0] | ((size_t)ip[1] << 8);
+    ip += 2;
+
+    if(offset == 0 || offset > (size_t)(op - dst)) {
+      return -1;
+    }
+
+    size_t length = token & 15;
+
+    if(length == 15 && get_length(&length, &ip, ip_end) != 0) {
+      return -1;
+    }
+
+    length += MIN_MATCH;
+
+    if((size_t)(op_end - op) < length) {
+      return -1;
+    }
+
+    const unsigned char* match = op - offset;
+
+    if(offset == 1) {
+      /* Runs of a single byte, which is what an empty stretch of filter looks like */
+      memset(op, *match, length);
+      op += length;
+    } else if(offset >= length) {
+      memcpy(op, match, length);
+      op += length;
+    } else {
+      /* Overlapping copy. The pattern repeats with period offset, so each copy can be
+       * twice as long as the last */
+      while(length > 0) {
+        const size_t n = ((size_t)(op - match) < length) ? (size_t)(op - match) : length;
+        memcpy(op, match, n);
+        op += n;
+        length -= n;
+      }
+    }
+  }
+
+  return (op == op_end) ? 0 : -1;
+}
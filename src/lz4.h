@@ -0,0 +1,20 @@
+#ifndef _LZ4_H_
+#define _LZ4_H_
+
+#include <stddef.h>
+
+/* Internal to the library. A self-contained implementation of the LZ4 block format (as
+ * documented in lz4_Block_format.md of the reference implementation), so that we can
+ * produce and consume compressed filters without an external dependency. Blocks are
+ * limited to 2**31 bytes */
+
+/* Compress size bytes of src into dst, returning the compressed size, or 0 if the
+ * result doesn't fit in capacity bytes (in which case the contents of dst are garbage) */
+size_t hibp_lz4_compress(unsigned char* dst, size_t capacity, const unsigned char* src, size_t size);
+
+/* Decompress the size bytes of src into exactly dst_size bytes of dst. Returns -1 if src
+ * is malformed, or doesn't decompress to exactly dst_size bytes; 0 otherwise. Never reads
+ * or writes out of bounds, regardless of the contents of src */
+int hibp_lz4_decompress(unsigned char* dst, size_t dst_size, const unsigned char* src, size_t size);
+
+#endif
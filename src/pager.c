@@ -0,0 +1,351 @@
+/* For pread */
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>  /* malloc, free, qsort */
+#include <string.h>  /* memcpy, memset */
+#include <assert.h>  /* assert */
+#include <errno.h>   /* errno, EINTR */
+#include <unistd.h>  /* pread, close */
+#include <pthread.h> /* pthread_mutex_* */
+
+#include "pager.h"
+#include "parallel.h"
+
+/* Pages are read onto the stack before they're cached, so they mustn't be too large */
+#define LOG2_PAGE_SIZE_MAX 16
+
+#define NONE (~(size_t)0)
+
+struct hibp_pager_st {
+  int fd;
+  size_t offset;
+  size_t size;
+  size_t log2_page_size;
+  size_t io_depth;
+
+  /* The cached pages: slot s holds page slot_pages[s] (NONE if it's empty) at
+   * pages + (s << log2_page_size) */
+  size_t n_slots;
+  unsigned char* pages;
+  size_t* slot_pages;
+
+  /* Slots in order of use, as a doubly-linked list from the most recently used (head) to
+   * the least (tail). Empty slots start out at the tail, so that they're filled first */
+  size_t* prev;
+  size_t* next;
+  size_t head;
+  size_t tail;
+
+  /* A hash table from pages to the slots holding them, chained through chain */
+  size_t bucket_mask;
+  size_t* buckets;
+  size_t* chain;
+
+  size_t hits;
+  size_t misses;
+  size_t errors;
+
+  pthread_mutex_t lock;
+};
+
+hibp_pager_t* hibp_pager_new(int fd, size_t offset, size_t size, size_t log2_page_size, size_t n_pages,
+                             size_t io_depth) {
+  assert(log2_page_size <= LOG2_PAGE_SIZE_MAX && n_pages > 0);
+
+  /* A power of 2 buckets, at least as many as slots */
+  size_t n_buckets = 1;
+
+  while(n_buckets < n_pages) {
+    n_buckets *= 2;
+  }
+
+  hibp_pager_t* p = (hibp_pager_t*)malloc(sizeof(hibp_pager_t));
+
+  if(p == NULL) {
+    return NULL;
+  }
+
+  p->pages = (unsigned char*)malloc(n_pages << log2_page_size);
+  p->slot_pages = (size_t*)malloc(n_pages * sizeof(size_t));
+  p->prev = (size_t*)malloc(n_pages * sizeof(size_t));
+  p->next = (size_t*)malloc(n_pages * sizeof(size_t));
+  p->buckets = (size_t*)malloc(n_buckets * sizeof(size_t));
+  p->chain = (size_t*)malloc(n_pages * sizeof(size_t));
+
+  if(p->pages == NULL || p->slot_pages == NULL || p->prev == NULL || p->next == NULL ||
+     p->buckets == NULL || p->chain == NULL || pthread_mutex_init(&p->lock, NULL) != 0) {
+    free(p->pages);
+    free(p->slot_pages);
+    free(p->prev);
+    free(p->next);
+    free(p->buckets);
+    free(p->chain);
+    free(p);
+    return NULL;
+  }
+
+  p->fd = fd;
+  p->offset = offset;
+  p->size = size;
+  p->log2_page_size = log2_page_size;
+  p->io_depth = io_depth;
+  p->n_slots = n_pages;
+  p->bucket_mask = n_buckets - 1;
+  p->head = 0;
+  p->tail = n_pages - 1;
+  p->hits = 0;
+  p->misses = 0;
+  p->errors = 0;
+
+  for(size_t s = 0; s < n_pages; s ++) {
+    p->slot_pages[s] = NONE;
+    p->prev[s] = (s == 0) ? NONE : s - 1;
+    p->next[s] = (s == n_pages - 1) ? NONE : s + 1;
+  }
+
+  for(size_t b = 0; b < n_buckets; b ++) {
+    p->buckets[b] = NONE;
+  }
+
+  return p;
+}
+
+void hibp_pager_destroy(hibp_pager_t* p) {
+  close(p->fd);
+  pthread_mutex_destroy(&p->lock);
+  free(p->pages);
+  free(p->slot_pages);
+  free(p->prev);
+  free(p->next);
+  free(p->buckets);
+  free(p->chain);
+  free(p);
+}
+
+/* The following four are called with the lock held */
+
+static size_t lookup(const hibp_pager_t* p, size_t page) {
+  for(size_t s = p->buckets[page & p->bucket_mask]; s != NONE; s = p->chain[s]) {
+    if(p->slot_pages[s] == page) {
+      return s;
+    }
+  }
+
+  return NONE;
+}
+
+/* Move slot s to the head of the list */
+static void touch(hibp_pager_t* p, size_t s) {
+  if(s == p->head) {
+    return;
+  }
+
+  p->next[p->prev[s]] = p->next[s];
+
+  if(s == p->tail) {
+    p->tail = p->prev[s];
+  } else {
+    p->prev[p->next[s]] = p->prev[s];
+  }
+
+  p->prev[s] = NONE;
+  p->next[s] = p->head;
+  p->prev[p->head] = s;
+  p->head = s;
+}
+
+/* Forget the page that slot s holds, if any */
+static void unhash(hibp_pager_t* p, size_t s) {
+  if(p->slot_pages[s] == NONE) {
+    return;
+  }
+
+  size_t* link = &p->buckets[p->slot_pages[s] & p->bucket_mask];
+
+  while(*link != s) {
+    link = &p->chain[*link];
+  }
+
+  *link = p->chain[s];
+  p->slot_pages[s] = NONE;
+}
+
+/* Cache a copy of the given page, evicting the least recently used one, unless it's
+ * already cached (by another thread that read it at the same time) */
+static void install(hibp_pager_t* p, size_t page, const unsigned char* data) {
+  size_t s = lookup(p, page);
+
+  if(s == NONE) {
+    s = p->tail;
+    unhash(p, s);
+
+    memcpy(p->pages + (s << p->log2_page_size), data, ((size_t)1) << p->log2_page_size);
+
+    const size_t b = page & p->bucket_mask;
+    p->slot_pages[s] = page;
+    p->chain[s] = p->buckets[b];
+    p->buckets[b] = s;
+  }
+
+  touch(p, s);
+}
+
+/* Read a page in full, zeroing whatever lies beyond the end of the region. Returns 0 on
+ * success, -1 on failure */
+static int read_page(const hibp_pager_t* p, size_t page, unsigned char* buffer) {
+  const size_t page_size = ((size_t)1) << p->log2_page_size;
+  const size_t start = page << p->log2_page_size;
+  const size_t length = (p->size - start < page_size) ? p->size - start : page_size;
+
+  size_t done = 0;
+
+  while(done < length) {
+    const ssize_t n = pread(p->fd, buffer + done, length - done, (off_t)(p->offset + start + done));
+
+    if(n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if(n <= 0) {
+      return -1;
+    }
+
+    done += (size_t)n;
+  }
+
+  memset(buffer + length, 0, page_size - length);
+
+  return 0;
+}
+
+static inline int bit_of(const unsigned char* page, size_t bit) {
+  return (page[bit / 8] >> (bit % 8)) & 1;
+}
+
+int hibp_pager_test_bit(hibp_pager_t* p, size_t bit) {
+  const size_t page = bit >> (p->log2_page_size + 3);
+  const size_t within = bit & ((((size_t)8) << p->log2_page_size) - 1);
+
+  assert(bit / 8 < p->size);
+
+  pthread_mutex_lock(&p->lock);
+
+  const size_t s = lookup(p, page);
+
+  if(s != NONE) {
+    touch(p, s);
+    p->hits ++;
+
+    const int value = bit_of(p->pages + (s << p->log2_page_size), within);
+    pthread_mutex_unlock(&p->lock);
+
+    return value;
+  }
+
+  p->misses ++;
+  pthread_mutex_unlock(&p->lock);
+
+  /* Read without the lock, so that threads missing on different pages wait on the disk
+   * together rather than in turn */
+  unsigned char buffer[((size_t)1) << LOG2_PAGE_SIZE_MAX];
+  const int failed = read_page(p, page, buffer);
+
+  pthread_mutex_lock(&p->lock);
+
+  if(failed) {
+    p->errors ++;
+  } else {
+    install(p, page, buffer);
+  }
+
+  pthread_mutex_unlock(&p->lock);
+
+  return failed ? -1 : bit_of(buffer, within);
+}
+
+typedef struct {
+  const hibp_pager_t* p;
+  const size_t* pages;
+  unsigned char* buffers;
+  int* failed;
+} fetch_job_t;
+
+static void fetch_nth_page(void* ctx, size_t i) {
+  const fetch_job_t* job = (const fetch_job_t*)ctx;
+  job->failed[i] = read_page(job->p, job->pages[i], job->buffers + (i << job->p->log2_page_size));
+}
+
+static int compare_pages(const void* x, const void* y) {
+  const size_t a = *(const size_t*)x;
+  const size_t b = *(const size_t*)y;
+  return (a > b) - (a < b);
+}
+
+void hibp_pager_prefetch(hibp_pager_t* p, size_t n, const size_t* bits) {
+  size_t* pages = (size_t*)malloc((n == 0 ? 1 : n) * sizeof(size_t));
+
+  if(pages == NULL) {
+    return;
+  }
+
+  size_t n_missing = 0;
+
+  pthread_mutex_lock(&p->lock);
+
+  for(size_t i = 0; i < n; i ++) {
+    const size_t page = bits[i] >> (p->log2_page_size + 3);
+
+    if(lookup(p, page) == NONE) {
+      pages[n_missing ++] = page;
+    }
+  }
+
+  pthread_mutex_unlock(&p->lock);
+
+  qsort(pages, n_missing, sizeof(size_t), compare_pages);
+
+  size_t n_distinct = 0;
+
+  for(size_t i = 0; i < n_missing; i ++) {
+    if(n_distinct == 0 || pages[n_distinct - 1] != pages[i]) {
+      pages[n_distinct ++] = pages[i];
+    }
+  }
+
+  /* No sense reading more than can be cached at once */
+  if(n_distinct > p->n_slots) {
+    n_distinct = p->n_slots;
+  }
+
+  unsigned char* buffers = (unsigned char*)malloc((n_distinct == 0 ? 1 : n_distinct) << p->log2_page_size);
+  int* failed = (int*)malloc((n_distinct == 0 ? 1 : n_distinct) * sizeof(int));
+
+  if(buffers != NULL && failed != NULL) {
+    fetch_job_t job = { p, pages, buffers, failed };
+    hibp_parallel_for(n_distinct, p->io_depth, fetch_nth_page, &job);
+
+    pthread_mutex_lock(&p->lock);
+
+    for(size_t i = 0; i < n_distinct; i ++) {
+      if(failed[i]) {
+        p->errors ++;
+      } else {
+        install(p, pages[i], buffers + (i << p->log2_page_size));
+      }
+    }
+
+    pthread_mutex_unlock(&p->lock);
+  }
+
+  free(pages);
+  free(buffers);
+  free(failed);
+}
+
+void hibp_pager_counts(hibp_pager_t* p, size_t* hits, size_t* misses, size_t* errors) {
+  pthread_mutex_lock(&p->lock);
+  *hits = p->hits;
+  *misses = p->misses;
+  *errors = p->errors;
+  pthread_mutex_unlock(&p->lock);
+}
@@ -0,0 +1,34 @@
+#ifndef _PAGER_H_
+#define _PAGER_H_
+
+#include <stddef.h>
+
+/* Internal to the library. A cache of the pages of a region of a file, each read on demand
+ * with pread, and evicted least recently used first, so that a bit vector far larger than
+ * memory can be probed a bit at a time. Safe for concurrent use by any number of threads */
+typedef struct hibp_pager_st hibp_pager_t;
+
+/* Create a pager for the size bytes of the file open on fd that start at offset, which
+ * caches up to n_pages pages of 2**log2_page_size bytes each (at most 64 KiB), and has up
+ * to io_depth reads outstanding at once when prefetching. The pager takes ownership of fd,
+ * closing it on destruction (but not on failure). Returns NULL if allocation fails */
+hibp_pager_t* hibp_pager_new(int fd, size_t offset, size_t size, size_t log2_page_size, size_t n_pages,
+                             size_t io_depth);
+
+void hibp_pager_destroy(hibp_pager_t* p);
+
+/* The value of the given bit of the region (numbered from the least significant bit of each
+ * byte), reading its page if it isn't cached. Returns -1 if reading fails */
+int hibp_pager_test_bit(hibp_pager_t* p, size_t bit);
+
+/* Read every page holding one of the n given bits that isn't already cached, with up to
+ * io_depth reads outstanding at once (on as many threads), so that probing the bits
+ * thereafter (hopefully) doesn't block. Purely an optimization; pages it reads may be
+ * evicted again before they're probed, if the cache is too small for them all */
+void hibp_pager_prefetch(hibp_pager_t* p, size_t n, const size_t* bits);
+
+/* Counts of probes that found their page cached and that didn't, and of failed reads,
+ * since the pager was created */
+void hibp_pager_counts(hibp_pager_t* p, size_t* hits, size_t* misses, size_t* errors);
+
+#endif
@@ -0,0 +1,95 @@
+/* For sysconf(_SC_NPROCESSORS_ONLN), which isn't actually POSIX */
+#define _DEFAULT_SOURCE
+
+#include <pthread.h> /* pthread_create, pthread_join */
+#include <unistd.h>  /* sysconf */
+
+#include "parallel.h"
+
+/* There's not much to be gained from more threads than this, and it lets us keep the
+ * thread handles on the stack */
+#define MAX_THREADS 64
+
+typedef struct {
+  size_t n;
+  size_t stride;
+  void (*fn)(void*, size_t);
+  void* ctx;
+} job_t;
+
+typedef struct {
+  const job_t* job;
+  size_t first;
+} worker_t;
+
+/* Each worker takes every stride'th index, starting from its own. The work items of
+ * the callers in this library are all roughly the same size, so there's no need for
+ * anything cleverer */
+static void* run_worker(void* arg) {
+  const worker_t* worker = (const worker_t*)arg;
+  const job_t* job = worker->job;
+
+  for(size_t i = worker->first; i < job->n; i += job->stride) {
+    job->fn(job->ctx, i);
+  }
+
+  return NULL;
+}
+
+size_t hibp_n_cpus(void) {
+  const long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return (n < 1) ? 1 : (size_t)n;
+}
+
+void hibp_parallel_for(size_t n, size_t n_threads, void (*fn)(void* ctx, size_t i), void* ctx) {
+  if(n_threads == 0) {
+    n_threads = hibp_n_cpus();
+  }
+
+  if(n_threads > n) {
+    n_threads = n;
+  }
+
+  if(n_threads > MAX_THREADS) {
+    n_threads = MAX_THREADS;
+  }
+
+  if(n_threads <= 1) {
+    for(size_t i = 0; i < n; i ++) {
+      fn(ctx, i);
+    }
+    return;
+  }
+
+  const job_t job = { n, n_threads, fn, ctx };
+
+  pthread_t threads[MAX_THREADS];
+  worker_t workers[MAX_THREADS];
+
+  /* Worker 0 runs on the calling thread, as does any worker whose thread couldn't be
+   * created */
+  size_t created = 1;
+
+  for(; created < n_threads; created ++) {
+    workers[created].job = &job;
+    workers[created].first = created;
+
+    if(pthread_create(&threads[created], NULL, run_worker, &workers[created]) != 0) {
+      break;
+    }
+  }
+
+  workers[0].job = &job;
+  workers[0].first = 0;
+  run_worker(&workers[0]);
+
+  for(size_t t = created; t < n_threads; t ++) {
+    workers[t].job = &job;
+    workers[t].first = t;
+    run_worker(&workers[t]);
+  }
+
+  for(size_t t = 1; t < created; t ++) {
+    pthread_join(threads[t], NULL);
+  }
+}
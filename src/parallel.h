@@ -0,0 +1,16 @@
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+#include <stddef.h>
+
+/* Internal to the library. Call fn(ctx, i) for every i in [0, n), spread across up to
+ * n_threads threads (including the calling thread), and return once every call has
+ * returned. n_threads == 0 means one thread per online CPU. Calls to fn run concurrently
+ * and in no particular order, so fn must be safe to call concurrently for distinct i.
+ * If threads can't be created, the remaining work is done on the calling thread */
+void hibp_parallel_for(size_t n, size_t n_threads, void (*fn)(void* ctx, size_t i), void* ctx);
+
+/* The number of online CPUs, or 1 if it can't be determined */
+size_t hibp_n_cpus(void);
+
+#endif
@@ -0,0 +1,152 @@
+#include <string.h>  /* memcpy */
+#include <stdint.h>  /* uint64_t */
+#include <pthread.h> /* pthread_once */
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "popcount.h"
+
+#define BLOCK_SIZE 64
+
+/* ================================================================
+ * Word-at-a-time implementations
+ * ================================================================ */
+
+static inline size_t popcount_word(uint64_t word) {
+#ifdef __GNUC__
+  return (size_t)__builtin_popcountll(word);
+#else
+  word = word - ((word >> 1) & 0x5555555555555555ULL);
+  word = (word & 0x3333333333333333ULL) + ((word >> 2) & 0x3333333333333333ULL);
+  word = (word + (word >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+  return (size_t)((word * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+/* Inlined into each of the kernels below, so that __builtin_popcountll is compiled to the
+ * popcnt instruction where the kernel's target has it */
+static inline size_t popcount_words(const unsigned char* buffer, size_t size, unsigned short* counts) {
+  size_t total = 0;
+  size_t i = 0;
+
+  for(; i + BLOCK_SIZE <= size; i += BLOCK_SIZE) {
+    size_t count = 0;
+
+    for(size_t j = 0; j < BLOCK_SIZE; j += 8) {
+      uint64_t word;
+      memcpy(&word, buffer + i + j, 8);
+      count += popcount_word(word);
+    }
+
+    if(counts != NULL) {
+      counts[i / BLOCK_SIZE] = (unsigned short)count;
+    }
+
+    total += count;
+  }
+
+  for(; i < size; i ++) {
+    total += popcount_word(buffer[i]);
+  }
+
+  return total;
+}
+
+static size_t popcount_generic(const unsigned char* buffer, size_t size, unsigned short* counts) {
+  return popcount_words(buffer, size, counts);
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HAVE_POPCOUNT_X86
+
+__attribute__((target("popcnt")))
+static size_t popcount_popcnt(const unsigned char* buffer, size_t size, unsigned short* counts) {
+  return popcount_words(buffer, size, counts);
+}
+
+/* ================================================================
+ * AVX2 implementation
+ * ================================================================ */
+
+/* The popcount of each byte of v, by looking up each nibble in a 16-entry table with
+ * vpshufb (Mula, Kurz, and Lemire, "Faster Population Counts Using AVX2 Instructions") */
+__attribute__((target("avx2")))
+static inline __m256i popcount_bytes(__m256i v) {
+  const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low_nibbles = _mm256_set1_epi8(0x0f);
+
+  const __m256i lo = _mm256_and_si256(v, low_nibbles);
+  const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_nibbles);
+
+  return _mm256_add_epi8(_mm256_shuffle_epi8(table, lo), _mm256_shuffle_epi8(table, hi));
+}
+
+/* The popcount of a 64-byte block, as four 64-bit partial sums */
+__attribute__((target("avx2")))
+static inline __m256i popcount_block(const unsigned char* block) {
+  const __m256i a = _mm256_loadu_si256((const __m256i*)block);
+  const __m256i b = _mm256_loadu_si256((const __m256i*)(block + 32));
+
+  /* At most 16 per byte, so the sum fits; vpsadbw then sums each run of 8 bytes */
+  const __m256i bytes = _mm256_add_epi8(popcount_bytes(a), popcount_bytes(b));
+
+  return _mm256_sad_epu8(bytes, _mm256_setzero_si256());
+}
+
+__attribute__((target("avx2")))
+static inline size_t sum_lanes(__m256i v) {
+  uint64_t lanes[4];
+  _mm256_storeu_si256((__m256i*)lanes, v);
+  return (size_t)(lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t popcount_avx2(const unsigned char* buffer, size_t size, unsigned short* counts) {
+  size_t total = 0;
+  size_t i = 0;
+
+  if(counts != NULL) {
+    for(; i + BLOCK_SIZE <= size; i += BLOCK_SIZE) {
+      const size_t count = sum_lanes(popcount_block(buffer + i));
+      counts[i / BLOCK_SIZE] = (unsigned short)count;
+      total += count;
+    }
+  } else {
+    /* Without counts per block, the partial sums needn't be reduced until the end */
+    __m256i sums = _mm256_setzero_si256();
+
+    for(; i + BLOCK_SIZE <= size; i += BLOCK_SIZE) {
+      sums = _mm256_add_epi64(sums, popcount_block(buffer + i));
+    }
+
+    total = sum_lanes(sums);
+  }
+
+  return total + popcount_words(buffer + i, size - i, NULL);
+}
+#endif
+
+/* ================================================================
+ * Dispatch
+ * ================================================================ */
+
+static size_t (*implementation)(const unsigned char*, size_t, unsigned short*) = popcount_generic;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static void init(void) {
+#ifdef HAVE_POPCOUNT_X86
+  if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+    implementation = popcount_avx2;
+  } else if(__builtin_cpu_supports("popcnt")) {
+    implementation = popcount_popcnt;
+  }
+#endif
+}
+
+size_t hibp_popcount(const unsigned char* buffer, size_t size, unsigned short* counts) {
+  pthread_once(&once, init);
+  return implementation(buffer, size, counts);
+}
@@ -0,0 +1,12 @@
+#ifndef _POPCOUNT_H_
+#define _POPCOUNT_H_
+
+#include <stddef.h>
+
+/* Internal to the library. Return the number of bits set among the size bytes of buffer.
+ * If counts is non-NULL, size must be a multiple of 64, and counts[i] is populated with the
+ * number of bits set in the i'th 64-byte block of buffer. Uses AVX2 where available, the
+ * popcnt instruction failing that, and a portable implementation otherwise */
+size_t hibp_popcount(const unsigned char* buffer, size_t size, unsigned short* counts);
+
+#endif
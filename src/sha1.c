@@ -0,0 +1,262 @@
+#include <openssl/sha.h> /* SHA1 */
+#include <string.h>      /* memcpy, memset */
+#include <stdint.h>      /* uint32_t, uint64_t */
+#include <pthread.h>     /* pthread_once */
+
+#include "sha1.h"
+
+#define SHA1_BYTES 20
+
+/* Messages of up to this many blocks (i.e. this many times 64 bytes, less 9 bytes of
+ * padding) are hashed in lanes. Lanes sit idle once their message is exhausted, so lanes
+ * are only worthwhile while messages are all about the same length; passwords and the like
+ * are almost all a single block */
+#define MAX_LANE_BLOCKS 4
+
+static void sha1_one(unsigned char* sha, size_t size, const unsigned char* buffer) {
+  /* As in hibp-bloom.c, SHA1 can't fail in practice */
+  SHA1(buffer, size, sha);
+}
+
+static inline size_t count_blocks(size_t size) {
+  return (size + 8) / 64 + 1;
+}
+
+/* ================================================================
+ * Lanes
+ * ================================================================ */
+
+#if defined(__GNUC__)
+#define HAVE_SHA1_LANES
+
+/* Eight lanes of 32-bit words. With AVX2, each operation on a vector is a single
+ * instruction; otherwise the compiler splits it into narrower operations (e.g. two for
+ * SSE2), which is still much faster than hashing one message at a time */
+#define LANES 8
+typedef uint32_t lanes_t __attribute__((vector_size(4 * LANES)));
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+/* Every lane x. A macro rather than a function, since returning a vector from a function
+ * compiled without AVX has a different ABI to returning one from a function compiled with */
+#define SPLAT(x) ((lanes_t){ (x), (x), (x), (x), (x), (x), (x), (x) })
+
+static inline uint32_t load_be32(const unsigned char* p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline void store_be32(unsigned char* p, uint32_t x) {
+  p[0] = x >> 24;
+  p[1] = x >> 16;
+  p[2] = x >> 8;
+  p[3] = x;
+}
+
+/* The index'th 64-byte block of the padded message of size bytes: the message, then a
+ * single 1 bit, then zeros, then the size of the message in bits as a big-endian 64-bit
+ * integer, in the last 8 bytes of the last block */
+static inline void pad_block(unsigned char* block, size_t size, const unsigned char* buffer,
+                             size_t index) {
+  const size_t offset = 64 * index;
+  const size_t copied = (size > offset) ? ((size - offset < 64) ? size - offset : 64) : 0;
+
+  memcpy(block, buffer + offset, copied);
+  memset(block + copied, 0, 64 - copied);
+
+  if(offset <= size && size < offset + 64) {
+    block[size - offset] = 0x80;
+  }
+
+  if(index == count_blocks(size) - 1) {
+    const uint64_t bits = (uint64_t)size * 8;
+
+    for(size_t i = 0; i < 8; i ++) {
+      block[56 + i] = (unsigned char)(bits >> (56 - 8 * i));
+    }
+  }
+}
+
+#define ROUND(f, k, i)                                                            \
+  do {                                                                            \
+    if((i) >= 16) {                                                               \
+      w[(i) & 15] = ROL(w[((i) - 3) & 15] ^ w[((i) - 8) & 15] ^                    \
+                        w[((i) - 14) & 15] ^ w[(i) & 15], 1);                      \
+    }                                                                             \
+    const lanes_t t = ROL(a, 5) + (f) + e + SPLAT(k) + w[(i) & 15];               \
+    e = d;                                                                        \
+    d = c;                                                                        \
+    c = ROL(b, 30);                                                               \
+    b = a;                                                                        \
+    a = t;                                                                        \
+  } while(0)
+
+/* Hash n <= LANES messages of at most MAX_LANE_BLOCKS blocks each, one per lane. Inlined
+ * into each of the kernels below, so that it's compiled for the instruction set of each */
+static inline __attribute__((always_inline))
+void hash_lanes(unsigned char* shas, size_t n, const size_t* sizes, const unsigned char* const* buffers) {
+  lanes_t h[5] = {
+    SPLAT(0x67452301), SPLAT(0xefcdab89), SPLAT(0x98badcfe), SPLAT(0x10325476), SPLAT(0xc3d2e1f0)
+  };
+
+  size_t n_blocks[LANES];
+  size_t max_blocks = 0;
+
+  for(size_t l = 0; l < LANES; l ++) {
+    n_blocks[l] = (l < n) ? count_blocks(sizes[l]) : 0;
+    max_blocks = (n_blocks[l] > max_blocks) ? n_blocks[l] : max_blocks;
+  }
+
+  for(size_t index = 0; index < max_blocks; index ++) {
+    /* Transpose the blocks, so that w[j] holds the j'th word of every lane's block */
+    uint32_t words[16][LANES];
+    uint32_t active[LANES];
+
+    for(size_t l = 0; l < LANES; l ++) {
+      unsigned char block[64];
+      active[l] = (index < n_blocks[l]) ? ~(uint32_t)0 : 0;
+
+      if(active[l]) {
+        pad_block(block, sizes[l], buffers[l], index);
+      } else {
+        memset(block, 0, 64);
+      }
+
+      for(size_t j = 0; j < 16; j ++) {
+        words[j][l] = load_be32(block + 4 * j);
+      }
+    }
+
+    lanes_t w[16];
+    lanes_t mask;
+    memcpy(w, words, sizeof(w));
+    memcpy(&mask, active, sizeof(mask));
+
+    lanes_t a = h[0];
+    lanes_t b = h[1];
+    lanes_t c = h[2];
+    lanes_t d = h[3];
+    lanes_t e = h[4];
+
+    for(size_t i = 0; i < 20; i ++) {
+      ROUND((b & c) | (~b & d), 0x5a827999, i);
+    }
+
+    for(size_t i = 20; i < 40; i ++) {
+      ROUND(b ^ c ^ d, 0x6ed9eba1, i);
+    }
+
+    for(size_t i = 40; i < 60; i ++) {
+      ROUND((b & c) | (b & d) | (c & d), 0x8f1bbcdc, i);
+    }
+
+    for(size_t i = 60; i < 80; i ++) {
+      ROUND(b ^ c ^ d, 0xca62c1d6, i);
+    }
+
+    /* Lanes whose messages are exhausted keep their digests */
+    h[0] = ((h[0] + a) & mask) | (h[0] & ~mask);
+    h[1] = ((h[1] + b) & mask) | (h[1] & ~mask);
+    h[2] = ((h[2] + c) & mask) | (h[2] & ~mask);
+    h[3] = ((h[3] + d) & mask) | (h[3] & ~mask);
+    h[4] = ((h[4] + e) & mask) | (h[4] & ~mask);
+  }
+
+  uint32_t digests[5][LANES];
+  memcpy(digests, h, sizeof(digests));
+
+  for(size_t l = 0; l < n; l ++) {
+    for(size_t k = 0; k < 5; k ++) {
+      store_be32(shas + l * SHA1_BYTES + 4 * k, digests[k][l]);
+    }
+  }
+}
+
+static void hash_lanes_generic(unsigned char* shas, size_t n, const size_t* sizes,
+                               const unsigned char* const* buffers) {
+  hash_lanes(shas, n, sizes, buffers);
+}
+
+#if defined(__x86_64__)
+#define HAVE_SHA1_LANES_AVX2
+
+__attribute__((target("avx2")))
+static void hash_lanes_avx2(unsigned char* shas, size_t n, const size_t* sizes,
+                            const unsigned char* const* buffers) {
+  hash_lanes(shas, n, sizes, buffers);
+}
+#endif
+#endif
+
+/* ================================================================
+ * Dispatch
+ * ================================================================ */
+
+#ifdef HAVE_SHA1_LANES
+static void (*implementation)(unsigned char*, size_t, const size_t*, const unsigned char* const*) =
+  hash_lanes_generic;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static void init(void) {
+#ifdef HAVE_SHA1_LANES_AVX2
+  if(__builtin_cpu_supports("avx2")) {
+    implementation = hash_lanes_avx2;
+  }
+#endif
+}
+#endif
+
+#ifdef HAVE_SHA1_LANES
+/* Hash the n_lanes messages gathered so far, writing each digest to its place in shas */
+static void flush_lanes(unsigned char* shas, size_t n_lanes, const size_t* indices,
+                        const size_t* sizes, const unsigned char* const* buffers) {
+  /* A single message is no faster in lanes */
+  if(n_lanes == 1) {
+    sha1_one(shas + indices[0] * SHA1_BYTES, sizes[0], buffers[0]);
+    return;
+  }
+
+  unsigned char lane_shas[LANES * SHA1_BYTES];
+  implementation(lane_shas, n_lanes, sizes, buffers);
+
+  for(size_t l = 0; l < n_lanes; l ++) {
+    memcpy(shas + indices[l] * SHA1_BYTES, lane_shas + l * SHA1_BYTES, SHA1_BYTES);
+  }
+}
+#endif
+
+void hibp_sha1_batch(unsigned char* shas, size_t n, const size_t* sizes,
+                     const unsigned char* const* buffers) {
+#ifdef HAVE_SHA1_LANES
+  pthread_once(&once, init);
+
+  /* Gather short messages into lanes, hashing long ones as they come */
+  size_t indices[LANES];
+  size_t lane_sizes[LANES];
+  const unsigned char* lane_buffers[LANES];
+  size_t n_lanes = 0;
+
+  for(size_t i = 0; i < n; i ++) {
+    if(count_blocks(sizes[i]) > MAX_LANE_BLOCKS) {
+      sha1_one(shas + i * SHA1_BYTES, sizes[i], buffers[i]);
+      continue;
+    }
+
+    indices[n_lanes] = i;
+    lane_sizes[n_lanes] = sizes[i];
+    lane_buffers[n_lanes] = buffers[i];
+
+    if(++ n_lanes == LANES) {
+      flush_lanes(shas, n_lanes, indices, lane_sizes, lane_buffers);
+      n_lanes = 0;
+    }
+  }
+
+  if(n_lanes > 0) {
+    flush_lanes(shas, n_lanes, indices, lane_sizes, lane_buffers);
+  }
+#else
+  for(size_t i = 0; i < n; i ++) {
+    sha1_one(shas + i * SHA1_BYTES, sizes[i], buffers[i]);
+  }
+#endif
+}
@@ -0,0 +1,14 @@
+#ifndef _SHA1_H_
+#define _SHA1_H_
+
+#include <stddef.h>
+
+/* Internal to the library. Compute the SHA1 of each of n messages, the i'th being the
+ * sizes[i] bytes at buffers[i], writing the 20-byte digests back-to-back to shas. Short
+ * messages are hashed several at a time, one per lane of a SIMD register (AVX2 where
+ * available), which is several times faster than hashing them one by one; long messages,
+ * for which there's nothing to gain, are passed to OpenSSL */
+void hibp_sha1_batch(unsigned char* shas, size_t n, const size_t* sizes,
+                     const unsigned char* const* buffers);
+
+#endif
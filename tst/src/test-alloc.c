@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "util.h"
+
+/* Assert that filters allocated on huge pages, on particular NUMA nodes, or by a custom
+ * allocator behave exactly like any other filter, whether created, copied, or loaded, that
+ * hibp_bf_destroy releases their memory as it was allocated, and that contradictory
+ * allocation directives are rejected. Huge page pools are usually empty on test machines,
+ * so HIBP_ALLOC_HUGETLB is allowed to fail with HIBP_E_NOMEM */
+
+#define N_STRINGS 5000
+#define LENGTH 40
+
+/* The custom allocator counts its outstanding allocations, and tags them so that frees
+ * can be matched to allocations */
+typedef struct {
+  size_t n_live;
+  size_t n_allocs;
+  size_t live_size;
+} counter_t;
+
+static void* counting_alloc(void* ctx, size_t size) {
+  counter_t* counter = (counter_t*)ctx;
+  counter->n_live ++;
+  counter->n_allocs ++;
+  counter->live_size += size;
+  return calloc(size, 1);
+}
+
+static void counting_free(void* ctx, void* buffer, size_t size) {
+  counter_t* counter = (counter_t*)ctx;
+  hassert0(counter->n_live > 0 && counter->live_size >= size);
+  counter->n_live --;
+  counter->live_size -= size;
+  free(buffer);
+}
+
+typedef struct {
+  int flags;
+  int node;
+  int custom;
+  hibp_layout_t layout;
+  size_t bits;
+} case_t;
+
+const case_t cases[] = {
+  { 0,                                             0, 0, HIBP_LAYOUT_STANDARD, 1 << 16 },
+  { HIBP_ALLOC_HUGEPAGES,                          0, 0, HIBP_LAYOUT_STANDARD, 1 << 24 },
+  { HIBP_ALLOC_HUGEPAGES,                          0, 0, HIBP_LAYOUT_BLOCKED,  512 * 1001 },
+  { HIBP_ALLOC_INTERLEAVE,                         0, 0, HIBP_LAYOUT_STANDARD, 100003 },
+  { HIBP_ALLOC_NODE,                               0, 0, HIBP_LAYOUT_BLOCKED,  1 << 20 },
+  { HIBP_ALLOC_HUGEPAGES | HIBP_ALLOC_INTERLEAVE,  0, 0, HIBP_LAYOUT_BLOCKED,  1 << 25 },
+  { HIBP_ALLOC_HUGETLB,                            0, 0, HIBP_LAYOUT_STANDARD, 1 << 20 },
+  { HIBP_ALLOC_HUGETLB | HIBP_ALLOC_NODE,          0, 0, HIBP_LAYOUT_BLOCKED,  1 << 22 },
+  { 0,                                             0, 1, HIBP_LAYOUT_STANDARD, 12345 },
+  { HIBP_ALLOC_HUGEPAGES,                          0, 1, HIBP_LAYOUT_BLOCKED,  1 << 18 }
+};
+
+const size_t n_cases = sizeof(cases) / sizeof(case_t);
+
+static size_t buffer_size(const hibp_bloom_filter_t* bf) {
+  return hibp_compute_total_size_bits(bf->layout, bf->hashing, bf->n_hash_functions, bf->bits) -
+         sizeof(hibp_bloom_filter_t);
+}
+
+int main(void) {
+  byte* shas = malloc(N_STRINGS * SHA1_BYTES);
+  hassert0(shas != NULL);
+
+  for(size_t i = 0; i < N_STRINGS; i ++) {
+    char* str = random_ascii_str(LENGTH);
+    sha1(shas + i * SHA1_BYTES, strlen(str), (const byte*)str);
+    free(str);
+  }
+
+  /* NUMA topology, such as it is */
+
+  const size_t n_nodes = hibp_numa_n_nodes();
+  hassert0(n_nodes >= 1);
+  hassert0(hibp_numa_node() >= 0 && (size_t)hibp_numa_node() < n_nodes);
+
+  /* Contradictions */
+
+  hibp_bloom_filter_t bf;
+  hibp_allocator_t allocator;
+
+  const int bad_flags[] = {
+    HIBP_ALLOC_HUGETLB | HIBP_ALLOC_HUGETLB_1GB,
+    HIBP_ALLOC_INTERLEAVE | HIBP_ALLOC_NODE,
+    0x100
+  };
+
+  for(size_t i = 0; i < sizeof(bad_flags) / sizeof(int); i ++) {
+    memset(&allocator, 0, sizeof(allocator));
+    allocator.flags = bad_flags[i];
+    hassert0(hibp_bf_new_alloc(&bf, HIBP_LAYOUT_STANDARD, HIBP_HASHING_RANDOM, 5, 1 << 10, &allocator) == HIBP_E_INVAL);
+  }
+
+  memset(&allocator, 0, sizeof(allocator));
+  allocator.flags = HIBP_ALLOC_NODE;
+  allocator.node = -1;
+  hassert0(hibp_bf_new_alloc(&bf, HIBP_LAYOUT_STANDARD, HIBP_HASHING_RANDOM, 5, 1 << 10, &allocator) == HIBP_E_INVAL);
+
+  /* A buffer from alloc can only be released by free */
+  counter_t unfreeable = { 0, 0, 0 };
+  memset(&allocator, 0, sizeof(allocator));
+  allocator.alloc = counting_alloc;
+  allocator.ctx = &unfreeable;
+  hassert0(hibp_bf_new_alloc(&bf, HIBP_LAYOUT_STANDARD, HIBP_HASHING_RANDOM, 5, 1 << 10, &allocator) == HIBP_E_INVAL);
+  hassert0(unfreeable.n_allocs == 0);
+
+  for(size_t c = 0; c < n_cases; c ++) {
+    const case_t* cs = &cases[c];
+    counter_t counter = { 0, 0, 0 };
+
+    memset(&allocator, 0, sizeof(allocator));
+    allocator.flags = cs->flags;
+    allocator.node = cs->node;
+
+    if(cs->custom) {
+      allocator.alloc = counting_alloc;
+      allocator.free = counting_free;
+      allocator.ctx = &counter;
+    }
+
+    hibp_status_t status =
+      hibp_bf_new_alloc(&bf, cs->layout, HIBP_HASHING_RANDOM, 7, cs->bits, &allocator);
+
+    if(status == HIBP_E_NOMEM && (cs->flags & HIBP_ALLOC_HUGETLB)) {
+      continue;
+    }
+
+    hassert(status == HIBP_OK, "expected HIBP_OK, got %s (case %d)", status2str(status), (int)c);
+
+    if(cs->custom) {
+      hassert0(counter.n_live == 1 && counter.live_size == buffer_size(&bf));
+    } else if(cs->flags & HIBP_ALLOC_HUGEPAGES) {
+      hassert0((uintptr_t)bf.buffer % (2 * 1024 * 1024) == 0);
+    }
+
+    /* A fresh filter is empty, however it was allocated */
+    for(size_t i = buffer_size(&bf) - (bf.bits + 7) / 8; i < buffer_size(&bf); i ++) {
+      hassert0(bf.buffer[i] == 0);
+    }
+
+    hibp_bf_insert_sha1_batch(&bf, N_STRINGS, shas);
+
+    for(size_t i = 0; i < N_STRINGS; i ++) {
+      hassert0(hibp_bf_query_sha1(&bf, shas + i * SHA1_BYTES));
+    }
+
+    /* A copy, allocated the same way */
+
+    hibp_bloom_filter_t copy;
+    hassert0(hibp_bf_new_copy(&copy, &bf, &allocator) == HIBP_OK);
+    hassert0(copy.bits == bf.bits && memcmp(copy.buffer, bf.buffer, buffer_size(&bf)) == 0);
+    hassert0(hibp_bf_union(&copy, &bf) == HIBP_OK);
+    hassert0(!cs->custom || counter.n_live == 2);
+
+    /* Copies are independent */
+    hibp_bf_insert_str(&copy, "only in the copy");
+    hassert0(hibp_bf_query_str(&copy, "only in the copy"));
+
+    /* To disk, and back into memory allocated the same way */
+
+    FILE* file = fopen("alloc.bl", "wb");
+    hassert0(file != NULL);
+    hassert0(hibp_bf_save_file_format(&bf, file, (c % 2 == 0) ? HIBP_FORMAT_CHUNKED : HIBP_FORMAT_COMPRESSED) == HIBP_OK);
+    fclose(file);
+
+    hibp_bloom_filter_t loaded;
+
+    file = fopen("alloc.bl", "rb");
+    hassert0(file != NULL);
+    hassert0(hibp_bf_load_file_alloc(&loaded, file, &allocator) == HIBP_OK);
+    fclose(file);
+
+    hassert0(memcmp(loaded.buffer, bf.buffer, buffer_size(&bf)) == 0);
+    hassert0(!cs->custom || counter.n_live == 3);
+
+    hibp_bf_destroy(&loaded);
+    hibp_bf_destroy(&copy);
+    hibp_bf_destroy(&bf);
+    remove("alloc.bl");
+
+    hassert0(counter.n_live == 0 && counter.live_size == 0);
+    hassert0(counter.n_allocs == (cs->custom ? 3 : 0));
+  }
+
+  /* One node-local copy per node of a lazily-verified mapping, verified in full first */
+
+  hassert0(hibp_bf_new_blocked(&bf, 9, 26) == HIBP_OK);
+  hibp_bf_insert_sha1_batch(&bf, N_STRINGS, shas);
+
+  FILE* file = fopen("alloc.bl", "wb");
+  hassert0(file != NULL);
+  hassert0(hibp_bf_save_file_format(&bf, file, HIBP_FORMAT_CHUNKED) == HIBP_OK);
+  const long size = ftell(file);
+  fclose(file);
+
+  hibp_bloom_filter_t mapped;
+  hassert0(hibp_bf_map_file(&mapped, "alloc.bl", HIBP_MAP_LAZY_VERIFY) == HIBP_OK);
+
+  for(size_t node = 0; node < n_nodes; node ++) {
+    hibp_bloom_filter_t replica;
+
+    memset(&allocator, 0, sizeof(allocator));
+    allocator.flags = HIBP_ALLOC_NODE;
+    allocator.node = (int)node;
+
+    if(hibp_bf_new_copy(&replica, &mapped, &allocator) != HIBP_OK) {
+      /* Nodes needn't be numbered contiguously */
+      continue;
+    }
+
+    hassert0(memcmp(replica.buffer, bf.buffer, buffer_size(&bf)) == 0);
+    hibp_bf_destroy(&replica);
+  }
+
+  hibp_bf_destroy(&mapped);
+
+  /* The last byte is in the bit vector, in a different chunk to the hash functions */
+  file = fopen("alloc.bl", "r+b");
+  hassert0(file != NULL);
+  fseek(file, size - 1, SEEK_SET);
+  const int last = fgetc(file);
+  fseek(file, size - 1, SEEK_SET);
+  fputc(last ^ 1, file);
+  fclose(file);
+
+  hassert0(hibp_bf_map_file(&mapped, "alloc.bl", HIBP_MAP_LAZY_VERIFY) == HIBP_OK);
+
+  hibp_bloom_filter_t replica;
+  const hibp_status_t status = hibp_bf_new_copy(&replica, &mapped, NULL);
+  hassert(status == HIBP_E_CHECKSUM, "expected HIBP_E_CHECKSUM, got %s", status2str(status));
+
+  hibp_bf_destroy(&mapped);
+  hibp_bf_destroy(&bf);
+  remove("alloc.bl");
+  free(shas);
+
+  return 0;
+}
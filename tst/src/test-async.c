@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <poll.h>
+
+#include "util.h"
+
+/* Assert that a query queue answers every query submitted to it, exactly once and as
+ * hibp_bf_query_sha1 would, whether results are delivered by callback or polled (with the
+ * file descriptor readable exactly while completions are waiting), and that destroying a
+ * queue first answers whatever's outstanding */
+
+typedef struct {
+  size_t n_threads;
+  size_t max_batch;
+  int callback;
+} case_t;
+
+const case_t cases[] = {
+  { 1, 1,  1 },
+  { 1, 1,  0 },
+  { 4, 0,  1 },
+  { 4, 0,  0 },
+  { 0, 7,  1 },
+  { 3, 64, 0 }
+};
+
+const size_t n_cases = sizeof(cases) / sizeof(case_t);
+
+#define N_INSERTS 20000
+#define N_QUERIES 50000
+
+typedef struct {
+  pthread_mutex_t lock;
+  int results[N_QUERIES];
+  int answered[N_QUERIES];
+  size_t n_answered;
+} tally_t;
+
+static void record(tally_t* t, void* tag, int result) {
+  const size_t i = (size_t)(uintptr_t)tag;
+
+  hassert(i < N_QUERIES, "expected a tag that was submitted, not %lu", (unsigned long)i);
+
+  pthread_mutex_lock(&t->lock);
+  hassert(!t->answered[i], "expected query %lu to be answered once", (unsigned long)i);
+  t->answered[i] = 1;
+  t->results[i] = result;
+  t->n_answered ++;
+  pthread_mutex_unlock(&t->lock);
+}
+
+static void complete(void* ctx, void* tag, int result) {
+  record((tally_t*)ctx, tag, result);
+}
+
+/* Submit every query, alternately one at a time and in batches of varying size */
+static void submit_all(hibp_query_queue_t* qq, const byte* shas, void** tags) {
+  size_t i = 0;
+
+  while(i < N_QUERIES) {
+    const size_t n = (rand() % 2 == 0) ? 1 : (size_t)(rand() % 1000);
+    const size_t m = (n < N_QUERIES - i) ? n : N_QUERIES - i;
+
+    if(m == 1) {
+      hassert0(hibp_qq_submit(qq, shas + i * SHA1_BYTES, tags[i]) == HIBP_OK);
+    } else {
+      hassert0(hibp_qq_submit_batch(qq, m, shas + i * SHA1_BYTES, tags + i) == HIBP_OK);
+    }
+
+    i += m;
+  }
+}
+
+static int readable(int fd, int timeout) {
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  return poll(&pfd, 1, timeout) == 1 && (pfd.revents & POLLIN);
+}
+
+int main(void) {
+  byte* shas = malloc(N_QUERIES * SHA1_BYTES);
+  void** tags = malloc(N_QUERIES * sizeof(void*));
+  tally_t* tally = malloc(sizeof(tally_t));
+  hibp_completion_t* completions = malloc(N_QUERIES * sizeof(hibp_completion_t));
+  hassert0(shas != NULL && tags != NULL && tally != NULL && completions != NULL);
+  hassert0(pthread_mutex_init(&tally->lock, NULL) == 0);
+
+  for(size_t i = 0; i < N_QUERIES; i ++) {
+    tags[i] = (void*)(uintptr_t)i;
+  }
+
+  hibp_bloom_filter_t bf;
+  hassert0(hibp_bf_new_blocked(&bf, 8, 18) == HIBP_OK);
+
+  /* Half the queries are for inserted elements, the rest (mostly) not */
+  random_shas(shas, N_QUERIES);
+
+  for(size_t i = 0; i < N_INSERTS; i ++) {
+    hibp_bf_insert_sha1(&bf, shas + 2 * i * SHA1_BYTES);
+  }
+
+  for(size_t c = 0; c < n_cases; c ++) {
+    const case_t* cs = &cases[c];
+
+    memset(tally->answered, 0, sizeof(tally->answered));
+    tally->n_answered = 0;
+
+    hibp_query_queue_t qq;
+    const hibp_status_t status =
+      hibp_qq_new(&qq, &bf, cs->n_threads, cs->max_batch, tally, cs->callback ? complete : NULL);
+    hassert(status == HIBP_OK, "expected HIBP_OK, got %s (case %d)", status2str(status), (int)c);
+
+    if(cs->callback) {
+      hassert0(hibp_qq_fd(&qq) == -1);
+      hassert0(hibp_qq_poll(&qq, N_QUERIES, completions) == 0);
+
+      submit_all(&qq, shas, tags);
+      hibp_qq_wait(&qq);
+
+      hassert(tally->n_answered == N_QUERIES, "expected every query to be answered, not %lu (case %d)",
+              (unsigned long)tally->n_answered, (int)c);
+    } else {
+      const int fd = hibp_qq_fd(&qq);
+      hassert0(fd >= 0 && !readable(fd, 0));
+
+      submit_all(&qq, shas, tags);
+
+      /* Poll as an event loop would, taking a few completions at a time */
+      while(tally->n_answered < N_QUERIES) {
+        hassert(readable(fd, 10000), "expected completions to be signalled (case %d)", (int)c);
+
+        const size_t n = hibp_qq_poll(&qq, 1 + rand() % 500, completions);
+
+        for(size_t i = 0; i < n; i ++) {
+          record(tally, completions[i].tag, completions[i].result);
+        }
+      }
+
+      hassert0(!readable(fd, 0));
+      hassert0(hibp_qq_poll(&qq, N_QUERIES, completions) == 0);
+    }
+
+    for(size_t i = 0; i < N_QUERIES; i ++) {
+      hassert(tally->results[i] == hibp_bf_query_sha1(&bf, shas + i * SHA1_BYTES),
+              "expected query %lu to agree with hibp_bf_query_sha1 (case %d)", (unsigned long)i, (int)c);
+    }
+
+    /* Destruction waits for whatever's still outstanding */
+    memset(tally->answered, 0, sizeof(tally->answered));
+    tally->n_answered = 0;
+
+    if(cs->callback) {
+      submit_all(&qq, shas, tags);
+    }
+
+    hibp_qq_destroy(&qq);
+
+    hassert0(tally->n_answered == (cs->callback ? N_QUERIES : 0));
+  }
+
+  hibp_bf_destroy(&bf);
+  pthread_mutex_destroy(&tally->lock);
+
+  free(shas);
+  free(tags);
+  free(tally);
+  free(completions);
+
+  return 0;
+}
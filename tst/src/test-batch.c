@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+/* Assert that the batched variants of insert and query are semantically equivalent
+ * to, and interoperable with, the unbatched variants. Also assert that strings of every
+ * length around the boundaries of SHA1's padding, and of its lanes (see hibp_sha1_batch),
+ * hash the same in batches as one at a time */
+
+#define MAX_LENGTH 100
+#define MAX_INPUTS 10000
+#define MAX_BINARY_LENGTH 600
+
+typedef struct {
+  hibp_layout_t layout;
+  size_t n_hash_functions;
+  size_t log2_bits;
+  size_t n_inputs;
+} case_t;
+
+const case_t cases[] = {
+  { HIBP_LAYOUT_STANDARD, 1,   0,  0 },
+  { HIBP_LAYOUT_STANDARD, 1,   1,  1 },
+  { HIBP_LAYOUT_STANDARD, 5,   5,  7 },
+  { HIBP_LAYOUT_STANDARD, 5,   10, 1000 },
+  { HIBP_LAYOUT_STANDARD, 15,  20, 10000 },
+  { HIBP_LAYOUT_STANDARD, 600, 10, 100 },
+  { HIBP_LAYOUT_BLOCKED,  2,   9,  13 },
+  { HIBP_LAYOUT_BLOCKED,  8,   16, 5000 },
+  { HIBP_LAYOUT_BLOCKED,  11,  20, 10000 }
+};
+
+const size_t n_cases = sizeof(cases) / sizeof(case_t);
+
+static char* strings[MAX_INPUTS];
+static size_t sizes[MAX_INPUTS];
+static const byte* buffers[MAX_INPUTS];
+static byte shas[MAX_INPUTS * SHA1_BYTES];
+static int inserted[MAX_INPUTS];
+static int results[MAX_INPUTS];
+
+int main(void) {
+  for(size_t c = 0; c < n_cases; c ++) {
+    const size_t n_inputs = cases[c].n_inputs;
+
+    hibp_bloom_filter_t bf;
+    hibp_status_t status;
+
+    if(cases[c].layout == HIBP_LAYOUT_BLOCKED) {
+      status = hibp_bf_new_blocked(&bf, cases[c].n_hash_functions, cases[c].log2_bits);
+    } else {
+      status = hibp_bf_new(&bf, cases[c].n_hash_functions, cases[c].log2_bits);
+    }
+
+    hassert0(status == HIBP_OK);
+
+    for(size_t i = 0; i < n_inputs; i ++) {
+      strings[i] = random_ascii_str(rand() % MAX_LENGTH);
+      sizes[i] = strlen(strings[i]);
+      buffers[i] = (const byte*)strings[i];
+      sha1(shas + i * SHA1_BYTES, sizes[i], buffers[i]);
+      inserted[i] = 0;
+    }
+
+    /* Insert a random subset of the inputs, alternating between batched and unbatched
+     * insertion so that batches of several sizes are exercised */
+    for(size_t i = 0; i < n_inputs;) {
+      const size_t n = 1 + rand() % 50;
+      const size_t m = (n <= n_inputs - i) ? n : n_inputs - i;
+
+      if(rand() % 2 == 0) {
+        for(size_t j = i; j < i + m; j ++) {
+          inserted[j] = 1;
+        }
+
+        switch(rand() % 3) {
+        case 0:
+          hibp_bf_insert_batch(&bf, m, sizes + i, buffers + i);
+          break;
+        case 1:
+          hibp_bf_insert_sha1_batch(&bf, m, shas + i * SHA1_BYTES);
+          break;
+        default:
+          for(size_t j = i; j < i + m; j ++) {
+            hibp_bf_insert_sha1(&bf, shas + j * SHA1_BYTES);
+          }
+        }
+      }
+
+      i += m;
+    }
+
+    hibp_bf_query_sha1_batch(&bf, n_inputs, shas, results);
+
+    for(size_t i = 0; i < n_inputs; i ++) {
+      const int q = hibp_bf_query_sha1(&bf, shas + i * SHA1_BYTES);
+
+      hassert(
+        results[i] == q,
+        "expected hibp_bf_query_sha1_batch to agree with hibp_bf_query_sha1 for %s (got %d, %d)",
+        strings[i], results[i], q
+      );
+
+      hassert(!inserted[i] || q, "expected %s to be present in the filter", strings[i]);
+    }
+
+    hibp_bf_query_batch(&bf, n_inputs, sizes, buffers, results);
+
+    for(size_t i = 0; i < n_inputs; i ++) {
+      const int q = hibp_bf_query(&bf, sizes[i], buffers[i]);
+
+      hassert(
+        results[i] == q,
+        "expected hibp_bf_query_batch to agree with hibp_bf_query for %s (got %d, %d)",
+        strings[i], results[i], q
+      );
+
+      free(strings[i]);
+    }
+
+    hibp_bf_destroy(&bf);
+  }
+
+  /* Arbitrary bytes, of every length up to well past the longest hashed in lanes, shuffled
+   * so that lanes hold messages of different lengths */
+  byte* binary = random_ascii_buffer(MAX_BINARY_LENGTH + 1);
+  hassert0(binary != NULL);
+
+  for(size_t i = 0; i < MAX_BINARY_LENGTH; i ++) {
+    binary[i] ^= (byte)(rand() % 256);
+  }
+
+  for(size_t i = 0; i <= MAX_BINARY_LENGTH; i ++) {
+    sizes[i] = i;
+  }
+
+  for(size_t i = MAX_BINARY_LENGTH; i > 0; i --) {
+    const size_t j = rand() % (i + 1);
+    const size_t swap = sizes[i];
+    sizes[i] = sizes[j];
+    sizes[j] = swap;
+  }
+
+  for(size_t i = 0; i <= MAX_BINARY_LENGTH; i ++) {
+    buffers[i] = binary + (MAX_BINARY_LENGTH - sizes[i]);
+  }
+
+  hibp_bloom_filter_t batched;
+  hibp_bloom_filter_t serial;
+  hassert0(hibp_bf_new(&batched, 8, 16) == HIBP_OK);
+  hassert0(hibp_bf_new_like(&serial, &batched) == HIBP_OK);
+
+  hibp_bf_insert_batch(&batched, MAX_BINARY_LENGTH + 1, sizes, buffers);
+
+  for(size_t i = 0; i <= MAX_BINARY_LENGTH; i ++) {
+    byte sha[SHA1_BYTES];
+    sha1(sha, sizes[i], buffers[i]);
+    hibp_bf_insert_sha1(&serial, sha);
+  }
+
+  hassert0(memcmp(batched.buffer, serial.buffer,
+                  hibp_compute_total_size(8, 16) - sizeof(hibp_bloom_filter_t)) == 0);
+
+  hibp_bf_query_batch(&serial, MAX_BINARY_LENGTH + 1, sizes, buffers, results);
+
+  for(size_t i = 0; i <= MAX_BINARY_LENGTH; i ++) {
+    hassert(results[i], "expected the string of length %lu to be present", (unsigned long)sizes[i]);
+  }
+
+  hibp_bf_destroy(&batched);
+  hibp_bf_destroy(&serial);
+  free(binary);
+
+  return 0;
+}
@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "util.h"
+
+/* Assert that Bloom filters whose bit vectors aren't a power of 2 in size have no false
+ * negatives, survive the round trip to and from disk in every format, have roughly the
+ * false positive rate predicted by theory, and occupy no more memory than their bits call
+ * for. Also assert that the power-of-2 case is exactly the original filter, and that
+ * hibp_compute_optimal_bits and hibp_compute_constrained_bits pick sensible sizes */
+
+#define LENGTH 50
+
+typedef struct {
+  hibp_layout_t layout;
+  hibp_hashing_t hashing;
+  size_t n_hash_functions;
+  size_t bits;
+  size_t n_strings;
+  hibp_format_t format;
+} case_t;
+
+const case_t cases[] = {
+  { HIBP_LAYOUT_STANDARD, HIBP_HASHING_RANDOM, 1,  1,       1,      HIBP_FORMAT_COMPACT },
+  { HIBP_LAYOUT_STANDARD, HIBP_HASHING_RANDOM, 3,  100,     10,     HIBP_FORMAT_ALIGNED },
+  { HIBP_LAYOUT_STANDARD, HIBP_HASHING_RANDOM, 5,  12345,   1000,   HIBP_FORMAT_CHUNKED },
+  { HIBP_LAYOUT_STANDARD, HIBP_HASHING_DOUBLE, 7,  3000001, 200000, HIBP_FORMAT_COMPRESSED },
+  { HIBP_LAYOUT_STANDARD, HIBP_HASHING_DOUBLE, 10, 999999,  50000,  HIBP_FORMAT_CHUNKED_SHA1 },
+  { HIBP_LAYOUT_BLOCKED,  HIBP_HASHING_RANDOM, 2,  1536,    100,    HIBP_FORMAT_COMPACT },
+  { HIBP_LAYOUT_BLOCKED,  HIBP_HASHING_RANDOM, 8,  512 * 77, 2000,  HIBP_FORMAT_CHUNKED },
+  { HIBP_LAYOUT_BLOCKED,  HIBP_HASHING_DOUBLE, 11, 512 * 3001, 50000, HIBP_FORMAT_ALIGNED },
+  { HIBP_LAYOUT_BLOCKED,  HIBP_HASHING_DOUBLE, 17, 512 * 999, 20000, HIBP_FORMAT_COMPRESSED }
+};
+
+const size_t n_cases = sizeof(cases) / sizeof(case_t);
+
+static size_t count_false_positives(const hibp_bloom_filter_t* bf, size_t n_trials) {
+  size_t positive = 0;
+
+  for(size_t i = 0; i < n_trials; i ++) {
+    char* str = random_ascii_str(LENGTH + 1);
+    positive += hibp_bf_query_str(bf, str);
+    free(str);
+  }
+
+  return positive;
+}
+
+static void assert_same_file(const char* filename, const hibp_bloom_filter_t* a,
+                             const hibp_bloom_filter_t* b) {
+  for(int k = 0; k < 2; k ++) {
+    FILE* file = fopen(filename, "wb");
+    hassert0(file != NULL);
+    hassert0(hibp_bf_save_file((k == 0) ? a : b, file) == HIBP_OK);
+    fclose(file);
+
+    if(k == 0) {
+      rename(filename, "bits-a.bl");
+    }
+  }
+
+  FILE* fa = fopen("bits-a.bl", "rb");
+  FILE* fb = fopen(filename, "rb");
+  hassert0(fa != NULL && fb != NULL);
+
+  for(int ca, cb; ; ) {
+    ca = fgetc(fa);
+    cb = fgetc(fb);
+    hassert0(ca == cb);
+
+    if(ca == EOF) {
+      break;
+    }
+  }
+
+  fclose(fa);
+  fclose(fb);
+  remove("bits-a.bl");
+  remove(filename);
+}
+
+int main(void) {
+  hibp_bloom_filter_t bf;
+
+  /* Parameter validation */
+  hassert0(hibp_bf_new_bits(&bf, HIBP_LAYOUT_STANDARD, HIBP_HASHING_RANDOM, 5, 0) == HIBP_E_INVAL);
+  hassert0(hibp_bf_new_bits(&bf, HIBP_LAYOUT_BLOCKED, HIBP_HASHING_RANDOM, 5, 1000) == HIBP_E_INVAL);
+  hassert0(hibp_bf_new_bits(&bf, HIBP_LAYOUT_BLOCKED, HIBP_HASHING_RANDOM, 5, 256) == HIBP_E_INVAL);
+
+  /* A power of 2 is the same filter as ever, down to the file */
+  for(int layout = 0; layout < 2; layout ++) {
+    hibp_bloom_filter_t pow2;
+    hassert0(hibp_bf_new_bits(&bf, (hibp_layout_t)layout, HIBP_HASHING_DOUBLE, 6, 1 << 14) == HIBP_OK);
+    hassert0(hibp_bf_new_hashing(&pow2, (hibp_layout_t)layout, HIBP_HASHING_DOUBLE, 6, 14) == HIBP_OK);
+    hassert0(bf.log2_bits == 14 && bf.bits == pow2.bits);
+
+    hibp_bf_insert_str(&bf, "hello");
+    hibp_bf_insert_str(&pow2, "hello");
+    assert_same_file("bits.bl", &bf, &pow2);
+
+    hibp_bf_destroy(&bf);
+    hibp_bf_destroy(&pow2);
+  }
+
+  for(size_t c = 0; c < n_cases; c ++) {
+    const case_t* cs = &cases[c];
+
+    hibp_status_t status =
+      hibp_bf_new_bits(&bf, cs->layout, cs->hashing, cs->n_hash_functions, cs->bits);
+    hassert(status == HIBP_OK, "expected HIBP_OK, got %s (case %d)", status2str(status), (int)c);
+
+    byte* shas = malloc(cs->n_strings * SHA1_BYTES);
+    hassert0(shas != NULL);
+
+    for(size_t i = 0; i < cs->n_strings; i ++) {
+      char* str = random_ascii_str(LENGTH);
+      sha1(shas + i * SHA1_BYTES, strlen(str), (const byte*)str);
+      free(str);
+    }
+
+    hibp_bf_insert_sha1_batch(&bf, cs->n_strings, shas);
+
+    /* Memory for the bits we asked for, and no more */
+
+    hibp_filter_info_t info;
+    hibp_bf_get_info(&info, &bf);
+    hassert0(info.bits == cs->bits);
+
+    /* Less the tables of compiled hash functions, which the library builds for itself */
+    const size_t total_size =
+      hibp_compute_total_size_bits(cs->layout, cs->hashing, cs->n_hash_functions, cs->bits);
+    hassert0(info.memory >= total_size);
+
+    const size_t size = total_size - sizeof(bf);
+    const size_t vector_size = (cs->bits + 7) / 8;
+    hassert0(size >= vector_size);
+    hassert0(cs->hashing == HIBP_HASHING_RANDOM || size == vector_size);
+
+    /* Unbatched and batched queries both find everything */
+
+    int* results = malloc(cs->n_strings * sizeof(int));
+    hassert0(results != NULL);
+
+    hibp_bf_query_sha1_batch(&bf, cs->n_strings, shas, results);
+
+    for(size_t i = 0; i < cs->n_strings; i ++) {
+      hassert(hibp_bf_query_sha1(&bf, shas + i * SHA1_BYTES) && results[i],
+              "expected element %lu to be present (case %d)", (unsigned long)i, (int)c);
+    }
+
+    free(results);
+
+    /* Combining requires the same number of bits */
+
+    hibp_bloom_filter_t other;
+    hassert0(hibp_bf_new_like(&other, &bf) == HIBP_OK);
+    hassert0(other.bits == cs->bits);
+    hassert0(hibp_bf_union(&other, &bf) == HIBP_OK);
+    hassert0(memcmp(bf.buffer, other.buffer, size) == 0);
+    hibp_bf_destroy(&other);
+
+    const size_t unit = (cs->layout == HIBP_LAYOUT_BLOCKED) ? 512 : 1;
+
+    if(cs->bits > unit) {
+      hassert0(hibp_bf_new_bits(&other, cs->layout, cs->hashing, cs->n_hash_functions,
+                                cs->bits - unit) == HIBP_OK);
+      hassert0(hibp_bf_union(&other, &bf) == HIBP_E_INVAL);
+      hibp_bf_destroy(&other);
+    }
+
+    /* Roughly the false positive rate predicted by theory (generously, for the blocked
+     * layout, whose blocks vary in load) */
+
+    if(cs->n_strings >= 1000) {
+      const size_t n_trials = 20000;
+      const double rate = (double)count_false_positives(&bf, n_trials) / n_trials;
+
+      const double k = (cs->layout == HIBP_LAYOUT_BLOCKED)
+        ? (double)(cs->n_hash_functions - 1)
+        : (double)cs->n_hash_functions;
+      const double expected = pow(1 - exp(-k * cs->n_strings / cs->bits), k);
+      const double slack = (cs->layout == HIBP_LAYOUT_BLOCKED) ? 3.0 : 1.5;
+
+      hassert(
+        rate <= slack * expected + 0.002,
+        "expected a false positive rate of ~%lf, but was %lf (case %d)",
+        expected, rate, (int)c
+      );
+    }
+
+    /* To and from disk */
+
+    FILE* file = fopen("bits.bl", "wb");
+    hassert0(file != NULL);
+    hassert0(hibp_bf_save_file_format(&bf, file, cs->format) == HIBP_OK);
+    fclose(file);
+
+    hibp_bloom_filter_t loaded;
+
+    file = fopen("bits.bl", "rb");
+    hassert0(file != NULL);
+    status = hibp_bf_load_file(&loaded, file);
+    hassert(status == HIBP_OK, "expected HIBP_OK, got %s (case %d)", status2str(status), (int)c);
+    fclose(file);
+
+    hassert0(loaded.layout == cs->layout && loaded.hashing == cs->hashing);
+    hassert0(loaded.n_hash_functions == cs->n_hash_functions && loaded.bits == cs->bits);
+    hassert0(memcmp(bf.buffer, loaded.buffer, size) == 0);
+    hibp_bf_destroy(&loaded);
+
+    if(cs->format != HIBP_FORMAT_COMPRESSED) {
+      hassert0(hibp_bf_map_file(&loaded, "bits.bl", HIBP_MAP_LAZY_VERIFY) == HIBP_OK);
+      hassert0(loaded.bits == cs->bits);
+
+      for(size_t i = 0; i < cs->n_strings; i ++) {
+        hassert0(hibp_bf_query_sha1(&loaded, shas + i * SHA1_BYTES));
+      }
+
+      hibp_bf_destroy(&loaded);
+    }
+
+    remove("bits.bl");
+
+    hibp_bf_destroy(&bf);
+    free(shas);
+  }
+
+  /* Exact sizing beats rounding to a power of 2, and stays within a memory limit */
+
+  const size_t counts[] = { 1, 1000, 123456, 10000000 };
+  const double rates[] = { 0.1, 0.01, 0.0001 };
+
+  for(size_t i = 0; i < sizeof(counts) / sizeof(size_t); i ++) {
+    for(size_t j = 0; j < sizeof(rates) / sizeof(double); j ++) {
+      for(int layout = 0; layout < 2; layout ++) {
+        size_t n_hash_functions;
+        size_t bits;
+        size_t log2_bits;
+        size_t pow2_n_hash_functions;
+
+        hibp_compute_optimal_bits((hibp_layout_t)layout, &n_hash_functions, &bits, counts[i], rates[j]);
+
+        if(layout == HIBP_LAYOUT_BLOCKED) {
+          hibp_compute_optimal_blocked_params(&pow2_n_hash_functions, &log2_bits, counts[i], rates[j]);
+          hassert0(bits % 512 == 0);
+        } else {
+          hibp_compute_optimal_params(&pow2_n_hash_functions, &log2_bits, counts[i], rates[j]);
+        }
+
+        hassert0(bits <= ((size_t)1) << log2_bits);
+        hassert0(bits >= ((size_t)1) << log2_bits >> 1 || bits < 1024);
+
+        const size_t max_memory =
+          hibp_compute_total_size_bits((hibp_layout_t)layout, HIBP_HASHING_RANDOM, n_hash_functions, bits);
+
+        hibp_compute_constrained_bits((hibp_layout_t)layout, &n_hash_functions, &bits, counts[i], max_memory);
+
+        const size_t memory =
+          hibp_compute_total_size_bits((hibp_layout_t)layout, HIBP_HASHING_RANDOM, n_hash_functions, bits);
+
+        hassert(memory <= max_memory || bits <= 512,
+                "expected at most %lu bytes, but got %lu", (unsigned long)max_memory, (unsigned long)memory);
+
+        /* The blocked layout reserves room for as many hash functions as it could ever
+         * want, but the standard layout should fill the limit almost exactly */
+        hassert0(layout == HIBP_LAYOUT_BLOCKED || memory >= max_memory - max_memory / 100 - 64);
+      }
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "util.h"
+
+/* Assert that Bloom filters with the blocked layout have no false negatives, survive
+ * the round trip to and from disk, and have roughly the false positive rate
+ * predicted by hibp_compute_optimal_blocked_params */
+
+#define MAX_STRINGS 20000
+#define LENGTH 50
+
+typedef struct {
+  size_t n_hash_functions;
+  size_t log2_bits;
+  size_t n_strings;
+} case_t;
+
+const case_t cases[] = {
+  { 2,  9,  1 },
+  { 2,  9,  100 },
+  { 5,  12, 1000 },
+  { 8,  16, 5000 },
+  { 11, 20, 20000 },
+  { 33, 20, 20000 }
+};
+
+const size_t n_cases = sizeof(cases) / sizeof(case_t);
+
+/* Expected false positive rate, computed independently of the library */
+static double expected_rate(size_t n_hash_functions, size_t log2_bits, size_t n_strings) {
+  const double lambda = n_strings / pow(2, log2_bits - 9);
+  const size_t n_probes = n_hash_functions - 1;
+
+  double rate = 0;
+
+  for(size_t i = 0; i < 10 * lambda + 100; i ++) {
+    const double poisson = exp(-lambda + i * log(lambda) - lgamma(i + 1));
+    rate += poisson * pow(1 - pow(1 - 1.0 / 512, n_probes * i), n_probes);
+  }
+
+  return rate;
+}
+
+int main(void) {
+  hibp_bloom_filter_t bf;
+
+  /* Parameter validation */
+  hassert0(hibp_bf_new_blocked(&bf, 5, 8) == HIBP_E_INVAL);
+  hassert0(hibp_bf_new_blocked(&bf, 1, 20) == HIBP_E_INVAL);
+
+  for(size_t c = 0; c < n_cases; c ++) {
+    const size_t n_strings = cases[c].n_strings;
+
+    hassert0(hibp_bf_new_blocked(&bf, cases[c].n_hash_functions, cases[c].log2_bits) == HIBP_OK);
+
+    char* strings[MAX_STRINGS];
+
+    for(size_t i = 0; i < n_strings; i ++) {
+      strings[i] = random_ascii_str(LENGTH);
+      hibp_bf_insert_str(&bf, strings[i]);
+    }
+
+    char filename[99];
+    sprintf(filename, "blocked.%d.bl", (int)(c + 1));
+
+    FILE* outfile = fopen(filename, "wb");
+    hassert0(outfile != NULL);
+    hassert0(hibp_bf_save_file(&bf, outfile) == HIBP_OK);
+    fclose(outfile);
+    hibp_bf_destroy(&bf);
+
+    FILE* infile = fopen(filename, "rb");
+    hassert0(infile != NULL);
+    hassert0(hibp_bf_load_file(&bf, infile) == HIBP_OK);
+    fclose(infile);
+    remove(filename);
+
+    hibp_filter_info_t info;
+    hibp_bf_get_info(&info, &bf);
+    hassert0(info.layout == HIBP_LAYOUT_BLOCKED);
+    hassert0(info.n_hash_functions == cases[c].n_hash_functions);
+    hassert0(info.log2_bits == cases[c].log2_bits);
+
+    for(size_t i = 0; i < n_strings; i ++) {
+      hassert(
+        hibp_bf_query_str(&bf, strings[i]),
+        "expected %s to be present in the blocked Bloom filter, but it was not",
+        strings[i]
+      );
+
+      free(strings[i]);
+    }
+
+    const size_t n_trials = 5 * n_strings;
+    size_t positive = 0;
+
+    for(size_t i = 0; i < n_trials; i ++) {
+      char* string = random_ascii_str(LENGTH);
+      positive += hibp_bf_query_str(&bf, string);
+      free(string);
+    }
+
+    const double rate = (double)positive / n_trials;
+    const double expected = expected_rate(cases[c].n_hash_functions, cases[c].log2_bits, n_strings);
+    const double maximum = (2 * expected < 1e-3) ? 1e-3 : 2 * expected;
+
+    hassert(
+      rate <= maximum,
+      "expected false positive rate to be ~%lf, but was %lf (case %lu)",
+      expected, rate, (unsigned long)(c + 1)
+    );
+
+    hibp_bf_destroy(&bf);
+  }
+
+  /* The parameter helpers pick parameters that meet the goal false positive rate, and
+   * never pick fewer bits than a standard filter would need */
+  {
+    size_t n_hash_functions;
+    size_t log2_bits;
+    size_t standard_n_hash_functions;
+    size_t standard_log2_bits;
+
+    hibp_compute_optimal_blocked_params(&n_hash_functions, &log2_bits, 100000, 0.001);
+    hibp_compute_optimal_params(&standard_n_hash_functions, &standard_log2_bits, 100000, 0.001);
+
+    hassert0(n_hash_functions >= 2);
+    hassert0(log2_bits >= standard_log2_bits);
+    hassert0(expected_rate(n_hash_functions, log2_bits, 100000) <= 0.001);
+
+    hibp_compute_constrained_blocked_params(&n_hash_functions, &log2_bits, 100000, 1024 * 1024);
+    hassert0(hibp_compute_total_size_layout(HIBP_LAYOUT_BLOCKED, n_hash_functions, log2_bits) <= 1024 * 1024);
+    hassert0(log2_bits == 22);
+  }
+
+  return 0;
+}
@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+/* Assert that filters saved in the compressed format load back byte for byte, whatever
+ * their fill, that sparse filters actually shrink, and that corruption anywhere in the
+ * file is detected, rather than crashing or yielding a different filter */
+
+#define MAX_LENGTH 50
+
+typedef struct {
+  hibp_layout_t layout;
+  size_t n_hash_functions;
+  size_t log2_bits;
+  size_t n_strings;
+
+  /* Upper bound on compressed size as a fraction of compact size */
+  double max_ratio;
+} case_t;
+
+const case_t cases[] = {
+  { HIBP_LAYOUT_STANDARD, 1,  0,  0,      1.1 },
+  { HIBP_LAYOUT_STANDARD, 3,  10, 10,     1.1 },
+  { HIBP_LAYOUT_STANDARD, 10, 20, 0,      0.01 },
+  { HIBP_LAYOUT_STANDARD, 10, 20, 100,    0.1 },
+  { HIBP_LAYOUT_STANDARD, 10, 20, 100000, 1.01 },
+  { HIBP_LAYOUT_STANDARD, 5,  26, 10000,  0.1 },
+  { HIBP_LAYOUT_STANDARD, 1,  24, 1000000, 1.01 },
+  { HIBP_LAYOUT_BLOCKED,  8,  24, 50000,  0.8 }
+};
+
+const size_t n_cases = sizeof(cases) / sizeof(case_t);
+
+static void save(membuf_t* mb, const hibp_bloom_filter_t* bf, hibp_format_t format) {
+  mb->buffer = NULL;
+  mb->size = 0;
+  mb->position = 0;
+  hassert0(hibp_bf_save_writer_format(bf, mb, mb_write, format) == HIBP_OK);
+}
+
+int main(void) {
+  for(size_t c = 0; c < n_cases; c ++) {
+    const case_t* cs = &cases[c];
+
+    hibp_bloom_filter_t bf;
+    hibp_status_t status;
+
+    if(cs->layout == HIBP_LAYOUT_BLOCKED) {
+      status = hibp_bf_new_blocked(&bf, cs->n_hash_functions, cs->log2_bits);
+    } else {
+      status = hibp_bf_new(&bf, cs->n_hash_functions, cs->log2_bits);
+    }
+
+    hassert0(status == HIBP_OK);
+
+    for(size_t i = 0; i < cs->n_strings; i ++) {
+      char* str = random_ascii_str(rand() % MAX_LENGTH);
+      hibp_bf_insert_str(&bf, str);
+      free(str);
+    }
+
+    membuf_t compact, compressed;
+    save(&compact, &bf, HIBP_FORMAT_COMPACT);
+    save(&compressed, &bf, HIBP_FORMAT_COMPRESSED);
+
+    hassert(
+      compressed.size <= cs->max_ratio * compact.size,
+      "expected compressed size %lu to be at most %.2f of compact size %lu (case %d)",
+      (unsigned long)compressed.size, cs->max_ratio, (unsigned long)compact.size, (int)c
+    );
+
+    hibp_bf_destroy(&bf);
+
+    /* Round trip; the filter must be identical */
+
+    status = hibp_bf_load_reader(&bf, &compressed, mb_read);
+    hassert(status == HIBP_OK, "expected HIBP_OK, got %s", status2str(status));
+
+    membuf_t reloaded;
+    save(&reloaded, &bf, HIBP_FORMAT_COMPACT);
+
+    hassert(
+      reloaded.size == compact.size && memcmp(reloaded.buffer, compact.buffer, compact.size) == 0,
+      "expected the decompressed filter to be identical to the original (case %d)",
+      (int)c
+    );
+
+    hibp_bf_destroy(&bf);
+
+    /* Compressed files can't be mapped */
+
+    char filename[99];
+    sprintf(filename, "compressed.%d.bl", (int)(c + 1));
+
+    FILE* file = fopen(filename, "wb");
+    hassert0(file != NULL);
+    hassert0(fwrite(compressed.buffer, 1, compressed.size, file) == compressed.size);
+    fclose(file);
+
+    status = hibp_bf_map_file(&bf, filename, 0);
+    hassert(status == HIBP_E_VERSION, "expected HIBP_E_VERSION, got %s", status2str(status));
+
+    file = fopen(filename, "rb");
+    hassert0(file != NULL);
+    status = hibp_bf_load_file(&bf, file);
+    hassert(status == HIBP_OK, "expected HIBP_OK, got %s", status2str(status));
+    hibp_bf_destroy(&bf);
+    fclose(file);
+
+    remove(filename);
+
+    /* Corrupt bytes after the header, one at a time */
+
+    for(size_t trial = 0; trial < 20; trial ++) {
+      const size_t header_size = 4 + 8 + 1 + 1 + 8 + 1 + 1;
+      const size_t offset = header_size + rand() % (compressed.size - header_size);
+      const byte original = compressed.buffer[offset];
+
+      compressed.buffer[offset] ^= 1 << (rand() % 8);
+      compressed.position = 0;
+
+      status = hibp_bf_load_reader(&bf, &compressed, mb_read);
+
+      /* Some corruption is benign; e.g. changing the offset of a match within a run of
+       * zeros doesn't change what it decompresses to. That's fine, so long as the filter
+       * itself is intact */
+      if(status == HIBP_OK) {
+        membuf_t corrupt;
+        save(&corrupt, &bf, HIBP_FORMAT_COMPACT);
+
+        hassert(
+          corrupt.size == compact.size && memcmp(corrupt.buffer, compact.buffer, compact.size) == 0,
+          "expected corruption at offset %lu to be detected (case %d)",
+          (unsigned long)offset, (int)c
+        );
+
+        free(corrupt.buffer);
+        hibp_bf_destroy(&bf);
+      } else {
+        hassert(
+          status == HIBP_E_CHECKSUM || status == HIBP_E_INVAL || status == HIBP_E_IO,
+          "expected HIBP_E_CHECKSUM, HIBP_E_INVAL, or HIBP_E_IO, got %s",
+          status2str(status)
+        );
+      }
+
+      compressed.buffer[offset] = original;
+    }
+
+    free(compact.buffer);
+    free(compressed.buffer);
+    free(reloaded.buffer);
+  }
+
+  return 0;
+}
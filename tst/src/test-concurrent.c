@@ -0,0 +1,261 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "util.h"
+
+/* Assert that in concurrent mode, several threads inserting into the same filter at once
+ * (even a tiny one, where they contend for the same words) never lose a bit, yielding
+ * exactly the filter built by a single thread, and that queries running alongside them
+ * find every element whose insertion has completed. Also assert that a lazily-verified
+ * filter is verified in full upon entering concurrent mode */
+
+#define MAX_THREADS 8
+#define BATCH_SIZE 7
+
+typedef struct {
+  hibp_layout_t layout;
+  size_t n_hash_functions;
+  size_t log2_bits;
+  size_t n_strings;
+  size_t n_threads;
+} case_t;
+
+const case_t cases[] = {
+  { HIBP_LAYOUT_STANDARD, 1,  0,  100,    2 },
+  { HIBP_LAYOUT_STANDARD, 3,  6,  1000,   4 },
+  { HIBP_LAYOUT_STANDARD, 5,  7,  10000,  8 },
+  { HIBP_LAYOUT_STANDARD, 10, 12, 20000,  8 },
+  { HIBP_LAYOUT_BLOCKED,  8,  9,  20000,  8 },
+  { HIBP_LAYOUT_BLOCKED,  11, 14, 50000,  4 },
+  { HIBP_LAYOUT_STANDARD, 7,  26, 100000, 8 },
+  { HIBP_LAYOUT_BLOCKED,  16, 24, 100000, 3 }
+};
+
+const size_t n_cases = sizeof(cases) / sizeof(case_t);
+
+typedef struct {
+  hibp_bloom_filter_t* bf;
+  const byte* shas;
+  size_t n_strings;
+  size_t n_threads;
+
+  /* How many of its elements each inserting thread has finished inserting. Thread t
+   * inserts elements t, t + n_threads, t + 2 * n_threads, ... */
+  size_t done[MAX_THREADS];
+} job_t;
+
+typedef struct {
+  job_t* job;
+  size_t thread;
+} worker_t;
+
+static void* insert_worker(void* ctx) {
+  const worker_t* w = (const worker_t*)ctx;
+  job_t* job = w->job;
+
+  byte batch[BATCH_SIZE * SHA1_BYTES];
+  size_t n_batch = 0;
+  size_t n_done = 0;
+
+  for(size_t i = w->thread; i < job->n_strings; i += job->n_threads) {
+    const byte* sha = job->shas + i * SHA1_BYTES;
+
+    /* Exercise both the unbatched and the batched paths */
+    if(w->thread % 2 == 0) {
+      hibp_bf_insert_sha1(job->bf, sha);
+      __atomic_store_n(&job->done[w->thread], ++ n_done, __ATOMIC_RELEASE);
+      continue;
+    }
+
+    memcpy(batch + n_batch * SHA1_BYTES, sha, SHA1_BYTES);
+
+    if(++ n_batch == BATCH_SIZE) {
+      hibp_bf_insert_sha1_batch(job->bf, n_batch, batch);
+      n_done += n_batch;
+      n_batch = 0;
+      __atomic_store_n(&job->done[w->thread], n_done, __ATOMIC_RELEASE);
+    }
+  }
+
+  hibp_bf_insert_sha1_batch(job->bf, n_batch, batch);
+  n_done += n_batch;
+  __atomic_store_n(&job->done[w->thread], n_done, __ATOMIC_RELEASE);
+
+  return NULL;
+}
+
+static void* query_worker(void* ctx) {
+  job_t* job = (job_t*)ctx;
+
+  const size_t expected = job->n_strings / job->n_threads;
+  size_t n_queries = 0;
+
+  for(int finished = 0; !finished; ) {
+    finished = 1;
+
+    for(size_t t = 0; t < job->n_threads; t ++) {
+      const size_t done = __atomic_load_n(&job->done[t], __ATOMIC_ACQUIRE);
+
+      if(done < expected) {
+        finished = 0;
+      }
+
+      if(done == 0) {
+        continue;
+      }
+
+      /* The most recently inserted element, and one at random */
+      const size_t indices[2] = {
+        t + (done - 1) * job->n_threads,
+        t + (rand() % done) * job->n_threads
+      };
+
+      int results[2];
+      byte shas[2 * SHA1_BYTES];
+
+      for(size_t k = 0; k < 2; k ++) {
+        memcpy(shas + k * SHA1_BYTES, job->shas + indices[k] * SHA1_BYTES, SHA1_BYTES);
+
+        hassert(hibp_bf_query_sha1(job->bf, shas + k * SHA1_BYTES),
+                "expected element %lu to be present once inserted", (unsigned long)indices[k]);
+      }
+
+      hibp_bf_query_sha1_batch(job->bf, 2, shas, results);
+      hassert0(results[0] && results[1]);
+
+      n_queries ++;
+    }
+  }
+
+  hassert0(n_queries > 0);
+
+  return NULL;
+}
+
+static size_t buffer_size(const hibp_bloom_filter_t* bf) {
+  return hibp_compute_total_size_layout(bf->layout, bf->n_hash_functions, bf->log2_bits) -
+         sizeof(hibp_bloom_filter_t);
+}
+
+int main(void) {
+  for(size_t c = 0; c < n_cases; c ++) {
+    const case_t* cs = &cases[c];
+
+    hibp_bloom_filter_t bf;
+    hibp_status_t status;
+
+    if(cs->layout == HIBP_LAYOUT_BLOCKED) {
+      status = hibp_bf_new_blocked(&bf, cs->n_hash_functions, cs->log2_bits);
+    } else {
+      status = hibp_bf_new(&bf, cs->n_hash_functions, cs->log2_bits);
+    }
+
+    hassert0(status == HIBP_OK);
+
+    byte* shas = malloc(cs->n_strings * SHA1_BYTES);
+    hassert0(shas != NULL);
+
+    for(size_t i = 0; i < cs->n_strings; i ++) {
+      char* str = random_ascii_str(rand() % 50);
+      sha1(shas + i * SHA1_BYTES, strlen(str), (const byte*)str);
+      free(str);
+    }
+
+    /* The reference, built by a single thread */
+
+    hibp_bloom_filter_t serial;
+    hassert0(hibp_bf_new_like(&serial, &bf) == HIBP_OK);
+
+    for(size_t i = 0; i < cs->n_strings; i ++) {
+      hibp_bf_insert_sha1(&serial, shas + i * SHA1_BYTES);
+    }
+
+    /* Several inserting threads and a querying thread, all at once */
+
+    hassert0(hibp_bf_set_concurrent(&bf, 1) == HIBP_OK);
+
+    job_t job;
+    job.bf = &bf;
+    job.shas = shas;
+    job.n_strings = cs->n_strings;
+    job.n_threads = cs->n_threads;
+    memset(job.done, 0, sizeof(job.done));
+
+    pthread_t inserters[MAX_THREADS];
+    worker_t workers[MAX_THREADS];
+    pthread_t querier;
+
+    hassert0(pthread_create(&querier, NULL, query_worker, &job) == 0);
+
+    for(size_t t = 0; t < cs->n_threads; t ++) {
+      workers[t].job = &job;
+      workers[t].thread = t;
+      hassert0(pthread_create(&inserters[t], NULL, insert_worker, &workers[t]) == 0);
+    }
+
+    for(size_t t = 0; t < cs->n_threads; t ++) {
+      hassert0(pthread_join(inserters[t], NULL) == 0);
+    }
+
+    hassert0(pthread_join(querier, NULL) == 0);
+
+    hassert(
+      memcmp(bf.buffer, serial.buffer, buffer_size(&bf)) == 0,
+      "expected concurrent insertion to yield the same filter as serial insertion (case %d)",
+      (int)c
+    );
+
+    /* Leaving concurrent mode changes nothing but the speed of insertions */
+
+    hassert0(hibp_bf_set_concurrent(&bf, 0) == HIBP_OK);
+    hibp_bf_insert_sha1_batch(&bf, cs->n_strings, shas);
+    hassert0(memcmp(bf.buffer, serial.buffer, buffer_size(&bf)) == 0);
+
+    /* A lazily-verified filter is verified before it enters concurrent mode */
+
+    FILE* file = fopen("concurrent.bl", "wb");
+    hassert0(file != NULL);
+    hassert0(hibp_bf_save_file_format(&bf, file, HIBP_FORMAT_CHUNKED) == HIBP_OK);
+    const long size = ftell(file);
+    fclose(file);
+
+    hibp_bloom_filter_t mapped;
+    hassert0(hibp_bf_map_file(&mapped, "concurrent.bl", HIBP_MAP_LAZY_VERIFY) == HIBP_OK);
+    hassert0(hibp_bf_set_concurrent(&mapped, 1) == HIBP_OK);
+    hibp_bf_insert_sha1_batch(&mapped, cs->n_strings, shas);
+    hassert0(memcmp(mapped.buffer, serial.buffer, buffer_size(&bf)) == 0);
+    hibp_bf_destroy(&mapped);
+
+    /* The last byte is in the bit vector */
+    file = fopen("concurrent.bl", "r+b");
+    hassert0(file != NULL);
+    fseek(file, size - 1, SEEK_SET);
+    const int last = fgetc(file);
+    fseek(file, size - 1, SEEK_SET);
+    fputc(last ^ 1, file);
+    fclose(file);
+
+    /* Unless it's in the same chunk as the hash functions, which are verified at once */
+    status = hibp_bf_map_file(&mapped, "concurrent.bl", HIBP_MAP_LAZY_VERIFY);
+
+    if(status == HIBP_OK) {
+      status = hibp_bf_set_concurrent(&mapped, 1);
+      hassert(status == HIBP_E_CHECKSUM, "expected HIBP_E_CHECKSUM, got %s", status2str(status));
+      hassert0(!mapped.concurrent);
+      hibp_bf_destroy(&mapped);
+    } else {
+      hassert(status == HIBP_E_CHECKSUM, "expected HIBP_E_CHECKSUM, got %s", status2str(status));
+      hassert0(size <= 4 * 1024 * 1024);
+    }
+
+    remove("concurrent.bl");
+
+    hibp_bf_destroy(&bf);
+    hibp_bf_destroy(&serial);
+    free(shas);
+  }
+
+  return 0;
+}
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+/* Assert that removing elements from a counting filter leaves exactly the filter that
+ * would have been built without them (so long as no counter saturates), never yields a
+ * false negative for the elements that remain, refuses elements certainly not present,
+ * and that counting filters survive being saved and loaded, but not corruption */
+
+typedef struct {
+  hibp_layout_t layout;
+  hibp_hashing_t hashing;
+  size_t n_hash_functions;
+  size_t bits;
+  size_t n_inserts;
+} case_t;
+
+const case_t cases[] = {
+  { HIBP_LAYOUT_STANDARD, HIBP_HASHING_RANDOM, 1,  8,       1 },
+  { HIBP_LAYOUT_STANDARD, HIBP_HASHING_RANDOM, 7,  1000,    50 },
+  { HIBP_LAYOUT_STANDARD, HIBP_HASHING_DOUBLE, 7,  1 << 16, 5000 },
+  { HIBP_LAYOUT_STANDARD, HIBP_HASHING_RANDOM, 10, 1 << 20, 60000 },
+  { HIBP_LAYOUT_BLOCKED,  HIBP_HASHING_RANDOM, 8,  1 << 16, 5000 },
+  { HIBP_LAYOUT_BLOCKED,  HIBP_HASHING_DOUBLE, 8,  3 << 12, 1000 }
+};
+
+const size_t n_cases = sizeof(cases) / sizeof(case_t);
+
+static size_t filter_size(const hibp_bloom_filter_t* bf) {
+  return hibp_compute_total_size_bits(bf->layout, bf->hashing, bf->n_hash_functions, bf->bits) - sizeof(*bf);
+}
+
+static int same(const hibp_bloom_filter_t* x, const hibp_bloom_filter_t* y) {
+  return memcmp(x->buffer, y->buffer, filter_size(x)) == 0;
+}
+
+int main(void) {
+  byte* shas = malloc(60000 * SHA1_BYTES);
+  hassert0(shas != NULL);
+
+  for(size_t c = 0; c < n_cases; c ++) {
+    const case_t* cs = &cases[c];
+    const size_t n = cs->n_inserts;
+    const size_t half = n / 2;
+
+    for(size_t i = 0; i < n * SHA1_BYTES; i ++) {
+      shas[i] = (byte)(rand() % 256);
+    }
+
+    hibp_counting_filter_t cf;
+    hassert0(hibp_cf_new(&cf, cs->layout, cs->hashing, cs->n_hash_functions, cs->bits) == HIBP_OK);
+
+    const hibp_bloom_filter_t* bf = hibp_cf_filter(&cf);
+
+    /* The same hash functions, with only the first half of the elements inserted */
+    hibp_bloom_filter_t expected;
+    hassert0(hibp_bf_new_like(&expected, bf) == HIBP_OK);
+
+    for(size_t i = 0; i < n; i ++) {
+      hibp_cf_insert_sha1(&cf, shas + i * SHA1_BYTES);
+    }
+
+    for(size_t i = 0; i < half; i ++) {
+      hibp_bf_insert_sha1(&expected, shas + i * SHA1_BYTES);
+    }
+
+    /* Save and reload, and carry on with the reloaded filter */
+    FILE* file = tmpfile();
+    hassert0(file != NULL);
+    hassert0(hibp_cf_save_file(&cf, file) == HIBP_OK);
+
+    rewind(file);
+
+    hibp_counting_filter_t loaded;
+    hassert0(hibp_cf_load_file(&loaded, file) == HIBP_OK);
+    hassert(same(hibp_cf_filter(&loaded), bf), "expected the reloaded filter to match (case %d)", (int)c);
+
+    hibp_cf_destroy(&cf);
+    cf = loaded;
+    bf = hibp_cf_filter(&cf);
+
+    for(size_t i = half; i < n; i ++) {
+      hassert(hibp_cf_remove_sha1(&cf, shas + i * SHA1_BYTES) == HIBP_OK,
+              "expected element %lu to be removable (case %d)", (unsigned long)i, (int)c);
+    }
+
+    for(size_t i = 0; i < half; i ++) {
+      hassert(hibp_bf_query_sha1(bf, shas + i * SHA1_BYTES),
+              "expected element %lu to remain (case %d)", (unsigned long)i, (int)c);
+    }
+
+    hassert(same(bf, &expected), "expected removals to undo insertions exactly (case %d)", (int)c);
+
+    /* Something queried negatively can't be removed, and is left alone */
+    byte absent[HIBP_SHA1_BYTES];
+
+    do {
+      for(size_t i = 0; i < SHA1_BYTES; i ++) {
+        absent[i] = (byte)(rand() % 256);
+      }
+    } while(hibp_bf_query_sha1(bf, absent));
+
+    hassert0(hibp_cf_remove_sha1(&cf, absent) == HIBP_E_INVAL);
+    hassert0(same(bf, &expected));
+
+    /* An element inserted often enough saturates its counters, which then stay put */
+    for(size_t i = 0; i < 20; i ++) {
+      hibp_cf_insert_sha1(&cf, absent);
+    }
+
+    for(size_t i = 0; i < 20; i ++) {
+      hassert0(hibp_cf_remove_sha1(&cf, absent) == HIBP_OK);
+    }
+
+    hassert(hibp_bf_query_sha1(bf, absent), "expected saturated counters to stick (case %d)", (int)c);
+
+    /* Collapsing yields an ordinary filter */
+    hibp_bloom_filter_t collapsed;
+    hassert0(hibp_cf_collapse(&collapsed, &cf) == HIBP_OK);
+    hassert0(same(&collapsed, bf));
+    hassert0(hibp_bf_query_sha1(&collapsed, absent));
+    hibp_bf_destroy(&collapsed);
+
+    /* Corrupting a counter, or the bit vector, is caught on load */
+    const long size = ftell(file);
+    hassert0(size > 0);
+
+    for(int target = 0; target < 2; target ++) {
+      const long offset = (target == 0) ? size - 5 : size - 4 - 8 * (long)((cs->bits + 15) / 16) - 1;
+
+      rewind(file);
+      hassert0(hibp_cf_save_file(&cf, file) == HIBP_OK);
+
+      hassert0(fseek(file, offset, SEEK_SET) == 0);
+      const int b = fgetc(file);
+      hassert0(fseek(file, offset, SEEK_SET) == 0);
+      fputc(b ^ 0x10, file);
+
+      rewind(file);
+      hassert(hibp_cf_load_file(&loaded, file) == HIBP_E_CHECKSUM,
+              "expected corruption to be caught (case %d, target %d)", (int)c, target);
+    }
+
+    /* A plain filter isn't a counting filter */
+    rewind(file);
+    hassert0(hibp_bf_save_file(bf, file) == HIBP_OK);
+    rewind(file);
+    hassert0(hibp_cf_load_file(&loaded, file) == HIBP_E_VERSION);
+
+    fclose(file);
+    hibp_bf_destroy(&expected);
+    hibp_cf_destroy(&cf);
+  }
+
+  free(shas);
+
+  return 0;
+}
@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "util.h"
+
+/* Assert that changes to a tracked filter can be persisted in place with
+ * hibp_bf_save_changes, yielding exactly the file that saving the whole filter afresh
+ * would, and that deltas carry those changes to other copies of the filter, however
+ * often they're applied, whether the copies are loaded or mapped. Also assert that
+ * deltas are rejected by filters with other hash functions, and when corrupt */
+
+#define MAX_LENGTH 50
+
+typedef struct {
+  hibp_layout_t layout;
+  size_t n_hash_functions;
+  size_t log2_bits;
+  size_t n_base;
+  size_t n_update;
+  hibp_format_t format;
+  int flags;
+} case_t;
+
+const case_t cases[] = {
+  { HIBP_LAYOUT_STANDARD, 1,  0,  0,      1,     HIBP_FORMAT_COMPACT,      0 },
+  { HIBP_LAYOUT_STANDARD, 5,  10, 100,    10,    HIBP_FORMAT_COMPACT,      0 },
+  { HIBP_LAYOUT_STANDARD, 10, 20, 10000,  100,   HIBP_FORMAT_ALIGNED,      HIBP_MAP_NO_VERIFY },
+  { HIBP_LAYOUT_BLOCKED,  8,  26, 100000, 100,   HIBP_FORMAT_CHUNKED,      HIBP_MAP_LAZY_VERIFY },
+  { HIBP_LAYOUT_STANDARD, 7,  26, 10000,  50000, HIBP_FORMAT_CHUNKED,      0 },
+  { HIBP_LAYOUT_BLOCKED,  11, 20, 1000,   1000,  HIBP_FORMAT_CHUNKED_SHA1, HIBP_MAP_LAZY_VERIFY }
+};
+
+const size_t n_cases = sizeof(cases) / sizeof(case_t);
+
+/* Copy at most max bytes of from */
+static void copy_file(const char* from, const char* to, size_t max) {
+  FILE* in = fopen(from, "rb");
+  FILE* out = fopen(to, "wb");
+  hassert0(in != NULL && out != NULL);
+
+  int c;
+
+  for(size_t i = 0; i < max && (c = fgetc(in)) != EOF; i ++) {
+    fputc(c, out);
+  }
+
+  fclose(in);
+  fclose(out);
+}
+
+static hibp_status_t apply(hibp_bloom_filter_t* bf, const char* filename) {
+  FILE* file = fopen(filename, "rb");
+  hassert0(file != NULL);
+  const hibp_status_t status = hibp_bf_apply_delta_file(bf, file);
+  fclose(file);
+  return status;
+}
+
+/* Insert n random elements, returning their SHA1s */
+static byte* insert_random(hibp_bloom_filter_t* bf, size_t n) {
+  byte* shas = malloc((n == 0 ? 1 : n) * SHA1_BYTES);
+  hassert0(shas != NULL);
+
+  for(size_t i = 0; i < n; i ++) {
+    char* str = random_ascii_str(rand() % MAX_LENGTH);
+    sha1(shas + i * SHA1_BYTES, strlen(str), (const byte*)str);
+    free(str);
+  }
+
+  /* Use the parallel path for large batches, to check that it tracks changes too */
+  if(n > 1000) {
+    hibp_bf_insert_sha1_parallel(bf, n, shas, 0);
+  } else {
+    for(size_t i = 0; i < n; i ++) {
+      hibp_bf_insert_sha1(bf, shas + i * SHA1_BYTES);
+    }
+  }
+
+  return shas;
+}
+
+int main(void) {
+  for(size_t c = 0; c < n_cases; c ++) {
+    const case_t* cs = &cases[c];
+
+    hibp_bloom_filter_t bf;
+    hibp_status_t status;
+
+    if(cs->layout == HIBP_LAYOUT_BLOCKED) {
+      status = hibp_bf_new_blocked(&bf, cs->n_hash_functions, cs->log2_bits);
+    } else {
+      status = hibp_bf_new(&bf, cs->n_hash_functions, cs->log2_bits);
+    }
+
+    hassert0(status == HIBP_OK);
+
+    free(insert_random(&bf, cs->n_base));
+
+    save_file(&bf, "base.bl", cs->format);
+    copy_file("base.bl", "replica.bl", SIZE_MAX);
+    copy_file("base.bl", "original.bl", SIZE_MAX);
+
+    /* Neither deltas nor in-place updates are possible without tracking */
+    hassert0(hibp_bf_save_delta_file(&bf, stdout) == HIBP_E_INVAL);
+    hassert0(hibp_bf_save_changes(&bf, "base.bl") == HIBP_E_INVAL);
+
+    hibp_bf_destroy(&bf);
+
+    /* Update the base in place */
+
+    status = hibp_bf_map_file(&bf, "base.bl", cs->flags);
+    hassert(status == HIBP_OK, "expected HIBP_OK, got %s", status2str(status));
+    hassert0(hibp_bf_track_changes(&bf) == HIBP_OK);
+
+    /* Restarting tracking is harmless */
+    hassert0(hibp_bf_track_changes(&bf) == HIBP_OK);
+
+    FILE* file = fopen("empty.delta", "wb");
+    hassert0(file != NULL);
+    hassert0(hibp_bf_save_delta_file(&bf, file) == HIBP_OK);
+    fclose(file);
+
+    byte* update = insert_random(&bf, cs->n_update);
+
+    file = fopen("update.delta", "wb");
+    hassert0(file != NULL);
+    hassert0(hibp_bf_save_delta_file(&bf, file) == HIBP_OK);
+    fclose(file);
+
+    status = hibp_bf_save_changes(&bf, "base.bl");
+    hassert(status == HIBP_OK, "expected HIBP_OK, got %s", status2str(status));
+
+    /* The mapping verifies against its new checksums, and so does the file */
+    hassert0(hibp_bf_verify(&bf) == HIBP_OK);
+
+    save_file(&bf, "expected.bl", cs->format);
+
+    hassert(
+      same_file("base.bl", "expected.bl"),
+      "expected the file updated in place to match a fresh save (case %d)",
+      (int)c
+    );
+
+    /* A filter already has everything in its own delta */
+    hassert0(apply(&bf, "update.delta") == HIBP_OK);
+
+    /* In the blocked layout, each element sets bits of a single page, so a small update
+     * makes for a small delta */
+    const size_t n_pages = ((((size_t)1) << cs->log2_bits) / 8 + 4095) / 4096;
+
+    if(cs->layout == HIBP_LAYOUT_BLOCKED && 10 * cs->n_update < n_pages) {
+      hassert(
+        file_size("update.delta") < file_size("base.bl") / 10,
+        "expected the delta (%ld bytes) to be much smaller than the filter (%ld bytes)",
+        file_size("update.delta"), file_size("base.bl")
+      );
+    }
+
+    hibp_bf_destroy(&bf);
+
+    hibp_bloom_filter_t updated;
+    status = hibp_bf_map_file(&updated, "base.bl", 0);
+    hassert(status == HIBP_OK, "expected HIBP_OK, got %s", status2str(status));
+
+    /* Bring a mapped replica up to date, save it in place, and check it against the
+     * updated base */
+
+    hibp_bloom_filter_t replica;
+    status = hibp_bf_map_file(&replica, "replica.bl", cs->flags);
+    hassert(status == HIBP_OK, "expected HIBP_OK, got %s", status2str(status));
+    hassert0(hibp_bf_track_changes(&replica) == HIBP_OK);
+
+    hassert0(apply(&replica, "empty.delta") == HIBP_OK);
+    hassert0(apply(&replica, "update.delta") == HIBP_OK);
+    hassert0(apply(&replica, "update.delta") == HIBP_OK);
+
+    /* The replica already has everything in the base, so this dirties nothing */
+    hassert0(hibp_bf_union(&replica, &updated) == HIBP_OK);
+
+    status = hibp_bf_save_changes(&replica, "replica.bl");
+    hassert(status == HIBP_OK, "expected HIBP_OK, got %s", status2str(status));
+    hibp_bf_destroy(&replica);
+
+    hassert(
+      same_file("replica.bl", "base.bl"),
+      "expected the replica updated in place to match the base (case %d)",
+      (int)c
+    );
+
+    remove("expected.bl");
+
+    /* Loaded rather than mapped: applying the delta to a loaded copy of the original
+     * yields the base too */
+
+    file = fopen("original.bl", "rb");
+    hassert0(file != NULL);
+    hassert0(hibp_bf_load_file(&replica, file) == HIBP_OK);
+    fclose(file);
+
+    hassert0(apply(&replica, "update.delta") == HIBP_OK);
+    hassert0(apply(&replica, "update.delta") == HIBP_OK);
+
+    for(size_t i = 0; i < cs->n_update; i ++) {
+      hassert(hibp_bf_query_sha1(&replica, update + i * SHA1_BYTES),
+              "expected update %lu to be present after applying the delta", (unsigned long)i);
+    }
+
+    save_file(&replica, "replica.bl", cs->format);
+    hassert0(same_file("replica.bl", "base.bl"));
+
+    /* Not mapped */
+    hassert0(hibp_bf_track_changes(&replica) == HIBP_OK);
+    hassert0(hibp_bf_save_changes(&replica, "replica.bl") == HIBP_E_INVAL);
+
+    /* Deltas can't clear bits, so a filter that's had bits cleared can't be shipped as one
+     * until tracking restarts */
+    hibp_bloom_filter_t empty;
+    hassert0(hibp_bf_new_like(&empty, &replica) == HIBP_OK);
+    hassert0(hibp_bf_intersect(&replica, &empty) == HIBP_OK);
+    hassert0(hibp_bf_save_delta_file(&replica, stdout) == HIBP_E_INVAL);
+    hibp_bf_destroy(&empty);
+
+    hassert0(hibp_bf_track_changes(&replica) == HIBP_OK);
+    file = fopen("cleared.delta", "wb");
+    hassert0(file != NULL);
+    hassert0(hibp_bf_save_delta_file(&replica, file) == HIBP_OK);
+    fclose(file);
+    remove("cleared.delta");
+
+    hibp_bf_destroy(&replica);
+    free(update);
+
+    /* A filter with other hash functions rejects the delta */
+
+    hibp_bloom_filter_t other;
+    hassert0(hibp_bf_new_blocked(&other, 2, 12) == HIBP_OK);
+    status = apply(&other, "update.delta");
+    hassert(status == HIBP_E_INVAL, "expected HIBP_E_INVAL, got %s", status2str(status));
+    hibp_bf_destroy(&other);
+
+    /* As does the filter itself, for a truncated or corrupt delta. The header (checked
+     * above) is the first 42 bytes */
+
+    const long size = file_size("update.delta");
+
+    copy_file("update.delta", "truncated.delta", rand() % size);
+    status = apply(&updated, "truncated.delta");
+    hassert(status == HIBP_E_IO, "expected HIBP_E_IO, got %s", status2str(status));
+    remove("truncated.delta");
+
+    if(size > 42) {
+      file = fopen("update.delta", "r+b");
+      hassert0(file != NULL);
+      fseek(file, 42 + rand() % (size - 42), SEEK_SET);
+      const int byte = fgetc(file);
+      fseek(file, -1, SEEK_CUR);
+      fputc(byte ^ 0x10, file);
+      fclose(file);
+
+      status = apply(&updated, "update.delta");
+
+      hassert(
+        status == HIBP_E_CHECKSUM || status == HIBP_E_INVAL || status == HIBP_E_IO,
+        "expected corruption to be detected, got %s", status2str(status)
+      );
+    }
+
+    hibp_bf_destroy(&updated);
+
+    remove("base.bl");
+    remove("replica.bl");
+    remove("original.bl");
+    remove("empty.delta");
+    remove("update.delta");
+  }
+
+  return 0;
+}
@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "util.h"
+
+/* Assert that hibp_bf_estimate_fpr yields the same outcome however many threads it runs
+ * on, that its confidence interval is sound, and that it agrees with the false positive
+ * rate observed by querying random SHA1s with hibp_bf_query_sha1_batch */
+
+#define N_TRIALS 1000003
+
+typedef struct {
+  hibp_layout_t layout;
+  hibp_hashing_t hashing;
+  size_t n_hash_functions;
+  size_t bits;
+  size_t n_inserts;
+} case_t;
+
+const case_t cases[] = {
+  { HIBP_LAYOUT_STANDARD, HIBP_HASHING_RANDOM, 1,  1000,    400 },
+  { HIBP_LAYOUT_STANDARD, HIBP_HASHING_RANDOM, 7,  1 << 16, 5000 },
+  { HIBP_LAYOUT_STANDARD, HIBP_HASHING_DOUBLE, 10, 1 << 20, 60000 },
+  { HIBP_LAYOUT_STANDARD, HIBP_HASHING_RANDOM, 40, 1 << 20, 10000 },
+  { HIBP_LAYOUT_BLOCKED,  HIBP_HASHING_RANDOM, 8,  1 << 16, 5000 },
+  { HIBP_LAYOUT_BLOCKED,  HIBP_HASHING_RANDOM, 8,  3 << 16, 10000 },
+  { HIBP_LAYOUT_BLOCKED,  HIBP_HASHING_DOUBLE, 8,  3 << 16, 10000 }
+};
+
+const size_t n_cases = sizeof(cases) / sizeof(case_t);
+
+int main(void) {
+  byte* shas = malloc(60000 * SHA1_BYTES);
+  byte* queries = malloc(N_TRIALS * SHA1_BYTES);
+  int* results = malloc(N_TRIALS * sizeof(int));
+  hassert0(shas != NULL && queries != NULL && results != NULL);
+
+  for(size_t c = 0; c < n_cases; c ++) {
+    const case_t* cs = &cases[c];
+
+    hibp_bloom_filter_t bf;
+    hassert0(hibp_bf_new_bits(&bf, cs->layout, cs->hashing, cs->n_hash_functions, cs->bits) == HIBP_OK);
+
+    hibp_fpr_estimate_t estimate;
+    hibp_bf_estimate_fpr(&estimate, &bf, N_TRIALS, c, 0);
+
+    hassert(estimate.trials == N_TRIALS && estimate.positives == 0 && estimate.rate == 0,
+            "expected an empty filter to have no false positives (case %d)", (int)c);
+    hassert(estimate.lower == 0 && estimate.upper > 0 && estimate.upper < 1e-5,
+            "expected a narrow interval about 0 for an empty filter (case %d)", (int)c);
+
+    for(size_t i = 0; i < cs->n_inserts * SHA1_BYTES; i ++) {
+      shas[i] = (byte)(rand() % 256);
+    }
+
+    hibp_bf_insert_sha1_batch(&bf, cs->n_inserts, shas);
+
+    hibp_bf_estimate_fpr(&estimate, &bf, N_TRIALS, c, 0);
+
+    for(size_t n_threads = 1; n_threads <= 3; n_threads ++) {
+      hibp_fpr_estimate_t other;
+      hibp_bf_estimate_fpr(&other, &bf, N_TRIALS, c, n_threads);
+
+      hassert(other.positives == estimate.positives,
+              "expected %lu positives on %lu thread(s), not %lu (case %d)", (unsigned long)estimate.positives,
+              (unsigned long)n_threads, (unsigned long)other.positives, (int)c);
+    }
+
+    hassert(estimate.rate == (double)estimate.positives / N_TRIALS,
+            "expected the rate to be exact (case %d)", (int)c);
+    hassert(estimate.lower <= estimate.rate && estimate.rate <= estimate.upper,
+            "expected %f to lie in [%f, %f] (case %d)", estimate.rate, estimate.lower, estimate.upper, (int)c);
+
+    /* Both rates are binomially distributed, and should be within five standard
+     * deviations of one another. The estimate mustn't count towards the queries of
+     * hibp_bf_get_stats */
+    for(size_t i = 0; i < N_TRIALS * SHA1_BYTES; i ++) {
+      queries[i] = (byte)(rand() % 256);
+    }
+
+    hibp_bf_query_sha1_batch(&bf, N_TRIALS, queries, results);
+
+    size_t positives = 0;
+
+    for(size_t i = 0; i < N_TRIALS; i ++) {
+      positives += results[i];
+    }
+
+    const double rate = (double)positives / N_TRIALS;
+    const double sigma = sqrt(2 * rate * (1 - rate) / N_TRIALS);
+
+    hassert(fabs(rate - estimate.rate) <= 5 * sigma + 1e-5,
+            "expected a false positive rate of about %f, not %f (case %d)", rate, estimate.rate, (int)c);
+
+    hibp_filter_stats_t stats;
+    hibp_bf_get_stats(&stats, &bf);
+
+    hassert(!stats.counters_enabled || stats.n_queries == N_TRIALS,
+            "expected only the batch of queries to be counted (case %d)", (int)c);
+
+    hibp_bf_destroy(&bf);
+  }
+
+  free(shas);
+  free(queries);
+  free(results);
+
+  return 0;
+}
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+/* Assert that building a fuse filter, through either kind of builder, fails with
+ * HIBP_E_NOMEM (and nothing else) whichever of its allocations fails, and otherwise
+ * yields a filter with no false negatives */
+
+#define LOG2_SHARDS 2
+#define N_INSERTS 2000
+
+/* The failing allocator stands in for malloc and friends throughout this test, forwarding
+ * to glibc's own, but once armed the countdown-th allocation after that fails */
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* buffer, size_t size);
+extern void __libc_free(void* buffer);
+
+static long countdown = -1;
+
+static int failing(void) {
+  return countdown >= 0 && countdown -- == 0;
+}
+
+void* malloc(size_t size) {
+  return failing() ? NULL : __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) {
+  return failing() ? NULL : __libc_calloc(n, size);
+}
+
+void* realloc(void* buffer, size_t size) {
+  return failing() ? NULL : __libc_realloc(buffer, size);
+}
+
+void free(void* buffer) {
+  __libc_free(buffer);
+}
+
+static int compare_shas(const void* a, const void* b) {
+  return memcmp(a, b, SHA1_BYTES);
+}
+
+int main(void) {
+  byte* shas = malloc(N_INSERTS * SHA1_BYTES);
+  hassert0(shas != NULL);
+  random_shas(shas, N_INSERTS);
+  qsort(shas, N_INSERTS, SHA1_BYTES, compare_shas);
+
+  for(int sorted = 0; sorted < 2; sorted ++) {
+    for(long k = 0; ; k ++) {
+      hibp_fuse_builder_t b;
+      hibp_fuse_filter_t ff;
+
+      if(sorted) {
+        hassert0(hibp_ff_builder_new_sorted(&b, 8, LOG2_SHARDS, 1) == HIBP_OK);
+      } else {
+        hassert0(hibp_ff_builder_new(&b, 8, LOG2_SHARDS) == HIBP_OK);
+      }
+
+      countdown = k;
+      hibp_status_t status = hibp_ff_builder_add_sha1_batch(&b, N_INSERTS, shas);
+
+      if(status == HIBP_OK) {
+        status = hibp_ff_build(&ff, &b, 1);
+      }
+
+      const int failed = (countdown < 0);
+      countdown = -1;
+      hibp_ff_builder_destroy(&b);
+
+      /* Some allocations (such as qsort's) can fail without consequence */
+      hassert(status == HIBP_OK || (failed && status == HIBP_E_NOMEM),
+              "expected HIBP_E_NOMEM when allocation %ld fails, not %s (sorted %d)", k, status2str(status), sorted);
+
+      if(status == HIBP_OK) {
+        for(size_t i = 0; i < N_INSERTS; i ++) {
+          hassert0(hibp_ff_query_sha1(&ff, shas + i * SHA1_BYTES));
+        }
+
+        hibp_ff_destroy(&ff);
+      }
+
+      if(!failed) {
+        break;
+      }
+    }
+  }
+
+  free(shas);
+
+  return 0;
+}
@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "util.h"
+
+/* Assert that fuse filters yield no false negatives and about the expected false positive
+ * rate, take about the expected space, don't depend on the order in which elements are
+ * added (nor on duplicates, nor on the number of threads building them, nor on whether a
+ * sorted builder built them as it went), and survive being saved and loaded, but not
+ * corruption */
+
+#define N_QUERIES 1000000
+
+typedef struct {
+  size_t fingerprint_bits;
+  size_t log2_shards;
+  size_t n;
+} case_t;
+
+const case_t cases[] = {
+  { 8,  0, 0 },
+  { 8,  0, 1 },
+  { 16, 0, 2 },
+  { 8,  0, 100 },
+  { 16, 2, 1000 },
+  { 8,  0, 1000000 },
+  { 16, 0, 1000000 },
+  { 8,  6, 1000000 },
+  { 16, 4, 200000 }
+};
+
+const size_t n_cases = sizeof(cases) / sizeof(case_t);
+
+static void build(hibp_fuse_filter_t* ff, const case_t* cs, const byte* shas, size_t n, int reverse,
+                  size_t n_threads) {
+  hibp_fuse_builder_t b;
+  hassert0(hibp_ff_builder_new(&b, cs->fingerprint_bits, cs->log2_shards) == HIBP_OK);
+
+  if(reverse) {
+    for(size_t i = n; i -- > 0; ) {
+      hassert0(hibp_ff_builder_add_sha1(&b, shas + i * SHA1_BYTES) == HIBP_OK);
+
+      if(i % 3 == 0) {
+        hassert0(hibp_ff_builder_add_sha1(&b, shas + i * SHA1_BYTES) == HIBP_OK);
+      }
+    }
+  } else {
+    hassert0(hibp_ff_builder_add_sha1_batch(&b, n, shas) == HIBP_OK);
+  }
+
+  hassert0(hibp_ff_build(ff, &b, n_threads) == HIBP_OK);
+  hibp_ff_builder_destroy(&b);
+}
+
+static int compare_shas(const void* a, const void* b) {
+  return memcmp(a, b, SHA1_BYTES);
+}
+
+/* Build from the elements sorted by SHA1, as a sorted builder requires, checking that it
+ * builds each shard as soon as the input has passed it */
+static void build_sorted(hibp_fuse_filter_t* ff, const case_t* cs, const byte* shas, size_t n) {
+  byte* sorted = malloc(n * SHA1_BYTES + 1);
+  hassert0(sorted != NULL);
+  memcpy(sorted, shas, n * SHA1_BYTES);
+  qsort(sorted, n, SHA1_BYTES, compare_shas);
+
+  hibp_fuse_builder_t b;
+  hassert0(hibp_ff_builder_new_sorted(&b, cs->fingerprint_bits, cs->log2_shards, 1) == HIBP_OK);
+  hassert0(hibp_ff_builder_add_sha1_batch(&b, n, sorted) == HIBP_OK);
+  hassert0(b.n_built == b.current);
+
+  /* Going back to a passed shard is refused */
+  if(n > 0 && b.current > 0) {
+    hassert0(hibp_ff_builder_add_sha1(&b, sorted) == HIBP_E_INVAL);
+  }
+
+  hassert0(hibp_ff_build(ff, &b, 0) == HIBP_OK);
+  hibp_ff_builder_destroy(&b);
+  free(sorted);
+}
+
+static membuf_t save(const hibp_fuse_filter_t* ff) {
+  membuf_t mb = { NULL, 0, 0 };
+  hassert0(hibp_ff_save_writer(ff, &mb, mb_write) == HIBP_OK);
+  return mb;
+}
+
+int main(void) {
+  byte* shas = malloc(1000000 * SHA1_BYTES);
+  byte* queries = malloc(N_QUERIES * SHA1_BYTES);
+  int* results = malloc(N_QUERIES * sizeof(int));
+  hassert0(shas != NULL && queries != NULL && results != NULL);
+
+  hibp_fuse_builder_t b;
+  hassert0(hibp_ff_builder_new(&b, 12, 0) == HIBP_E_INVAL);
+  hassert0(hibp_ff_builder_new(&b, 8, 21) == HIBP_E_2BIG);
+  hassert0(hibp_ff_builder_new_sorted(&b, 12, 0, 0) == HIBP_E_INVAL);
+
+  for(size_t c = 0; c < n_cases; c ++) {
+    const case_t* cs = &cases[c];
+    const size_t n = cs->n;
+
+    for(size_t i = 0; i < n * SHA1_BYTES; i ++) {
+      shas[i] = (byte)(rand() % 256);
+    }
+
+    hibp_fuse_filter_t ff;
+    build(&ff, cs, shas, n, 0, 0);
+
+    for(size_t i = 0; i < n; i ++) {
+      hassert(hibp_ff_query_sha1(&ff, shas + i * SHA1_BYTES), "expected element %lu to be present (case %d)",
+              (unsigned long)i, (int)c);
+    }
+
+    /* Smaller shards take a little more space per element */
+    if((n >> cs->log2_shards) >= 100000) {
+      const double bytes = (double)hibp_ff_size(&ff) / n;
+      const double expected = 1.125 * cs->fingerprint_bits / 8;
+
+      hassert(bytes <= 1.05 * expected, "expected about %f bytes per element, not %f (case %d)", expected, bytes,
+              (int)c);
+    }
+
+    /* Batched queries agree with unbatched ones, and are about as often falsely positive
+     * as expected */
+    for(size_t i = 0; i < N_QUERIES * SHA1_BYTES; i ++) {
+      queries[i] = (byte)(rand() % 256);
+    }
+
+    hibp_ff_query_sha1_batch(&ff, N_QUERIES, queries, results);
+
+    size_t positives = 0;
+
+    for(size_t i = 0; i < N_QUERIES; i ++) {
+      hassert0(results[i] == hibp_ff_query_sha1(&ff, queries + i * SHA1_BYTES));
+      positives += results[i];
+    }
+
+    const double rate = ldexp(1, -(int)cs->fingerprint_bits);
+    const double sigma = sqrt(rate * (1 - rate) / N_QUERIES);
+
+    hassert(fabs((double)positives / N_QUERIES - rate) <= 5 * sigma,
+            "expected a false positive rate of about %f, not %f (case %d)", rate, (double)positives / N_QUERIES,
+            (int)c);
+
+    /* The same elements in reverse order, with duplicates, on one thread, yield the same
+     * filter */
+    membuf_t mb = save(&ff);
+
+    hibp_fuse_filter_t other;
+    build(&other, cs, shas, n, 1, 1);
+
+    membuf_t other_mb = save(&other);
+    hassert(mb.size == other_mb.size && memcmp(mb.buffer, other_mb.buffer, mb.size) == 0,
+            "expected the filter not to depend on order or threads (case %d)", (int)c);
+    free(other_mb.buffer);
+    hibp_ff_destroy(&other);
+
+    /* As do the elements in order, through a sorted builder */
+    build_sorted(&other, cs, shas, n);
+
+    other_mb = save(&other);
+    hassert(mb.size == other_mb.size && memcmp(mb.buffer, other_mb.buffer, mb.size) == 0,
+            "expected a sorted builder to build the same filter (case %d)", (int)c);
+    free(other_mb.buffer);
+    hibp_ff_destroy(&other);
+
+    /* Reloading yields the same filter */
+    hassert0(hibp_ff_load_reader(&other, &mb, mb_read) == HIBP_OK);
+    hassert0(other.fingerprint_bits == cs->fingerprint_bits && other.log2_shards == cs->log2_shards);
+
+    for(size_t i = 0; i < 1000; i ++) {
+      hassert0(hibp_ff_query_sha1(&other, queries + i * SHA1_BYTES) == results[i]);
+    }
+
+    hibp_ff_destroy(&other);
+
+    /* Corruption anywhere is caught (as an IO error if it garbles the sizes, and hence
+     * where the file should end), and truncation is an IO error */
+    for(size_t k = 0; k < 10; k ++) {
+      const size_t offset = (k == 0) ? 0 : (size_t)rand() % mb.size;
+      mb.buffer[offset] ^= 0x01;
+      mb.position = 0;
+
+      const hibp_status_t st = hibp_ff_load_reader(&other, &mb, mb_read);
+      hassert(st == HIBP_E_CHECKSUM || st == HIBP_E_IO || (offset < 4 && st == HIBP_E_VERSION),
+              "expected corruption at %lu to be caught, not %s (case %d)", (unsigned long)offset, status2str(st),
+              (int)c);
+
+      mb.buffer[offset] ^= 0x01;
+    }
+
+    mb.size --;
+    mb.position = 0;
+    hassert0(hibp_ff_load_reader(&other, &mb, mb_read) == HIBP_E_IO);
+
+    free(mb.buffer);
+    hibp_ff_destroy(&ff);
+  }
+
+  free(shas);
+  free(queries);
+  free(results);
+
+  return 0;
+}
@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "util.h"
+
+/* Assert that Bloom filters with double hashing have no false negatives, survive the
+ * round trip to and from disk in every format (the family being recorded in the file),
+ * store no hash functions, and have roughly the false positive rate of a filter with
+ * random hash functions. Also assert that every such filter with the same parameters has
+ * the same hash functions, however it was built, and that the two families don't mix */
+
+#define LENGTH 50
+
+typedef struct {
+  hibp_layout_t layout;
+  size_t n_hash_functions;
+  size_t log2_bits;
+  size_t n_strings;
+  hibp_format_t format;
+} case_t;
+
+const case_t cases[] = {
+  { HIBP_LAYOUT_STANDARD, 1,  0,  1,      HIBP_FORMAT_COMPACT },
+  { HIBP_LAYOUT_STANDARD, 3,  6,  10,     HIBP_FORMAT_ALIGNED },
+  { HIBP_LAYOUT_STANDARD, 5,  16, 1000,   HIBP_FORMAT_COMPACT },
+  { HIBP_LAYOUT_STANDARD, 10, 20, 20000,  HIBP_FORMAT_CHUNKED },
+  { HIBP_LAYOUT_STANDARD, 7,  24, 100000, HIBP_FORMAT_COMPRESSED },
+  { HIBP_LAYOUT_BLOCKED,  2,  9,  100,    HIBP_FORMAT_COMPACT },
+  { HIBP_LAYOUT_BLOCKED,  8,  16, 5000,   HIBP_FORMAT_CHUNKED_SHA1 },
+  { HIBP_LAYOUT_BLOCKED,  11, 20, 20000,  HIBP_FORMAT_ALIGNED },
+  { HIBP_LAYOUT_BLOCKED,  33, 20, 20000,  HIBP_FORMAT_COMPRESSED }
+};
+
+const size_t n_cases = sizeof(cases) / sizeof(case_t);
+
+static void build(hibp_bloom_filter_t* bf, const case_t* cs, hibp_hashing_t hashing,
+                  const byte* shas) {
+  hibp_status_t status =
+    hibp_bf_new_hashing(bf, cs->layout, hashing, cs->n_hash_functions, cs->log2_bits);
+  hassert(status == HIBP_OK, "expected HIBP_OK, got %s", status2str(status));
+  hibp_bf_insert_sha1_batch(bf, cs->n_strings, shas);
+}
+
+static size_t count_false_positives(const hibp_bloom_filter_t* bf, size_t n_trials) {
+  size_t positive = 0;
+
+  for(size_t i = 0; i < n_trials; i ++) {
+    char* str = random_ascii_str(LENGTH + 1);
+    positive += hibp_bf_query_str(bf, str);
+    free(str);
+  }
+
+  return positive;
+}
+
+int main(void) {
+  hibp_bloom_filter_t bf;
+
+  /* Parameter validation */
+  hassert0(hibp_bf_new_hashing(&bf, HIBP_LAYOUT_STANDARD, (hibp_hashing_t)2, 5, 10) == HIBP_E_INVAL);
+  hassert0(hibp_bf_new_hashing(&bf, HIBP_LAYOUT_BLOCKED, HIBP_HASHING_DOUBLE, 5, 8) == HIBP_E_INVAL);
+  hassert0(hibp_bf_new_hashing(&bf, HIBP_LAYOUT_BLOCKED, HIBP_HASHING_DOUBLE, 1, 20) == HIBP_E_INVAL);
+
+  for(size_t c = 0; c < n_cases; c ++) {
+    const case_t* cs = &cases[c];
+
+    byte* shas = malloc(cs->n_strings * SHA1_BYTES);
+    hassert0(shas != NULL);
+
+    for(size_t i = 0; i < cs->n_strings; i ++) {
+      char* str = random_ascii_str(LENGTH);
+      sha1(shas + i * SHA1_BYTES, strlen(str), (const byte*)str);
+      free(str);
+    }
+
+    build(&bf, cs, HIBP_HASHING_DOUBLE, shas);
+
+    /* Nothing but the bit vector */
+
+    hibp_filter_info_t info;
+    hibp_bf_get_info(&info, &bf);
+    hassert0(info.layout == cs->layout && info.hashing == HIBP_HASHING_DOUBLE);
+    hassert0(info.memory == hibp_compute_total_size_hashing(cs->layout, HIBP_HASHING_DOUBLE,
+                                                            cs->n_hash_functions, cs->log2_bits));
+
+    const size_t size = info.memory - sizeof(bf);
+    hassert0(size == ((((size_t)1) << cs->log2_bits) + 7) / 8);
+
+    /* Unbatched and batched queries both find everything */
+
+    int* results = malloc(cs->n_strings * sizeof(int));
+    hassert0(results != NULL);
+
+    hibp_bf_query_sha1_batch(&bf, cs->n_strings, shas, results);
+
+    for(size_t i = 0; i < cs->n_strings; i ++) {
+      hassert(hibp_bf_query_sha1(&bf, shas + i * SHA1_BYTES) && results[i],
+              "expected element %lu to be present (case %d)", (unsigned long)i, (int)c);
+    }
+
+    free(results);
+
+    /* The same hash functions every time, so that independently-built filters combine.
+     * Parallel insertion sets the same bits too */
+
+    hibp_bloom_filter_t other;
+    hassert0(hibp_bf_new_hashing(&other, cs->layout, HIBP_HASHING_DOUBLE, cs->n_hash_functions,
+                                 cs->log2_bits) == HIBP_OK);
+    hibp_bf_insert_sha1_parallel(&other, cs->n_strings, shas, 0);
+    hassert0(memcmp(bf.buffer, other.buffer, size) == 0);
+    hassert0(hibp_bf_union(&bf, &other) == HIBP_OK);
+    hibp_bf_destroy(&other);
+
+    /* But not with random hash functions, even with the same bits set */
+
+    build(&other, cs, HIBP_HASHING_RANDOM, shas);
+    hassert0(hibp_bf_union(&bf, &other) == HIBP_E_INVAL);
+
+    hibp_bf_get_info(&info, &other);
+    hassert0(info.hashing == HIBP_HASHING_RANDOM);
+
+    /* Roughly the same false positive rate as random hash functions (for the tiniest
+     * filters, the rate varies too much from one filter to the next to say) */
+
+    if(cs->n_strings >= 1000) {
+      const size_t n_trials = 20000;
+      const double rate = (double)count_false_positives(&bf, n_trials) / n_trials;
+      const double random_rate = (double)count_false_positives(&other, n_trials) / n_trials;
+
+      hassert(
+        rate <= 1.5 * random_rate + 0.002,
+        "expected a false positive rate of ~%lf, but was %lf (case %d)",
+        random_rate, rate, (int)c
+      );
+    }
+
+    /* To and from disk */
+
+    FILE* file = fopen("hashing.bl", "wb");
+    hassert0(file != NULL);
+    hassert0(hibp_bf_save_file_format(&bf, file, cs->format) == HIBP_OK);
+    fclose(file);
+
+    hibp_bloom_filter_t loaded;
+
+    file = fopen("hashing.bl", "rb");
+    hassert0(file != NULL);
+    hassert0(hibp_bf_load_file(&loaded, file) == HIBP_OK);
+    fclose(file);
+
+    hassert0(loaded.layout == cs->layout && loaded.hashing == HIBP_HASHING_DOUBLE);
+    hassert0(loaded.n_hash_functions == cs->n_hash_functions && loaded.log2_bits == cs->log2_bits);
+    hassert0(memcmp(bf.buffer, loaded.buffer, size) == 0);
+    hibp_bf_destroy(&loaded);
+
+    if(cs->format != HIBP_FORMAT_COMPRESSED) {
+      hassert0(hibp_bf_map_file(&loaded, "hashing.bl", HIBP_MAP_LAZY_VERIFY) == HIBP_OK);
+      hassert0(loaded.hashing == HIBP_HASHING_DOUBLE);
+
+      for(size_t i = 0; i < cs->n_strings; i ++) {
+        hassert0(hibp_bf_query_sha1(&loaded, shas + i * SHA1_BYTES));
+      }
+
+      hibp_bf_destroy(&loaded);
+    }
+
+    remove("hashing.bl");
+
+    /* A compact file of a filter with random hash functions in the standard layout is
+     * still in the original format, which can't record the family; the double-hashed
+     * equivalent isn't */
+
+    if(cs->layout == HIBP_LAYOUT_STANDARD) {
+      for(int k = 0; k < 2; k ++) {
+        file = fopen("hashing.bl", "wb");
+        hassert0(file != NULL);
+        hassert0(hibp_bf_save_file((k == 0) ? &bf : &other, file) == HIBP_OK);
+        fclose(file);
+
+        file = fopen("hashing.bl", "rb");
+        hassert0(file != NULL);
+        hassert0(fgetc(file) == 0xb1 && fgetc(file) == ((k == 0) ? 0x01 : 0x00));
+        fclose(file);
+      }
+
+      remove("hashing.bl");
+    }
+
+    hibp_bf_destroy(&other);
+    hibp_bf_destroy(&bf);
+    free(shas);
+  }
+
+  return 0;
+}
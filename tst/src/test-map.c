@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "util.h"
+
+/* Assert that a Bloom filter mapped with hibp_bf_map_file behaves identically to the
+ * filter that was saved, that insertions into a mapped filter don't modify the file, and
+ * that corrupted and truncated files are rejected */
+
+#define MAX_LENGTH 100
+#define MAX_STRINGS 10000
+
+typedef struct {
+  hibp_layout_t layout;
+  size_t n_hash_functions;
+  size_t log2_bits;
+  size_t n_strings;
+  hibp_format_t format;
+  int flags;
+} case_t;
+
+const case_t cases[] = {
+  { HIBP_LAYOUT_STANDARD, 1,  0,  1,     HIBP_FORMAT_COMPACT, 0 },
+  { HIBP_LAYOUT_STANDARD, 5,  5,  50,    HIBP_FORMAT_COMPACT, HIBP_MAP_POPULATE },
+  { HIBP_LAYOUT_STANDARD, 10, 10, 10000, HIBP_FORMAT_COMPACT, HIBP_MAP_HUGEPAGES },
+  { HIBP_LAYOUT_STANDARD, 15, 20, 10000, HIBP_FORMAT_COMPACT, HIBP_MAP_NO_VERIFY },
+  { HIBP_LAYOUT_BLOCKED,  8,  16, 5000,  HIBP_FORMAT_COMPACT, HIBP_MAP_POPULATE | HIBP_MAP_HUGEPAGES },
+  { HIBP_LAYOUT_BLOCKED,  11, 20, 10000, HIBP_FORMAT_COMPACT, HIBP_MAP_NO_VERIFY },
+  { HIBP_LAYOUT_STANDARD, 1,  0,  1,     HIBP_FORMAT_ALIGNED, 0 },
+  { HIBP_LAYOUT_STANDARD, 15, 20, 10000, HIBP_FORMAT_ALIGNED, HIBP_MAP_POPULATE },
+  { HIBP_LAYOUT_BLOCKED,  11, 20, 10000, HIBP_FORMAT_ALIGNED, 0 },
+  { HIBP_LAYOUT_STANDARD, 10, 10, 10000, HIBP_FORMAT_CHUNKED, HIBP_MAP_LAZY_VERIFY },
+  { HIBP_LAYOUT_STANDARD, 3,  26, 10000, HIBP_FORMAT_CHUNKED, HIBP_MAP_LAZY_VERIFY },
+  { HIBP_LAYOUT_BLOCKED,  8,  26, 5000,  HIBP_FORMAT_CHUNKED, 0 },
+  { HIBP_LAYOUT_BLOCKED,  8,  16, 5000,  HIBP_FORMAT_CHUNKED_SHA1, HIBP_MAP_LAZY_VERIFY },
+  { HIBP_LAYOUT_STANDARD, 5,  26, 1000,  HIBP_FORMAT_CHUNKED_SHA1, HIBP_MAP_NO_VERIFY }
+};
+
+const size_t n_cases = sizeof(cases) / sizeof(case_t);
+
+int main(void) {
+  for(size_t c = 0; c < n_cases; c ++) {
+    const size_t n_strings = cases[c].n_strings;
+
+    hibp_bloom_filter_t bf;
+    hibp_status_t status;
+
+    if(cases[c].layout == HIBP_LAYOUT_BLOCKED) {
+      status = hibp_bf_new_blocked(&bf, cases[c].n_hash_functions, cases[c].log2_bits);
+    } else {
+      status = hibp_bf_new(&bf, cases[c].n_hash_functions, cases[c].log2_bits);
+    }
+
+    hassert0(status == HIBP_OK);
+
+    char* strings[MAX_STRINGS];
+    int present[MAX_STRINGS];
+
+    for(size_t i = 0; i < n_strings; i ++) {
+      strings[i] = random_ascii_str(rand() % MAX_LENGTH);
+
+      if(rand() % 2 == 0) {
+        hibp_bf_insert_str(&bf, strings[i]);
+      }
+    }
+
+    for(size_t i = 0; i < n_strings; i ++) {
+      present[i] = hibp_bf_query_str(&bf, strings[i]);
+    }
+
+    char filename[99];
+    sprintf(filename, "map.%d.bl", (int)(c + 1));
+
+    save_file(&bf, filename, cases[c].format);
+    hibp_bf_destroy(&bf);
+
+    status = hibp_bf_map_file(&bf, filename, cases[c].flags);
+    hassert(status == HIBP_OK, "expected HIBP_OK, got %s", status2str(status));
+    hassert0(hibp_bf_verify(&bf) == HIBP_OK);
+
+    hibp_filter_info_t info;
+    hibp_bf_get_info(&info, &bf);
+    hassert0(info.layout == cases[c].layout);
+    hassert0(info.n_hash_functions == cases[c].n_hash_functions);
+    hassert0(info.log2_bits == cases[c].log2_bits);
+
+    /* In the aligned and chunked formats the bit vector, which ends the file, must start
+     * on a page boundary */
+    if(cases[c].format != HIBP_FORMAT_COMPACT) {
+      const long vector_size = (info.bits + 7) / 8;
+      hassert0((file_size(filename) - vector_size) % 4096 == 0);
+    }
+
+    for(size_t i = 0; i < n_strings; i ++) {
+      const int pr = hibp_bf_query_str(&bf, strings[i]);
+
+      hassert(
+        pr == present[i],
+        "expected %s to %s in the mapped Bloom filter, but it %s",
+        strings[i],
+        (present[i] ? "be present" : "not be present"),
+        (pr ? "was" : "wasn't")
+      );
+    }
+
+    /* Insert everything into the mapped filter; the file must be unchanged */
+
+    for(size_t i = 0; i < n_strings; i ++) {
+      hibp_bf_insert_str(&bf, strings[i]);
+      hassert0(hibp_bf_query_str(&bf, strings[i]));
+    }
+
+    /* Lazy verification checks chunks before they're first written to, so it never sees
+     * our insertions */
+    if(cases[c].flags & HIBP_MAP_LAZY_VERIFY) {
+      hassert0(hibp_bf_verify(&bf) == HIBP_OK);
+    }
+
+    hibp_bf_destroy(&bf);
+
+    status = hibp_bf_map_file(&bf, filename, 0);
+    hassert(status == HIBP_OK, "expected HIBP_OK, got %s", status2str(status));
+
+    for(size_t i = 0; i < n_strings; i ++) {
+      hassert0(hibp_bf_query_str(&bf, strings[i]) == present[i]);
+      free(strings[i]);
+    }
+
+    hibp_bf_destroy(&bf);
+
+    /* Flip the last bit of the file, which lies in the bit vector */
+
+    const long size = file_size(filename);
+
+    FILE* file = fopen(filename, "r+b");
+    hassert0(file != NULL);
+    fseek(file, size - 1, SEEK_SET);
+    const int last = fgetc(file);
+    fseek(file, size - 1, SEEK_SET);
+    fputc(last ^ 0x80, file);
+    fclose(file);
+
+    status = hibp_bf_map_file(&bf, filename, 0);
+    hassert(status == HIBP_E_CHECKSUM, "expected HIBP_E_CHECKSUM, got %s", status2str(status));
+
+    status = hibp_bf_map_file(&bf, filename, HIBP_MAP_NO_VERIFY);
+    hassert(status == HIBP_OK, "expected HIBP_OK, got %s", status2str(status));
+    hassert0(hibp_bf_verify(&bf) == HIBP_E_CHECKSUM);
+    hibp_bf_destroy(&bf);
+
+    /* Lazily, the corruption is only noticed up front if it's in the same chunk as the
+     * hash functions, which is always the case for a small filter and never the case for
+     * a large chunked filter */
+    const int multiple_chunks = (cases[c].format == HIBP_FORMAT_CHUNKED ||
+                                 cases[c].format == HIBP_FORMAT_CHUNKED_SHA1) && size > (4 << 20);
+
+    status = hibp_bf_map_file(&bf, filename, HIBP_MAP_LAZY_VERIFY);
+
+    if(multiple_chunks) {
+      hassert(status == HIBP_OK, "expected HIBP_OK, got %s", status2str(status));
+    }
+
+    if(status == HIBP_OK) {
+      hassert0(hibp_bf_verify(&bf) == HIBP_E_CHECKSUM);
+      hibp_bf_destroy(&bf);
+    } else {
+      hassert(status == HIBP_E_CHECKSUM, "expected HIBP_E_CHECKSUM, got %s", status2str(status));
+    }
+
+    /* Truncate the file by one byte */
+
+    file = fopen(filename, "rb");
+    hassert0(file != NULL);
+    char* contents = malloc(size);
+    hassert0(fread(contents, 1, size, file) == (size_t)size);
+    fclose(file);
+
+    file = fopen(filename, "wb");
+    hassert0(file != NULL);
+    fwrite(contents, 1, size - 1, file);
+    fclose(file);
+    free(contents);
+
+    status = hibp_bf_map_file(&bf, filename, HIBP_MAP_NO_VERIFY);
+    hassert(status == HIBP_E_IO, "expected HIBP_E_IO, got %s", status2str(status));
+
+    remove(filename);
+  }
+
+  hibp_bloom_filter_t bf;
+  const hibp_status_t status = hibp_bf_map_file(&bf, "map.nonexistent.bl", 0);
+  hassert(status == HIBP_E_IO, "expected HIBP_E_IO, got %s", status2str(status));
+
+  return 0;
+}
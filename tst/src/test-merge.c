@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+/* Assert that filters built with hibp_bf_new_like over disjoint shares of a set combine
+ * with hibp_bf_union into exactly the filter built over the whole set, that
+ * hibp_bf_intersect yields no false negatives for the common elements, and that filters
+ * with different hash functions can't be combined */
+
+#define MAX_LENGTH 50
+#define MAX_PARTS 8
+
+typedef struct {
+  hibp_layout_t layout;
+  size_t n_hash_functions;
+  size_t log2_bits;
+  size_t n_strings;
+  size_t n_parts;
+} case_t;
+
+const case_t cases[] = {
+  { HIBP_LAYOUT_STANDARD, 1,  0,  10,     2 },
+  { HIBP_LAYOUT_STANDARD, 5,  10, 1000,   3 },
+  { HIBP_LAYOUT_STANDARD, 10, 20, 50000,  8 },
+  { HIBP_LAYOUT_BLOCKED,  8,  16, 10000,  4 },
+  { HIBP_LAYOUT_STANDARD, 3,  26, 100000, 5 },
+  { HIBP_LAYOUT_BLOCKED,  11, 25, 100000, 2 }
+};
+
+const size_t n_cases = sizeof(cases) / sizeof(case_t);
+
+static size_t buffer_size(const case_t* cs) {
+  return hibp_compute_total_size_layout(cs->layout, cs->n_hash_functions, cs->log2_bits) -
+         sizeof(hibp_bloom_filter_t);
+}
+
+static int same(const hibp_bloom_filter_t* x, const hibp_bloom_filter_t* y, const case_t* cs) {
+  return memcmp(x->buffer, y->buffer, buffer_size(cs)) == 0;
+}
+
+int main(void) {
+  for(size_t c = 0; c < n_cases; c ++) {
+    const case_t* cs = &cases[c];
+
+    hibp_bloom_filter_t whole;
+    hibp_status_t status;
+
+    if(cs->layout == HIBP_LAYOUT_BLOCKED) {
+      status = hibp_bf_new_blocked(&whole, cs->n_hash_functions, cs->log2_bits);
+    } else {
+      status = hibp_bf_new(&whole, cs->n_hash_functions, cs->log2_bits);
+    }
+
+    hassert0(status == HIBP_OK);
+
+    hibp_bloom_filter_t parts[MAX_PARTS];
+
+    for(size_t p = 0; p < cs->n_parts; p ++) {
+      hassert0(hibp_bf_new_like(&parts[p], &whole) == HIBP_OK);
+    }
+
+    byte* shas = malloc(cs->n_strings * SHA1_BYTES);
+    hassert0(shas != NULL);
+
+    for(size_t i = 0; i < cs->n_strings; i ++) {
+      char* str = random_ascii_str(rand() % MAX_LENGTH);
+      sha1(shas + i * SHA1_BYTES, strlen(str), (const byte*)str);
+      free(str);
+
+      hibp_bf_insert_sha1(&whole, shas + i * SHA1_BYTES);
+      hibp_bf_insert_sha1(&parts[i % cs->n_parts], shas + i * SHA1_BYTES);
+    }
+
+    /* The union of the parts, accumulated into an empty filter, is the whole */
+
+    hibp_bloom_filter_t merged;
+    hassert0(hibp_bf_new_like(&merged, &parts[0]) == HIBP_OK);
+
+    for(size_t p = 0; p < cs->n_parts; p ++) {
+      status = hibp_bf_union(&merged, &parts[p]);
+      hassert(status == HIBP_OK, "expected HIBP_OK, got %s", status2str(status));
+    }
+
+    hassert(same(&merged, &whole, cs), "expected the union of the parts to be the whole (case %d)", (int)c);
+
+    /* Union with itself is a no-op */
+    hassert0(hibp_bf_union(&merged, &merged) == HIBP_OK);
+    hassert0(same(&merged, &whole, cs));
+
+    /* Intersection: elements common to both operands are present in the result */
+
+    hibp_bloom_filter_t left, right;
+    hassert0(hibp_bf_new_like(&left, &whole) == HIBP_OK);
+    hassert0(hibp_bf_new_like(&right, &whole) == HIBP_OK);
+
+    for(size_t i = 0; i < cs->n_strings; i ++) {
+      const byte* sha = shas + i * SHA1_BYTES;
+
+      if(i % 3 != 1) {
+        hibp_bf_insert_sha1(&left, sha);
+      }
+
+      if(i % 3 != 2) {
+        hibp_bf_insert_sha1(&right, sha);
+      }
+    }
+
+    hassert0(hibp_bf_intersect(&left, &right) == HIBP_OK);
+
+    for(size_t i = 0; i < cs->n_strings; i += 3) {
+      hassert(hibp_bf_query_sha1(&left, shas + i * SHA1_BYTES),
+              "expected element %lu to be present in the intersection", (unsigned long)i);
+    }
+
+    /* Intersecting the whole with any part yields the part, since every bit of a part is
+     * set in the whole */
+    hassert0(hibp_bf_intersect(&merged, &parts[0]) == HIBP_OK);
+    hassert0(same(&merged, &parts[0], cs));
+
+    /* Filters loaded from a saved copy of the template combine as well */
+
+    FILE* file = fopen("merge.bl", "wb");
+    hassert0(file != NULL);
+    hassert0(hibp_bf_save_file(&parts[1], file) == HIBP_OK);
+    fclose(file);
+
+    hibp_bloom_filter_t loaded;
+    status = hibp_bf_map_file(&loaded, "merge.bl", HIBP_MAP_LAZY_VERIFY);
+    hassert(status == HIBP_OK, "expected HIBP_OK, got %s", status2str(status));
+
+    hassert0(hibp_bf_union(&parts[0], &loaded) == HIBP_OK);
+    hassert0(hibp_bf_union(&loaded, &parts[0]) == HIBP_OK);
+    hassert0(same(&loaded, &parts[0], cs));
+
+    hibp_bf_destroy(&loaded);
+    remove("merge.bl");
+
+    /* A filter with the same parameters but fresh hash functions can't be combined */
+
+    hibp_bloom_filter_t other;
+
+    if(cs->layout == HIBP_LAYOUT_BLOCKED) {
+      hassert0(hibp_bf_new_blocked(&other, cs->n_hash_functions, cs->log2_bits) == HIBP_OK);
+    } else {
+      hassert0(hibp_bf_new(&other, cs->n_hash_functions, cs->log2_bits) == HIBP_OK);
+    }
+
+    /* Barring an extraordinary coincidence, that is */
+    if(memcmp(other.buffer, whole.buffer, buffer_size(cs) - ((((size_t)1) << cs->log2_bits) + 7) / 8) != 0) {
+      hassert0(hibp_bf_union(&whole, &other) == HIBP_E_INVAL);
+      hassert0(hibp_bf_intersect(&whole, &other) == HIBP_E_INVAL);
+    }
+
+    hibp_bf_destroy(&other);
+
+    /* Nor can one with different parameters */
+
+    hassert0(hibp_bf_new_blocked(&other, 2, 12) == HIBP_OK);
+    hassert0(hibp_bf_union(&whole, &other) == HIBP_E_INVAL);
+    hibp_bf_destroy(&other);
+
+    for(size_t p = 0; p < cs->n_parts; p ++) {
+      hibp_bf_destroy(&parts[p]);
+    }
+
+    hibp_bf_destroy(&left);
+    hibp_bf_destroy(&right);
+    hibp_bf_destroy(&merged);
+    hibp_bf_destroy(&whole);
+    free(shas);
+  }
+
+  return 0;
+}
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "util.h"
+
+/* Assert that a Bloom filter paged with hibp_bf_page_file answers queries, single and
+ * batched, exactly as the filter that was saved does, even when its cache holds only a
+ * fraction of it, and that bad parameters, compressed files, and truncated files are
+ * rejected */
+
+typedef struct {
+  hibp_layout_t layout;
+  size_t n_hash_functions;
+  size_t log2_bits;
+  size_t n_inserts;
+  hibp_format_t format;
+  hibp_page_params_t params;
+} case_t;
+
+const case_t cases[] = {
+  { HIBP_LAYOUT_STANDARD, 1,  0,  1,     HIBP_FORMAT_COMPACT, { 0, 0, 0 } },
+  { HIBP_LAYOUT_STANDARD, 10, 20, 50000, HIBP_FORMAT_COMPACT, { 1 << 16, 12, 4 } },
+  { HIBP_LAYOUT_STANDARD, 7,  22, 90000, HIBP_FORMAT_ALIGNED, { 1 << 14, 9, 1 } },
+  { HIBP_LAYOUT_BLOCKED,  8,  16, 5000,  HIBP_FORMAT_COMPACT, { 0, 16, 0 } },
+  { HIBP_LAYOUT_BLOCKED,  8,  22, 90000, HIBP_FORMAT_ALIGNED, { 1 << 16, 12, 8 } },
+  { HIBP_LAYOUT_BLOCKED,  11, 20, 50000, HIBP_FORMAT_CHUNKED, { 1 << 17, 13, 0 } }
+};
+
+const size_t n_cases = sizeof(cases) / sizeof(case_t);
+
+#define MAX_INSERTS 90000
+#define TRIALS 100000
+
+int main(void) {
+  byte* shas = malloc(MAX_INSERTS * SHA1_BYTES);
+  byte* trials = malloc(TRIALS * SHA1_BYTES);
+  int* results = malloc(TRIALS * sizeof(int));
+  hassert0(shas != NULL && trials != NULL && results != NULL);
+
+  for(size_t c = 0; c < n_cases; c ++) {
+    const case_t* cs = &cases[c];
+
+    hibp_bloom_filter_t bf;
+    hibp_status_t status;
+
+    if(cs->layout == HIBP_LAYOUT_BLOCKED) {
+      status = hibp_bf_new_blocked(&bf, cs->n_hash_functions, cs->log2_bits);
+    } else {
+      status = hibp_bf_new(&bf, cs->n_hash_functions, cs->log2_bits);
+    }
+
+    hassert0(status == HIBP_OK);
+
+    random_shas(shas, cs->n_inserts);
+
+    for(size_t i = 0; i < cs->n_inserts; i ++) {
+      hibp_bf_insert_sha1(&bf, shas + i * SHA1_BYTES);
+    }
+
+    char filename[99];
+    sprintf(filename, "paged.%d.bl", (int)(c + 1));
+    save_file(&bf, filename, cs->format);
+
+    hibp_bloom_filter_t paged;
+    status = hibp_bf_page_file(&paged, filename, &cs->params);
+    hassert(status == HIBP_OK, "expected HIBP_OK, got %s (case %d)", status2str(status), (int)c);
+
+    hibp_filter_info_t info;
+    hibp_bf_get_info(&info, &paged);
+    hassert0(info.layout == cs->layout);
+    hassert0(info.n_hash_functions == cs->n_hash_functions);
+    hassert0(info.log2_bits == cs->log2_bits);
+
+    for(size_t i = 0; i < cs->n_inserts; i ++) {
+      hassert(hibp_bf_query_sha1(&paged, shas + i * SHA1_BYTES),
+              "expected element %lu to be present (case %d)", (unsigned long)i, (int)c);
+    }
+
+    /* Batched queries prefetch their pages, and agree with unbatched ones and with the
+     * filter in memory */
+    random_shas(trials, TRIALS);
+    hibp_bf_query_sha1_batch(&paged, TRIALS, trials, results);
+
+    for(size_t i = 0; i < TRIALS; i ++) {
+      const byte* sha = trials + i * SHA1_BYTES;
+      const int expected = hibp_bf_query_sha1(&bf, sha);
+
+      hassert(results[i] == expected && hibp_bf_query_sha1(&paged, sha) == expected,
+              "expected query %lu to agree with the filter in memory (case %d)", (unsigned long)i, (int)c);
+    }
+
+    size_t hits;
+    size_t misses;
+    size_t errors;
+    hibp_bf_page_counts(&paged, &hits, &misses, &errors);
+
+    hassert(misses > 0 && hits > 0 && errors == 0, "expected hits and misses but no errors, not %lu, %lu, %lu (case %d)",
+            (unsigned long)hits, (unsigned long)misses, (unsigned long)errors, (int)c);
+    hassert0(hibp_bf_verify(&paged) == HIBP_OK);
+
+    hibp_bf_destroy(&paged);
+    hibp_bf_destroy(&bf);
+
+    /* Truncating the file by a byte is noticed up front */
+    const long size = file_size(filename);
+    FILE* file = fopen(filename, "rb");
+    hassert0(file != NULL);
+    char* contents = malloc(size);
+    hassert0(fread(contents, 1, size, file) == (size_t)size);
+    fclose(file);
+
+    file = fopen(filename, "wb");
+    hassert0(file != NULL);
+    fwrite(contents, 1, size - 1, file);
+    fclose(file);
+    free(contents);
+
+    status = hibp_bf_page_file(&paged, filename, NULL);
+    hassert(status == HIBP_E_IO, "expected HIBP_E_IO, got %s (case %d)", status2str(status), (int)c);
+
+    remove(filename);
+  }
+
+  /* Pages must be 512 bytes to 64 KiB, and compressed files can't be paged */
+  hibp_bloom_filter_t bf;
+  hassert0(hibp_bf_new_blocked(&bf, 8, 16) == HIBP_OK);
+  save_file(&bf, "paged.bl", HIBP_FORMAT_COMPACT);
+
+  hibp_bloom_filter_t paged;
+  const hibp_page_params_t small = { 0, 8, 0 };
+  const hibp_page_params_t large = { 0, 17, 0 };
+  hassert0(hibp_bf_page_file(&paged, "paged.bl", &small) == HIBP_E_INVAL);
+  hassert0(hibp_bf_page_file(&paged, "paged.bl", &large) == HIBP_E_INVAL);
+  hassert0(hibp_bf_page_file(&paged, "paged.missing.bl", NULL) == HIBP_E_IO);
+
+  save_file(&bf, "paged.bl", HIBP_FORMAT_COMPRESSED);
+  hassert0(hibp_bf_page_file(&paged, "paged.bl", NULL) == HIBP_E_VERSION);
+
+  remove("paged.bl");
+  hibp_bf_destroy(&bf);
+
+  free(shas);
+  free(trials);
+  free(results);
+
+  return 0;
+}
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+/* Assert that the parallel insertion functions build exactly the same filter as the
+ * serial ones, regardless of the number of threads */
+
+#define MAX_LENGTH 50
+#define MAX_INPUTS 100000
+
+typedef struct {
+  hibp_layout_t layout;
+  size_t n_hash_functions;
+  size_t log2_bits;
+  size_t n_inputs;
+  size_t n_threads;
+} case_t;
+
+const case_t cases[] = {
+  { HIBP_LAYOUT_STANDARD, 1,   0,  0,      4 },
+  { HIBP_LAYOUT_STANDARD, 1,   1,  1,      4 },
+  { HIBP_LAYOUT_STANDARD, 5,   10, 5000,   1 },
+  { HIBP_LAYOUT_STANDARD, 5,   10, 5000,   3 },
+  { HIBP_LAYOUT_STANDARD, 10,  20, 100000, 0 },
+  { HIBP_LAYOUT_STANDARD, 10,  20, 100000, 8 },
+  { HIBP_LAYOUT_STANDARD, 600, 10, 1000,   4 },
+  { HIBP_LAYOUT_BLOCKED,  8,   16, 100000, 4 },
+  { HIBP_LAYOUT_BLOCKED,  11,  20, 50000,  0 }
+};
+
+const size_t n_cases = sizeof(cases) / sizeof(case_t);
+
+/* Trivial deterministic PRNG, so that filters created from the same seed get the same hash
+ * functions */
+static size_t lcg(void* ctx, size_t upper_bound) {
+  unsigned long long* state = (unsigned long long*)ctx;
+  (*state) = (*state) * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (size_t)((*state) >> 33) % upper_bound;
+}
+
+static void new_filter(hibp_bloom_filter_t* bf, const case_t* c, unsigned long long seed) {
+  const hibp_status_t status = (c->layout == HIBP_LAYOUT_BLOCKED)
+    ? hibp_bf_new_blocked_prng(bf, c->n_hash_functions, c->log2_bits, &seed, lcg)
+    : hibp_bf_new_prng(bf, c->n_hash_functions, c->log2_bits, &seed, lcg);
+
+  hassert0(status == HIBP_OK);
+}
+
+/* For comparing filters byte for byte */
+static int membuf_putc(int c, void* ctx) {
+  membuf_t* mb = (membuf_t*)ctx;
+
+  if(mb->size % 4096 == 0) {
+    mb->buffer = realloc(mb->buffer, mb->size + 4096);
+    hassert0(mb->buffer != NULL);
+  }
+
+  mb->buffer[mb->size ++] = (byte)c;
+  return c;
+}
+
+static void serialize(membuf_t* mb, const hibp_bloom_filter_t* bf) {
+  mb->buffer = NULL;
+  mb->size = 0;
+  mb->position = 0;
+  hassert0(hibp_bf_save_stream(bf, mb, membuf_putc) == HIBP_OK);
+}
+
+static char* strings[MAX_INPUTS];
+static size_t sizes[MAX_INPUTS];
+static const byte* buffers[MAX_INPUTS];
+static byte shas[MAX_INPUTS * SHA1_BYTES];
+
+int main(void) {
+  for(size_t c = 0; c < n_cases; c ++) {
+    const size_t n_inputs = cases[c].n_inputs;
+
+    for(size_t i = 0; i < n_inputs; i ++) {
+      strings[i] = random_ascii_str(rand() % MAX_LENGTH);
+      sizes[i] = strlen(strings[i]);
+      buffers[i] = (const byte*)strings[i];
+      sha1(shas + i * SHA1_BYTES, sizes[i], buffers[i]);
+    }
+
+    const unsigned long long seed = rand();
+
+    hibp_bloom_filter_t serial;
+    new_filter(&serial, &cases[c], seed);
+    hibp_bf_insert_sha1_batch(&serial, n_inputs, shas);
+
+    hibp_bloom_filter_t from_shas;
+    new_filter(&from_shas, &cases[c], seed);
+    hibp_bf_insert_sha1_parallel(&from_shas, n_inputs, shas, cases[c].n_threads);
+
+    hibp_bloom_filter_t from_strings;
+    new_filter(&from_strings, &cases[c], seed);
+    hibp_bf_insert_parallel(&from_strings, n_inputs, sizes, buffers, cases[c].n_threads);
+
+    membuf_t expected, actual_shas, actual_strings;
+    serialize(&expected, &serial);
+    serialize(&actual_shas, &from_shas);
+    serialize(&actual_strings, &from_strings);
+
+    hassert(
+      expected.size == actual_shas.size && memcmp(expected.buffer, actual_shas.buffer, expected.size) == 0,
+      "expected hibp_bf_insert_sha1_parallel to agree with hibp_bf_insert_sha1_batch (case %d)",
+      (int)c
+    );
+
+    hassert(
+      expected.size == actual_strings.size &&
+        memcmp(expected.buffer, actual_strings.buffer, expected.size) == 0,
+      "expected hibp_bf_insert_parallel to agree with hibp_bf_insert_sha1_batch (case %d)",
+      (int)c
+    );
+
+    for(size_t i = 0; i < n_inputs; i ++) {
+      hassert(hibp_bf_query_sha1(&from_shas, shas + i * SHA1_BYTES), "expected %s to be present", strings[i]);
+      free(strings[i]);
+    }
+
+    free(expected.buffer);
+    free(actual_shas.buffer);
+    free(actual_strings.buffer);
+
+    hibp_bf_destroy(&serial);
+    hibp_bf_destroy(&from_shas);
+    hibp_bf_destroy(&from_strings);
+  }
+
+  return 0;
+}
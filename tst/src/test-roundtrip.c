@@ -15,16 +15,31 @@ typedef struct {
   size_t n_hash_functions;
   size_t log2_bits;
   size_t n_strings;
+  hibp_format_t format;
 } case_t;
 
 const case_t cases[] = {
-  { 1,  0,  1 },
-  { 1,  1,  1 },
-  { 5,  5,  50 },
-  { 5,  5,  1000 },
-  { 5,  10, 10000 },
-  { 10, 10, 10000 },
-  { 15, 20, 10000 }
+  { 1,  0,  1,     HIBP_FORMAT_COMPACT },
+  { 1,  1,  1,     HIBP_FORMAT_COMPACT },
+  { 5,  5,  50,    HIBP_FORMAT_COMPACT },
+  { 5,  5,  1000,  HIBP_FORMAT_COMPACT },
+  { 5,  10, 10000, HIBP_FORMAT_COMPACT },
+  { 10, 10, 10000, HIBP_FORMAT_COMPACT },
+  { 15, 20, 10000, HIBP_FORMAT_COMPACT },
+  { 1,  0,  1,     HIBP_FORMAT_ALIGNED },
+  { 5,  5,  1000,  HIBP_FORMAT_ALIGNED },
+  { 10, 10, 10000, HIBP_FORMAT_ALIGNED },
+  { 15, 20, 10000, HIBP_FORMAT_ALIGNED },
+  { 1,  0,  1,     HIBP_FORMAT_CHUNKED },
+  { 5,  10, 10000, HIBP_FORMAT_CHUNKED },
+  { 3,  26, 10000, HIBP_FORMAT_CHUNKED },
+  { 5,  10, 1000,  HIBP_FORMAT_CHUNKED_SHA1 },
+  { 3,  26, 1000,  HIBP_FORMAT_CHUNKED_SHA1 },
+  { 1,  0,  1,     HIBP_FORMAT_COMPRESSED },
+  { 5,  5,  1000,  HIBP_FORMAT_COMPRESSED },
+  { 10, 20, 10000, HIBP_FORMAT_COMPRESSED },
+  { 3,  28, 10000, HIBP_FORMAT_COMPRESSED },
+  { 1,  12, 10000, HIBP_FORMAT_COMPRESSED }
 };
 
 const size_t n_cases = sizeof(cases) / sizeof(case_t);
@@ -59,7 +74,7 @@ int main(void) {
 
     FILE* outfile = fopen(filename, "wb");
     hassert0(outfile != NULL);
-    hassert0(hibp_bf_save_file(&bf, outfile) == HIBP_OK);
+    hassert0(hibp_bf_save_file_format(&bf, outfile, cases[c].format) == HIBP_OK);
     fclose(outfile);
     hibp_bf_destroy(&bf);
 
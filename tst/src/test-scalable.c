@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "util.h"
+
+/* Assert that a scalable filter grows new layers as insertions exceed its planned
+ * capacity, without false negatives and without its false positive rate exceeding the
+ * bound it was created with, that batched queries agree with unbatched ones, and that it
+ * survives being saved and loaded (carrying on inserting afterwards), but not
+ * corruption */
+
+typedef struct {
+  hibp_layout_t layout;
+  hibp_hashing_t hashing;
+  size_t capacity;
+  double fp;
+  size_t n_inserts;
+} case_t;
+
+const case_t cases[] = {
+  { HIBP_LAYOUT_STANDARD, HIBP_HASHING_RANDOM, 1,     0.1,   1000 },
+  { HIBP_LAYOUT_STANDARD, HIBP_HASHING_RANDOM, 1000,  0.01,  1000 },
+  { HIBP_LAYOUT_STANDARD, HIBP_HASHING_RANDOM, 1000,  0.01,  100000 },
+  { HIBP_LAYOUT_STANDARD, HIBP_HASHING_DOUBLE, 5000,  0.001, 200000 },
+  { HIBP_LAYOUT_BLOCKED,  HIBP_HASHING_RANDOM, 10000, 0.01,  300000 },
+  { HIBP_LAYOUT_BLOCKED,  HIBP_HASHING_DOUBLE, 2000,  0.05,  50000 }
+};
+
+const size_t n_cases = sizeof(cases) / sizeof(case_t);
+
+#define MAX_INSERTS 300000
+#define TRIALS 1000000
+
+int main(void) {
+  byte* shas = malloc(MAX_INSERTS * SHA1_BYTES);
+  byte* trials = malloc(TRIALS * SHA1_BYTES);
+  int* results = malloc(TRIALS * sizeof(int));
+  hassert0(shas != NULL && trials != NULL && results != NULL);
+
+  hibp_scalable_filter_t sc;
+  hassert0(hibp_sc_new(&sc, HIBP_LAYOUT_STANDARD, HIBP_HASHING_RANDOM, 0, 0.01) == HIBP_E_INVAL);
+  hassert0(hibp_sc_new(&sc, HIBP_LAYOUT_STANDARD, HIBP_HASHING_RANDOM, 100, 0) == HIBP_E_INVAL);
+  hassert0(hibp_sc_new(&sc, HIBP_LAYOUT_STANDARD, HIBP_HASHING_RANDOM, 100, 1) == HIBP_E_INVAL);
+
+  for(size_t c = 0; c < n_cases; c ++) {
+    const case_t* cs = &cases[c];
+    const size_t n = cs->n_inserts;
+    const size_t half = n / 2;
+
+    random_shas(shas, n);
+
+    hassert0(hibp_sc_new(&sc, cs->layout, cs->hashing, cs->capacity, cs->fp) == HIBP_OK);
+    hassert0(hibp_sc_n_layers(&sc) == 1);
+
+    for(size_t i = 0; i < half; i ++) {
+      hassert0(hibp_sc_insert_sha1(&sc, shas + i * SHA1_BYTES) == HIBP_OK);
+    }
+
+    /* Duplicates aren't counted */
+    const size_t count = hibp_sc_count(&sc);
+
+    for(size_t i = 0; i < half; i ++) {
+      hassert0(hibp_sc_insert_sha1(&sc, shas + i * SHA1_BYTES) == HIBP_OK);
+    }
+
+    hassert(hibp_sc_count(&sc) == count, "expected duplicates to be skipped (case %d)", (int)c);
+
+    /* Save and reload, and carry on inserting into the reloaded filter */
+    membuf_t mb = { NULL, 0, 0 };
+    hassert0(hibp_sc_save_writer(&sc, &mb, mb_write) == HIBP_OK);
+
+    hibp_scalable_filter_t loaded;
+    hassert0(hibp_sc_load_reader(&loaded, &mb, mb_read) == HIBP_OK);
+    hassert0(hibp_sc_n_layers(&loaded) == hibp_sc_n_layers(&sc));
+    hassert0(hibp_sc_count(&loaded) == count);
+
+    for(size_t i = 0; i < hibp_sc_n_layers(&sc); i ++) {
+      const hibp_bloom_filter_t* x = hibp_sc_layer(&sc, i);
+      const hibp_bloom_filter_t* y = hibp_sc_layer(&loaded, i);
+      const size_t size = hibp_compute_total_size_bits(x->layout, x->hashing, x->n_hash_functions, x->bits) - sizeof(*x);
+
+      hassert(x->bits == y->bits && memcmp(x->buffer, y->buffer, size) == 0,
+              "expected layer %d to be reloaded intact (case %d)", (int)i, (int)c);
+    }
+
+    hassert0(hibp_sc_estimated_fpr(&loaded) == hibp_sc_estimated_fpr(&sc));
+
+    hibp_sc_destroy(&sc);
+    sc = loaded;
+
+    for(size_t i = half; i < n; i ++) {
+      hassert0(hibp_sc_insert_sha1(&sc, shas + i * SHA1_BYTES) == HIBP_OK);
+    }
+
+    hassert0(hibp_sc_count(&sc) <= n);
+
+    if(n > 4 * cs->capacity) {
+      hassert(hibp_sc_n_layers(&sc) > 1, "expected the filter to grow (case %d)", (int)c);
+    }
+
+    for(size_t i = 0; i < n; i ++) {
+      hassert(hibp_sc_query_sha1(&sc, shas + i * SHA1_BYTES),
+              "expected element %lu to be present (case %d)", (unsigned long)i, (int)c);
+    }
+
+    /* The rate of false positives is within five standard deviations of the bound, and
+     * batched queries agree with unbatched ones */
+    random_shas(trials, TRIALS);
+    hibp_sc_query_sha1_batch(&sc, TRIALS, trials, results);
+
+    size_t positives = 0;
+
+    for(size_t i = 0; i < TRIALS; i ++) {
+      hassert(results[i] == hibp_sc_query_sha1(&sc, trials + i * SHA1_BYTES),
+              "expected batched query %lu to agree (case %d)", (unsigned long)i, (int)c);
+      positives += results[i];
+    }
+
+    const double rate = (double)positives / TRIALS;
+    const double sigma = sqrt(cs->fp * (1 - cs->fp) / TRIALS);
+
+    hassert(rate <= cs->fp + 5 * sigma, "expected a false positive rate of at most %f, not %f (case %d)",
+            cs->fp, rate, (int)c);
+
+    if(cs->layout == HIBP_LAYOUT_STANDARD) {
+      const double estimate = hibp_sc_estimated_fpr(&sc);
+      hassert(estimate <= cs->fp && fabs(estimate - rate) <= 5 * sigma,
+              "expected an estimated false positive rate near %f, not %f (case %d)", rate, estimate, (int)c);
+    }
+
+    /* Corrupting the header is caught, as is a plain filter masquerading as a scalable
+     * one */
+    mb.size = 0;
+    mb.position = 0;
+    hassert0(hibp_sc_save_writer(&sc, &mb, mb_write) == HIBP_OK);
+
+    mb.buffer[6] ^= 0x01;
+    hassert(hibp_sc_load_reader(&loaded, &mb, mb_read) == HIBP_E_CHECKSUM,
+            "expected corruption to be caught (case %d)", (int)c);
+
+    mb.size = 0;
+    mb.position = 0;
+    hassert0(hibp_bf_save_writer(hibp_sc_layer(&sc, 0), &mb, mb_write) == HIBP_OK);
+    hassert0(hibp_sc_load_reader(&loaded, &mb, mb_read) == HIBP_E_VERSION);
+
+    free(mb.buffer);
+    hibp_sc_destroy(&sc);
+  }
+
+  free(shas);
+  free(trials);
+  free(results);
+
+  return 0;
+}
@@ -0,0 +1,287 @@
+/* For kill, usleep, and MSG_NOSIGNAL */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "util.h"
+#include "server.h"
+
+/* Assert that the server answers every request pipelined on a connection, in order, even
+ * when the responses far outstrip what it buffers per connection, the requests fill its
+ * input buffer, and the client half-closes the connection straight after its last
+ * request; and that it rejects a malformed request and then closes the connection */
+
+#define LOG2_SHARDS 4
+#define N_SHARDS (1 << LOG2_SHARDS)
+#define N_INSERTS 200000
+
+/* Each round asks for every shard, which is a few hundred KiB of responses, and queries a
+ * batch, which is 20 KiB of requests */
+#define N_ROUNDS 16
+#define BATCH 1024
+
+#define HEADER_SIZE 8
+
+static void put_header(byte* header, int type, size_t argument) {
+  memset(header, 0, HEADER_SIZE);
+  header[0] = (byte)type;
+  header[4] = (byte)(argument >> 24);
+  header[5] = (byte)(argument >> 16);
+  header[6] = (byte)(argument >> 8);
+  header[7] = (byte)argument;
+}
+
+static size_t get_be32(const byte* p) {
+  return ((size_t)p[0] << 24) | ((size_t)p[1] << 16) | ((size_t)p[2] << 8) | (size_t)p[3];
+}
+
+/* A port on the loopback interface that was free a moment ago. TCP rather than a Unix
+ * socket, since loopback TCP buffers can grow large enough for the server to send all the
+ * responses it buffers at once, which is when it's most tempted to close a half-closed
+ * connection early */
+static in_port_t free_port(void) {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+
+  const int fd = socket(AF_INET, SOCK_STREAM, 0);
+  socklen_t size = sizeof(addr);
+  hassert0(fd >= 0 && bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+  hassert0(getsockname(fd, (struct sockaddr*)&addr, &size) == 0);
+  close(fd);
+
+  return addr.sin_port;
+}
+
+static int connect_to_server(in_port_t port) {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = port;
+
+  /* The server takes a moment to load the filter and start listening */
+  for(size_t attempt = 0; attempt < 1000; attempt ++) {
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    hassert0(fd >= 0);
+
+    if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+      return fd;
+    }
+
+    close(fd);
+    usleep(10000);
+  }
+
+  hassert(0, "expected the server to start listening");
+  return -1;
+}
+
+/* Sends the requests, then half-closes the connection, while the main thread reads the
+ * responses (lest both ends block on full buffers) */
+typedef struct {
+  int fd;
+  const byte* requests;
+  size_t size;
+} sender_t;
+
+static void* send_requests(void* ctx) {
+  const sender_t* s = (const sender_t*)ctx;
+
+  for(size_t sent = 0; sent < s->size; ) {
+    const ssize_t n = send(s->fd, s->requests + sent, s->size - sent, MSG_NOSIGNAL);
+    hassert(n > 0 || errno == EINTR, "expected to send every request, not %s", strerror(errno));
+    sent += (n > 0) ? (size_t)n : 0;
+  }
+
+  hassert0(shutdown(s->fd, SHUT_WR) == 0);
+
+  return NULL;
+}
+
+/* Read until the server closes the connection */
+static membuf_t receive_all(int fd) {
+  membuf_t mb = { NULL, 0, 0 };
+  byte buffer[1 << 16];
+
+  for(;;) {
+    const ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+
+    if(n == 0) {
+      return mb;
+    }
+
+    hassert(n > 0 || errno == EINTR, "expected to receive every response, not %s", strerror(errno));
+
+    if(n > 0) {
+      mb_write(&mb, buffer, (size_t)n);
+    }
+  }
+}
+
+/* Check the response at *offset within responses, and skip past it */
+static void expect_response(const membuf_t* responses, size_t* offset, int status, const byte* payload,
+                            size_t payload_size, size_t k) {
+  hassert(responses->size - *offset >= HEADER_SIZE, "expected response %lu, but the connection was closed",
+          (unsigned long)k);
+
+  const byte* header = responses->buffer + *offset;
+  hassert(header[0] == status && header[1] == 0 && header[2] == 0 && header[3] == 0,
+          "expected response %lu to have status %d, not %d", (unsigned long)k, status, (int)header[0]);
+  hassert(get_be32(header + 4) == payload_size && responses->size - *offset - HEADER_SIZE >= payload_size,
+          "expected response %lu to have %lu bytes of payload", (unsigned long)k, (unsigned long)payload_size);
+  hassert(memcmp(header + HEADER_SIZE, payload, payload_size) == 0, "expected response %lu to match",
+          (unsigned long)k);
+
+  *offset += HEADER_SIZE + payload_size;
+}
+
+int main(void) {
+  hibp_sharded_filter_t sf;
+  hassert0(hibp_sf_new(&sf, LOG2_SHARDS, 7, 18) == HIBP_OK);
+
+  byte* shas = malloc(N_INSERTS * SHA1_BYTES);
+  hassert0(shas != NULL);
+  random_shas(shas, N_INSERTS);
+  hibp_sf_insert_sha1_parallel(&sf, N_INSERTS, shas, 0);
+
+  hassert0(hibp_sf_save_file(&sf, "server.sf", HIBP_FORMAT_COMPACT) == HIBP_OK);
+
+  /* What SERVER_RANGE should yield for each shard */
+  membuf_t ranges[N_SHARDS];
+
+  for(size_t i = 0; i < N_SHARDS; i ++) {
+    ranges[i].buffer = NULL;
+    ranges[i].size = 0;
+    ranges[i].position = 0;
+    hassert0(hibp_bf_save_writer_format(hibp_sf_shard(&sf, i), &ranges[i], mb_write, HIBP_FORMAT_COMPRESSED) ==
+             HIBP_OK);
+  }
+
+  /* Half of each batch was inserted, and the rest (mostly) wasn't */
+  byte* batches = malloc(N_ROUNDS * BATCH * SHA1_BYTES);
+  hassert0(batches != NULL);
+  random_shas(batches, N_ROUNDS * BATCH);
+
+  for(size_t i = 0; i < N_ROUNDS * BATCH; i += 2) {
+    memcpy(batches + i * SHA1_BYTES, shas + (rand() % N_INSERTS) * SHA1_BYTES, SHA1_BYTES);
+  }
+
+  /* Every round's requests, and finally a prefix out of range */
+  const size_t round_size = N_SHARDS * HEADER_SIZE + HEADER_SIZE + BATCH * SHA1_BYTES;
+  const size_t requests_size = N_ROUNDS * round_size + HEADER_SIZE;
+  byte* requests = malloc(requests_size);
+  hassert0(requests != NULL);
+
+  byte* request = requests;
+
+  for(size_t r = 0; r < N_ROUNDS; r ++) {
+    for(size_t i = 0; i < N_SHARDS; i ++) {
+      put_header(request, SERVER_RANGE, i);
+      request += HEADER_SIZE;
+    }
+
+    put_header(request, SERVER_QUERY, BATCH);
+    memcpy(request + HEADER_SIZE, batches + r * BATCH * SHA1_BYTES, BATCH * SHA1_BYTES);
+    request += HEADER_SIZE + BATCH * SHA1_BYTES;
+  }
+
+  put_header(request, SERVER_RANGE, N_SHARDS);
+
+  const in_port_t port = free_port();
+  char address[99];
+  sprintf(address, "127.0.0.1:%d", (int)ntohs(port));
+
+  const pid_t server = fork();
+  hassert0(server >= 0);
+
+  if(server == 0) {
+    _exit(server_run(address, "server.sf", 2));
+  }
+
+  /* Pipeline everything, half-close, and expect every response */
+  const int fd = connect_to_server(port);
+
+  sender_t sender = { fd, requests, requests_size };
+  pthread_t thread;
+  hassert0(pthread_create(&thread, NULL, send_requests, &sender) == 0);
+
+  membuf_t responses = receive_all(fd);
+  pthread_join(thread, NULL);
+  close(fd);
+
+  byte bitmap[BATCH / 8];
+  size_t offset = 0;
+  size_t k = 0;
+
+  for(size_t r = 0; r < N_ROUNDS; r ++) {
+    for(size_t i = 0; i < N_SHARDS; i ++) {
+      expect_response(&responses, &offset, SERVER_OK, ranges[i].buffer, ranges[i].size, k ++);
+    }
+
+    memset(bitmap, 0, sizeof(bitmap));
+
+    for(size_t i = 0; i < BATCH; i ++) {
+      const int present = hibp_sf_query_sha1(&sf, batches + (r * BATCH + i) * SHA1_BYTES);
+      bitmap[i / 8] |= (byte)(present << (i % 8));
+    }
+
+    expect_response(&responses, &offset, SERVER_OK, bitmap, sizeof(bitmap), k ++);
+  }
+
+  expect_response(&responses, &offset, SERVER_E_NOT_FOUND, NULL, 0, k ++);
+  hassert(offset == responses.size, "expected no more than %lu responses", (unsigned long)k);
+
+  free(responses.buffer);
+
+  /* A malformed request is answered, and the connection closed, without the client
+   * closing its end */
+  const int bad = connect_to_server(port);
+  byte header[HEADER_SIZE];
+  put_header(header, SERVER_QUERY, SERVER_MAX_BATCH + 1);
+  hassert0(send(bad, header, HEADER_SIZE, MSG_NOSIGNAL) == HEADER_SIZE);
+
+  responses = receive_all(bad);
+  close(bad);
+
+  offset = 0;
+  expect_response(&responses, &offset, SERVER_E_BAD_REQUEST, NULL, 0, 0);
+  hassert0(offset == responses.size);
+  free(responses.buffer);
+
+  /* SIGTERM stops the server cleanly */
+  hassert0(kill(server, SIGTERM) == 0);
+
+  int wstatus;
+  hassert0(waitpid(server, &wstatus, 0) == server);
+  hassert(WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0, "expected the server to exit cleanly");
+
+  for(size_t i = 0; i < N_SHARDS; i ++) {
+    free(ranges[i].buffer);
+
+    char filename[99];
+    sprintf(filename, "server.sf.%x", (unsigned)i);
+    remove(filename);
+  }
+
+  remove("server.sf");
+  hibp_sf_destroy(&sf);
+  free(shas);
+  free(batches);
+  free(requests);
+
+  return 0;
+}
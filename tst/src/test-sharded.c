@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+/* Assert that a sharded filter routes every element to the shard named by its prefix, that
+ * the shards' hash functions steer clear of the prefix, that it survives being saved and
+ * loaded (in part or in full), that parallel insertion and batched queries agree with
+ * their serial counterparts, and that corrupt manifests and missing shards are rejected */
+
+#define MAX_STRINGS 20000
+
+typedef struct {
+  hibp_layout_t layout;
+  size_t log2_shards;
+  size_t n_hash_functions;
+  size_t log2_bits;
+  size_t n_strings;
+  hibp_format_t format;
+} case_t;
+
+const case_t cases[] = {
+  { HIBP_LAYOUT_STANDARD, 0,  5,  10, 1000,  HIBP_FORMAT_COMPACT },
+  { HIBP_LAYOUT_STANDARD, 1,  5,  10, 1000,  HIBP_FORMAT_COMPACT },
+  { HIBP_LAYOUT_STANDARD, 4,  10, 16, 20000, HIBP_FORMAT_ALIGNED },
+  { HIBP_LAYOUT_BLOCKED,  5,  8,  16, 20000, HIBP_FORMAT_CHUNKED },
+  { HIBP_LAYOUT_STANDARD, 8,  7,  12, 20000, HIBP_FORMAT_COMPRESSED },
+  { HIBP_LAYOUT_STANDARD, 10, 3,  1,  5000,  HIBP_FORMAT_COMPACT }
+};
+
+const size_t n_cases = sizeof(cases) / sizeof(case_t);
+
+static void check(const hibp_sharded_filter_t* sf, const byte* shas, const int* present,
+                  size_t n, size_t first, size_t last) {
+  for(size_t i = 0; i < n; i ++) {
+    const byte* sha = shas + i * SHA1_BYTES;
+    const size_t shard = hibp_sf_shard_of(sf, sha);
+    const int loaded = (first <= shard && shard < last);
+
+    /* Elements of shards that aren't loaded are always reported as present */
+    const int expected = loaded ? present[i] : 1;
+    const int pr = hibp_sf_query_sha1(sf, sha);
+
+    hassert(pr == expected, "expected query for element %lu (shard %lu) to yield %d, got %d",
+            (unsigned long)i, (unsigned long)shard, expected, pr);
+  }
+
+  int* results = malloc(n * sizeof(int));
+  hassert0(results != NULL);
+  hibp_sf_query_sha1_batch(sf, n, shas, results);
+
+  for(size_t i = 0; i < n; i ++) {
+    hassert(results[i] == hibp_sf_query_sha1(sf, shas + i * SHA1_BYTES),
+            "expected hibp_sf_query_sha1_batch to agree with hibp_sf_query_sha1 (element %lu)",
+            (unsigned long)i);
+  }
+
+  free(results);
+}
+
+/* Mirrors the naming scheme of hibp_sf_save_file */
+static void shard_name(char* name, const char* filename, size_t log2_shards, size_t i) {
+  const int digits = (log2_shards == 0) ? 1 : (int)((log2_shards + 3) / 4);
+  sprintf(name, "%s.%0*lx", filename, digits, (unsigned long)i);
+}
+
+static void remove_all(const char* filename, size_t log2_shards) {
+  char name[99];
+
+  for(size_t i = 0; i < ((size_t)1 << log2_shards); i ++) {
+    shard_name(name, filename, log2_shards, i);
+    remove(name);
+  }
+
+  remove(filename);
+}
+
+int main(void) {
+  for(size_t c = 0; c < n_cases; c ++) {
+    const case_t* cs = &cases[c];
+
+    hibp_sharded_filter_t sf;
+    hibp_status_t status;
+
+    if(cs->layout == HIBP_LAYOUT_BLOCKED) {
+      status = hibp_sf_new_blocked(&sf, cs->log2_shards, cs->n_hash_functions, cs->log2_bits);
+    } else {
+      status = hibp_sf_new(&sf, cs->log2_shards, cs->n_hash_functions, cs->log2_bits);
+    }
+
+    hassert(status == HIBP_OK, "expected HIBP_OK, got %s", status2str(status));
+
+    const size_t n_shards = hibp_sf_n_shards(&sf);
+    hassert0(n_shards == ((size_t)1 << cs->log2_shards));
+
+    /* No hash function may draw on a bit of the prefix. The hash functions are the first
+     * bytes of each buffer, each byte the index of a bit of the SHA1 */
+
+    for(size_t s = 0; s < n_shards; s ++) {
+      hibp_bloom_filter_t* bf = hibp_sf_shard(&sf, s);
+      hassert0(bf != NULL);
+
+      const size_t hash_functions_size = (cs->layout == HIBP_LAYOUT_BLOCKED)
+        ? (cs->log2_bits - 9) + (cs->n_hash_functions - 1) * 9
+        : cs->n_hash_functions * cs->log2_bits;
+
+      for(size_t i = 0; i < hash_functions_size; i ++) {
+        const size_t index = bf->buffer[i];
+        const size_t position = 8 * (index / 8) + (7 - index % 8);
+
+        hassert(position >= cs->log2_shards,
+                "expected hash functions of shard %lu to avoid the prefix, but bit %lu is used",
+                (unsigned long)s, (unsigned long)index);
+      }
+    }
+
+    /* Insert half the elements, and check routing: each element lives only in its shard */
+
+    byte* shas = malloc(cs->n_strings * SHA1_BYTES);
+    int* present = malloc(cs->n_strings * sizeof(int));
+    hassert0(shas != NULL && present != NULL);
+
+    for(size_t i = 0; i < cs->n_strings; i ++) {
+      char* str = random_ascii_str(1 + rand() % 50);
+      sha1(shas + i * SHA1_BYTES, strlen(str), (const byte*)str);
+
+      present[i] = 0;
+
+      if(rand() % 2 == 0) {
+        hibp_sf_insert_str(&sf, str);
+      }
+
+      free(str);
+    }
+
+    for(size_t i = 0; i < cs->n_strings; i ++) {
+      const byte* sha = shas + i * SHA1_BYTES;
+      const size_t shard = hibp_sf_shard_of(&sf, sha);
+
+      hassert0(shard < n_shards);
+      hassert0(shard == ((size_t)sha[0] << 16 | (size_t)sha[1] << 8 | sha[2]) >> (24 - cs->log2_shards));
+
+      present[i] = hibp_sf_query_sha1(&sf, sha);
+      hassert0(present[i] == hibp_bf_query_sha1(hibp_sf_shard(&sf, shard), sha));
+    }
+
+    check(&sf, shas, present, cs->n_strings, 0, n_shards);
+
+    /* The full round trip, by loading and by mapping */
+
+    hassert0(hibp_sf_save_file(&sf, "sharded.bl", cs->format) == HIBP_OK);
+    hibp_sf_destroy(&sf);
+
+    status = hibp_sf_load_file(&sf, "sharded.bl", 0, (size_t)-1);
+    hassert(status == HIBP_OK, "expected HIBP_OK, got %s", status2str(status));
+    check(&sf, shas, present, cs->n_strings, 0, n_shards);
+    hibp_sf_destroy(&sf);
+
+    if(cs->format != HIBP_FORMAT_COMPRESSED) {
+      status = hibp_sf_map_file(&sf, "sharded.bl", 0, (size_t)-1, HIBP_MAP_LAZY_VERIFY);
+      hassert(status == HIBP_OK, "expected HIBP_OK, got %s", status2str(status));
+      check(&sf, shas, present, cs->n_strings, 0, n_shards);
+      hibp_sf_destroy(&sf);
+    }
+
+    /* Only some of the shards; one past the end is clipped */
+
+    const size_t first = n_shards / 2;
+    status = hibp_sf_load_file(&sf, "sharded.bl", first, n_shards);
+    hassert(status == HIBP_OK, "expected HIBP_OK, got %s", status2str(status));
+    check(&sf, shas, present, cs->n_strings, first, n_shards);
+
+    for(size_t s = 0; s < n_shards; s ++) {
+      hassert0((hibp_sf_shard(&sf, s) != NULL) == (s >= first));
+    }
+
+    hibp_sf_destroy(&sf);
+
+    /* Parallel insertion must yield exactly the same shards as serial insertion. Start
+     * both from the same (empty) shards by saving and reloading */
+
+    hassert0(hibp_sf_new_blocked(&sf, cs->log2_shards, 8, 12) == HIBP_OK);
+    hassert0(hibp_sf_save_file(&sf, "empty.bl", HIBP_FORMAT_COMPACT) == HIBP_OK);
+    hibp_sf_destroy(&sf);
+
+    hassert0(hibp_sf_load_file(&sf, "empty.bl", 0, (size_t)-1) == HIBP_OK);
+
+    for(size_t i = 0; i < cs->n_strings; i ++) {
+      hibp_sf_insert_sha1(&sf, shas + i * SHA1_BYTES);
+    }
+
+    hassert0(hibp_sf_save_file(&sf, "serial.bl", HIBP_FORMAT_COMPACT) == HIBP_OK);
+    hibp_sf_destroy(&sf);
+
+    hassert0(hibp_sf_load_file(&sf, "empty.bl", 0, (size_t)-1) == HIBP_OK);
+    hibp_sf_insert_sha1_parallel(&sf, cs->n_strings, shas, 0);
+    hassert0(hibp_sf_save_file(&sf, "parallel.bl", HIBP_FORMAT_COMPACT) == HIBP_OK);
+    hibp_sf_destroy(&sf);
+
+    for(size_t s = 0; s < n_shards; s ++) {
+      char serial[99], parallel[99];
+      shard_name(serial, "serial.bl", cs->log2_shards, s);
+      shard_name(parallel, "parallel.bl", cs->log2_shards, s);
+
+      hassert(same_file(serial, parallel), "expected shard %lu to be identical", (unsigned long)s);
+    }
+
+    remove_all("empty.bl", cs->log2_shards);
+    remove_all("serial.bl", cs->log2_shards);
+    remove_all("parallel.bl", cs->log2_shards);
+
+    /* Corrupt manifest */
+
+    FILE* file = fopen("sharded.bl", "r+b");
+    hassert0(file != NULL);
+    fseek(file, 6, SEEK_SET);
+    fputc(0x7f, file);
+    fclose(file);
+
+    status = hibp_sf_load_file(&sf, "sharded.bl", 0, (size_t)-1);
+    hassert(status == HIBP_E_CHECKSUM, "expected HIBP_E_CHECKSUM, got %s", status2str(status));
+
+    /* Missing shard */
+
+    hassert0(hibp_sf_new(&sf, cs->log2_shards, cs->n_hash_functions, cs->log2_bits) == HIBP_OK);
+    hassert0(hibp_sf_save_file(&sf, "sharded.bl", cs->format) == HIBP_OK);
+    hibp_sf_destroy(&sf);
+
+    char name[99];
+    shard_name(name, "sharded.bl", cs->log2_shards, n_shards - 1);
+    remove(name);
+
+    status = hibp_sf_load_file(&sf, "sharded.bl", 0, (size_t)-1);
+    hassert(status == HIBP_E_IO, "expected HIBP_E_IO, got %s", status2str(status));
+
+    status = hibp_sf_load_file(&sf, "sharded.bl", 0, n_shards - 1);
+    hassert(status == HIBP_OK, "expected HIBP_OK, got %s", status2str(status));
+    hibp_sf_destroy(&sf);
+
+    remove_all("sharded.bl", cs->log2_shards);
+
+    free(shas);
+    free(present);
+  }
+
+  /* Invalid parameters */
+
+  hibp_sharded_filter_t sf;
+  hassert0(hibp_sf_new(&sf, 21, 5, 10) == HIBP_E_2BIG);
+  hassert0(hibp_sf_new(&sf, 4, 0, 10) == HIBP_E_INVAL);
+  hassert0(hibp_sf_new_blocked(&sf, 4, 5, 8) == HIBP_E_INVAL);
+
+  return 0;
+}
@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "util.h"
+
+/* Assert that hibp_bf_get_stats counts the bits of a filter exactly, that its estimates of
+ * the false positive rate and of the cardinality agree with what is actually observed, and
+ * that, if the library was built with HIBP_STATS, its counters agree with what was done to
+ * the filter (and otherwise stay at 0) */
+
+#define N_QUERIES 200000
+
+typedef struct {
+  hibp_layout_t layout;
+  hibp_hashing_t hashing;
+  size_t n_hash_functions;
+  size_t bits;
+  size_t n_inserts;
+} case_t;
+
+const case_t cases[] = {
+  { HIBP_LAYOUT_STANDARD, HIBP_HASHING_RANDOM, 1,  8,             1 },
+  { HIBP_LAYOUT_STANDARD, HIBP_HASHING_RANDOM, 7,  1000,          50 },
+  { HIBP_LAYOUT_STANDARD, HIBP_HASHING_RANDOM, 5,  1 << 16,       5000 },
+  { HIBP_LAYOUT_STANDARD, HIBP_HASHING_DOUBLE, 7,  1 << 20,       100000 },
+  { HIBP_LAYOUT_STANDARD, HIBP_HASHING_RANDOM, 10, 1 << 24,       1000000 },
+  { HIBP_LAYOUT_STANDARD, HIBP_HASHING_RANDOM, 3,  1 << 20,       2000000 },
+  { HIBP_LAYOUT_BLOCKED,  HIBP_HASHING_RANDOM, 2,  512,           10 },
+  { HIBP_LAYOUT_BLOCKED,  HIBP_HASHING_RANDOM, 8,  1 << 16,       5000 },
+  { HIBP_LAYOUT_BLOCKED,  HIBP_HASHING_DOUBLE, 8,  1 << 20,       100000 },
+  { HIBP_LAYOUT_BLOCKED,  HIBP_HASHING_RANDOM, 11, 3 * 512 * 100, 20000 }
+};
+
+const size_t n_cases = sizeof(cases) / sizeof(case_t);
+
+static size_t brute_force_bits_set(const hibp_bloom_filter_t* bf) {
+  const size_t buffer_size =
+    hibp_compute_total_size_bits(bf->layout, bf->hashing, bf->n_hash_functions, bf->bits) - sizeof(*bf);
+  const size_t vector_size = (bf->bits + 7) / 8;
+  const byte* vector = bf->buffer + buffer_size - vector_size;
+
+  size_t bits_set = 0;
+
+  for(size_t i = 0; i < bf->bits; i ++) {
+    bits_set += (vector[i / 8] >> (i % 8)) & 1;
+  }
+
+  return bits_set;
+}
+
+int main(void) {
+  byte* shas = malloc(2000000 * SHA1_BYTES);
+  byte* queries = malloc(N_QUERIES * SHA1_BYTES);
+  int* results = malloc(N_QUERIES * sizeof(int));
+  hassert0(shas != NULL && queries != NULL && results != NULL);
+
+  for(size_t c = 0; c < n_cases; c ++) {
+    const case_t* cs = &cases[c];
+
+    hibp_bloom_filter_t bf;
+    hassert0(hibp_bf_new_bits(&bf, cs->layout, cs->hashing, cs->n_hash_functions, cs->bits) == HIBP_OK);
+
+    hibp_filter_stats_t stats;
+    hibp_bf_get_stats(&stats, &bf);
+
+    hassert(stats.bits_set == 0 && stats.fill_ratio == 0, "expected a new filter to be empty (case %d)", (int)c);
+    hassert(stats.estimated_fpr == 0 && stats.estimated_cardinality == 0,
+            "expected a new filter to have no false positives or elements (case %d)", (int)c);
+
+    /* Split the insertions among all of the insertion functions */
+    const size_t n = cs->n_inserts;
+    const size_t half = (n + 1) / 2;
+    random_shas(shas, n);
+
+    hibp_bf_insert_sha1(&bf, shas);
+    hibp_bf_insert_sha1_batch(&bf, half - 1, shas + SHA1_BYTES);
+    hibp_bf_insert_sha1_parallel(&bf, n - half, shas + half * SHA1_BYTES, 0);
+
+    /* Query the first half of the inserted elements one at a time... */
+    for(size_t i = 0; i < half; i ++) {
+      hassert0(hibp_bf_query_sha1(&bf, shas + i * SHA1_BYTES));
+    }
+
+    /* ... and some elements that (almost certainly) weren't inserted in a batch */
+    random_shas(queries, N_QUERIES);
+    hibp_bf_query_sha1_batch(&bf, N_QUERIES, queries, results);
+
+    size_t n_positives = 0;
+
+    for(size_t i = 0; i < N_QUERIES; i ++) {
+      n_positives += results[i];
+    }
+
+    hibp_bf_get_stats(&stats, &bf);
+
+    const size_t bits_set = brute_force_bits_set(&bf);
+
+    hassert(stats.bits_set == bits_set, "expected %lu bits to be set, not %lu (case %d)",
+            (unsigned long)bits_set, (unsigned long)stats.bits_set, (int)c);
+    hassert(stats.fill_ratio == (double)bits_set / cs->bits, "expected the fill ratio to be exact (case %d)", (int)c);
+    hassert(hibp_bf_fill_ratio(&bf) == stats.fill_ratio,
+            "expected hibp_bf_fill_ratio to agree with hibp_bf_get_stats (case %d)", (int)c);
+
+    /* Within five standard deviations of the estimate, and a little slack for the error
+     * of the estimate itself */
+    const double fpr = (double)n_positives / N_QUERIES;
+    const double sigma = sqrt(stats.estimated_fpr * (1 - stats.estimated_fpr) / N_QUERIES);
+
+    hassert(fabs(fpr - stats.estimated_fpr) <= 5 * sigma + 0.01 * stats.estimated_fpr + 1e-9,
+            "expected a false positive rate of about %f, not %f (case %d)", stats.estimated_fpr, fpr, (int)c);
+
+    if(n >= 1000 && stats.fill_ratio < 0.99) {
+      hassert(fabs(stats.estimated_cardinality - n) <= 0.03 * n,
+              "expected a cardinality of about %lu, not %f (case %d)", (unsigned long)n,
+              stats.estimated_cardinality, (int)c);
+    }
+
+    if(stats.counters_enabled) {
+      const unsigned long long n_queries = half + N_QUERIES;
+
+      hassert(stats.n_inserts == n, "expected %lu insertions, not %llu (case %d)",
+              (unsigned long)n, stats.n_inserts, (int)c);
+      hassert(stats.n_queries == n_queries, "expected %llu queries, not %llu (case %d)",
+              n_queries, stats.n_queries, (int)c);
+      hassert(stats.n_positives == half + n_positives, "expected %lu positive queries, not %llu (case %d)",
+              (unsigned long)(half + n_positives), stats.n_positives, (int)c);
+
+      /* Positive queries test every bit; negative queries at least one */
+      const size_t k = cs->n_hash_functions - (cs->layout == HIBP_LAYOUT_BLOCKED);
+
+      hassert(stats.n_probes >= stats.n_positives * k + (n_queries - stats.n_positives) &&
+              stats.n_probes <= n_queries * k,
+              "expected between %llu and %llu probes, not %llu (case %d)",
+              stats.n_positives * k + (n_queries - stats.n_positives), n_queries * k, stats.n_probes, (int)c);
+
+      hibp_bf_reset_stats(&bf);
+      hibp_bf_get_stats(&stats, &bf);
+
+      hassert(stats.n_inserts == 0 && stats.n_queries == 0 && stats.n_positives == 0 && stats.n_probes == 0,
+              "expected hibp_bf_reset_stats to zero the counters (case %d)", (int)c);
+    } else {
+      hassert(stats.n_inserts == 0 && stats.n_queries == 0 && stats.n_positives == 0 && stats.n_probes == 0 &&
+              stats.load_seconds == 0 && stats.verify_seconds == 0 && stats.save_seconds == 0,
+              "expected the counters to be 0 without HIBP_STATS (case %d)", (int)c);
+    }
+
+    /* A reloaded filter has the same bits, and counters of its own */
+    membuf_t mb = { NULL, 0, 0 };
+    hassert0(hibp_bf_save_writer(&bf, &mb, mb_write) == HIBP_OK);
+
+    hibp_bf_get_stats(&stats, &bf);
+    hassert(!stats.counters_enabled || stats.save_seconds > 0, "expected the save to be timed (case %d)", (int)c);
+
+    hibp_bloom_filter_t loaded;
+    hassert0(hibp_bf_load_reader(&loaded, &mb, mb_read) == HIBP_OK);
+
+    hibp_filter_stats_t loaded_stats;
+    hibp_bf_get_stats(&loaded_stats, &loaded);
+
+    hassert(loaded_stats.bits_set == stats.bits_set && loaded_stats.estimated_fpr == stats.estimated_fpr,
+            "expected a reloaded filter to yield the same statistics (case %d)", (int)c);
+    hassert(loaded_stats.n_inserts == 0 && loaded_stats.n_queries == 0 && loaded_stats.save_seconds == 0,
+            "expected a reloaded filter to start counting afresh (case %d)", (int)c);
+    hassert(!loaded_stats.counters_enabled || (loaded_stats.load_seconds > 0 && loaded_stats.verify_seconds > 0),
+            "expected the load to be timed (case %d)", (int)c);
+
+    free(mb.buffer);
+    hibp_bf_destroy(&loaded);
+    hibp_bf_destroy(&bf);
+  }
+
+  free(shas);
+  free(queries);
+  free(results);
+
+  return 0;
+}
@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "util.h"
+
+/* Assert that the block-oriented and byte-at-a-time stream functions agree with each other
+ * byte for byte, that a filter survives the round trip through them no matter how reads
+ * and writes are split up, and that errors and premature EOF are reported as HIBP_E_IO */
+
+#define MAX_LENGTH 100
+#define MAX_STRINGS 10000
+
+typedef struct {
+  hibp_layout_t layout;
+  size_t n_hash_functions;
+  size_t log2_bits;
+  size_t n_strings;
+  hibp_format_t format;
+} case_t;
+
+const case_t cases[] = {
+  { HIBP_LAYOUT_STANDARD, 1,  0,  1,     HIBP_FORMAT_COMPACT },
+  { HIBP_LAYOUT_STANDARD, 5,  10, 1000,  HIBP_FORMAT_COMPACT },
+  { HIBP_LAYOUT_STANDARD, 15, 20, 10000, HIBP_FORMAT_COMPACT },
+  { HIBP_LAYOUT_BLOCKED,  8,  16, 5000,  HIBP_FORMAT_COMPACT },
+  { HIBP_LAYOUT_STANDARD, 5,  10, 1000,  HIBP_FORMAT_ALIGNED },
+  { HIBP_LAYOUT_BLOCKED,  11, 20, 10000, HIBP_FORMAT_ALIGNED },
+  { HIBP_LAYOUT_STANDARD, 3,  24, 10000, HIBP_FORMAT_CHUNKED },
+  { HIBP_LAYOUT_STANDARD, 5,  10, 1000,  HIBP_FORMAT_CHUNKED_SHA1 },
+  { HIBP_LAYOUT_STANDARD, 5,  10, 1000,  HIBP_FORMAT_COMPRESSED },
+  { HIBP_LAYOUT_BLOCKED,  8,  26, 10000, HIBP_FORMAT_COMPRESSED }
+};
+
+const size_t n_cases = sizeof(cases) / sizeof(case_t);
+
+/* In-memory stream. Reads and writes are cut short at random, and fail once limit bytes
+ * have been transferred */
+typedef struct {
+  byte* buffer;
+  size_t size;
+  size_t capacity;
+  size_t position;
+  size_t limit;
+} flakybuf_t;
+
+static void flakybuf_new(flakybuf_t* mb, size_t limit) {
+  mb->buffer = NULL;
+  mb->size = 0;
+  mb->capacity = 0;
+  mb->position = 0;
+  mb->limit = limit;
+}
+
+static size_t short_size(size_t size) {
+  return (rand() % 4 == 0) ? 1 + rand() % size : size;
+}
+
+static size_t flaky_write(void* ctx, const void* buffer, size_t size) {
+  flakybuf_t* mb = (flakybuf_t*)ctx;
+
+  size = short_size(size);
+
+  if(mb->size + size > mb->limit) {
+    size = mb->limit - mb->size;
+  }
+
+  if(mb->size + size > mb->capacity) {
+    mb->capacity = 2 * (mb->size + size);
+    mb->buffer = realloc(mb->buffer, mb->capacity);
+    hassert0(mb->buffer != NULL);
+  }
+
+  memcpy(mb->buffer + mb->size, buffer, size);
+  mb->size += size;
+
+  return size;
+}
+
+static size_t flaky_read(void* ctx, void* buffer, size_t size) {
+  flakybuf_t* mb = (flakybuf_t*)ctx;
+
+  size = short_size(size);
+
+  if(mb->position + size > mb->size) {
+    size = mb->size - mb->position;
+  }
+
+  memcpy(buffer, mb->buffer + mb->position, size);
+  mb->position += size;
+
+  return size;
+}
+
+static int flaky_putc(int c, void* ctx) {
+  const byte b = (byte)c;
+  return (flaky_write(ctx, &b, 1) == 1) ? c : EOF;
+}
+
+static int flaky_getc(void* ctx) {
+  byte b;
+  return (flaky_read(ctx, &b, 1) == 1) ? b : EOF;
+}
+
+static void assert_same(const hibp_bloom_filter_t* bf, char** strings, const int* present,
+                        size_t n_strings) {
+  for(size_t i = 0; i < n_strings; i ++) {
+    const int pr = hibp_bf_query_str(bf, strings[i]);
+
+    hassert(
+      pr == present[i],
+      "expected %s to %s in the Bloom filter, but it %s",
+      strings[i],
+      (present[i] ? "be present" : "not be present"),
+      (pr ? "was" : "wasn't")
+    );
+  }
+}
+
+int main(void) {
+  for(size_t c = 0; c < n_cases; c ++) {
+    const case_t* cs = &cases[c];
+
+    hibp_bloom_filter_t bf;
+    hibp_status_t status;
+
+    if(cs->layout == HIBP_LAYOUT_BLOCKED) {
+      status = hibp_bf_new_blocked(&bf, cs->n_hash_functions, cs->log2_bits);
+    } else {
+      status = hibp_bf_new(&bf, cs->n_hash_functions, cs->log2_bits);
+    }
+
+    hassert0(status == HIBP_OK);
+
+    char* strings[MAX_STRINGS];
+    int present[MAX_STRINGS];
+
+    for(size_t i = 0; i < cs->n_strings; i ++) {
+      strings[i] = random_ascii_str(rand() % MAX_LENGTH);
+
+      if(rand() % 2 == 0) {
+        hibp_bf_insert_str(&bf, strings[i]);
+      }
+    }
+
+    for(size_t i = 0; i < cs->n_strings; i ++) {
+      present[i] = hibp_bf_query_str(&bf, strings[i]);
+    }
+
+    /* The writer and putc paths must produce identical output */
+
+    flakybuf_t blocks, bytes;
+    flakybuf_new(&blocks, SIZE_MAX);
+    flakybuf_new(&bytes, SIZE_MAX);
+
+    hassert0(hibp_bf_save_writer_format(&bf, &blocks, flaky_write, cs->format) == HIBP_OK);
+    hassert0(hibp_bf_save_stream_format(&bf, &bytes, flaky_putc, cs->format) == HIBP_OK);
+
+    hassert(
+      blocks.size == bytes.size && memcmp(blocks.buffer, bytes.buffer, blocks.size) == 0,
+      "expected hibp_bf_save_writer_format to agree with hibp_bf_save_stream_format (case %d)",
+      (int)c
+    );
+
+    if(cs->format == HIBP_FORMAT_COMPACT) {
+      flakybuf_t compact;
+      flakybuf_new(&compact, SIZE_MAX);
+      hassert0(hibp_bf_save_writer(&bf, &compact, flaky_write) == HIBP_OK);
+      hassert0(compact.size == blocks.size && memcmp(compact.buffer, blocks.buffer, blocks.size) == 0);
+      free(compact.buffer);
+    }
+
+    const size_t size = blocks.size;
+
+    hibp_bf_destroy(&bf);
+
+    /* Both load paths must recover the filter */
+
+    status = hibp_bf_load_reader(&bf, &blocks, flaky_read);
+    hassert(status == HIBP_OK, "expected HIBP_OK, got %s", status2str(status));
+    hassert0(blocks.position == size);
+    assert_same(&bf, strings, present, cs->n_strings);
+    hibp_bf_destroy(&bf);
+
+    status = hibp_bf_load_stream(&bf, &bytes, flaky_getc);
+    hassert(status == HIBP_OK, "expected HIBP_OK, got %s", status2str(status));
+    assert_same(&bf, strings, present, cs->n_strings);
+
+    /* A write error anywhere is an IO error */
+
+    flakybuf_t failing;
+    flakybuf_new(&failing, rand() % size);
+    status = hibp_bf_save_writer_format(&bf, &failing, flaky_write, cs->format);
+    hassert(status == HIBP_E_IO, "expected HIBP_E_IO, got %s", status2str(status));
+    free(failing.buffer);
+
+    hibp_bf_destroy(&bf);
+
+    /* As is a premature EOF */
+
+    blocks.position = 0;
+    blocks.size = rand() % size;
+    status = hibp_bf_load_reader(&bf, &blocks, flaky_read);
+    hassert(status == HIBP_E_IO, "expected HIBP_E_IO, got %s", status2str(status));
+
+    free(blocks.buffer);
+    free(bytes.buffer);
+
+    for(size_t i = 0; i < cs->n_strings; i ++) {
+      free(strings[i]);
+    }
+  }
+
+  return 0;
+}
@@ -85,3 +85,64 @@ byte* random_sha1(void) {
 void sha1(byte* sha, size_t size, const byte* buffer) {
   hassert0(SHA1(buffer, size, sha) != NULL);
 }
+
+void random_shas(byte* shas, size_t n) {
+  for(size_t i = 0; i < n * SHA1_BYTES; i ++) {
+    shas[i] = (byte)(rand() % 256);
+  }
+}
+
+size_t mb_write(void* ctx, const void* buffer, size_t size) {
+  membuf_t* mb = (membuf_t*)ctx;
+  mb->buffer = realloc(mb->buffer, mb->size + size);
+  hassert0(mb->buffer != NULL);
+  memcpy(mb->buffer + mb->size, buffer, size);
+  mb->size += size;
+  return size;
+}
+
+size_t mb_read(void* ctx, void* buffer, size_t size) {
+  membuf_t* mb = (membuf_t*)ctx;
+
+  if(size > mb->size - mb->position) {
+    size = mb->size - mb->position;
+  }
+
+  memcpy(buffer, mb->buffer + mb->position, size);
+  mb->position += size;
+  return size;
+}
+
+void save_file(const hibp_bloom_filter_t* bf, const char* filename, hibp_format_t format) {
+  FILE* file = fopen(filename, "wb");
+  hassert0(file != NULL);
+  hassert0(hibp_bf_save_file_format(bf, file, format) == HIBP_OK);
+  fclose(file);
+}
+
+long file_size(const char* filename) {
+  FILE* file = fopen(filename, "rb");
+  hassert0(file != NULL);
+  fseek(file, 0, SEEK_END);
+  const long size = ftell(file);
+  fclose(file);
+  return size;
+}
+
+int same_file(const char* a, const char* b) {
+  FILE* fa = fopen(a, "rb");
+  FILE* fb = fopen(b, "rb");
+  hassert0(fa != NULL && fb != NULL);
+
+  int ca, cb;
+
+  do {
+    ca = fgetc(fa);
+    cb = fgetc(fb);
+  } while(ca == cb && ca != EOF);
+
+  fclose(fa);
+  fclose(fb);
+
+  return ca == cb;
+}
@@ -26,4 +26,21 @@ char* random_ascii_str(size_t length);
 
 void sha1(byte* sha, size_t size, const byte* buffer);
 
+void random_shas(byte* shas, size_t n);
+
+/* An in-memory stream: mb_write (a hibp_write_t) appends to buffer, and mb_read (a
+ * hibp_read_t) reads it back from position onwards */
+typedef struct {
+  byte* buffer;
+  size_t size;
+  size_t position;
+} membuf_t;
+
+size_t mb_write(void* ctx, const void* buffer, size_t size);
+size_t mb_read(void* ctx, void* buffer, size_t size);
+
+void save_file(const hibp_bloom_filter_t* bf, const char* filename, hibp_format_t format);
+long file_size(const char* filename);
+int same_file(const char* a, const char* b);
+
 #endif